@@ -0,0 +1,134 @@
+#include "othello.h"
+
+/*
+ * Function: multi_pv
+ *
+ * Description: This function finds the best root moves of a position, up to a
+ *              given number of them, along with their exact scores and
+ *              principal variations.  The root moves are divided among several
+ *              threads, which share a transposition table.  Each root move is
+ *              searched with a window just wide enough to tell whether it
+ *              belongs among the best moves found so far, so moves that cannot
+ *              make the list are refuted cheaply, while moves that do make it
+ *              are given exact scores.
+ *
+ * Inputs:
+ *  - board: The position to analyze.
+ *  - color: The player whose turn it is.
+ *  - depth_limit: The maximum allowable depth of the decision tree.
+ *  - num_lines: The number of root moves to report.
+ *  - num_threads: The number of threads to use.  If less than 1, one thread per
+ *                 hardware core is used.
+ *  - table: The transposition table to use.  Results stored by earlier analyses
+ *           of the same position are reused.
+ *
+ * Outputs:
+ *  - lines: The best root moves are stored here, best first.
+ *
+ * Return value: The number of lines found, which is less than num_lines only if
+ *               the player has fewer legal moves than that.
+ */
+int Analysis::multi_pv(GameBoard* board, int color, int depth_limit,
+                       int num_lines, int num_threads,
+                       TranspositionTable* table, vector<PVLine>* lines) {
+  TraceSpan span("iteration", depth_limit);
+  lines->clear();
+  ArenaTree tree;
+  tree.set_table(table);
+  tree.build(board, color, depth_limit);
+  int num_moves = tree.get_node(0)->num_children;
+  int32_t first_child = tree.get_node(0)->first_child;
+  if (num_lines > num_moves) num_lines = num_moves;
+  if (num_lines <= 0) return 0;
+  if (num_threads < 1) num_threads = (int) thread::hardware_concurrency();
+  if (num_threads < 1) num_threads = 1;
+
+  // best holds the (value, child) pairs of the best moves found so far, best
+  // first.  Once it is full, its last value is the bar a move must clear.
+  vector<pair<int, int32_t> > best;
+  mutex best_lock;
+  atomic<int> next_move(0);
+
+  auto worker = [&]() {
+    int m;
+    while ((m = next_move.fetch_add(1)) < num_moves) {
+      int32_t child = first_child + m;
+      int alpha = INT_MIN, beta = INT_MAX;
+      best_lock.lock();
+      if ((int) best.size() == num_lines) {
+        if (color == 2) alpha = best.back().first - 1;
+        else beta = best.back().first + 1;
+      }
+      best_lock.unlock();
+
+      ArenaNode* node = tree.get_node(child);
+      TraceSpan span("root move", node->x * BOARD_SIZE + node->y);
+      int value = tree.alpha_beta(child, alpha, beta);
+      if ((value <= alpha) || (value >= beta)) continue;
+
+      best_lock.lock();
+      auto position = best.begin();
+      while ((position != best.end()) &&
+             ((color == 2) ? (position->first >= value) :
+              (position->first <= value))) {
+        ++position;
+      }
+      best.insert(position, make_pair(value, child));
+      if ((int) best.size() > num_lines) best.pop_back();
+      best_lock.unlock();
+    }
+  };
+
+  vector<thread> threads;
+  for (int t = 1; t < num_threads; ++t) {
+    threads.push_back(thread(worker));
+  }
+  worker();
+  for (auto th = threads.begin(); th != threads.end(); ++th) {
+    th->join();
+  }
+
+  for (auto entry = best.begin(); entry != best.end(); ++entry) {
+    PVLine line;
+    line.value = entry->first;
+    extract_pv(&tree, table, entry->second, &line);
+    lines->push_back(line);
+  }
+  return (int) lines->size();
+}
+
+/*
+ * Function: extract_pv
+ *
+ * Description: This function reads the principal variation starting with a
+ *              given node out of the transposition table, by following the best
+ *              move stored for each position for as long as an exact result is
+ *              stored for it.
+ *
+ * Inputs:
+ *  - tree: The tree that was searched.
+ *  - table: The transposition table used by the search.
+ *  - index: The index of the node at which the variation starts.
+ *
+ * Outputs:
+ *  - line: The move of the node at index, followed by the variation, is
+ *          appended to line->moves.
+ */
+void Analysis::extract_pv(ArenaTree* tree, TranspositionTable* table,
+                          int32_t index, PVLine* line) {
+  while (index >= 0) {
+    ArenaNode* node = tree->get_node(index);
+    line->moves.push_back(node->x * BOARD_SIZE + node->y);
+    if (node->num_children == 0) break;
+
+    int value, bound, move;
+    uint64_t key = TranspositionTable::key(node->black, node->white,
+                                           node->color);
+    if (!table->probe(key, tree->remaining_depth(index), &value, &bound,
+                      &move) ||
+        (bound != BOUND_EXACT) || (move == NO_MOVE)) {
+      break;
+    }
+    index = tree->find_child(index, move / BOARD_SIZE, move % BOARD_SIZE);
+  }
+}
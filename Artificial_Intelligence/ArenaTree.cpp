@@ -0,0 +1,313 @@
+#include "othello.h"
+
+// The number of nodes allocated when an ArenaTree is created.
+#define ARENA_INITIAL_CAPACITY 4096
+
+/*
+ * Constructor for ArenaTree.
+ */
+ArenaTree::ArenaTree() {
+  nodes = new ArenaNode[ARENA_INITIAL_CAPACITY];
+  num_nodes = 0;
+  capacity = ARENA_INITIAL_CAPACITY;
+  depth_limit = INT_MAX;
+  table = NULL;
+}
+
+/*
+ * Destructor for ArenaTree.  The whole tree is freed at once.
+ */
+ArenaTree::~ArenaTree() {
+  delete[] nodes;
+}
+
+/*
+ * Function: clear
+ *
+ * Description: This function frees every node in the tree, in constant time.
+ *              The node array is kept, so that the next tree built can reuse
+ *              it without allocating.
+ */
+void ArenaTree::clear() {
+  num_nodes = 0;
+}
+
+/*
+ * Function: allocate
+ *
+ * Description: This function allocates a run of consecutive nodes at the end
+ *              of the node array, doubling the array if it is full.  Since the
+ *              array may move, pointers to nodes must not be held across calls
+ *              to this function; indices remain valid.
+ *
+ * Inputs:
+ *  - count: The number of nodes to allocate.
+ *
+ * Return value: The index of the first node allocated.
+ */
+int32_t ArenaTree::allocate(size_t count) {
+  if (num_nodes + count > capacity) {
+    size_t new_capacity = capacity;
+    while (num_nodes + count > new_capacity) new_capacity *= 2;
+    ArenaNode* new_nodes = new ArenaNode[new_capacity];
+    memcpy(new_nodes, nodes, num_nodes * sizeof(ArenaNode));
+    delete[] nodes;
+    nodes = new_nodes;
+    capacity = new_capacity;
+  }
+  int32_t first = (int32_t) num_nodes;
+  num_nodes += count;
+  return first;
+}
+
+/*
+ * Function: build
+ *
+ * Description: This function replaces the tree with a new decision tree, with
+ *              the same shape as the one built by
+ *              Othello::create_decision_tree.
+ *
+ * Inputs:
+ *  - board: The board at the root of the tree.
+ *  - color: The player whose turn it is at the root of the tree.
+ *  - depth_limit: If positive, this is the maximum allowable depth of the tree.
+ *                 Otherwise, signifies that there is no maximum depth.
+ */
+void ArenaTree::build(GameBoard* board, int color, int depth_limit) {
+  clear();
+  this->depth_limit = (depth_limit <= 0) ? INT_MAX : depth_limit;
+  int32_t root = allocate(1);
+  board->to_bitboards(&nodes[root].black, &nodes[root].white);
+  nodes[root].first_child = -1;
+  nodes[root].num_children = 0;
+  nodes[root].x = -1;
+  nodes[root].y = -1;
+  nodes[root].color = (int8_t) color;
+  nodes[root].depth = 0;
+  expand(root, this->depth_limit);
+}
+
+/*
+ * Function: expand
+ *
+ * Description: This function creates the children of a node, one for each
+ *              legal move from its board, and then recursively fills out their
+ *              subtrees, provided depth_limit is not reached.  All of a node's
+ *              children are allocated before any of its grandchildren, which
+ *              keeps them contiguous.
+ *
+ * Inputs:
+ *  - index: The index of the node to expand.
+ *  - depth_limit: The maximum allowable depth of the tree.
+ */
+void ArenaTree::expand(int32_t index, int depth_limit) {
+  if (nodes[index].depth >= depth_limit) return;
+
+  uint64_t black = nodes[index].black, white = nodes[index].white;
+  int color = nodes[index].color;
+  scratch.load_bitboards(black, white);
+  int moves[BOARD_SIZE * BOARD_SIZE];
+  int num_moves = 0;
+  for (int i = 0; i < BOARD_SIZE; ++i) {
+    for (int j = 0; j < BOARD_SIZE; ++j) {
+      if (scratch.is_legal(color, i, j)) {
+        moves[num_moves++] = i * BOARD_SIZE + j;
+      }
+    }
+  }
+  if (num_moves == 0) return;
+
+  int32_t first = allocate(num_moves);
+  nodes[index].first_child = first;
+  nodes[index].num_children = (uint8_t) num_moves;
+  for (int k = 0; k < num_moves; ++k) {
+    if (k > 0) scratch.load_bitboards(black, white);
+    int x = moves[k] / BOARD_SIZE, y = moves[k] % BOARD_SIZE;
+    scratch.place_piece(color, x, y, true);
+    ArenaNode* child = &nodes[first + k];
+    scratch.to_bitboards(&child->black, &child->white);
+    child->first_child = -1;
+    child->num_children = 0;
+    child->x = (int8_t) x;
+    child->y = (int8_t) y;
+    child->color = (int8_t) (3 - color);
+    child->depth = (int8_t) (nodes[index].depth + 1);
+  }
+  for (int k = 0; k < num_moves; ++k) {
+    expand(first + k, depth_limit);
+  }
+}
+
+/*
+ * Function: evaluate
+ *
+ * Description: This function measures the score of a node's board in the same
+ *              way as GameBoard::evaluate.
+ *
+ * Inputs:
+ *  - index: The index of the node.
+ *
+ * Return value: The score of the node's board.
+ */
+int ArenaTree::evaluate(int32_t index) {
+  return GameBoard::evaluate_bitboards(nodes[index].black, nodes[index].white);
+}
+
+/*
+ * Function: alpha_beta
+ *
+ * Description: This function performs the same alpha-beta pruning as
+ *              Othello::alpha_beta, on the subtree rooted at a node of this
+ *              tree.  If a transposition table has been set, results are looked
+ *              up in it before a subtree is searched and recorded in it
+ *              afterwards, and the best move recorded for a position is
+ *              searched first.
+ *
+ * Inputs:
+ *  - index: The index of the root of the subtree being evaluated.
+ *  - alpha: The best possible heuristic score for the black player found thus
+ *           far.
+ *  - beta: The best possible heuristic score for the white player found thus
+ *          far.
+ *
+ * Return value: The heuristic score that would result from the best move by the
+ *               player.
+ */
+int ArenaTree::alpha_beta(int32_t index, int alpha, int beta) {
+  ArenaNode* node = &nodes[index];
+  if (node->num_children == 0) {
+    node->value = evaluate(index);
+    return node->value;
+  }
+
+  uint64_t key = 0;
+  int32_t first_searched = -1;
+  if (table != NULL) {
+    key = TranspositionTable::key(node->black, node->white, node->color);
+    int stored_value, bound, move;
+    if (table->probe(key, remaining_depth(index), &stored_value, &bound,
+                     &move)) {
+      if (bound == BOUND_EXACT) {
+        node->value = stored_value;
+        return stored_value;
+      }
+      if (bound == BOUND_LOWER) alpha = max(alpha, stored_value);
+      if (bound == BOUND_UPPER) beta = min(beta, stored_value);
+      if (beta <= alpha) {
+        node->value = stored_value;
+        return stored_value;
+      }
+      if (move != NO_MOVE) {
+        first_searched = find_child(index, move / BOARD_SIZE,
+                                    move % BOARD_SIZE);
+      }
+    }
+  }
+
+  // When every child is a leaf, the children are scored in one batch, as in
+  // Othello::alpha_beta.
+  int leaf_values[BOARD_SIZE * BOARD_SIZE];
+  bool batched = !NNUE::is_loaded();
+  for (int32_t k = 0; batched && (k < node->num_children); ++k) {
+    if (nodes[node->first_child + k].num_children != 0) batched = false;
+  }
+  if (batched) {
+    uint64_t black[BOARD_SIZE * BOARD_SIZE], white[BOARD_SIZE * BOARD_SIZE];
+    for (int32_t k = 0; k < node->num_children; ++k) {
+      black[k] = nodes[node->first_child + k].black;
+      white[k] = nodes[node->first_child + k].white;
+    }
+    GameBoard::weighted_scores_of_bitboards(black, white, node->num_children,
+                                            leaf_values);
+  }
+
+  // The children are searched in order, except that the child for the stored
+  // best move, if any, goes first.
+  int32_t best_child = -1;
+  int value = (node->color == 2) ? INT_MIN : INT_MAX;
+  int alpha_searched = alpha, beta_searched = beta;
+  for (int32_t k = -1; k < node->num_children; ++k) {
+    int32_t child = (k < 0) ? first_searched : node->first_child + k;
+    if ((child < 0) || ((k >= 0) && (child == first_searched))) continue;
+    int child_value;
+    if (batched) {
+      child_value = leaf_values[child - node->first_child];
+      nodes[child].value = child_value;
+    }
+    else {
+      child_value = alpha_beta(child, alpha, beta);
+    }
+    if (node->color == 2) {
+      if ((best_child < 0) || (child_value > value)) best_child = child;
+      value = max(value, child_value);
+      alpha = max(alpha, value);
+    }
+    else {
+      if ((best_child < 0) || (child_value < value)) best_child = child;
+      value = min(value, child_value);
+      beta = min(beta, value);
+    }
+    if (beta <= alpha) break;
+  }
+  node->value = value;
+
+  if (table != NULL) {
+    int bound = BOUND_EXACT;
+    if (value <= alpha_searched) bound = BOUND_UPPER;
+    else if (value >= beta_searched) bound = BOUND_LOWER;
+    table->store(key, remaining_depth(index), value, bound,
+                 nodes[best_child].x * BOARD_SIZE + nodes[best_child].y);
+  }
+  return value;
+}
+
+/*
+ * Function: find_child
+ *
+ * Description: This function finds the child of a node for a given move.
+ *
+ * Inputs:
+ *  - index: The index of the node.
+ *  - x: The x-coordinate of the move.
+ *  - y: The y-coordinate of the move.
+ *
+ * Return value: The index of the child, or -1 if there is no such child.
+ */
+int32_t ArenaTree::find_child(int32_t index, int x, int y) {
+  int32_t end = nodes[index].first_child + nodes[index].num_children;
+  for (int32_t child = nodes[index].first_child; child < end; ++child) {
+    if ((nodes[child].x == x) && (nodes[child].y == y)) return child;
+  }
+  return -1;
+}
+
+/*
+ * Function: remaining_depth
+ *
+ * Description: This function finds how many more levels the tree was allowed to
+ *              grow below a node, capped at 255 so that it fits in a
+ *              transposition table entry.  Two nodes with the same board,
+ *              player to move, and remaining depth have identical subtrees.
+ *
+ * Inputs:
+ *  - index: The index of the node.
+ *
+ * Return value: The remaining depth.
+ */
+int ArenaTree::remaining_depth(int32_t index) {
+  if (depth_limit == INT_MAX) return 255;
+  return min(depth_limit - nodes[index].depth, 255);
+}
+
+/*
+ * Function: set_table
+ *
+ * Description: Changes the transposition table used by alpha_beta.
+ *
+ * Inputs:
+ *  - t: The new transposition table, or NULL to search without one.
+ */
+void ArenaTree::set_table(TranspositionTable* t) {table = t;}
+
+ArenaNode* ArenaTree::get_node(int32_t index) {return &nodes[index];}
+size_t ArenaTree::size() {return num_nodes;}
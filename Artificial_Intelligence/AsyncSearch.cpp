@@ -0,0 +1,120 @@
+#include "othello.h"
+
+/*
+ * Constructor for AsyncSearch.
+ */
+AsyncSearch::AsyncSearch() {
+  stop_requested.store(false);
+}
+
+/*
+ * Destructor for AsyncSearch.  Stops the search, if one is running.
+ */
+AsyncSearch::~AsyncSearch() {
+  stop();
+}
+
+/*
+ * Function: start
+ *
+ * Description: This function starts searching a position on a new thread, by
+ *              iterative deepening (see Othello::iterative_deepening), and
+ *              returns at once.  If a search was already running, it is
+ *              stopped first.  The position is copied, so the board may be
+ *              changed while the search runs.
+ *
+ * Inputs:
+ *  - game_board: The board on which the move would be made.
+ *  - color: The color of the player whose move is being chosen.
+ *  - depth_limit: If positive, the deepest iteration allowed.
+ *  - node_limit: If positive, the search stops after this many nodes.
+ *  - callback: If not empty, called on the search thread with the result of
+ *              each iteration that finishes, which is the best move found so
+ *              far.  It should return quickly, since the search waits for it.
+ *
+ * Return value: A future for the result of the search, which becomes ready
+ *               when the deepest iteration allowed finishes, the node limit is
+ *               reached, or the search is stopped.  Its move is the best move
+ *               found, or -1 if the player has no legal moves; its depth and
+ *               value are those of the deepest iteration to finish (0 if none
+ *               did), and its nodes and seconds cover the whole search.
+ */
+future<IterationResult> AsyncSearch::start(GameBoard* game_board, int color,
+    int depth_limit, long node_limit,
+    function<void(const IterationResult&)> callback) {
+  stop();
+  uint64_t black, white;
+  game_board->to_bitboards(&black, &white);
+  stop_requested.store(false);
+  progress = callback;
+  result = promise<IterationResult>();
+  future<IterationResult> finished = result.get_future();
+  searcher = thread(&AsyncSearch::run, this, black, white, color, depth_limit,
+                    node_limit);
+  return finished;
+}
+
+/*
+ * Function: run
+ *
+ * Description: This function is the body of the search thread.  It searches
+ *              the position given to start, reports each iteration, and
+ *              fulfills the promise of the search's result.
+ *
+ * Inputs:
+ *  - black: The spaces holding black pieces.
+ *  - white: The spaces holding white pieces.
+ *  - color: The color of the player whose move is being chosen.
+ *  - depth_limit: If positive, the deepest iteration allowed.
+ *  - node_limit: If positive, the search stops after this many nodes.
+ */
+void AsyncSearch::run(uint64_t black, uint64_t white, int color,
+                      int depth_limit, long node_limit) {
+  TraceSpan span("async search", color);
+  SearchWorker worker(-1);
+  worker.set_node_limit(node_limit);
+  worker.set_stop_flag(&stop_requested);
+
+  IterationResult final_result;
+  final_result.depth = 0;
+  final_result.value = 0;
+  auto report = [this, &final_result](const IterationResult& iteration) {
+    final_result.depth = iteration.depth;
+    final_result.value = iteration.value;
+    if (progress) progress(iteration);
+  };
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  final_result.move = Othello::iterative_deepening(black, white, color,
+                                                   depth_limit, &worker,
+                                                   report);
+  final_result.nodes = worker.get_nodes();
+  final_result.seconds =
+    chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  result.set_value(final_result);
+}
+
+/*
+ * Function: request_stop
+ *
+ * Description: This function asks the search to stop, and returns at once.
+ *              The search checks for the request at every node, so its future
+ *              becomes ready within the time it takes to search one node, plus
+ *              any time spent in the callback.  Its result is the best move
+ *              found so far.  It is safe to call from any thread, including
+ *              from the callback.
+ */
+void AsyncSearch::request_stop() {
+  stop_requested.store(true);
+}
+
+/*
+ * Function: stop
+ *
+ * Description: This function stops the search, if one is running, and waits
+ *              for its thread to finish.  It must not be called from the
+ *              callback.
+ */
+void AsyncSearch::stop() {
+  request_stop();
+  if (searcher.joinable()) searcher.join();
+}
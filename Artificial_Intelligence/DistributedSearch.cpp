@@ -0,0 +1,595 @@
+#include "othello.h"
+
+// A worker checks its socket for new windows once every this many nodes.
+#define DISTRIBUTED_POLL_INTERVAL 1024
+
+/*
+ * Constructor for SearchWorker.
+ *
+ * Inputs:
+ *  - fd: The worker's end of the socket connecting it to the coordinator, or -1
+ *        for a worker that searches on behalf of the current process.
+ */
+SearchWorker::SearchWorker(int fd) {
+  this->fd = fd;
+  task = -1;
+  shared_alpha = INT_MIN;
+  shared_beta = INT_MAX;
+  quit = false;
+  nodes = 0;
+  node_limit = 0;
+  stop_flag = NULL;
+  aborted = false;
+}
+
+/*
+ * Function: run
+ *
+ * Description: This is the main loop of a worker process.  It reads messages
+ *              from the worker's socket, searches each task it is sent, and
+ *              sends back the task's result, until the coordinator asks it to
+ *              exit or closes the socket.  Windows sent for tasks that have
+ *              already finished are ignored.
+ */
+void SearchWorker::run() {
+  while (!quit) {
+    SearchMessage message;
+    if (recv(fd, &message, sizeof(message), 0) != sizeof(message)) return;
+    if (message.type == MESSAGE_QUIT) return;
+    if (message.type != MESSAGE_TASK) continue;
+
+    task = message.task;
+    shared_alpha = message.alpha;
+    shared_beta = message.beta;
+    nodes = 0;
+    int value = search(message.black, message.white, message.color,
+                       message.depth, message.alpha, message.beta);
+    if (quit) return;
+
+    message.type = MESSAGE_RESULT;
+    message.value = value;
+    message.nodes = nodes;
+    if (send(fd, &message, sizeof(message), MSG_NOSIGNAL) != sizeof(message)) {
+      return;
+    }
+  }
+}
+
+/*
+ * Function: poll_bounds
+ *
+ * Description: This function reads any messages waiting on the worker's socket
+ *              without blocking.  A new window for the current task replaces
+ *              the shared window, which search applies at every node.  If the
+ *              coordinator asks the worker to exit, or has gone away, the
+ *              shared window is made empty so that the search unwinds quickly.
+ */
+void SearchWorker::poll_bounds() {
+  SearchMessage message;
+  ssize_t length;
+  while ((length = recv(fd, &message, sizeof(message), MSG_DONTWAIT)) ==
+         sizeof(message)) {
+    if (message.type == MESSAGE_QUIT) break;
+    if ((message.type == MESSAGE_BOUNDS) && (message.task == task)) {
+      shared_alpha = message.alpha;
+      shared_beta = message.beta;
+    }
+  }
+  if ((length >= 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK))) {
+    quit = true;
+    shared_alpha = INT_MAX;
+    shared_beta = INT_MIN;
+  }
+}
+
+/*
+ * Function: search
+ *
+ * Description: This function performs the same alpha-beta pruning as
+ *              Othello::alpha_beta on the decision tree that
+ *              Othello::create_decision_tree would build below a board, but
+ *              generates the tree as it goes instead of building it first.  The
+ *              window of every node is narrowed to the shared window, which
+ *              can only narrow while a task is being searched; this is
+ *              equivalent to having searched the task with the narrower window
+ *              from the start, as far as the nodes not yet searched are
+ *              concerned.
+ *
+ *              If a node limit has been set, the search is aborted once that
+ *              many nodes have been searched, and if a stop flag has been set,
+ *              as soon as the flag is raised: no further nodes are visited, and
+ *              the values returned from then on are meaningless.
+ *
+ * Inputs:
+ *  - black: The spaces holding black pieces.
+ *  - white: The spaces holding white pieces.
+ *  - color: The player whose turn it is.
+ *  - depth: The number of levels of the tree below this board.
+ *  - alpha: The best possible heuristic score for the black player found thus
+ *           far.
+ *  - beta: The best possible heuristic score for the white player found thus
+ *          far.
+ *
+ * Return value: The heuristic score that would result from the best move by the
+ *               player.
+ */
+int SearchWorker::search(uint64_t black, uint64_t white, int color, int depth,
+                         int alpha, int beta) {
+  if (aborted) return 0;
+  ++nodes;
+  if ((node_limit > 0) && (nodes >= node_limit)) aborted = true;
+  if ((stop_flag != NULL) && stop_flag->load(memory_order_relaxed)) {
+    aborted = true;
+  }
+  if ((fd >= 0) && (nodes % DISTRIBUTED_POLL_INTERVAL == 0)) poll_bounds();
+  if (depth <= 0) return GameBoard::evaluate_bitboards(black, white);
+
+  scratch.load_bitboards(black, white);
+  int moves[BOARD_SIZE * BOARD_SIZE];
+  int num_moves = 0;
+  for (int i = 0; i < BOARD_SIZE; ++i) {
+    for (int j = 0; j < BOARD_SIZE; ++j) {
+      if (scratch.is_legal(color, i, j)) {
+        moves[num_moves++] = i * BOARD_SIZE + j;
+      }
+    }
+  }
+  if (num_moves == 0) return GameBoard::evaluate_bitboards(black, white);
+
+  alpha = max(alpha, shared_alpha);
+  beta = min(beta, shared_beta);
+  int value = (color == 2) ? INT_MIN : INT_MAX;
+  for (int k = 0; k < num_moves; ++k) {
+    uint64_t child_black, child_white;
+    if (k > 0) scratch.load_bitboards(black, white);
+    scratch.place_piece(color, moves[k] / BOARD_SIZE, moves[k] % BOARD_SIZE,
+                        true);
+    scratch.to_bitboards(&child_black, &child_white);
+    int child_value = search(child_black, child_white, 3 - color, depth - 1,
+                             alpha, beta);
+    if (color == 2) {
+      value = max(value, child_value);
+      alpha = max(alpha, value);
+    }
+    else {
+      value = min(value, child_value);
+      beta = min(beta, value);
+    }
+    alpha = max(alpha, shared_alpha);
+    beta = min(beta, shared_beta);
+    if (beta <= alpha) break;
+  }
+  return value;
+}
+
+/*
+ * Function: search_root
+ *
+ * Description: This function finds the best move from a board in the same way
+ *              as Othello::choose_move: each legal move is searched in order of
+ *              its coordinates, with a window that only admits moves strictly
+ *              better than the best found so far, so that the first of several
+ *              equally good moves is chosen.
+ *
+ * Inputs:
+ *  - black: The spaces holding black pieces.
+ *  - white: The spaces holding white pieces.
+ *  - color: The player whose turn it is.
+ *  - depth: The maximum allowable depth of the decision tree.  Must be
+ *           positive.
+ *
+ * Outputs:
+ *  - best_move: The best move, as x * BOARD_SIZE + y, is stored here.  If the
+ *               search is aborted, this is the best of the moves whose search
+ *               finished, and is left unchanged if there were none.
+ *
+ * Return value: The heuristic score of the best move, or INT_MIN (for black)
+ *               or INT_MAX (for white) if no move's search finished.
+ */
+int SearchWorker::search_root(uint64_t black, uint64_t white, int color,
+                              int depth, int* best_move) {
+  int moves[BOARD_SIZE * BOARD_SIZE];
+  uint64_t move_black[BOARD_SIZE * BOARD_SIZE];
+  uint64_t move_white[BOARD_SIZE * BOARD_SIZE];
+  int num_moves = 0;
+  for (int i = 0; i < BOARD_SIZE; ++i) {
+    for (int j = 0; j < BOARD_SIZE; ++j) {
+      scratch.load_bitboards(black, white);
+      if (!scratch.place_piece(color, i, j, true)) continue;
+      scratch.to_bitboards(&move_black[num_moves], &move_white[num_moves]);
+      moves[num_moves++] = i * BOARD_SIZE + j;
+    }
+  }
+
+  int best_value = (color == 2) ? INT_MIN : INT_MAX;
+  for (int k = 0; k < num_moves; ++k) {
+    int alpha = INT_MIN, beta = INT_MAX;
+    if (k > 0) {
+      if (color == 2) alpha = best_value;
+      else beta = best_value;
+    }
+    int value = search(move_black[k], move_white[k], 3 - color, depth - 1,
+                       alpha, beta);
+    if (aborted) break;
+    if ((k == 0) || ((color == 2) ? (value > best_value) :
+                     (value < best_value))) {
+      best_value = value;
+      *best_move = moves[k];
+    }
+  }
+  return best_value;
+}
+
+/*
+ * Function: set_node_limit
+ *
+ * Description: Sets the number of nodes after which the search is aborted.  The
+ *              count includes every node searched since the worker was
+ *              created, so a limit covers a series of searches.
+ *
+ * Inputs:
+ *  - limit: The node limit, or 0 for no limit.
+ */
+void SearchWorker::set_node_limit(long limit) {node_limit = limit;}
+
+/*
+ * Function: set_stop_flag
+ *
+ * Description: Sets a flag that another thread can raise to abort the search.
+ *              The flag is checked at every node, so the search stops within
+ *              the time it takes to search one node.
+ *
+ * Inputs:
+ *  - flag: The stop flag, or NULL for none.
+ */
+void SearchWorker::set_stop_flag(atomic<bool>* flag) {stop_flag = flag;}
+
+bool SearchWorker::is_aborted() {return aborted;}
+long SearchWorker::get_nodes() {return nodes;}
+
+/*
+ * Constructor for DistributedSearch.  Forks the worker processes, each of which
+ * is connected to this process by a socket pair carrying SearchMessages.  If a
+ * worker cannot be started, the search runs with the workers started so far.
+ * Since the workers are copies of this process, weights and networks must be
+ * loaded before the search is created for the workers to use them.
+ *
+ * Inputs:
+ *  - num_workers: The number of worker processes to start.
+ */
+DistributedSearch::DistributedSearch(int num_workers) {
+  nodes = 0;
+  cout.flush();
+  for (int w = 0; w < num_workers; ++w) {
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, pair) != 0) break;
+    pid_t pid = fork();
+    if (pid < 0) {
+      close(pair[0]);
+      close(pair[1]);
+      break;
+    }
+    if (pid == 0) {
+      close(pair[0]);
+      for (auto fd = fds.begin(); fd != fds.end(); ++fd) close(*fd);
+      SearchWorker worker(pair[1]);
+      worker.run();
+      _exit(0);
+    }
+    close(pair[1]);
+    pids.push_back(pid);
+    fds.push_back(pair[0]);
+  }
+}
+
+/*
+ * Destructor for DistributedSearch.  Stops the workers.
+ */
+DistributedSearch::~DistributedSearch() {
+  stop_workers();
+}
+
+/*
+ * Function: stop_workers
+ *
+ * Description: This function asks every worker to exit, closes their sockets,
+ *              and waits for them to finish.  Afterwards, choose_move searches
+ *              in the current process.
+ */
+void DistributedSearch::stop_workers() {
+  SearchMessage message;
+  memset(&message, 0, sizeof(message));
+  message.type = MESSAGE_QUIT;
+  for (size_t w = 0; w < fds.size(); ++w) {
+    send(fds[w], &message, sizeof(message), MSG_NOSIGNAL);
+    close(fds[w]);
+  }
+  for (size_t w = 0; w < pids.size(); ++w) {
+    waitpid(pids[w], NULL, 0);
+  }
+  fds.clear();
+  pids.clear();
+}
+
+/*
+ * Function: choose_move
+ *
+ * Description: This function finds the same move as Othello::choose_move, by
+ *              dividing the root moves among the workers.  Root moves are
+ *              handed out one at a time as workers become free, so that a
+ *              worker given a quick move goes on to another.  Once fewer root
+ *              moves are left than there are free workers, each remaining root
+ *              move is split into its replies, which are handed out in the same
+ *              way, so that the last moves do not leave workers idle.
+ *
+ *              Every task is searched with the narrowest window in which its
+ *              result can still change the choice of move: a root move must
+ *              beat the best move found so far (or tie it, if it comes
+ *              earlier), and a reply must also be better for the replying
+ *              player than the replies to the same root move found so far.
+ *              Whenever a result narrows the window of a task being searched,
+ *              the new window is sent to its worker.  If a reply refutes its
+ *              root move, the rest of that move's replies are cancelled by
+ *              sending them an empty window.
+ *
+ *              If there are no workers, or a worker fails, the search is done
+ *              in the current process instead.
+ *
+ * Inputs:
+ *  - board: The board on which the move would be made.
+ *  - color: The color of the player whose move is being chosen.
+ *  - depth_limit: The maximum allowable depth of the decision tree.
+ *
+ * Outputs:
+ *  - best_x: The x-coordinate of the best move is stored here.
+ *  - best_y: The y-coordinate of the best move is stored here.
+ *
+ * Return value: True if a move was found; false if the player has no legal
+ *               moves.
+ */
+bool DistributedSearch::choose_move(GameBoard* board, int color,
+                                    int depth_limit, int* best_x,
+                                    int* best_y) {
+  nodes = 0;
+  if (depth_limit <= 0) depth_limit = INT_MAX;
+
+  // Generate the root moves in the same order as create_decision_tree.
+  uint64_t black, white;
+  board->to_bitboards(&black, &white);
+  GameBoard scratch;
+  vector<int> moves;
+  vector<uint64_t> move_black, move_white;
+  for (int i = 0; i < BOARD_SIZE; ++i) {
+    for (int j = 0; j < BOARD_SIZE; ++j) {
+      scratch.load_bitboards(black, white);
+      if (!scratch.place_piece(color, i, j, true)) continue;
+      uint64_t b, w;
+      scratch.to_bitboards(&b, &w);
+      moves.push_back(i * BOARD_SIZE + j);
+      move_black.push_back(b);
+      move_white.push_back(w);
+    }
+  }
+  int num_moves = (int) moves.size();
+  if (num_moves == 0) return false;
+
+  if (fds.empty()) {
+    SearchWorker local(-1);
+    int move = moves[0];
+    local.search_root(black, white, color, depth_limit, &move);
+    nodes = local.get_nodes();
+    *best_x = move / BOARD_SIZE;
+    *best_y = move % BOARD_SIZE;
+    return true;
+  }
+
+  int best = -1, best_value = 0;
+  vector<bool> done(num_moves, false); // whether a root move has been decided
+  vector<int> pending(num_moves, 0); // replies of a split move not yet back
+  vector<int> reply_value(num_moves, (color == 2) ? INT_MAX : INT_MIN);
+
+  // The window in which a root move's result must fall to change the choice
+  // of move.
+  auto root_window = [&](int m, int* alpha, int* beta) {
+    *alpha = INT_MIN;
+    *beta = INT_MAX;
+    if (best < 0) return;
+    if (color == 2) *alpha = (m < best) ? best_value - 1 : best_value;
+    else *beta = (m < best) ? best_value + 1 : best_value;
+  };
+
+  // Records the result of a root move, which is exact if it falls within the
+  // move's window.
+  auto decide = [&](int m, int value) {
+    int alpha, beta;
+    root_window(m, &alpha, &beta);
+    done[m] = true;
+    if ((value > alpha) && (value < beta)) {
+      best = m;
+      best_value = value;
+    }
+  };
+
+  vector<RootTask> tasks;
+  deque<int> queue; // replies waiting for a worker
+  int next_move = 0; // the first root move not yet handed out
+  int worker_count = (int) fds.size();
+  vector<int> worker_task(worker_count, -1); // -1 if the worker is free
+  vector<int64_t> task_start(worker_count, 0); // for tracing worker_task
+  bool failed = false;
+
+  auto task_window = [&](int t, int* alpha, int* beta) {
+    int m = tasks[t].move;
+    if (done[m]) {
+      *alpha = 0;
+      *beta = 0;
+      return;
+    }
+    root_window(m, alpha, beta);
+    if (tasks[t].is_reply) {
+      if (color == 2) *beta = reply_value[m];
+      else *alpha = reply_value[m];
+    }
+  };
+
+  auto send_message = [&](int w, int type, int t) {
+    SearchMessage message;
+    memset(&message, 0, sizeof(message));
+    message.type = type;
+    message.task = t;
+    task_window(t, &tasks[t].alpha, &tasks[t].beta);
+    message.alpha = tasks[t].alpha;
+    message.beta = tasks[t].beta;
+    if (type == MESSAGE_TASK) {
+      message.black = tasks[t].black;
+      message.white = tasks[t].white;
+      message.color = tasks[t].is_reply ? color : 3 - color;
+      message.depth = tasks[t].is_reply ? depth_limit - 2 : depth_limit - 1;
+    }
+    if (send(fds[w], &message, sizeof(message), MSG_NOSIGNAL) !=
+        sizeof(message)) {
+      failed = true;
+    }
+  };
+
+  // Hands the next task to a free worker, splitting root moves once fewer are
+  // left than there are free workers.
+  auto dispatch = [&](int w) {
+    while (!failed) {
+      int t;
+      if (!queue.empty()) {
+        t = queue.front();
+        queue.pop_front();
+        if (done[tasks[t].move]) continue;
+      }
+      else if (next_move < num_moves) {
+        int m = next_move++;
+        int num_free = 0;
+        for (int v = 0; v < worker_count; ++v) {
+          if (worker_task[v] < 0) ++num_free;
+        }
+        if ((num_moves - m < num_free) && (depth_limit > 1)) {
+          for (int i = 0; i < BOARD_SIZE; ++i) {
+            for (int j = 0; j < BOARD_SIZE; ++j) {
+              scratch.load_bitboards(move_black[m], move_white[m]);
+              if (!scratch.place_piece(3 - color, i, j, true)) continue;
+              RootTask reply;
+              reply.move = m;
+              reply.is_reply = true;
+              scratch.to_bitboards(&reply.black, &reply.white);
+              queue.push_back((int) tasks.size());
+              tasks.push_back(reply);
+              ++pending[m];
+            }
+          }
+          if (pending[m] > 0) continue;
+        }
+        RootTask whole;
+        whole.move = m;
+        whole.is_reply = false;
+        whole.black = move_black[m];
+        whole.white = move_white[m];
+        t = (int) tasks.size();
+        tasks.push_back(whole);
+      }
+      else {
+        return;
+      }
+      worker_task[w] = t;
+      task_start[w] = SearchTrace::now();
+      send_message(w, MESSAGE_TASK, t);
+      return;
+    }
+  };
+
+  vector<struct pollfd> polls(worker_count);
+  for (int w = 0; w < worker_count; ++w) {
+    polls[w].events = POLLIN;
+    dispatch(w);
+  }
+
+  while (!failed) {
+    // Only busy workers are polled, so that one that hangs up while idle does
+    // not wake poll until it is next given a task, which then fails to send.
+    int num_busy = 0;
+    for (int w = 0; w < worker_count; ++w) {
+      polls[w].fd = (worker_task[w] >= 0) ? fds[w] : -1;
+      polls[w].revents = 0;
+      if (worker_task[w] >= 0) ++num_busy;
+    }
+    if (num_busy == 0) break;
+
+    if (poll(polls.data(), worker_count, -1) < 0) {
+      if (errno == EINTR) continue;
+      failed = true;
+      break;
+    }
+    for (int w = 0; w < worker_count; ++w) {
+      if ((polls[w].revents == 0) || (worker_task[w] < 0)) continue;
+      if (!(polls[w].revents & POLLIN)) {
+        failed = true; // a busy worker hung up or failed without a result
+        break;
+      }
+      SearchMessage message;
+      if ((recv(fds[w], &message, sizeof(message), 0) != sizeof(message)) ||
+          (message.type != MESSAGE_RESULT) ||
+          (message.task != worker_task[w])) {
+        failed = true;
+        break;
+      }
+      worker_task[w] = -1;
+      nodes += message.nodes;
+
+      int m = tasks[message.task].move;
+      SearchTrace::record_span(pids[w], tasks[message.task].is_reply ?
+                               "reply" : "root move", task_start[w], moves[m]);
+      if (done[m]) continue;
+      if (!tasks[message.task].is_reply) {
+        decide(m, message.value);
+        continue;
+      }
+      int alpha, beta;
+      root_window(m, &alpha, &beta);
+      --pending[m];
+      if ((color == 2) ? (message.value <= alpha) : (message.value >= beta)) {
+        done[m] = true; // refuted
+      }
+      else {
+        reply_value[m] = (color == 2) ? min(reply_value[m], message.value) :
+          max(reply_value[m], message.value);
+        if (pending[m] == 0) decide(m, reply_value[m]);
+      }
+    }
+    if (failed) break;
+
+    // Send any narrower windows, then give the free workers more work.
+    for (int w = 0; w < worker_count; ++w) {
+      int t = worker_task[w];
+      if (t < 0) continue;
+      int alpha, beta;
+      task_window(t, &alpha, &beta);
+      if ((alpha != tasks[t].alpha) || (beta != tasks[t].beta)) {
+        if (done[tasks[t].move]) {
+          SearchTrace::record_for(pids[w], "abort", 'i',
+                                  moves[tasks[t].move]);
+        }
+        send_message(w, MESSAGE_BOUNDS, t);
+      }
+    }
+    for (int w = 0; w < worker_count; ++w) {
+      if (worker_task[w] < 0) dispatch(w);
+    }
+  }
+
+  if (failed) {
+    SearchTrace::record("abort", 'i', -1);
+    stop_workers();
+    return choose_move(board, color, depth_limit, best_x, best_y);
+  }
+  *best_x = moves[best] / BOARD_SIZE;
+  *best_y = moves[best] % BOARD_SIZE;
+  return true;
+}
+
+int DistributedSearch::num_workers() {return (int) fds.size();}
+long DistributedSearch::get_nodes() {return nodes;}
@@ -0,0 +1,225 @@
+#include "othello.h"
+
+// Moves are ordered by the number of replies they leave the opponent when at
+// least this many spaces are empty.  Closer to the end of the game, ordering
+// costs more than it saves.
+#define ENDGAME_ORDERING_EMPTIES 7
+
+// The eight directions in which pieces can be flipped, as changes in x and y.
+static const int directions[8][2] = {{-1, -1}, {-1, 0}, {-1, 1}, {0, -1},
+                                     {0, 1}, {1, -1}, {1, 0}, {1, 1}};
+
+/*
+ * Function: shift
+ *
+ * Description: This function moves every piece of a 64-bit board one space in
+ *              a given direction, dropping those that would leave the board.
+ *
+ * Inputs:
+ *  - board: The 64-bit board to shift.
+ *  - direction: The index of the direction in directions.
+ *
+ * Return value: The shifted board.
+ */
+uint64_t Endgame::shift(uint64_t board, int direction) {
+  int dy = directions[direction][1];
+  int amount = directions[direction][0] * BOARD_SIZE + dy;
+  board = (amount > 0) ? (board << amount) : (board >> -amount);
+  if (dy == 1) board &= ~COLUMN_ZERO;
+  if (dy == -1) board &= ~(COLUMN_ZERO << (BOARD_SIZE - 1));
+  return board;
+}
+
+/*
+ * Function: legal_moves
+ *
+ * Description: This function finds every legal move for a player at once.  In
+ *              each direction, runs of the opponent's pieces adjacent to the
+ *              player's pieces are extended one space at a time, and an empty
+ *              space just beyond such a run is a legal move.
+ *
+ * Inputs:
+ *  - own: The pieces of the player to move.
+ *  - opponent: The pieces of the opponent.
+ *
+ * Return value: The 64-bit board of the spaces on which the player may move.
+ */
+uint64_t Endgame::legal_moves(uint64_t own, uint64_t opponent) {
+  uint64_t empty = ~(own | opponent);
+  uint64_t moves = 0;
+  for (int d = 0; d < 8; ++d) {
+    uint64_t run = shift(own, d) & opponent;
+    for (int k = 0; k < BOARD_SIZE - 3; ++k) {
+      run |= shift(run, d) & opponent;
+    }
+    moves |= shift(run, d) & empty;
+  }
+  return moves;
+}
+
+/*
+ * Function: flips
+ *
+ * Description: This function finds the pieces flipped by a move.
+ *
+ * Inputs:
+ *  - own: The pieces of the player making the move.
+ *  - opponent: The pieces of the opponent.
+ *  - square: The space of the move, as x * BOARD_SIZE + y.
+ *
+ * Return value: The 64-bit board of the opponent's pieces that the move flips.
+ */
+uint64_t Endgame::flips(uint64_t own, uint64_t opponent, int square) {
+  uint64_t flipped = 0;
+  uint64_t start = (uint64_t) 1 << square;
+  for (int d = 0; d < 8; ++d) {
+    uint64_t run = 0;
+    uint64_t next = shift(start, d);
+    while (next & opponent) {
+      run |= next;
+      next = shift(next, d);
+    }
+    if (next & own) flipped |= run;
+  }
+  return flipped;
+}
+
+/*
+ * Function: solve
+ *
+ * Description: This function finds the exact score of a position with best
+ *              play by both players, by alpha-beta pruning over every line of
+ *              play to the end of the game.  A player with no legal moves
+ *              passes, and the game ends when both players must pass in a row.
+ *              Like the score of raw_score_of_board, the result is the number
+ *              of black pieces minus the number of white pieces; empty spaces
+ *              are not awarded to either player.
+ *
+ * Inputs:
+ *  - black: The spaces holding black pieces.
+ *  - white: The spaces holding white pieces.
+ *  - color: The player whose turn it is.
+ *  - alpha: The best score for the black player found thus far.
+ *  - beta: The best score for the white player found thus far.
+ *  - passed: Whether the other player passed on the turn before this one.
+ *
+ * Outputs:
+ *  - best_move: If not NULL, the best move, as x * BOARD_SIZE + y, is stored
+ *               here, or NO_MOVE if the player must pass.
+ *  - nodes: The number of positions searched is added to the value here.
+ *
+ * Return value: The exact score, if it lies strictly between alpha and beta;
+ *               otherwise a bound on it, as in Othello::alpha_beta.
+ */
+int Endgame::solve(uint64_t black, uint64_t white, int color, int alpha,
+                   int beta, bool passed, int* best_move, long* nodes) {
+  ++*nodes;
+  if (best_move != NULL) *best_move = NO_MOVE;
+  uint64_t own = (color == 2) ? black : white;
+  uint64_t opponent = (color == 2) ? white : black;
+  uint64_t moves = legal_moves(own, opponent);
+  if (moves == 0) {
+    if (passed) {
+      return __builtin_popcountll(black) - __builtin_popcountll(white);
+    }
+    return solve(black, white, 3 - color, alpha, beta, true, NULL, nodes);
+  }
+
+  // List the moves, ordered near the root by how few replies each leaves the
+  // opponent, so that strong moves tend to be searched first.
+  int squares[BOARD_SIZE * BOARD_SIZE];
+  int replies[BOARD_SIZE * BOARD_SIZE];
+  int num_moves = 0;
+  bool ordered = (__builtin_popcountll(~(black | white)) >=
+                  ENDGAME_ORDERING_EMPTIES);
+  for (; moves != 0; moves &= moves - 1) {
+    int square = __builtin_ctzll(moves);
+    int count = 0;
+    if (ordered) {
+      uint64_t flipped = flips(own, opponent, square);
+      uint64_t placed = own | flipped | ((uint64_t) 1 << square);
+      count = __builtin_popcountll(legal_moves(opponent & ~flipped, placed));
+    }
+    int k = num_moves++;
+    while ((k > 0) && (replies[k - 1] > count)) {
+      squares[k] = squares[k - 1];
+      replies[k] = replies[k - 1];
+      --k;
+    }
+    squares[k] = square;
+    replies[k] = count;
+  }
+
+  int value = (color == 2) ? INT_MIN : INT_MAX;
+  for (int k = 0; k < num_moves; ++k) {
+    uint64_t flipped = flips(own, opponent, squares[k]);
+    uint64_t new_own = own | flipped | ((uint64_t) 1 << squares[k]);
+    uint64_t new_opponent = opponent & ~flipped;
+    int child_value = (color == 2) ?
+      solve(new_own, new_opponent, 1, alpha, beta, false, NULL, nodes) :
+      solve(new_opponent, new_own, 2, alpha, beta, false, NULL, nodes);
+    if ((color == 2) ? (child_value > value) : (child_value < value)) {
+      value = child_value;
+      if (best_move != NULL) *best_move = squares[k];
+    }
+    if (color == 2) alpha = max(alpha, value);
+    else beta = min(beta, value);
+    if (beta <= alpha) break;
+  }
+  return value;
+}
+
+/*
+ * Function: choose_move
+ *
+ * Description: This function finds the best move for a player by solving the
+ *              position exactly.  If a database is given, the position is
+ *              looked up in it first, and a position that has to be solved is
+ *              added to it afterwards.  Positions are stored in canonical form,
+ *              so a result is shared by all of a position's symmetric images.
+ *
+ * Inputs:
+ *  - board: The board on which the move would be made.
+ *  - color: The color of the player whose move is being chosen.
+ *  - db: The database of solved positions, or NULL.
+ *
+ * Outputs:
+ *  - best_x: The x-coordinate of the best move is stored here.
+ *  - best_y: The y-coordinate of the best move is stored here.
+ *
+ * Return value: True if a move was found; false if the player has no legal
+ *               moves.
+ */
+bool Endgame::choose_move(GameBoard* board, int color, SolvedDB* db,
+                          int* best_x, int* best_y) {
+  TraceSpan span("endgame", color);
+  uint64_t black, white;
+  board->to_bitboards(&black, &white);
+  uint64_t moves = (color == 2) ? legal_moves(black, white) :
+    legal_moves(white, black);
+  if (moves == 0) return false;
+
+  uint64_t canonical_black, canonical_white;
+  int symmetry = Symmetry::canonicalize(black, white, &canonical_black,
+                                        &canonical_white);
+  int score, move;
+  if ((db != NULL) &&
+      db->lookup(canonical_black, canonical_white, color, &score, &move) &&
+      (move != NO_MOVE)) {
+    Symmetry::untransform_move(symmetry, move / BOARD_SIZE, move % BOARD_SIZE,
+                               best_x, best_y);
+    if ((moves >> (*best_x * BOARD_SIZE + *best_y)) & 1) return true;
+  }
+
+  long nodes = 0;
+  score = solve(black, white, color, INT_MIN, INT_MAX, false, &move, &nodes);
+  *best_x = move / BOARD_SIZE;
+  *best_y = move % BOARD_SIZE;
+  if (db != NULL) {
+    int x, y;
+    Symmetry::transform_move(symmetry, *best_x, *best_y, &x, &y);
+    db->insert(canonical_black, canonical_white, color, score,
+               x * BOARD_SIZE + y);
+  }
+  return true;
+}
@@ -1,9 +1,98 @@
 #include "othello.h"
 
+int GameBoard::flip_method = FLIP_TABLE;
+
+// Tables for finding flips a line of the board at a time (see table_flips).  A
+// line is a row, column, or diagonal, and its spaces are numbered 0 to 7 along
+// it, so that the pieces on a line form an 8-bit pattern.  For a move at space
+// p of a line, outflank_table[p][k] is the pattern of spaces that would
+// outflank a run of the opponent's pieces starting next to p, given that k is
+// the pattern of the opponent's pieces on spaces 1 to 6 (pieces on the ends of
+// a line can never be flipped); flipped_table[p][o] is the pattern of spaces
+// between p and the outflanking spaces in pattern o.
+static uint8_t outflank_table[BOARD_SIZE][64];
+static uint8_t flipped_table[BOARD_SIZE][256];
+
+// column_spread[k] is the 64-bit board of the spaces with y-coordinate 0 whose
+// x-coordinates are set in pattern k.  diagonal_masks[x - y + 7] and
+// anti_diagonal_masks[x + y] are the 64-bit boards of the two diagonals
+// through (x, y).
+static uint64_t column_spread[256];
+static uint64_t diagonal_masks[2 * BOARD_SIZE - 1];
+static uint64_t anti_diagonal_masks[2 * BOARD_SIZE - 1];
+
+// Helper function for table_flips.  Fills in the flip tables, and returns true.
+static bool make_flip_tables() {
+  for (int p = 0; p < BOARD_SIZE; ++p) {
+    for (int inner = 0; inner < 64; ++inner) {
+      int opponent = inner << 1;
+      int outflank = 0;
+      int k = p + 1;
+      while ((k < BOARD_SIZE) && ((opponent >> k) & 1)) ++k;
+      if ((k > p + 1) && (k < BOARD_SIZE)) outflank |= 1 << k;
+      k = p - 1;
+      while ((k >= 0) && ((opponent >> k) & 1)) --k;
+      if ((k < p - 1) && (k >= 0)) outflank |= 1 << k;
+      outflank_table[p][inner] = (uint8_t) outflank;
+    }
+    for (int outflank = 0; outflank < 256; ++outflank) {
+      int flipped = 0;
+      for (int k = 0; k < BOARD_SIZE; ++k) {
+        if (!((outflank >> k) & 1)) continue;
+        for (int j = min(k, p) + 1; j < max(k, p); ++j) flipped |= 1 << j;
+      }
+      flipped_table[p][outflank] = (uint8_t) flipped;
+    }
+  }
+
+  for (int pattern = 0; pattern < 256; ++pattern) {
+    column_spread[pattern] = 0;
+    for (int k = 0; k < BOARD_SIZE; ++k) {
+      if ((pattern >> k) & 1) {
+        column_spread[pattern] |= (uint64_t) 1 << (k * BOARD_SIZE);
+      }
+    }
+  }
+  for (int k = 0; k < 2 * BOARD_SIZE - 1; ++k) {
+    diagonal_masks[k] = 0;
+    anti_diagonal_masks[k] = 0;
+  }
+  for (int i = 0; i < BOARD_SIZE; ++i) {
+    for (int j = 0; j < BOARD_SIZE; ++j) {
+      uint64_t bit = (uint64_t) 1 << (i * BOARD_SIZE + j);
+      diagonal_masks[i - j + BOARD_SIZE - 1] |= bit;
+      anti_diagonal_masks[i + j] |= bit;
+    }
+  }
+  return true;
+}
+
+// Helper function for table_flips.  Returns the pattern of pieces flipped on a
+// line by a move at space p, given the patterns of each player's pieces.
+static inline int line_flips(int p, int own, int opponent) {
+  return flipped_table[p][outflank_table[p][(opponent >> 1) & 63] & own];
+}
+
+// Helper function for table_flips.  Returns the pattern of the pieces in column
+// y, numbered by x-coordinate.  The multiplication moves the bit of space
+// (x, y) to bit 56 + x, and no two of the partial products overlap.
+static inline int column_pattern(uint64_t bits, int y) {
+  return (int) ((((bits >> y) & COLUMN_ZERO) * 0x0102040810204080ULL) >> 56);
+}
+
+// Helper function for table_flips.  Returns the pattern of the pieces on a
+// diagonal, numbered by y-coordinate.  The spaces of a diagonal are all in
+// different columns, so the multiplication gathers them into the top byte
+// without carries.
+static inline int diagonal_pattern(uint64_t bits, uint64_t mask) {
+  return (int) (((bits & mask) * COLUMN_ZERO) >> 56);
+}
+
 /*
  * This is the default constructor for the GameBoard class.
  */
 GameBoard::GameBoard() {
+  accumulator = NULL;
   game_board = new int*[BOARD_SIZE];
   for (int i = 0; i < BOARD_SIZE; ++i) {
     game_board[i] = new int[BOARD_SIZE];
@@ -18,6 +107,7 @@ GameBoard::GameBoard() {
   game_board[BOARD_SIZE / 2][BOARD_SIZE / 2] = 2;
   game_board[BOARD_SIZE / 2][(BOARD_SIZE / 2) - 1] = 1; // white
   game_board[(BOARD_SIZE / 2) - 1][BOARD_SIZE / 2] = 1;
+  sync_bitboards();
 }
 
 /*
@@ -34,6 +124,16 @@ GameBoard::GameBoard(const GameBoard &gb) {
       game_board[i][j] = gb.game_board[i][j];
     }
   }
+  black_bits = gb.black_bits;
+  white_bits = gb.white_bits;
+
+  accumulator = NULL;
+  if (gb.accumulator != NULL) {
+    accumulator = new int16_t[NNUE_HIDDEN];
+    for (int k = 0; k < NNUE_HIDDEN; ++k) {
+      accumulator[k] = gb.accumulator[k];
+    }
+  }
 }
 
 /*
@@ -44,6 +144,35 @@ GameBoard::~GameBoard() {
     delete[] game_board[i];
   }
   delete[] game_board;
+  if (accumulator != NULL) delete[] accumulator;
+}
+
+/*
+ * Function: set_space
+ *
+ * Description: This function changes the contents of a space, keeping the
+ *              accumulator of the neural evaluator (if any) up to date.
+ *
+ * Inputs:
+ *  - x: The x-coordinate of the space.
+ *  - y: The y-coordinate of the space.
+ *  - color: The new contents of the space: 0 for empty, 1 for white, or 2 for
+ *           black.
+ */
+void GameBoard::set_space(int x, int y, int color) {
+  int old_color = game_board[x][y];
+  game_board[x][y] = color;
+  uint64_t bit = (uint64_t) 1 << (x * BOARD_SIZE + y);
+  black_bits = (color == 2) ? (black_bits | bit) : (black_bits & ~bit);
+  white_bits = (color == 1) ? (white_bits | bit) : (white_bits & ~bit);
+  if ((accumulator == NULL) || (old_color == color)) return;
+  if (old_color == 0) {
+    NNUE::add_feature(accumulator, NNUE::feature_index(color, x, y));
+  }
+  else {
+    NNUE::move_feature(accumulator, NNUE::feature_index(old_color, x, y),
+                       NNUE::feature_index(color, x, y));
+  }
 }
 
 /*
@@ -51,6 +180,8 @@ GameBoard::~GameBoard() {
  *
  * Description: This function places a given piece of a given color on the
  *              board and flips all pieces that will now need to be flipped.
+ *              The flipped pieces are found by flip_pieces or table_flips,
+ *              according to the flip method (see set_flip_method).
  *
  * Inputs:
  *  - color: The color of the piece to be placed.  1 represents white, and 2
@@ -73,6 +204,19 @@ bool GameBoard::place_piece(int color, int x, int y, bool do_flip) {
     return false;
   }
 
+  if (flip_method == FLIP_TABLE) {
+    uint64_t flipped = table_flips(color, x, y);
+    if (flipped == 0) return false;
+    if (do_flip) {
+      for (; flipped != 0; flipped &= flipped - 1) {
+        int square = __builtin_ctzll(flipped);
+        set_space(square / BOARD_SIZE, square % BOARD_SIZE, color);
+      }
+      set_space(x, y, color);
+    }
+    return true;
+  }
+
   // For all directions away from (x, y), check to see if there are pieces of
   // the opposite color that can be flipped, and flip them (if do_flip).
   bool is_legal = false;
@@ -85,7 +229,7 @@ bool GameBoard::place_piece(int color, int x, int y, bool do_flip) {
   }
 
   // Place a piece at (x, y).
-  if (is_legal && do_flip) game_board[x][y] = color;
+  if (is_legal && do_flip) set_space(x, y, color);
   
   return is_legal;
 }
@@ -151,13 +295,55 @@ bool GameBoard::flip_pieces(int color, int x, int y, int dir_x, int dir_y,
   if (do_flip) {
     for (x = orig_x + dir_x, y = orig_y + dir_y; game_board[x][y] != color;
 	 x += dir_x, y += dir_y) {
-      game_board[x][y] = color;
+      set_space(x, y, color);
     }
   }
 
   return true;
 }
 
+/*
+ * Function: table_flips
+ *
+ * Description: This function finds the pieces that a move would flip with a
+ *              few table lookups per line through the move, rather than by
+ *              stepping along each direction as flip_pieces does.  The pieces
+ *              of each player on the row, the column, and the two diagonals
+ *              through the move are gathered into 8-bit patterns, which index
+ *              the tables filled in by make_flip_tables, and the flipped
+ *              patterns are spread back onto the board.  Is only meaningful
+ *              when BOARD_SIZE is 8.
+ *
+ * Inputs:
+ *  - color: The color of the piece that would be placed.
+ *  - x: The x-coordinate of the space of the move, which must be empty.
+ *  - y: The y-coordinate of the space of the move, which must be empty.
+ *
+ * Return value: The 64-bit board (see to_bitboards) of the pieces that would
+ *               be flipped, which is 0 if and only if the move is illegal.
+ */
+uint64_t GameBoard::table_flips(int color, int x, int y) {
+  static const bool tables_ready = make_flip_tables();
+  (void) tables_ready;
+  uint64_t own = (color == 2) ? black_bits : white_bits;
+  uint64_t opponent = (color == 2) ? white_bits : black_bits;
+
+  int row = x * BOARD_SIZE;
+  uint64_t flipped = (uint64_t) line_flips(y, (own >> row) & 0xFF,
+                                           (opponent >> row) & 0xFF) << row;
+  flipped |= column_spread[line_flips(x, column_pattern(own, y),
+                                      column_pattern(opponent, y))] << y;
+  uint64_t mask = diagonal_masks[x - y + BOARD_SIZE - 1];
+  flipped |= (line_flips(y, diagonal_pattern(own, mask),
+                         diagonal_pattern(opponent, mask)) * COLUMN_ZERO) &
+    mask;
+  mask = anti_diagonal_masks[x + y];
+  flipped |= (line_flips(y, diagonal_pattern(own, mask),
+                         diagonal_pattern(opponent, mask)) * COLUMN_ZERO) &
+    mask;
+  return flipped;
+}
+
 /*
  * Function: raw_score_of_board
  *
@@ -184,9 +370,12 @@ int GameBoard::raw_score_of_board() {
  *
  * Description: This function is used to measure the score of the board for the
  *              purpose of minimax move prediction.  Spaces on the board are
- *              assigned a heuristic score.  Corner spaces are worth 5 points,
- *              spaces next to corners are worth 2 points, spaces on sides are
- *              worth 3 points, and all other spaces are worth 1 point.
+ *              assigned a heuristic score according to their class (see
+ *              Othello::square_class).  By default, corner spaces are worth 5
+ *              points, spaces next to corners are worth 2 points, spaces on
+ *              sides are worth 3 points, and all other spaces are worth 1
+ *              point; these can be replaced by a weight file produced by the
+ *              Tuner (see Othello::load_weights).
  *
  * Return value: the score of the board in its current state as measured by the
  *               aforementioned heuristic.  A positive value indicates that
@@ -197,27 +386,46 @@ int GameBoard::weighted_score_of_board() {
   int total = 0;
   for (int i = 0; i < BOARD_SIZE; ++i) {
     for (int j = 0; j < BOARD_SIZE; ++j) {
-      if (Othello::is_corner(i, j)) {
-	if (game_board[i][j] == 2) total += 5;
-	if (game_board[i][j] == 1) total -= 5;
-      }
-      else if (Othello::is_next_to_corner(i, j)) {
-	if (game_board[i][j] == 2) total += 2;
-	if (game_board[i][j] == 1) total -= 2;
-      }
-      else if (Othello::is_side(i, j)) {
-	if (game_board[i][j] == 2) total += 3;
-	if (game_board[i][j] == 1) total -= 3;
-      }
-      else {
-	if (game_board[i][j] == 2) total += 1;
-	if (game_board[i][j] == 1) total -= 1;
-      }
+      int weight =
+        Othello::get_square_weight(Othello::square_class(i, j, BOARD_SIZE));
+      if (game_board[i][j] == 2) total += weight;
+      if (game_board[i][j] == 1) total -= weight;
     }
   }
   return total;
 }
 
+/*
+ * Function: evaluate
+ *
+ * Description: This function measures the score of the board for the purpose of
+ *              minimax move prediction, using the neural evaluator if this
+ *              board has an accumulator (see attach_accumulator), and
+ *              weighted_score_of_board otherwise.
+ *
+ * Return value: the score of the board.  A positive value indicates that black
+ *               is in a better position than white, and a negative value
+ *               indicates that white is in a better position than black.
+ */
+int GameBoard::evaluate() {
+  if (accumulator != NULL) return NNUE::evaluate(accumulator);
+  return weighted_score_of_board();
+}
+
+/*
+ * Function: attach_accumulator
+ *
+ * Description: This function gives this board an accumulator for the neural
+ *              evaluator, so that evaluate uses the network from then on.  The
+ *              accumulator is copied along with the board, so boards derived
+ *              from this one use the network as well.  Requires that a network
+ *              has been loaded with NNUE::load.
+ */
+void GameBoard::attach_accumulator() {
+  if (accumulator == NULL) accumulator = new int16_t[NNUE_HIDDEN];
+  NNUE::refresh(this, accumulator);
+}
+
 /*
  * Function: is_legal
  *
@@ -235,3 +443,273 @@ int GameBoard::weighted_score_of_board() {
 bool GameBoard::is_legal(int color, int x, int y) {
   return place_piece(color, x, y, false);
 }
+
+/*
+ * Function: load_position
+ *
+ * Description: This function replaces the state of the board with a position
+ *              given as a string of BOARD_SIZE * BOARD_SIZE characters, one per
+ *              space, each of which is '0' (empty), '1' (white), or '2'
+ *              (black).  Spaces are listed in the order (0, 0), (0, 1), ...,
+ *              (0, BOARD_SIZE - 1), (1, 0), and so on.
+ *
+ * Inputs:
+ *  - position: The string describing the position.
+ *
+ * Return value:
+ *  - If true, the board now holds the given position.
+ *  - If false, the string was malformed, and the board is unchanged.
+ */
+bool GameBoard::load_position(const char* position) {
+  for (int k = 0; k < BOARD_SIZE * BOARD_SIZE; ++k) {
+    if ((position[k] < '0') || (position[k] > '2')) return false;
+  }
+  for (int i = 0; i < BOARD_SIZE; ++i) {
+    for (int j = 0; j < BOARD_SIZE; ++j) {
+      game_board[i][j] = position[i * BOARD_SIZE + j] - '0';
+    }
+  }
+  sync_bitboards();
+  if (accumulator != NULL) NNUE::refresh(this, accumulator);
+  return true;
+}
+
+/*
+ * Function: save_position
+ *
+ * Description: This function writes the state of the board as a string in the
+ *              format accepted by load_position.
+ *
+ * Outputs:
+ *  - position: The string describing the position.  Is assumed to hold at
+ *              least BOARD_SIZE * BOARD_SIZE + 1 characters, the last of which
+ *              will be set to the null terminator.
+ */
+void GameBoard::save_position(char* position) {
+  for (int i = 0; i < BOARD_SIZE; ++i) {
+    for (int j = 0; j < BOARD_SIZE; ++j) {
+      position[i * BOARD_SIZE + j] = '0' + game_board[i][j];
+    }
+  }
+  position[BOARD_SIZE * BOARD_SIZE] = 0;
+}
+
+/*
+ * Function: to_bitboards
+ *
+ * Description: This function converts the board to a pair of 64-bit boards, in
+ *              which space (x, y) is bit x * BOARD_SIZE + y.  The board keeps
+ *              its state in this form as well (see sync_bitboards), so this
+ *              takes constant time.  Is only meaningful when BOARD_SIZE is 8.
+ *
+ * Outputs:
+ *  - black: The bits of the spaces holding black pieces are set here.
+ *  - white: The bits of the spaces holding white pieces are set here.
+ */
+void GameBoard::to_bitboards(uint64_t* black, uint64_t* white) {
+  *black = black_bits;
+  *white = white_bits;
+}
+
+/*
+ * Function: sync_bitboards
+ *
+ * Description: This function recomputes the board's 64-bit boards from
+ *              game_board, after the whole state has been replaced.  Changes
+ *              to single spaces keep them up to date through set_space.
+ */
+void GameBoard::sync_bitboards() {
+  black_bits = 0;
+  white_bits = 0;
+  for (int i = 0; i < BOARD_SIZE; ++i) {
+    for (int j = 0; j < BOARD_SIZE; ++j) {
+      uint64_t bit = (uint64_t) 1 << (i * BOARD_SIZE + j);
+      if (game_board[i][j] == 2) black_bits |= bit;
+      if (game_board[i][j] == 1) white_bits |= bit;
+    }
+  }
+}
+
+/*
+ * Function: load_bitboards
+ *
+ * Description: This function replaces the state of the board with a position
+ *              given as a pair of 64-bit boards (see to_bitboards).
+ *
+ * Inputs:
+ *  - black: The spaces holding black pieces.
+ *  - white: The spaces holding white pieces.
+ */
+void GameBoard::load_bitboards(uint64_t black, uint64_t white) {
+  for (int i = 0; i < BOARD_SIZE; ++i) {
+    for (int j = 0; j < BOARD_SIZE; ++j) {
+      int square = i * BOARD_SIZE + j;
+      game_board[i][j] = ((black >> square) & 1) ? 2 :
+        (((white >> square) & 1) ? 1 : 0);
+    }
+  }
+  black_bits = black;
+  white_bits = white;
+  if (accumulator != NULL) NNUE::refresh(this, accumulator);
+}
+
+// Helper function for weighted_score_of_bitboards.  Returns, for each class of
+// space, the 64-bit board of the spaces in that class.
+static vector<uint64_t> make_class_masks() {
+  vector<uint64_t> masks(NUM_SQUARE_CLASSES, 0);
+  for (int i = 0; i < BOARD_SIZE; ++i) {
+    for (int j = 0; j < BOARD_SIZE; ++j) {
+      masks[Othello::square_class(i, j, BOARD_SIZE)] |=
+        (uint64_t) 1 << (i * BOARD_SIZE + j);
+    }
+  }
+  return masks;
+}
+
+/*
+ * Function: weighted_score_of_bitboards
+ *
+ * Description: This function computes the same score as
+ *              weighted_score_of_board for a position given as a pair of 64-bit
+ *              boards, by counting the pieces of each color in each class of
+ *              space.
+ *
+ * Inputs:
+ *  - black: The spaces holding black pieces.
+ *  - white: The spaces holding white pieces.
+ *
+ * Return value: The weighted score of the position.
+ */
+int GameBoard::weighted_score_of_bitboards(uint64_t black, uint64_t white) {
+  static const vector<uint64_t> class_masks = make_class_masks();
+  int total = 0;
+  for (int k = 0; k < NUM_SQUARE_CLASSES; ++k) {
+    total += Othello::get_square_weight(k) *
+      (__builtin_popcountll(black & class_masks[k]) -
+       __builtin_popcountll(white & class_masks[k]));
+  }
+  return total;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// Helper function for weighted_scores_avx2.  Counts the pieces in each 64-bit
+// lane, by looking up the count of each 4-bit half of each byte and summing
+// the counts of the eight bytes of the lane.
+__attribute__((target("avx2")))
+static inline __m256i popcount_lanes(__m256i bits) {
+  const __m256i nibble_counts = _mm256_setr_epi8(
+    0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+    0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i low_nibbles = _mm256_set1_epi8(0x0f);
+  __m256i low = _mm256_and_si256(bits, low_nibbles);
+  __m256i high = _mm256_and_si256(_mm256_srli_epi16(bits, 4), low_nibbles);
+  __m256i counts = _mm256_add_epi8(_mm256_shuffle_epi8(nibble_counts, low),
+                                   _mm256_shuffle_epi8(nibble_counts, high));
+  return _mm256_sad_epu8(counts, _mm256_setzero_si256());
+}
+
+// Helper function for weighted_scores_of_bitboards.  Scores positions four at
+// a time, one per 64-bit lane, and any left over one at a time.
+__attribute__((target("avx2")))
+static void weighted_scores_avx2(const uint64_t* black, const uint64_t* white,
+                                 int count, const uint64_t* masks,
+                                 const int* weights, int* scores) {
+  int k = 0;
+  for (; k + 4 <= count; k += 4) {
+    __m256i black_lanes = _mm256_loadu_si256((const __m256i*) (black + k));
+    __m256i white_lanes = _mm256_loadu_si256((const __m256i*) (white + k));
+    __m256i totals = _mm256_setzero_si256();
+    for (int c = 0; c < NUM_SQUARE_CLASSES; ++c) {
+      __m256i mask = _mm256_set1_epi64x((long long) masks[c]);
+      __m256i difference = _mm256_sub_epi64(
+        popcount_lanes(_mm256_and_si256(black_lanes, mask)),
+        popcount_lanes(_mm256_and_si256(white_lanes, mask)));
+      totals = _mm256_add_epi64(totals, _mm256_mul_epi32(
+        difference, _mm256_set1_epi64x(weights[c])));
+    }
+    int64_t lanes[4];
+    _mm256_storeu_si256((__m256i*) lanes, totals);
+    for (int lane = 0; lane < 4; ++lane) scores[k + lane] = (int) lanes[lane];
+  }
+  for (; k < count; ++k) {
+    scores[k] = GameBoard::weighted_score_of_bitboards(black[k], white[k]);
+  }
+}
+
+#endif
+
+/*
+ * Function: weighted_scores_of_bitboards
+ *
+ * Description: This function computes weighted_score_of_bitboards for a batch
+ *              of positions at once, given as an array of black boards and an
+ *              array of white boards.  On processors with AVX2, four positions
+ *              are scored at a time; elsewhere, one at a time.
+ *
+ * Inputs:
+ *  - black: The spaces holding black pieces in each position.
+ *  - white: The spaces holding white pieces in each position.
+ *  - count: The number of positions.
+ *
+ * Outputs:
+ *  - scores: The weighted score of each position is stored here.
+ */
+void GameBoard::weighted_scores_of_bitboards(const uint64_t* black,
+                                             const uint64_t* white, int count,
+                                             int* scores) {
+#if defined(__x86_64__) || defined(__i386__)
+  static const bool has_avx2 = __builtin_cpu_supports("avx2");
+  if (has_avx2) {
+    static const vector<uint64_t> class_masks = make_class_masks();
+    int weights[NUM_SQUARE_CLASSES];
+    for (int c = 0; c < NUM_SQUARE_CLASSES; ++c) {
+      weights[c] = Othello::get_square_weight(c);
+    }
+    weighted_scores_avx2(black, white, count, class_masks.data(), weights,
+                         scores);
+    return;
+  }
+#endif
+  for (int k = 0; k < count; ++k) {
+    scores[k] = weighted_score_of_bitboards(black[k], white[k]);
+  }
+}
+
+/*
+ * Function: evaluate_bitboards
+ *
+ * Description: This function measures the score of a position given as a pair
+ *              of 64-bit boards in the same way as evaluate, using the neural
+ *              evaluator if a network has been loaded.
+ *
+ * Inputs:
+ *  - black: The spaces holding black pieces.
+ *  - white: The spaces holding white pieces.
+ *
+ * Return value: The score of the position.
+ */
+int GameBoard::evaluate_bitboards(uint64_t black, uint64_t white) {
+  if (NNUE::is_loaded()) {
+    GameBoard board;
+    board.load_bitboards(black, white);
+    board.attach_accumulator();
+    return board.evaluate();
+  }
+  return weighted_score_of_bitboards(black, white);
+}
+
+/*
+ * Function: set_flip_method
+ *
+ * Description: This function chooses how every board finds the pieces flipped
+ *              by a move.  FLIP_TABLE, the default, is faster; FLIP_SCAN is the
+ *              original method, and is kept to check the tables against.
+ *
+ * Inputs:
+ *  - method: FLIP_SCAN or FLIP_TABLE.
+ */
+void GameBoard::set_flip_method(int method) {flip_method = method;}
+
+int GameBoard::get_flip_method() {return flip_method;}
+int GameBoard::get_space(int x, int y) {return game_board[x][y];}
@@ -0,0 +1,216 @@
+#include "othello.h"
+
+/*
+ * A game log is a sequence of game records, one per game.  Each record begins
+ * with a GAME_LOG_HEADER_SIZE-byte header:
+ *  - byte 0: GAME_LOG_MAGIC.
+ *  - byte 1: the color played by the program (1 for white, 2 for black) in the
+ *            low two bits, plus GAME_LOG_FORFEIT if the user forfeited.
+ *  - byte 2: the number of turns in the game.
+ *  - byte 3: the final raw score of the board (see raw_score_of_board), as a
+ *            signed byte.
+ * The header is followed by one byte per turn, starting with black's first turn
+ * and alternating colors from there.  A turn in which a piece was placed at
+ * (x, y) is stored as x * BOARD_SIZE + y, and a pass is stored as
+ * GAME_LOG_PASS.
+ */
+
+/*
+ * Constructor for GameLog.
+ *
+ * Inputs:
+ *  - filename: The path of the log file.  It is created if it does not exist,
+ *              and appended to if it does.
+ *  - color: The color played by the program.
+ */
+GameLog::GameLog(const char* filename, int color) {
+  fd = open(filename, O_WRONLY|O_APPEND|O_CREAT,
+            S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+  our_color = color;
+}
+
+/*
+ * Destructor for GameLog.
+ */
+GameLog::~GameLog() {
+  if (fd >= 0) close(fd);
+}
+
+/*
+ * Function: is_open
+ *
+ * Return value: True if the log file was opened successfully; false otherwise.
+ */
+bool GameLog::is_open() {return fd >= 0;}
+
+/*
+ * Function: record_move
+ *
+ * Description: This function records a turn in which a piece was placed.
+ *
+ * Inputs:
+ *  - x: The x-coordinate of the space onto which the piece was placed.
+ *  - y: The y-coordinate of the space onto which the piece was placed.
+ */
+void GameLog::record_move(int x, int y) {
+  turns.push_back((unsigned char) (x * BOARD_SIZE + y));
+}
+
+/*
+ * Function: record_pass
+ *
+ * Description: This function records a turn in which the player passed.
+ */
+void GameLog::record_pass() {
+  turns.push_back((unsigned char) GAME_LOG_PASS);
+}
+
+/*
+ * Function: finish
+ *
+ * Description: This function appends the record of the game to the log file
+ *              with a single write, and clears the recorded turns so that the
+ *              next game can be recorded.
+ *
+ * Inputs:
+ *  - score: The final raw score of the board.
+ *  - forfeit: Whether the game ended because the user made an illegal move.
+ *
+ * Return value: True if the record was written; false otherwise.
+ */
+bool GameLog::finish(int score, bool forfeit) {
+  if ((fd < 0) || (turns.size() > 0xFF)) {
+    turns.clear();
+    return false;
+  }
+
+  vector<unsigned char> record(GAME_LOG_HEADER_SIZE + turns.size());
+  record[0] = GAME_LOG_MAGIC;
+  record[1] = (unsigned char) (our_color | (forfeit ? GAME_LOG_FORFEIT : 0));
+  record[2] = (unsigned char) turns.size();
+  record[3] = (unsigned char) (signed char) score;
+  copy(turns.begin(), turns.end(), record.begin() + GAME_LOG_HEADER_SIZE);
+  turns.clear();
+
+  return write(fd, record.data(), record.size()) == (ssize_t) record.size();
+}
+
+/*
+ * Constructor for GameLogReader.
+ */
+GameLogReader::GameLogReader() {
+  data = NULL;
+  length = 0;
+}
+
+/*
+ * Destructor for GameLogReader.
+ */
+GameLogReader::~GameLogReader() {
+  if (data != NULL) munmap(data, length);
+}
+
+/*
+ * Function: open_log
+ *
+ * Description: This function maps a game log into memory and indexes the games
+ *              stored in it.  Indexing stops at the first malformed record, so
+ *              a log whose last record was only partially written can still be
+ *              read.
+ *
+ * Inputs:
+ *  - filename: The path of the log file.
+ *
+ * Return value: The number of games indexed, or -1 if the file could not be
+ *               opened or mapped.
+ */
+long GameLogReader::open_log(const char* filename) {
+  if (data != NULL) munmap(data, length);
+  data = NULL;
+  length = 0;
+  offsets.clear();
+
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) return -1;
+  struct stat filestat;
+  if (fstat(fd, &filestat)) {
+    close(fd);
+    return -1;
+  }
+  if (filestat.st_size == 0) {
+    close(fd);
+    return 0;
+  }
+  void* mapping = mmap(NULL, filestat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) return -1;
+  data = (unsigned char*) mapping;
+  length = filestat.st_size;
+  madvise(data, length, MADV_SEQUENTIAL);
+
+  size_t offset = 0;
+  while (offset + GAME_LOG_HEADER_SIZE <= length) {
+    if (data[offset] != GAME_LOG_MAGIC) break;
+    size_t next = offset + GAME_LOG_HEADER_SIZE + data[offset + 2];
+    if (next > length) break;
+    offsets.push_back(offset);
+    offset = next;
+  }
+  return (long) offsets.size();
+}
+
+size_t GameLogReader::num_games() {return offsets.size();}
+int GameLogReader::num_turns(size_t game) {return data[offsets[game] + 2];}
+int GameLogReader::get_result(size_t game) {
+  return (signed char) data[offsets[game] + 3];
+}
+bool GameLogReader::is_forfeit(size_t game) {
+  return (data[offsets[game] + 1] & GAME_LOG_FORFEIT) != 0;
+}
+
+/*
+ * Function: apply_turn
+ *
+ * Description: This function plays one turn of a logged game on a board.
+ *
+ * Inputs:
+ *  - game: The index of the game.
+ *  - turn: The index of the turn within the game.  Turns are assumed to be
+ *          applied in order.
+ *
+ * Outputs:
+ *  - board: The board onto which the turn is played.
+ *
+ * Return value: True if the turn was a pass or a legal move; false if the
+ *               logged move is not legal on the board.
+ */
+bool GameLogReader::apply_turn(size_t game, int turn, GameBoard* board) {
+  unsigned char move = data[offsets[game] + GAME_LOG_HEADER_SIZE + turn];
+  if (move == GAME_LOG_PASS) return true;
+  if (move >= BOARD_SIZE * BOARD_SIZE) return false;
+  int color = (turn % 2 == 0) ? 2 : 1;
+  return board->place_piece(color, move / BOARD_SIZE, move % BOARD_SIZE, true);
+}
+
+/*
+ * Function: replay
+ *
+ * Description: This function plays every turn of a logged game on a board.
+ *
+ * Inputs:
+ *  - game: The index of the game.
+ *
+ * Outputs:
+ *  - board: The board onto which the game is played.  Is assumed to hold the
+ *           starting position.
+ *
+ * Return value: The number of turns played, or -1 if the game contains a move
+ *               that is not legal.
+ */
+int GameLogReader::replay(size_t game, GameBoard* board) {
+  int turns = num_turns(game);
+  for (int t = 0; t < turns; ++t) {
+    if (!apply_turn(game, t, board)) return -1;
+  }
+  return turns;
+}
@@ -0,0 +1,197 @@
+#include "othello.h"
+
+bool NNUE::loaded = false;
+int16_t NNUE::feature_weights[NNUE_INPUTS][NNUE_HIDDEN];
+int16_t NNUE::hidden_biases[NNUE_HIDDEN];
+int16_t NNUE::output_weights[NNUE_HIDDEN];
+int32_t NNUE::output_bias;
+int32_t NNUE::output_shift;
+
+// Hidden-layer values are clipped to the range [0, NNUE_CLIP] before being
+// fed to the output neuron.
+#define NNUE_CLIP 127
+
+/*
+ * Function: load
+ *
+ * Description: This function loads a network from a weight file.  The file is
+ *              in native byte order and consists of:
+ *               - the four characters of NNUE_MAGIC;
+ *               - the hidden layer size as a 32-bit integer, which must equal
+ *                 NNUE_HIDDEN;
+ *               - the 16-bit feature weights, NNUE_HIDDEN for each of the
+ *                 NNUE_INPUTS inputs in the order given by feature_index;
+ *               - the NNUE_HIDDEN 16-bit hidden biases;
+ *               - the NNUE_HIDDEN 16-bit output weights;
+ *               - the 32-bit output bias; and
+ *               - the 32-bit output shift.
+ *
+ * Inputs:
+ *  - filename: The path of the weight file.
+ *
+ * Return value: True if the network was loaded; false if the file could not be
+ *               read or is malformed, in which case no network is loaded.
+ */
+bool NNUE::load(const char* filename) {
+  loaded = false;
+  FILE* file = fopen(filename, "rb");
+  if (file == NULL) return false;
+
+  char magic[4];
+  int32_t hidden;
+  bool ok = (fread(magic, 1, 4, file) == 4) &&
+    (memcmp(magic, NNUE_MAGIC, 4) == 0) &&
+    (fread(&hidden, sizeof(hidden), 1, file) == 1) &&
+    (hidden == NNUE_HIDDEN) &&
+    (fread(feature_weights, sizeof(feature_weights), 1, file) == 1) &&
+    (fread(hidden_biases, sizeof(hidden_biases), 1, file) == 1) &&
+    (fread(output_weights, sizeof(output_weights), 1, file) == 1) &&
+    (fread(&output_bias, sizeof(output_bias), 1, file) == 1) &&
+    (fread(&output_shift, sizeof(output_shift), 1, file) == 1) &&
+    (output_shift >= 0) && (output_shift < 32);
+  fclose(file);
+
+  loaded = ok;
+  return ok;
+}
+
+bool NNUE::is_loaded() {return loaded;}
+
+/*
+ * Function: feature_index
+ *
+ * Description: This function finds the input of the network that is active
+ *              when a piece of a given color occupies a given space.
+ *
+ * Inputs:
+ *  - color: The color of the piece.  1 represents white, and 2 represents
+ *           black.
+ *  - x: The x-coordinate of the space.
+ *  - y: The y-coordinate of the space.
+ *
+ * Return value: The index of the input.
+ */
+int NNUE::feature_index(int color, int x, int y) {
+  return (color - 1) * BOARD_SIZE * BOARD_SIZE + x * BOARD_SIZE + y;
+}
+
+/*
+ * Function: refresh
+ *
+ * Description: This function computes an accumulator from scratch for the
+ *              pieces on a board.
+ *
+ * Inputs:
+ *  - board: The board.
+ *
+ * Outputs:
+ *  - accumulator: The NNUE_HIDDEN values of the hidden layer are stored here.
+ */
+void NNUE::refresh(GameBoard* board, int16_t* accumulator) {
+  for (int k = 0; k < NNUE_HIDDEN; ++k) {
+    accumulator[k] = hidden_biases[k];
+  }
+  for (int i = 0; i < BOARD_SIZE; ++i) {
+    for (int j = 0; j < BOARD_SIZE; ++j) {
+      int color = board->get_space(i, j);
+      if (color != 0) add_feature(accumulator, feature_index(color, i, j));
+    }
+  }
+}
+
+/*
+ * Function: add_feature
+ *
+ * Description: This function updates an accumulator for an input that has
+ *              become active, i.e. a piece placed on an empty space.
+ *
+ * Inputs:
+ *  - feature: The index of the input.
+ *
+ * Outputs:
+ *  - accumulator: The accumulator to update.
+ */
+void NNUE::add_feature(int16_t* accumulator, int feature) {
+  const int16_t* weights = feature_weights[feature];
+#ifdef __SSE2__
+  for (int k = 0; k < NNUE_HIDDEN; k += 8) {
+    __m128i a = _mm_loadu_si128((__m128i*) (accumulator + k));
+    __m128i w = _mm_loadu_si128((const __m128i*) (weights + k));
+    _mm_storeu_si128((__m128i*) (accumulator + k), _mm_add_epi16(a, w));
+  }
+#else
+  for (int k = 0; k < NNUE_HIDDEN; ++k) {
+    accumulator[k] += weights[k];
+  }
+#endif
+}
+
+/*
+ * Function: move_feature
+ *
+ * Description: This function updates an accumulator for one input becoming
+ *              inactive and another becoming active in a single pass, as when
+ *              a piece is flipped.
+ *
+ * Inputs:
+ *  - from: The index of the input that has become inactive.
+ *  - to: The index of the input that has become active.
+ *
+ * Outputs:
+ *  - accumulator: The accumulator to update.
+ */
+void NNUE::move_feature(int16_t* accumulator, int from, int to) {
+  const int16_t* removed = feature_weights[from];
+  const int16_t* added = feature_weights[to];
+#ifdef __SSE2__
+  for (int k = 0; k < NNUE_HIDDEN; k += 8) {
+    __m128i a = _mm_loadu_si128((__m128i*) (accumulator + k));
+    __m128i r = _mm_loadu_si128((const __m128i*) (removed + k));
+    __m128i w = _mm_loadu_si128((const __m128i*) (added + k));
+    a = _mm_add_epi16(_mm_sub_epi16(a, r), w);
+    _mm_storeu_si128((__m128i*) (accumulator + k), a);
+  }
+#else
+  for (int k = 0; k < NNUE_HIDDEN; ++k) {
+    accumulator[k] += added[k] - removed[k];
+  }
+#endif
+}
+
+/*
+ * Function: evaluate
+ *
+ * Description: This function runs the output layer of the network on an
+ *              accumulator: the hidden values are clipped to [0, NNUE_CLIP],
+ *              multiplied by the output weights and summed, and the sum plus
+ *              the output bias is scaled down by the output shift.
+ *
+ * Inputs:
+ *  - accumulator: The accumulator of the board to evaluate.
+ *
+ * Return value: The score of the board.  A positive value indicates that black
+ *               is in a better position than white.
+ */
+int NNUE::evaluate(const int16_t* accumulator) {
+  int32_t total = 0;
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i clip = _mm_set1_epi16(NNUE_CLIP);
+  __m128i sums = _mm_setzero_si128();
+  for (int k = 0; k < NNUE_HIDDEN; k += 8) {
+    __m128i a = _mm_loadu_si128((const __m128i*) (accumulator + k));
+    a = _mm_min_epi16(_mm_max_epi16(a, zero), clip);
+    __m128i w = _mm_loadu_si128((const __m128i*) (output_weights + k));
+    sums = _mm_add_epi32(sums, _mm_madd_epi16(a, w));
+  }
+  sums = _mm_add_epi32(sums, _mm_shuffle_epi32(sums, 0x4e));
+  sums = _mm_add_epi32(sums, _mm_shuffle_epi32(sums, 0xb1));
+  total = _mm_cvtsi128_si32(sums);
+#else
+  for (int k = 0; k < NNUE_HIDDEN; ++k) {
+    int32_t a = min(max((int32_t) accumulator[k], 0), NNUE_CLIP);
+    total += a * output_weights[k];
+  }
+#endif
+  return (total + output_bias) >> output_shift;
+}
@@ -1,6 +1,13 @@
 #include "othello.h"
 
 int Othello::our_color;
+int Othello::square_weights[NUM_SQUARE_CLASSES] = {5, 2, 3, 1};
+GameLog* Othello::game_log = NULL;
+ArenaTree* Othello::arena = NULL;
+DistributedSearch* Othello::distributed = NULL;
+int Othello::endgame_empties = 0;
+SolvedDB* Othello::solved_db = NULL;
+long Othello::node_budget = 0;
 
 /*
  * Function: take_turn
@@ -24,45 +31,25 @@ int Othello::our_color;
 bool Othello::take_turn(int color, GameBoard *game_board, int depth_limit,
 			bool* forfeit) {
   
+  TraceSpan span("turn", color);
   *forfeit = false;
 
   if (our_color == color) {
-    // If this is us, we create a TreeNode for the current board state and fill
-    // out the tree...
-    TreeNode* tree_root = new TreeNode(new GameBoard(*game_board), 0, color);
-    create_decision_tree(tree_root, depth_limit);
+    // If this is us, we search for the best move to make...
+    int best_x, best_y;
+    bool found_move = choose_move(color, game_board, depth_limit, &best_x,
+				  &best_y);
 
-    // ...and we either pass because we have no legal moves...
-    if (tree_root->no_children()) {
+    // ...and once we've found it, we alter the main game board accordingly, or
+    // we pass because we have no legal moves.
+    if (!found_move || !game_board->place_piece(color, best_x, best_y, true)) {
       cout << "I pass!\n";
-      delete tree_root;
+      if (game_log) game_log->record_pass();
       return true;
     }
-
-    // ...or we perform alpha-beta pruning on the tree and find the best turn to
-    // take.
-    int best_value = alpha_beta(tree_root, INT_MIN, INT_MAX);
-    TreeNode* best_move;
-    for (auto child = tree_root->get_children()->begin();
-	 child != tree_root->get_children()->end(); ++child) {
-      if ((*child)->get_value() == best_value) {
-	best_move = *child;
-	break;
-      }
-    }
-
-    // Once we've found the best move, we alter the main game board accordingly.
-    bool legal_move = game_board->place_piece(color, best_move->get_x(),
-					      best_move->get_y(), true);
-    if (legal_move) {
-      cout << "I placed a " << (color == 2 ? "black" : "white") <<
-	" piece at (" << best_move->get_x() << ", " << best_move->get_y() <<
-	")!\n";
-    }
-    else {
-      cout << "I pass!\n";
-    }
-    delete tree_root;
+    cout << "I placed a " << (color == 2 ? "black" : "white") <<
+      " piece at (" << best_x << ", " << best_y << ")!\n";
+    if (game_log) game_log->record_move(best_x, best_y);
   }
   else {
     // If this is not us, we read input from cin and adjust the main game board
@@ -70,6 +57,7 @@ bool Othello::take_turn(int color, GameBoard *game_board, int depth_limit,
     int x, y;
     cin >> x >> y;
     if ((x < 0) || (x >= BOARD_SIZE) || (y < 0) || (y >= BOARD_SIZE)) {
+      if (game_log) game_log->record_pass();
       return true;
     }
     if (!game_board->is_legal(color, x, y)) {
@@ -77,12 +65,219 @@ bool Othello::take_turn(int color, GameBoard *game_board, int depth_limit,
       return true;
     }
     game_board->place_piece(color, x, y, true);
+    if (game_log) game_log->record_move(x, y);
   }
 
   return false;
   
 }
 
+/*
+ * Function: choose_move
+ *
+ * Description: This function builds a decision tree for the current board state
+ *              and performs alpha-beta pruning on it to find the best move for
+ *              a player.  Positions with few enough empty spaces (see
+ *              set_endgame) are instead solved exactly by Endgame::choose_move,
+ *              which consults Othello::solved_db first.  If a node budget has
+ *              been set, the search deepens iteratively until the budget is
+ *              spent (see search_with_budget).  If Othello::distributed has
+ *              been set, the search is divided among its workers.  Otherwise,
+ *              the tree is built in Othello::arena if one has been set, and out
+ *              of TreeNodes if not.
+ *
+ * Inputs:
+ *  - color: The color of the player whose move is being chosen.
+ *  - game_board: The board on which the move would be made.
+ *  - depth_limit: The maximum allowable depth of the decision tree.
+ *
+ * Outputs:
+ *  - best_x: The x-coordinate of the best move is stored here.
+ *  - best_y: The y-coordinate of the best move is stored here.
+ *
+ * Return value: True if a move was found; false if the player has no legal
+ *               moves.
+ */
+bool Othello::choose_move(int color, GameBoard* game_board, int depth_limit,
+			  int* best_x, int* best_y) {
+  if (endgame_empties > 0) {
+    uint64_t black, white;
+    game_board->to_bitboards(&black, &white);
+    if (BOARD_SIZE * BOARD_SIZE - __builtin_popcountll(black | white) <=
+	endgame_empties) {
+      return Endgame::choose_move(game_board, color, solved_db, best_x,
+				  best_y);
+    }
+  }
+
+  if (node_budget > 0) {
+    return search_with_budget(game_board, color, depth_limit, node_budget,
+			      best_x, best_y, NULL, NULL);
+  }
+
+  TraceSpan span("iteration", depth_limit);
+  if (distributed != NULL) {
+    return distributed->choose_move(game_board, color, depth_limit, best_x,
+				    best_y);
+  }
+
+  if (arena != NULL) {
+    arena->build(game_board, color, depth_limit);
+    if (arena->get_node(0)->num_children == 0) return false;
+    int best_value = arena->alpha_beta(0, INT_MIN, INT_MAX);
+    ArenaNode* root = arena->get_node(0);
+    for (int32_t child = root->first_child;
+	 child < root->first_child + root->num_children; ++child) {
+      if (arena->get_node(child)->value == best_value) {
+	*best_x = arena->get_node(child)->x;
+	*best_y = arena->get_node(child)->y;
+	return true;
+      }
+    }
+    return false;
+  }
+
+  TreeNode* tree_root = new TreeNode(new GameBoard(*game_board), 0, color);
+  create_decision_tree(tree_root, depth_limit);
+  if (tree_root->no_children()) {
+    delete tree_root;
+    return false;
+  }
+
+  // Find the first child whose value matches the best value.
+  int best_value = alpha_beta(tree_root, INT_MIN, INT_MAX);
+  bool found_move = false;
+  for (auto child = tree_root->get_children()->begin();
+       child != tree_root->get_children()->end(); ++child) {
+    if ((*child)->get_value() == best_value) {
+      *best_x = (*child)->get_x();
+      *best_y = (*child)->get_y();
+      found_move = true;
+      break;
+    }
+  }
+  delete tree_root;
+  return found_move;
+}
+
+/*
+ * Function: search_with_budget
+ *
+ * Description: This function finds the best move for a player by iterative
+ *              deepening under a node budget (see iterative_deepening).  The
+ *              search runs in the calling thread and uses no randomness, so a
+ *              given position and budget always yield the same move after the
+ *              same number of nodes.
+ *
+ * Inputs:
+ *  - game_board: The board on which the move would be made.
+ *  - color: The color of the player whose move is being chosen.
+ *  - depth_limit: If positive, the deepest iteration allowed.  Iterations never
+ *                 go deeper than the number of empty spaces.
+ *  - budget: The number of nodes to search, counted over all iterations.
+ *
+ * Outputs:
+ *  - best_x: The x-coordinate of the best move is stored here.
+ *  - best_y: The y-coordinate of the best move is stored here.
+ *  - iterations: If not NULL, the result of each iteration that finished is
+ *                stored here.
+ *  - nodes: If not NULL, the number of nodes searched is stored here,
+ *           including those of an iteration cut short by the budget.
+ *
+ * Return value: True if a move was found; false if the player has no legal
+ *               moves.
+ */
+bool Othello::search_with_budget(GameBoard* game_board, int color,
+				 int depth_limit, long budget, int* best_x,
+				 int* best_y, vector<IterationResult>* iterations,
+				 long* nodes) {
+  if (iterations != NULL) iterations->clear();
+  uint64_t black, white;
+  game_board->to_bitboards(&black, &white);
+  SearchWorker worker(-1);
+  worker.set_node_limit(budget);
+  auto record = [iterations](const IterationResult& result) {
+    if (iterations != NULL) iterations->push_back(result);
+  };
+  int move = iterative_deepening(black, white, color, depth_limit, &worker,
+				 record);
+  if (nodes != NULL) *nodes = worker.get_nodes();
+  if (move < 0) return false;
+  *best_x = move / BOARD_SIZE;
+  *best_y = move % BOARD_SIZE;
+  return true;
+}
+
+/*
+ * Function: iterative_deepening
+ *
+ * Description: This function finds the best move for a player by searching to
+ *              depth 1, 2, 3, and so on, in the same way as choose_move, until
+ *              the deepest allowed iteration finishes or the worker's search is
+ *              aborted (see SearchWorker::set_node_limit and set_stop_flag).
+ *              The move chosen by the deepest iteration to finish is returned.
+ *
+ * Inputs:
+ *  - black: The spaces holding black pieces.
+ *  - white: The spaces holding white pieces.
+ *  - color: The color of the player whose move is being chosen.
+ *  - depth_limit: If positive, the deepest iteration allowed.  Iterations never
+ *                 go deeper than the number of empty spaces.
+ *  - worker: The worker that searches each iteration.
+ *  - report: Called with the result of each iteration that finishes, on the
+ *            calling thread.
+ *
+ * Return value: The best move, as x * BOARD_SIZE + y, or -1 if the player has
+ *               no legal moves.
+ */
+int Othello::iterative_deepening(uint64_t black, uint64_t white, int color,
+				 int depth_limit, SearchWorker* worker,
+				 function<void(const IterationResult&)> report) {
+
+  // If the search is aborted before any move has been searched, the first
+  // legal move is played.
+  GameBoard board;
+  board.load_bitboards(black, white);
+  int move = -1;
+  for (int i = 0; (i < BOARD_SIZE) && (move < 0); ++i) {
+    for (int j = 0; j < BOARD_SIZE; ++j) {
+      if (board.is_legal(color, i, j)) {
+	move = i * BOARD_SIZE + j;
+	break;
+      }
+    }
+  }
+  if (move < 0) return -1;
+
+  int max_depth = BOARD_SIZE * BOARD_SIZE - __builtin_popcountll(black | white);
+  if (depth_limit > 0) max_depth = min(max_depth, depth_limit);
+
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  for (int depth = 1; depth <= max_depth; ++depth) {
+    TraceSpan span("iteration", depth);
+    int iteration_move = move;
+    int value = worker->search_root(black, white, color, depth,
+				    &iteration_move);
+    if (worker->is_aborted()) {
+      SearchTrace::record("abort", 'i', depth);
+      // Moves whose search finished in the first iteration are still better
+      // than the fallback.
+      if (depth == 1) move = iteration_move;
+      break;
+    }
+    move = iteration_move;
+    IterationResult result;
+    result.depth = depth;
+    result.move = move;
+    result.value = value;
+    result.nodes = worker->get_nodes();
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() -
+					      start).count();
+    report(result);
+  }
+  return move;
+}
+
 /*
  * Function: create_decision_tree
  *
@@ -142,32 +337,54 @@ void Othello::create_decision_tree(TreeNode* root, int depth_limit) {
  */
 int Othello::alpha_beta(TreeNode* root, int alpha, int beta) {
   if (root->no_children()) {
-    root->set_value(root->get_board()->weighted_score_of_board());
+    root->set_value(root->get_board()->evaluate());
     return root->get_value();
   }
 
-  if (root->get_color() == 2) {
-    int value = INT_MIN;
-    for (auto child = root->get_children()->begin();
-	 child != root->get_children()->end(); ++child) {
-      value = max(value, alpha_beta(*child, alpha, beta));
-      alpha = max(alpha, value);
-      if (beta <= alpha) break;
+  // When every child is a leaf, as at the frontier of the tree, the children
+  // are scored in one batch (see GameBoard::weighted_scores_of_bitboards)
+  // rather than one at a time.  Leaves are only scored this way when the
+  // neural evaluator is not in use.
+  TreeNode* children[BOARD_SIZE * BOARD_SIZE];
+  int num_children = 0;
+  bool batched = !NNUE::is_loaded();
+  for (auto child = root->get_children()->begin();
+       child != root->get_children()->end(); ++child) {
+    if (!(*child)->no_children()) batched = false;
+    children[num_children++] = *child;
+  }
+  int leaf_values[BOARD_SIZE * BOARD_SIZE];
+  if (batched) {
+    uint64_t black[BOARD_SIZE * BOARD_SIZE], white[BOARD_SIZE * BOARD_SIZE];
+    for (int k = 0; k < num_children; ++k) {
+      children[k]->get_board()->to_bitboards(&black[k], &white[k]);
     }
-    root->set_value(value);
-    return value;
+    GameBoard::weighted_scores_of_bitboards(black, white, num_children,
+	                                    leaf_values);
   }
-  else {
-    int value = INT_MAX;
-    for (auto child = root->get_children()->begin();
-	 child != root->get_children()->end(); ++child) {
-      value = min(value, alpha_beta(*child, alpha, beta));
+
+  int value = (root->get_color() == 2) ? INT_MIN : INT_MAX;
+  for (int k = 0; k < num_children; ++k) {
+    int child_value;
+    if (batched) {
+      children[k]->set_value(leaf_values[k]);
+      child_value = leaf_values[k];
+    }
+    else {
+      child_value = alpha_beta(children[k], alpha, beta);
+    }
+    if (root->get_color() == 2) {
+      value = max(value, child_value);
+      alpha = max(alpha, value);
+    }
+    else {
+      value = min(value, child_value);
       beta = min(beta, value);
-      if (beta <= alpha) break;
     }
-    root->set_value(value);
-    return value;
-  } 
+    if (beta <= alpha) break;
+  }
+  root->set_value(value);
+  return value;
 }
 
 /*
@@ -181,6 +398,74 @@ int Othello::alpha_beta(TreeNode* root, int alpha, int beta) {
  */
 void Othello::set_color(int c) {our_color = c;}
 
+/*
+ * Function: set_game_log
+ *
+ * Description: Changes Othello::game_log, the log to which take_turn records
+ *              every turn taken.
+ *
+ * Inputs:
+ *  - log: The new game log, or NULL to stop recording turns.
+ */
+void Othello::set_game_log(GameLog* log) {game_log = log;}
+
+/*
+ * Function: set_arena
+ *
+ * Description: Changes Othello::arena, the tree in which choose_move builds its
+ *              decision trees.
+ *
+ * Inputs:
+ *  - tree: The new arena tree, or NULL to build trees out of TreeNodes.
+ */
+void Othello::set_arena(ArenaTree* tree) {arena = tree;}
+
+/*
+ * Function: set_distributed
+ *
+ * Description: Changes Othello::distributed, the workers among which
+ *              choose_move divides its searches.
+ *
+ * Inputs:
+ *  - search: The new distributed search, or NULL to search in this process.
+ */
+void Othello::set_distributed(DistributedSearch* search) {
+  distributed = search;
+}
+
+/*
+ * Function: set_endgame
+ *
+ * Description: Changes Othello::endgame_empties, the number of empty spaces at
+ *              or below which choose_move solves positions exactly.
+ *
+ * Inputs:
+ *  - empties: The new number of empty spaces, or 0 to never solve positions.
+ */
+void Othello::set_endgame(int empties) {endgame_empties = empties;}
+
+/*
+ * Function: set_solved_db
+ *
+ * Description: Changes Othello::solved_db, the database of solved positions
+ *              consulted and extended by the endgame solver.
+ *
+ * Inputs:
+ *  - db: The new database, or NULL to solve without one.
+ */
+void Othello::set_solved_db(SolvedDB* db) {solved_db = db;}
+
+/*
+ * Function: set_node_budget
+ *
+ * Description: Changes Othello::node_budget, the number of nodes choose_move
+ *              searches for each move (see search_with_budget).
+ *
+ * Inputs:
+ *  - budget: The new node budget, or 0 to search to the depth limit instead.
+ */
+void Othello::set_node_budget(long budget) {node_budget = budget;}
+
 /*
  * Function: is_corner
  *
@@ -190,12 +475,12 @@ void Othello::set_color(int c) {our_color = c;}
  * Inputs:
  *  - x: The x-coordinate of the space in question.
  *  - y: The y-coordinate of the space in question.
+ *  - size: The number of spaces along each side of the board.
  *
  * Return value: True if the space is a corner space; false otherwise.
  */
-bool Othello::is_corner(int x, int y) {
-  return ((x == 0) || (x == BOARD_SIZE - 1)) &&
-    ((y == 0) || (y == BOARD_SIZE - 1));
+bool Othello::is_corner(int x, int y, int size) {
+  return ((x == 0) || (x == size - 1)) && ((y == 0) || (y == size - 1));
 }
 
 /*
@@ -210,14 +495,15 @@ bool Othello::is_corner(int x, int y) {
  * Inputs:
  *  - x: The x-coordinate of the space in question.
  *  - y: The y-coordinate of the space in question.
+ *  - size: The number of spaces along each side of the board.
  *
  * Return value: True if the space is adjacent to a corner space; false
  *               otherwise.
  */
-bool Othello::is_next_to_corner(int x, int y) {
-  return ((x <= 1) || (x >= BOARD_SIZE - 2)) &&
-    ((y <= 1) || (y >= BOARD_SIZE - 2)) &&
-    !is_corner(x, y) && is_side(x, y);
+bool Othello::is_next_to_corner(int x, int y, int size) {
+  return ((x <= 1) || (x >= size - 2)) &&
+    ((y <= 1) || (y >= size - 2)) &&
+    !is_corner(x, y, size) && is_side(x, y, size);
 }
 
 /*
@@ -229,12 +515,111 @@ bool Othello::is_next_to_corner(int x, int y) {
  * Inputs:
  *  - x: The x-coordinate of the space in question.
  *  - y: The y-coordinate of the space in question.
+ *  - size: The number of spaces along each side of the board.
  *
  * Return value: True if the space is a side space; false otherwise.
  */
-bool Othello::is_side(int x, int y) {
-  return (((x == 0) || (x == BOARD_SIZE - 1)) &&
-	  (y >= 2) && (y <= BOARD_SIZE - 3)) ||
-    (((y == 0) || (y == BOARD_SIZE - 1)) &&
-     (x >= 2) && (x <= BOARD_SIZE - 3));
+bool Othello::is_side(int x, int y, int size) {
+  return (((x == 0) || (x == size - 1)) &&
+	  (y >= 2) && (y <= size - 3)) ||
+    (((y == 0) || (y == size - 1)) &&
+     (x >= 2) && (x <= size - 3));
+}
+
+/*
+ * Function: square_class
+ *
+ * Description: This function sorts a space on the board into one of the
+ *              classes used by weighted_score_of_board.  The same classes are
+ *              used for boards of other sizes (see WideBoard).
+ *
+ * Inputs:
+ *  - x: The x-coordinate of the space in question.
+ *  - y: The y-coordinate of the space in question.
+ *  - size: The number of spaces along each side of the board.
+ *
+ * Return value: 0 for a corner space, 1 for a space next to a corner, 2 for a
+ *               side space, and 3 for any other space.
+ */
+int Othello::square_class(int x, int y, int size) {
+  if (is_corner(x, y, size)) return 0;
+  if (is_next_to_corner(x, y, size)) return 1;
+  if (is_side(x, y, size)) return 2;
+  return 3;
+}
+
+/*
+ * Function: load_weights
+ *
+ * Description: This function replaces the square weights used by
+ *              weighted_score_of_board with those stored in a weight file
+ *              written by Tuner::write_weights.  The file holds
+ *              NUM_SQUARE_CLASSES whitespace-separated integers, in the order
+ *              given by square_class.
+ *
+ * Inputs:
+ *  - filename: The path of the weight file.
+ *
+ * Return value: True if the weights were loaded; false if the file could not
+ *               be read, in which case the current weights are unchanged.
+ */
+bool Othello::load_weights(const char* filename) {
+  FILE* file = fopen(filename, "r");
+  if (file == NULL) return false;
+  int loaded[NUM_SQUARE_CLASSES];
+  for (int k = 0; k < NUM_SQUARE_CLASSES; ++k) {
+    if (fscanf(file, "%d", &loaded[k]) != 1) {
+      fclose(file);
+      return false;
+    }
+  }
+  fclose(file);
+  for (int k = 0; k < NUM_SQUARE_CLASSES; ++k) {
+    square_weights[k] = loaded[k];
+  }
+  return true;
+}
+
+int Othello::get_square_weight(int c) {return square_weights[c];}
+
+/*
+ * Function: play_random_turns
+ *
+ * Description: This function plays a number of turns on a board, starting with
+ *              black, in which each player makes a legal move chosen uniformly
+ *              at random with rand(), or passes if it has no legal moves.  It
+ *              is used to generate positions for benchmarks.
+ *
+ * Inputs:
+ *  - turns: The number of turns to play.
+ *
+ * Outputs:
+ *  - board: The board on which to play.
+ *
+ * Return value: The color of the player whose turn it is once the turns have
+ *               been played, or 0 if the game ended before then.
+ */
+int Othello::play_random_turns(GameBoard* board, int turns) {
+  int color = 2;
+  bool passed = false;
+  for (int t = 0; t < turns; ++t) {
+    int moves[BOARD_SIZE * BOARD_SIZE];
+    int num_moves = 0;
+    for (int i = 0; i < BOARD_SIZE; ++i) {
+      for (int j = 0; j < BOARD_SIZE; ++j) {
+	if (board->is_legal(color, i, j)) moves[num_moves++] = i * BOARD_SIZE + j;
+      }
+    }
+    if (num_moves == 0) {
+      if (passed) return 0;
+      passed = true;
+    }
+    else {
+      passed = false;
+      int move = moves[rand() % num_moves];
+      board->place_piece(color, move / BOARD_SIZE, move % BOARD_SIZE, true);
+    }
+    color = 3 - color;
+  }
+  return color;
 }
@@ -0,0 +1,253 @@
+#include "othello.h"
+
+atomic<bool> SearchTrace::enabled(false);
+FILE* SearchTrace::file = NULL;
+bool SearchTrace::first_event = true;
+atomic<TraceBuffer*> SearchTrace::buffers(NULL);
+atomic<int32_t> SearchTrace::next_tid(1);
+chrono::steady_clock::time_point SearchTrace::epoch;
+
+// The trace buffer of the calling thread, or NULL if it has not recorded an
+// event yet.
+static thread_local TraceBufferOwner owner;
+
+/*
+ * Destructor for TraceBufferOwner.  Gives the buffer back for reuse.  Events in
+ * the buffer that have not been dumped yet are kept.
+ */
+TraceBufferOwner::~TraceBufferOwner() {
+  if (buffer != NULL) buffer->in_use.store(false);
+}
+
+/*
+ * Function: claim_buffer
+ *
+ * Description: This function finds the trace buffer of the calling thread.  A
+ *              thread that has not recorded an event before claims a buffer
+ *              given back by a thread that has exited, if there is one, and
+ *              otherwise adds a new buffer to the list.  Neither requires a
+ *              lock: buffers are claimed by compare-and-swap of their in_use
+ *              flags, and are pushed onto the list by compare-and-swap of its
+ *              head.  Buffers are never freed.
+ *
+ * Return value: The calling thread's buffer.
+ */
+TraceBuffer* SearchTrace::claim_buffer() {
+  if (owner.buffer != NULL) return owner.buffer;
+
+  for (TraceBuffer* buffer = buffers.load(); buffer != NULL;
+       buffer = buffer->next) {
+    bool expected = false;
+    if (buffer->in_use.compare_exchange_strong(expected, true)) {
+      owner.buffer = buffer;
+      return buffer;
+    }
+  }
+
+  TraceBuffer* buffer = new TraceBuffer;
+  buffer->count.store(0);
+  buffer->dumped = 0;
+  buffer->in_use.store(true);
+  buffer->tid = next_tid.fetch_add(1);
+  buffer->next = buffers.load();
+  while (!buffers.compare_exchange_weak(buffer->next, buffer)) {}
+  owner.buffer = buffer;
+  return buffer;
+}
+
+/*
+ * Function: start
+ *
+ * Description: This function starts recording events, to be written to a trace
+ *              file by dump.  The file is written in the JSON array form of the
+ *              Chrome trace event format, which may be viewed before stop
+ *              writes its closing bracket.  The trace is stopped when the
+ *              program exits, if not before.
+ *
+ * Inputs:
+ *  - filename: The path of the trace file.
+ *
+ * Return value: True if the trace file was created; false otherwise.
+ */
+bool SearchTrace::start(const char* filename) {
+  static bool registered = false;
+  if (file != NULL) stop();
+  file = fopen(filename, "w");
+  if (file == NULL) return false;
+  if (!registered) {
+    atexit(stop);
+    registered = true;
+  }
+  fprintf(file, "[\n");
+  first_event = true;
+  epoch = chrono::steady_clock::now();
+  enabled.store(true);
+  return true;
+}
+
+/*
+ * Function: stop
+ *
+ * Description: This function stops recording events, dumps any that have not
+ *              been written yet, and closes the trace file.
+ */
+void SearchTrace::stop() {
+  if (file == NULL) return;
+  enabled.store(false);
+  dump();
+  fprintf(file, "\n]\n");
+  fclose(file);
+  file = NULL;
+}
+
+bool SearchTrace::is_enabled() {return enabled.load(memory_order_relaxed);}
+
+/*
+ * Function: record
+ *
+ * Description: This function records an instant event on the calling thread's
+ *              timeline, if tracing has been started.  Spans are recorded with
+ *              record_span instead, as one event each, so that a ring buffer
+ *              that wraps drops whole spans rather than their beginnings.
+ *
+ * Inputs:
+ *  - name: The name of the event.  Must be a string literal, or otherwise
+ *          outlive the trace.
+ *  - phase: 'i' for an instant.
+ *  - arg: A number describing the event, such as the depth of an iteration or
+ *         the space of a move (as x * BOARD_SIZE + y).
+ */
+void SearchTrace::record(const char* name, char phase, int64_t arg) {
+  record_for(-1, name, phase, arg);
+}
+
+/*
+ * Function: record_for
+ *
+ * Description: This function records an event, if tracing has been started, on
+ *              a given timeline rather than the calling thread's own.  It is
+ *              used to show the work of other processes, such as the workers of
+ *              a DistributedSearch, as seen by the calling thread.
+ *
+ * Inputs:
+ *  - tid: The timeline of the event, or -1 for the calling thread's own.
+ *  - name: The name of the event (see record).
+ *  - phase: The phase of the event (see record).
+ *  - arg: A number describing the event.
+ */
+void SearchTrace::record_for(int32_t tid, const char* name, char phase,
+                             int64_t arg) {
+  if (!enabled.load(memory_order_relaxed)) return;
+  TraceBuffer* buffer = claim_buffer();
+  uint64_t count = buffer->count.load(memory_order_relaxed);
+  TraceEvent* event = &buffer->events[count & (TRACE_BUFFER_SIZE - 1)];
+  event->time = now();
+  event->duration = 0;
+  event->name = name;
+  event->phase = phase;
+  event->tid = (tid < 0) ? buffer->tid : tid;
+  event->arg = arg;
+  buffer->count.store(count + 1, memory_order_release);
+}
+
+/*
+ * Function: now
+ *
+ * Description: This function reads the clock of the trace, for marking the
+ *              start of a span to be recorded later by record_span.
+ *
+ * Return value: The nanoseconds since the trace was started, or 0 if tracing
+ *               has not been started.
+ */
+int64_t SearchTrace::now() {
+  if (!enabled.load(memory_order_relaxed)) return 0;
+  return chrono::duration_cast<chrono::nanoseconds>(
+    chrono::steady_clock::now() - epoch).count();
+}
+
+/*
+ * Function: record_span
+ *
+ * Description: This function records a span that has just ended, if tracing
+ *              has been started, as a single complete ('X') event.
+ *
+ * Inputs:
+ *  - tid: The timeline of the span, or -1 for the calling thread's own.
+ *  - name: The name of the span (see record).
+ *  - start: When the span began, as returned by now.  A span begun before the
+ *           trace was started is shown as beginning with the trace.
+ *  - arg: A number describing the span.
+ */
+void SearchTrace::record_span(int32_t tid, const char* name, int64_t start,
+                              int64_t arg) {
+  if (!enabled.load(memory_order_relaxed)) return;
+  TraceBuffer* buffer = claim_buffer();
+  uint64_t count = buffer->count.load(memory_order_relaxed);
+  TraceEvent* event = &buffer->events[count & (TRACE_BUFFER_SIZE - 1)];
+  event->time = start;
+  event->duration = now() - start;
+  event->name = name;
+  event->phase = 'X';
+  event->tid = (tid < 0) ? buffer->tid : tid;
+  event->arg = arg;
+  buffer->count.store(count + 1, memory_order_release);
+}
+
+/*
+ * Function: dump
+ *
+ * Description: This function writes the events recorded since the last dump to
+ *              the trace file, if tracing has been started.  If a thread has
+ *              recorded more than TRACE_BUFFER_SIZE events since then, only the
+ *              most recent TRACE_BUFFER_SIZE are written.  It should be called
+ *              by one thread at a time, at a point where the threads of the
+ *              search are idle, such as after each turn.
+ */
+void SearchTrace::dump() {
+  if (file == NULL) return;
+  int pid = (int) getpid();
+  for (TraceBuffer* buffer = buffers.load(); buffer != NULL;
+       buffer = buffer->next) {
+    uint64_t count = buffer->count.load(memory_order_acquire);
+    uint64_t begin = buffer->dumped;
+    if (count - begin > TRACE_BUFFER_SIZE) begin = count - TRACE_BUFFER_SIZE;
+    for (uint64_t k = begin; k < count; ++k) {
+      TraceEvent* event = &buffer->events[k & (TRACE_BUFFER_SIZE - 1)];
+      fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,",
+              first_event ? "" : ",\n", event->name, event->phase,
+              event->time / 1000.0);
+      if (event->phase == 'X') {
+        fprintf(file, "\"dur\":%.3f,", event->duration / 1000.0);
+      }
+      else if (event->phase == 'i') {
+        fprintf(file, "\"s\":\"t\",");
+      }
+      fprintf(file, "\"pid\":%d,\"tid\":%d,\"args\":{\"value\":%lld}}",
+              pid, (int) event->tid, (long long) event->arg);
+      first_event = false;
+    }
+    buffer->dumped = count;
+  }
+  fflush(file);
+}
+
+/*
+ * Constructor for TraceSpan.  Notes when the span begins; nothing is recorded
+ * until it ends.
+ *
+ * Inputs:
+ *  - name: The name of the span (see SearchTrace::record).
+ *  - arg: A number describing the span.
+ */
+TraceSpan::TraceSpan(const char* name, int64_t arg) {
+  this->name = name;
+  this->arg = arg;
+  start = SearchTrace::now();
+}
+
+/*
+ * Destructor for TraceSpan.  Records the whole span.
+ */
+TraceSpan::~TraceSpan() {
+  SearchTrace::record_span(-1, name, start, arg);
+}
@@ -0,0 +1,379 @@
+#include "othello.h"
+
+/*
+ * A solved-position database named F consists of two files.
+ *
+ * The sorted file, F, holds a SOLVED_DB_HEADER_SIZE-byte header followed by
+ * the entries, sorted by is_before with no two entries for the same position.
+ * The header consists of the four characters of SOLVED_DB_MAGIC, the size of
+ * an entry as a 32-bit integer, and the number of entries as a 64-bit integer,
+ * all in native byte order.  The sorted file is only ever replaced as a whole,
+ * by renaming a new file over it, so a process that has mapped it keeps a
+ * consistent view.
+ *
+ * The log, F.log, holds entries in the order they were solved, each appended
+ * with a single write.  It may hold entries that are also in the sorted file,
+ * or that appear more than once.  Compaction first renames the log to
+ * F.log.merging, and deletes that only once the new sorted file has replaced
+ * the old one.  A process that appended an entry to the log just after it was
+ * renamed appends it again to the new log, so no entry is lost.
+ */
+
+/*
+ * Constructor for SolvedDB.
+ */
+SolvedDB::SolvedDB() {
+  data = NULL;
+  length = 0;
+  entries = NULL;
+  num_entries = 0;
+  mapped_dev = 0;
+  mapped_ino = 0;
+  log_fd = -1;
+}
+
+/*
+ * Destructor for SolvedDB.
+ */
+SolvedDB::~SolvedDB() {
+  if (data != NULL) munmap(data, length);
+  if (log_fd >= 0) close(log_fd);
+}
+
+/*
+ * Function: is_before
+ *
+ * Description: This function defines the order of entries in the sorted file:
+ *              by black pieces, then white pieces, then player to move.
+ *
+ * Inputs:
+ *  - a: The first entry.
+ *  - b: The second entry.
+ *
+ * Return value: True if a comes before b; false otherwise.
+ */
+bool SolvedDB::is_before(const SolvedEntry& a, const SolvedEntry& b) {
+  if (a.black != b.black) return a.black < b.black;
+  if (a.white != b.white) return a.white < b.white;
+  return a.color < b.color;
+}
+
+/*
+ * Function: log_name
+ *
+ * Description: This function finds the name of the log of a database.
+ *
+ * Inputs:
+ *  - filename: The path of the database's sorted file.
+ *
+ * Return value: The path of the database's log.
+ */
+string SolvedDB::log_name(const char* filename) {
+  return string(filename) + ".log";
+}
+
+/*
+ * Function: open_db
+ *
+ * Description: This function maps the sorted file of a database into memory
+ *              and opens its log for appending, creating the log if needed.
+ *              A database whose sorted file does not exist yet is empty until
+ *              it is first compacted.
+ *
+ * Inputs:
+ *  - filename: The path of the database's sorted file.
+ *
+ * Return value: The number of entries in the sorted file, or -1 if either file
+ *               could not be opened or the sorted file is malformed.
+ */
+long SolvedDB::open_db(const char* filename) {
+  if (data != NULL) munmap(data, length);
+  if (log_fd >= 0) close(log_fd);
+  data = NULL;
+  length = 0;
+  entries = NULL;
+  num_entries = 0;
+  mapped_dev = 0;
+  mapped_ino = 0;
+  appended.clear();
+  path = filename;
+
+  log_fd = open(log_name(filename).c_str(), O_WRONLY|O_APPEND|O_CREAT,
+                S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+  if (log_fd < 0) return -1;
+  return map_sorted();
+}
+
+/*
+ * Function: map_sorted
+ *
+ * Description: This function maps the sorted file of the database into memory
+ *              in place of the one mapped before, if any, which is kept if the
+ *              file cannot be mapped.
+ *
+ * Return value: The number of entries in the sorted file, 0 if it does not
+ *               exist, or -1 if it could not be mapped or is malformed.
+ */
+long SolvedDB::map_sorted() {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return (errno == ENOENT) ? 0 : -1;
+  struct stat filestat;
+  if (fstat(fd, &filestat) || (filestat.st_size < SOLVED_DB_HEADER_SIZE)) {
+    close(fd);
+    return -1;
+  }
+  void* mapping = mmap(NULL, filestat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) return -1;
+
+  unsigned char* new_data = (unsigned char*) mapping;
+  uint32_t entry_size;
+  uint64_t count;
+  memcpy(&entry_size, new_data + 4, sizeof(entry_size));
+  memcpy(&count, new_data + 8, sizeof(count));
+  if ((memcmp(new_data, SOLVED_DB_MAGIC, 4) != 0) ||
+      (entry_size != sizeof(SolvedEntry)) ||
+      (count > (filestat.st_size - SOLVED_DB_HEADER_SIZE) /
+       sizeof(SolvedEntry))) {
+    munmap(new_data, filestat.st_size);
+    return -1;
+  }
+  if (data != NULL) munmap(data, length);
+  data = new_data;
+  length = filestat.st_size;
+  entries = (SolvedEntry*) (data + SOLVED_DB_HEADER_SIZE);
+  num_entries = count;
+  mapped_dev = filestat.st_dev;
+  mapped_ino = filestat.st_ino;
+  madvise(data, length, MADV_RANDOM);
+  return (long) num_entries;
+}
+
+/*
+ * Function: refresh
+ *
+ * Description: This function maps the sorted file of the database again if it
+ *              has been replaced by compaction since it was mapped, so that the
+ *              entries merged by compaction can be looked up.  The entries this
+ *              process has added are kept, even if they are now in the sorted
+ *              file too.
+ */
+void SolvedDB::refresh() {
+  struct stat filestat;
+  if (path.empty() || (stat(path.c_str(), &filestat) != 0)) return;
+  if ((filestat.st_dev == mapped_dev) && (filestat.st_ino == mapped_ino)) {
+    return;
+  }
+  map_sorted();
+}
+
+/*
+ * Function: lookup
+ *
+ * Description: This function looks up a solved position, first by binary
+ *              search of the sorted file, mapped again if it has been compacted
+ *              since (see refresh), then among the entries this process has
+ *              added since opening the database.
+ *
+ * Inputs:
+ *  - black: The black pieces of the position, in canonical form.
+ *  - white: The white pieces of the position, in canonical form.
+ *  - color: The player whose turn it is.
+ *
+ * Outputs:
+ *  - score: The exact score of the position is stored here.
+ *  - move: The best move in the position is stored here.
+ *
+ * Return value: True if the position was found; false otherwise.
+ */
+bool SolvedDB::lookup(uint64_t black, uint64_t white, int color, int* score,
+                      int* move) {
+  refresh();
+  SolvedEntry key;
+  key.black = black;
+  key.white = white;
+  key.color = (uint8_t) color;
+
+  SolvedEntry* found = lower_bound(entries, entries + num_entries, key,
+                                   is_before);
+  if ((found == entries + num_entries) || is_before(key, *found)) {
+    found = NULL;
+    for (auto entry = appended.begin(); entry != appended.end(); ++entry) {
+      if ((entry->black == black) && (entry->white == white) &&
+          (entry->color == color)) {
+        found = &*entry;
+        break;
+      }
+    }
+    if (found == NULL) return false;
+  }
+  *score = found->score;
+  *move = found->move;
+  return true;
+}
+
+/*
+ * Function: insert
+ *
+ * Description: This function appends a solved position to the log.  It can be
+ *              looked up by this process at once, and by other processes once
+ *              the database has been compacted.
+ *
+ * Inputs:
+ *  - black: The black pieces of the position, in canonical form.
+ *  - white: The white pieces of the position, in canonical form.
+ *  - color: The player whose turn it is.
+ *  - score: The exact score of the position.
+ *  - move: The best move in the position, as x * BOARD_SIZE + y, or NO_MOVE.
+ *
+ * Return value: True if the entry was written to the log; false otherwise.
+ */
+bool SolvedDB::insert(uint64_t black, uint64_t white, int color, int score,
+                      int move) {
+  SolvedEntry entry;
+  memset(&entry, 0, sizeof(entry));
+  entry.black = black;
+  entry.white = white;
+  entry.color = (uint8_t) color;
+  entry.score = (int8_t) score;
+  entry.move = (uint8_t) move;
+  appended.push_back(entry);
+  return append_to_log(entry);
+}
+
+/*
+ * Function: append_to_log
+ *
+ * Description: This function appends an entry to the log.  If compaction has
+ *              renamed the log since it was opened, the entry may have been
+ *              appended to the renamed log after compaction read it, so the new
+ *              log is opened and the entry appended to it as well.
+ *
+ * Inputs:
+ *  - entry: The entry to append.
+ *
+ * Return value: True if the entry was written to the log; false otherwise.
+ */
+bool SolvedDB::append_to_log(const SolvedEntry& entry) {
+  if (log_fd < 0) return false;
+  if (write(log_fd, &entry, sizeof(entry)) != (ssize_t) sizeof(entry)) {
+    return false;
+  }
+  string log = log_name(path.c_str());
+  struct stat opened, named;
+  if ((fstat(log_fd, &opened) == 0) && (stat(log.c_str(), &named) == 0) &&
+      (opened.st_dev == named.st_dev) && (opened.st_ino == named.st_ino)) {
+    return true;
+  }
+  close(log_fd);
+  log_fd = open(log.c_str(), O_WRONLY|O_APPEND|O_CREAT,
+                S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+  if (log_fd < 0) return false;
+  return write(log_fd, &entry, sizeof(entry)) == (ssize_t) sizeof(entry);
+}
+
+/*
+ * Function: compact
+ *
+ * Description: This function merges the log of a database into its sorted
+ *              file.  The log is first renamed aside, so that entries appended
+ *              while compacting go to a new log (see append_to_log).  The
+ *              merged entries are written to a temporary file, which is then
+ *              renamed over the sorted file, so processes reading the database
+ *              are never disturbed; the renamed log is deleted only once that
+ *              rename is durable.  A renamed log left by an interrupted
+ *              compaction is merged, and the log left for the next compaction.
+ *              Malformed log entries, a partially written last entry, and
+ *              duplicate entries are dropped.  Only one compaction of a
+ *              database may run at a time.
+ *
+ * Inputs:
+ *  - filename: The path of the database's sorted file.
+ *
+ * Return value: The number of entries in the new sorted file, or -1 if the
+ *               database could not be read or the new file could not be
+ *               written.
+ */
+long SolvedDB::compact(const char* filename) {
+  SolvedDB old;
+  if (old.open_db(filename) < 0) return -1;
+  vector<SolvedEntry> merged(old.entries, old.entries + old.num_entries);
+
+  string log = log_name(filename);
+  string merging = log + ".merging";
+  struct stat filestat;
+  if ((stat(merging.c_str(), &filestat) != 0) &&
+      (rename(log.c_str(), merging.c_str()) != 0) && (errno != ENOENT)) {
+    return -1;
+  }
+  int fd = open(merging.c_str(), O_RDONLY);
+  if ((fd < 0) && (errno != ENOENT)) return -1;
+  vector<SolvedEntry> logged;
+  if (fd >= 0) {
+    if (fstat(fd, &filestat)) {
+      close(fd);
+      return -1;
+    }
+    logged.resize(filestat.st_size / sizeof(SolvedEntry));
+    size_t bytes = logged.size() * sizeof(SolvedEntry);
+    bool read_ok = (bytes == 0) ||
+      (read(fd, logged.data(), bytes) == (ssize_t) bytes);
+    close(fd);
+    if (!read_ok) return -1;
+  }
+  for (auto entry = logged.begin(); entry != logged.end(); ++entry) {
+    if (((entry->color == 1) || (entry->color == 2)) &&
+        (entry->score >= -BOARD_SIZE * BOARD_SIZE) &&
+        (entry->score <= BOARD_SIZE * BOARD_SIZE) &&
+        ((entry->move < BOARD_SIZE * BOARD_SIZE) ||
+         (entry->move == NO_MOVE))) {
+      merged.push_back(*entry);
+    }
+  }
+
+  // Entries from the old sorted file come first, so stable sorting keeps them
+  // over any duplicates in the log.
+  stable_sort(merged.begin(), merged.end(), is_before);
+  auto end = unique(merged.begin(), merged.end(),
+                    [](const SolvedEntry& a, const SolvedEntry& b) {
+                      return !is_before(a, b) && !is_before(b, a);
+                    });
+  merged.erase(end, merged.end());
+
+  string temporary = string(filename) + ".tmp";
+  fd = open(temporary.c_str(), O_WRONLY|O_CREAT|O_TRUNC,
+            S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+  if (fd < 0) return -1;
+  unsigned char header[SOLVED_DB_HEADER_SIZE];
+  uint32_t entry_size = sizeof(SolvedEntry);
+  uint64_t count = merged.size();
+  memcpy(header, SOLVED_DB_MAGIC, 4);
+  memcpy(header + 4, &entry_size, sizeof(entry_size));
+  memcpy(header + 8, &count, sizeof(count));
+  size_t bytes = merged.size() * sizeof(SolvedEntry);
+  bool write_ok =
+    (write(fd, header, sizeof(header)) == (ssize_t) sizeof(header)) &&
+    ((bytes == 0) || (write(fd, merged.data(), bytes) == (ssize_t) bytes)) &&
+    (fsync(fd) == 0);
+  if ((close(fd) != 0) || !write_ok ||
+      (rename(temporary.c_str(), filename) != 0)) {
+    unlink(temporary.c_str());
+    return -1;
+  }
+
+  // The renamed log may only go once the new sorted file is sure to be in
+  // place after a crash.
+  size_t slash = string(filename).rfind('/');
+  string directory = (slash == string::npos) ? "." :
+    string(filename).substr(0, slash + 1);
+  int directory_fd = open(directory.c_str(), O_RDONLY|O_DIRECTORY);
+  if (directory_fd < 0) return -1;
+  bool synced = (fsync(directory_fd) == 0);
+  close(directory_fd);
+  if (!synced || ((unlink(merging.c_str()) != 0) && (errno != ENOENT))) {
+    return -1;
+  }
+  return (long) merged.size();
+}
+
+size_t SolvedDB::size() {return num_entries + appended.size();}
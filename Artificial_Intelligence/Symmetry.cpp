@@ -0,0 +1,234 @@
+#include "othello.h"
+
+static_assert(BOARD_SIZE == 8, "Symmetry requires 64-bit boards");
+
+/*
+ * Function: flip_x
+ *
+ * Description: This function reverses the x-coordinate of every space on a
+ *              64-bit board.  Each x-coordinate occupies one byte, so this is a
+ *              byte swap.
+ *
+ * Inputs:
+ *  - b: The board to flip.
+ *
+ * Return value: The flipped board.
+ */
+uint64_t Symmetry::flip_x(uint64_t b) {
+  return __builtin_bswap64(b);
+}
+
+/*
+ * Function: flip_y
+ *
+ * Description: This function reverses the y-coordinate of every space on a
+ *              64-bit board, by reversing the order of the bits within each
+ *              byte.
+ *
+ * Inputs:
+ *  - b: The board to flip.
+ *
+ * Return value: The flipped board.
+ */
+uint64_t Symmetry::flip_y(uint64_t b) {
+  const uint64_t k1 = 0x5555555555555555ULL;
+  const uint64_t k2 = 0x3333333333333333ULL;
+  const uint64_t k4 = 0x0f0f0f0f0f0f0f0fULL;
+  b = ((b >> 1) & k1) | ((b & k1) << 1);
+  b = ((b >> 2) & k2) | ((b & k2) << 2);
+  b = ((b >> 4) & k4) | ((b & k4) << 4);
+  return b;
+}
+
+/*
+ * Function: transpose
+ *
+ * Description: This function swaps the x- and y-coordinates of every space on a
+ *              64-bit board.  The bits are exchanged in three rounds of
+ *              delta swaps, first between 4-by-4 quadrants, then between 2-by-2
+ *              blocks, and then between single spaces.
+ *
+ * Inputs:
+ *  - b: The board to transpose.
+ *
+ * Return value: The transposed board.
+ */
+uint64_t Symmetry::transpose(uint64_t b) {
+  const uint64_t k1 = 0x5500550055005500ULL;
+  const uint64_t k2 = 0x3333000033330000ULL;
+  const uint64_t k4 = 0x0f0f0f0f00000000ULL;
+  uint64_t t;
+  t = k4 & (b ^ (b << 28));
+  b ^= t ^ (t >> 28);
+  t = k2 & (b ^ (b << 14));
+  b ^= t ^ (t >> 14);
+  t = k1 & (b ^ (b << 7));
+  b ^= t ^ (t >> 7);
+  return b;
+}
+
+/*
+ * Function: transform
+ *
+ * Description: This function applies a symmetry to a 64-bit board.
+ *
+ * Inputs:
+ *  - b: The board to transform.
+ *  - symmetry: The number of the symmetry to apply, from 0 to
+ *              NUM_SYMMETRIES - 1.
+ *
+ * Return value: The transformed board.
+ */
+uint64_t Symmetry::transform(uint64_t b, int symmetry) {
+  if (symmetry & 4) b = transpose(b);
+  if (symmetry & 1) b = flip_x(b);
+  if (symmetry & 2) b = flip_y(b);
+  return b;
+}
+
+/*
+ * Function: untransform
+ *
+ * Description: This function undoes a symmetry applied to a 64-bit board by
+ *              transform.
+ *
+ * Inputs:
+ *  - b: The transformed board.
+ *  - symmetry: The number of the symmetry that was applied.
+ *
+ * Return value: The board as it was before the symmetry was applied.
+ */
+uint64_t Symmetry::untransform(uint64_t b, int symmetry) {
+  if (symmetry & 2) b = flip_y(b);
+  if (symmetry & 1) b = flip_x(b);
+  if (symmetry & 4) b = transpose(b);
+  return b;
+}
+
+/*
+ * Function: canonicalize
+ *
+ * Description: This function finds the canonical form of a position: of the
+ *              eight symmetric images of the position, the one whose black
+ *              board, and then white board, is numerically smallest.
+ *
+ * Inputs:
+ *  - black: The black pieces of the position.
+ *  - white: The white pieces of the position.
+ *
+ * Outputs:
+ *  - canonical_black: The black pieces of the canonical form.
+ *  - canonical_white: The white pieces of the canonical form.
+ *
+ * Return value: The number of the symmetry that maps the position to its
+ *               canonical form.
+ */
+int Symmetry::canonicalize(uint64_t black, uint64_t white,
+                           uint64_t* canonical_black,
+                           uint64_t* canonical_white) {
+  int best = 0;
+  *canonical_black = black;
+  *canonical_white = white;
+  for (int symmetry = 1; symmetry < NUM_SYMMETRIES; ++symmetry) {
+    uint64_t b = transform(black, symmetry);
+    if (b > *canonical_black) continue;
+    uint64_t w = transform(white, symmetry);
+    if ((b < *canonical_black) || (w < *canonical_white)) {
+      best = symmetry;
+      *canonical_black = b;
+      *canonical_white = w;
+    }
+  }
+  return best;
+}
+
+/*
+ * Function: hash
+ *
+ * Description: This function mixes the two halves of a position into a single
+ *              64-bit hash value.
+ *
+ * Inputs:
+ *  - black: The black pieces of the position.
+ *  - white: The white pieces of the position.
+ *
+ * Return value: The hash value of the position.
+ */
+uint64_t Symmetry::hash(uint64_t black, uint64_t white) {
+  uint64_t h = black * 0x9e3779b97f4a7c15ULL;
+  h ^= (white ^ (white >> 29)) * 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 32;
+  h *= 0x94d049bb133111ebULL;
+  h ^= h >> 29;
+  return h;
+}
+
+/*
+ * Function: canonical_hash
+ *
+ * Description: This function computes a hash value of a board that is the same
+ *              for all eight of its symmetric images.
+ *
+ * Inputs:
+ *  - board: The board to hash.
+ *
+ * Outputs:
+ *  - symmetry: If not NULL, the number of the symmetry that maps the board to
+ *              its canonical form is stored here, so that moves found for the
+ *              canonical form can be mapped back with untransform_move.
+ *
+ * Return value: The hash value of the canonical form of the board.
+ */
+uint64_t Symmetry::canonical_hash(GameBoard* board, int* symmetry) {
+  uint64_t black, white, canonical_black, canonical_white;
+  board->to_bitboards(&black, &white);
+  int s = canonicalize(black, white, &canonical_black, &canonical_white);
+  if (symmetry != NULL) *symmetry = s;
+  return hash(canonical_black, canonical_white);
+}
+
+/*
+ * Function: transform_move
+ *
+ * Description: This function maps a space on a board to the corresponding
+ *              space on the board's image under a symmetry.
+ *
+ * Inputs:
+ *  - symmetry: The number of the symmetry.
+ *  - x: The x-coordinate of the space on the original board.
+ *  - y: The y-coordinate of the space on the original board.
+ *
+ * Outputs:
+ *  - new_x: The x-coordinate of the space on the transformed board.
+ *  - new_y: The y-coordinate of the space on the transformed board.
+ */
+void Symmetry::transform_move(int symmetry, int x, int y, int* new_x,
+                              int* new_y) {
+  uint64_t b = transform((uint64_t) 1 << (x * BOARD_SIZE + y), symmetry);
+  int square = __builtin_ctzll(b);
+  *new_x = square / BOARD_SIZE;
+  *new_y = square % BOARD_SIZE;
+}
+
+/*
+ * Function: untransform_move
+ *
+ * Description: This function maps a space on the image of a board under a
+ *              symmetry back to the corresponding space on the original board.
+ *
+ * Inputs:
+ *  - symmetry: The number of the symmetry.
+ *  - x: The x-coordinate of the space on the transformed board.
+ *  - y: The y-coordinate of the space on the transformed board.
+ *
+ * Outputs:
+ *  - new_x: The x-coordinate of the space on the original board.
+ *  - new_y: The y-coordinate of the space on the original board.
+ */
+void Symmetry::untransform_move(int symmetry, int x, int y, int* new_x,
+                                int* new_y) {
+  uint64_t b = untransform((uint64_t) 1 << (x * BOARD_SIZE + y), symmetry);
+  int square = __builtin_ctzll(b);
+  *new_x = square / BOARD_SIZE;
+  *new_y = square % BOARD_SIZE;
+}
@@ -0,0 +1,147 @@
+#include "othello.h"
+
+// Layout of an entry's packed data.  Bit 63 marks the entry as in use, so that
+// an empty entry never passes the key check.
+#define TT_DEPTH_SHIFT 32
+#define TT_BOUND_SHIFT 40
+#define TT_MOVE_SHIFT 42
+#define TT_IN_USE ((uint64_t) 1 << 63)
+
+// Helper function for resize.  Rounds a requested number of entries down to a
+// power of two, with a minimum of one.
+static size_t round_entries(size_t entries) {
+  size_t rounded = 1;
+  while (rounded * 2 <= entries) rounded *= 2;
+  return rounded;
+}
+
+/*
+ * Constructor for TranspositionTable.
+ *
+ * Inputs:
+ *  - entries: The number of entries in the table.  It is rounded down to a
+ *             power of two.
+ */
+TranspositionTable::TranspositionTable(size_t entries) {
+  checks = NULL;
+  data = NULL;
+  resize(entries);
+}
+
+/*
+ * Destructor for TranspositionTable.
+ */
+TranspositionTable::~TranspositionTable() {
+  delete[] checks;
+  delete[] data;
+}
+
+/*
+ * Function: key
+ *
+ * Description: This function computes the key under which a position is stored
+ *              in the table.
+ *
+ * Inputs:
+ *  - black: The black pieces of the position.
+ *  - white: The white pieces of the position.
+ *  - color: The player whose turn it is.
+ *
+ * Return value: The key of the position.
+ */
+uint64_t TranspositionTable::key(uint64_t black, uint64_t white, int color) {
+  uint64_t h = Symmetry::hash(black, white);
+  return (color == 2) ? ~h : h;
+}
+
+/*
+ * Function: resize
+ *
+ * Description: This function changes the number of entries in the table,
+ *              discarding its contents.  It must not be called while the table
+ *              is in use by a search.
+ *
+ * Inputs:
+ *  - entries: The new number of entries.  It is rounded down to a power of two.
+ */
+void TranspositionTable::resize(size_t entries) {
+  delete[] checks;
+  delete[] data;
+  num_entries = round_entries(entries);
+  checks = new atomic<uint64_t>[num_entries];
+  data = new atomic<uint64_t>[num_entries];
+  clear();
+  SearchTrace::record("tt resize", 'i', (int64_t) num_entries);
+}
+
+/*
+ * Function: clear
+ *
+ * Description: This function empties the table.
+ */
+void TranspositionTable::clear() {
+  for (size_t i = 0; i < num_entries; ++i) {
+    checks[i].store(0, memory_order_relaxed);
+    data[i].store(0, memory_order_relaxed);
+  }
+}
+
+/*
+ * Function: probe
+ *
+ * Description: This function looks up the result of searching a position to a
+ *              given remaining depth.
+ *
+ * Inputs:
+ *  - key: The key of the position (see TranspositionTable::key).
+ *  - depth: The remaining depth of the search.  Only a result for exactly this
+ *           depth is returned, since the tree below a node is determined by
+ *           its remaining depth.
+ *
+ * Outputs:
+ *  - value: The stored value.
+ *  - bound: The stored bound type: BOUND_EXACT, BOUND_LOWER, or BOUND_UPPER.
+ *  - move: The best move found, as x * BOARD_SIZE + y, or NO_MOVE.
+ *
+ * Return value: True if a result was found; false otherwise, in which case the
+ *               outputs are unchanged.
+ */
+bool TranspositionTable::probe(uint64_t key, int depth, int* value, int* bound,
+                               int* move) {
+  size_t index = key & (num_entries - 1);
+  uint64_t d = data[index].load(memory_order_relaxed);
+  uint64_t check = checks[index].load(memory_order_relaxed);
+  if (((check ^ d) != key) || !(d & TT_IN_USE)) return false;
+  if ((int) ((d >> TT_DEPTH_SHIFT) & 0xff) != depth) return false;
+  *value = (int) (uint32_t) d;
+  *bound = (int) ((d >> TT_BOUND_SHIFT) & 0x3);
+  *move = (int) ((d >> TT_MOVE_SHIFT) & 0x7f);
+  return true;
+}
+
+/*
+ * Function: store
+ *
+ * Description: This function records the result of searching a position,
+ *              replacing whatever was stored in its entry.
+ *
+ * Inputs:
+ *  - key: The key of the position (see TranspositionTable::key).
+ *  - depth: The remaining depth of the search, from 0 to 255.
+ *  - value: The value found by the search.
+ *  - bound: The bound type of the value: BOUND_EXACT, BOUND_LOWER, or
+ *           BOUND_UPPER.
+ *  - move: The best move found, as x * BOARD_SIZE + y, or NO_MOVE.
+ */
+void TranspositionTable::store(uint64_t key, int depth, int value, int bound,
+                               int move) {
+  size_t index = key & (num_entries - 1);
+  uint64_t d = (uint64_t) (uint32_t) value |
+    ((uint64_t) (depth & 0xff) << TT_DEPTH_SHIFT) |
+    ((uint64_t) (bound & 0x3) << TT_BOUND_SHIFT) |
+    ((uint64_t) (move & 0x7f) << TT_MOVE_SHIFT) | TT_IN_USE;
+  checks[index].store(key ^ d, memory_order_relaxed);
+  data[index].store(d, memory_order_relaxed);
+}
+
+size_t TranspositionTable::size() {return num_entries;}
@@ -0,0 +1,297 @@
+#include "othello.h"
+
+// Number of positions evaluated together by each call to evaluate_batch.
+#define TUNER_BATCH_SIZE 1024
+
+// The largest weight (in absolute value) written by write_weights.  Weights are
+// fit as real numbers, so they are scaled up before being rounded to the
+// integers used by weighted_score_of_board.
+#define TUNER_WEIGHT_SCALE 100
+
+/*
+ * Constructor for Tuner.  Chooses the feature columns: one for each class of
+ * space that occurs on the board.  A class that no space is in (such as the
+ * spaces next to corners, which square_class never returns on any board) would
+ * only add a column of zeros, so it is left out, and its weight is written as
+ * 0.
+ */
+Tuner::Tuner() {
+  num_positions = 0;
+  bool occurs[NUM_SQUARE_CLASSES] = {false};
+  for (int i = 0; i < BOARD_SIZE; ++i) {
+    for (int j = 0; j < BOARD_SIZE; ++j) {
+      occurs[Othello::square_class(i, j, BOARD_SIZE)] = true;
+    }
+  }
+  num_features = 0;
+  for (int c = 0; c < NUM_SQUARE_CLASSES; ++c) {
+    if (occurs[c]) feature_class[num_features++] = c;
+  }
+  for (int k = 0; k < NUM_SQUARE_CLASSES; ++k) {
+    weights[k] = 0.0;
+  }
+}
+
+/*
+ * Function: load_positions
+ *
+ * Description: This function reads labeled positions from a file and appends
+ *              their features to the feature matrix.  Each line of the file
+ *              holds a position in the format accepted by
+ *              GameBoard::load_position, followed by whitespace, followed by
+ *              the result of the game from which the position was taken: 1 if
+ *              black won, 0 if the game was tied, or -1 if white won.  Lines
+ *              that do not follow this format are skipped.
+ *
+ * Inputs:
+ *  - filename: The path of the file of labeled positions.
+ *
+ * Return value: The number of positions loaded, or -1 if the file could not be
+ *               opened.
+ */
+long Tuner::load_positions(const char* filename) {
+  FILE* file = fopen(filename, "r");
+  if (file == NULL) return -1;
+
+  // Classify every space once, rather than once per position.
+  int classes[BOARD_SIZE * BOARD_SIZE];
+  for (int i = 0; i < BOARD_SIZE; ++i) {
+    for (int j = 0; j < BOARD_SIZE; ++j) {
+      classes[i * BOARD_SIZE + j] = Othello::square_class(i, j, BOARD_SIZE);
+    }
+  }
+
+  long loaded = 0;
+  char line[256];
+  while (fgets(line, sizeof(line), file) != NULL) {
+    int counts[NUM_SQUARE_CLASSES] = {0};
+    bool valid = true;
+    for (int k = 0; k < BOARD_SIZE * BOARD_SIZE; ++k) {
+      if (line[k] == '2') ++counts[classes[k]];
+      else if (line[k] == '1') --counts[classes[k]];
+      else if (line[k] != '0') {
+        valid = false;
+        break;
+      }
+    }
+    if (!valid) continue;
+
+    char* end;
+    long result = strtol(line + BOARD_SIZE * BOARD_SIZE, &end, 10);
+    if ((end == line + BOARD_SIZE * BOARD_SIZE) || (result < -1) ||
+        (result > 1)) {
+      continue;
+    }
+
+    for (int k = 0; k < num_features; ++k) {
+      features[k].push_back((float) counts[feature_class[k]]);
+    }
+    labels.push_back((float) (result + 1) / 2.0f);
+    ++loaded;
+  }
+  fclose(file);
+
+  num_positions += loaded;
+  return loaded;
+}
+
+/*
+ * Function: evaluate_batch
+ *
+ * Description: This function computes the weighted score of a run of
+ *              consecutive positions in the feature matrix.  The work is done
+ *              one feature column at a time, so that every inner loop streams
+ *              through contiguous floats and is vectorized by the compiler.
+ *
+ * Inputs:
+ *  - columns: num_columns pointers, each to the first entry of the run in the
+ *             corresponding feature column.
+ *  - w: The weight of each feature column.
+ *  - num_columns: The number of feature columns.
+ *  - count: The number of positions in the run.
+ *
+ * Outputs:
+ *  - scores: The weighted score of each position in the run.  Is assumed to
+ *            hold at least count floats.
+ */
+void Tuner::evaluate_batch(const float* const* columns, const double* w,
+                           int num_columns, size_t count, float* scores) {
+  for (size_t i = 0; i < count; ++i) {
+    scores[i] = 0.0f;
+  }
+  for (int k = 0; k < num_columns; ++k) {
+    const float* column = columns[k];
+    float weight = (float) w[k];
+    for (size_t i = 0; i < count; ++i) {
+      scores[i] += weight * column[i];
+    }
+  }
+}
+
+/*
+ * Function: fit
+ *
+ * Description: This function fits the weights to the loaded positions by
+ *              logistic regression: the probability that black wins a position
+ *              is modeled as the logistic function of its weighted score, and
+ *              the weights are found by batch gradient descent on the
+ *              cross-entropy of that model.  The gradient of each iteration is
+ *              computed in parallel, with every thread taking a contiguous
+ *              share of the positions.  The threads are started once and wait
+ *              between iterations, rather than being started anew for each.
+ *
+ * Inputs:
+ *  - iterations: The number of gradient descent steps to take.
+ *  - learning_rate: The size of each step.
+ *  - num_threads: The number of threads to use.  If less than 1, one thread
+ *                 per hardware core is used.
+ *
+ * Return value: The mean cross-entropy of the loaded positions under the final
+ *               weights, or -1 if no positions have been loaded.
+ */
+double Tuner::fit(int iterations, double learning_rate, int num_threads) {
+  if (num_positions == 0) return -1.0;
+  if (num_threads < 1) num_threads = (int) thread::hardware_concurrency();
+  if (num_threads < 1) num_threads = 1;
+
+  vector<double> gradients(num_threads * NUM_SQUARE_CLASSES);
+  vector<double> losses(num_threads);
+  size_t share = (num_positions + num_threads - 1) / num_threads;
+
+  // Each worker accumulates the gradient and loss of its share of the
+  // positions into its own slots of gradients and losses.
+  auto worker = [&](int t) {
+    size_t begin = t * share;
+    size_t end = min(num_positions, begin + share);
+    double gradient[NUM_SQUARE_CLASSES] = {0.0};
+    double loss = 0.0;
+    float scores[TUNER_BATCH_SIZE];
+    float errors[TUNER_BATCH_SIZE];
+    for (size_t b = begin; b < end; b += TUNER_BATCH_SIZE) {
+      size_t count = min((size_t) TUNER_BATCH_SIZE, end - b);
+      const float* columns[NUM_SQUARE_CLASSES];
+      for (int k = 0; k < num_features; ++k) {
+        columns[k] = features[k].data() + b;
+      }
+      evaluate_batch(columns, weights, num_features, count, scores);
+
+      const float* label = labels.data() + b;
+      for (size_t i = 0; i < count; ++i) {
+        float p = 1.0f / (1.0f + expf(-scores[i]));
+        errors[i] = p - label[i];
+        p = min(max(p, 1e-7f), 1.0f - 1e-7f);
+        loss -= label[i] * logf(p) + (1.0f - label[i]) * logf(1.0f - p);
+      }
+      for (int k = 0; k < num_features; ++k) {
+        float partial = 0.0f;
+        for (size_t i = 0; i < count; ++i) {
+          partial += errors[i] * columns[k][i];
+        }
+        gradient[k] += partial;
+      }
+    }
+    for (int k = 0; k < num_features; ++k) {
+      gradients[t * NUM_SQUARE_CLASSES + k] = gradient[k];
+    }
+    losses[t] = loss;
+  };
+
+  // The other threads wait for round to be advanced, take their shares of that
+  // round, and count themselves out of remaining; the calling thread takes
+  // share 0 and waits for remaining to reach 0.  A round of -1 stops them.
+  mutex pool_lock;
+  condition_variable round_started, round_finished;
+  int round = 0;
+  int remaining = 0;
+  vector<thread> threads;
+  for (int t = 1; t < num_threads; ++t) {
+    threads.push_back(thread([&, t]() {
+      int last = 0;
+      while (true) {
+        unique_lock<mutex> lock(pool_lock);
+        round_started.wait(lock, [&]() {return round != last;});
+        if (round < 0) return;
+        last = round;
+        lock.unlock();
+        worker(t);
+        lock.lock();
+        if (--remaining == 0) round_finished.notify_one();
+      }
+    }));
+  }
+
+  double loss = 0.0;
+  for (int iteration = 0; iteration <= iterations; ++iteration) {
+    {
+      lock_guard<mutex> lock(pool_lock);
+      ++round;
+      remaining = num_threads - 1;
+    }
+    round_started.notify_all();
+    worker(0);
+    {
+      unique_lock<mutex> lock(pool_lock);
+      round_finished.wait(lock, [&]() {return remaining == 0;});
+    }
+
+    loss = 0.0;
+    for (int t = 0; t < num_threads; ++t) {
+      loss += losses[t];
+    }
+    loss /= (double) num_positions;
+
+    // The final pass only measures the loss of the fitted weights.
+    if (iteration == iterations) break;
+    for (int k = 0; k < num_features; ++k) {
+      double gradient = 0.0;
+      for (int t = 0; t < num_threads; ++t) {
+        gradient += gradients[t * NUM_SQUARE_CLASSES + k];
+      }
+      weights[k] -= learning_rate * gradient / (double) num_positions;
+    }
+  }
+
+  {
+    lock_guard<mutex> lock(pool_lock);
+    round = -1;
+  }
+  round_started.notify_all();
+  for (auto th = threads.begin(); th != threads.end(); ++th) {
+    th->join();
+  }
+  return loss;
+}
+
+/*
+ * Function: write_weights
+ *
+ * Description: This function writes the fitted weights to a weight file that
+ *              can be read by Othello::load_weights.  The weights are scaled so
+ *              that the largest of them is TUNER_WEIGHT_SCALE in absolute
+ *              value, and then rounded to integers.  Classes of space left out
+ *              of the feature columns are given weight 0.
+ *
+ * Inputs:
+ *  - filename: The path of the weight file to write.
+ *
+ * Return value: True if the file was written; false otherwise.
+ */
+bool Tuner::write_weights(const char* filename) {
+  double class_weights[NUM_SQUARE_CLASSES] = {0.0};
+  double largest = 0.0;
+  for (int k = 0; k < num_features; ++k) {
+    class_weights[feature_class[k]] = weights[k];
+    largest = max(largest, fabs(weights[k]));
+  }
+  double scale = (largest > 0.0) ? TUNER_WEIGHT_SCALE / largest : 0.0;
+
+  FILE* file = fopen(filename, "w");
+  if (file == NULL) return false;
+  for (int c = 0; c < NUM_SQUARE_CLASSES; ++c) {
+    fprintf(file, "%ld%c", lround(class_weights[c] * scale),
+            (c == NUM_SQUARE_CLASSES - 1) ? '\n' : ' ');
+  }
+  return fclose(file) == 0;
+}
+
+size_t Tuner::get_num_positions() {return num_positions;}
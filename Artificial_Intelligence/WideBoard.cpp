@@ -0,0 +1,409 @@
+#include "othello.h"
+
+// The eight directions in which pieces can be flanked, as changes in bit index.
+// A change of +1 or -1 moves along the y-axis, and a change of +WIDE_MAX_SIZE
+// or -WIDE_MAX_SIZE moves along the x-axis.
+static const int directions[8] = {
+  1, -1, WIDE_MAX_SIZE, -WIDE_MAX_SIZE,
+  WIDE_MAX_SIZE + 1, WIDE_MAX_SIZE - 1, -WIDE_MAX_SIZE + 1, -WIDE_MAX_SIZE - 1
+};
+
+bool WideBits::empty() {
+  for (int i = 0; i < WIDE_WORDS; ++i) {
+    if (words[i]) return false;
+  }
+  return true;
+}
+
+int WideBits::count() {
+  int total = 0;
+  for (int i = 0; i < WIDE_WORDS; ++i) {
+    total += __builtin_popcountll(words[i]);
+  }
+  return total;
+}
+
+// Returns the lowest space in the set, or -1 if the set is empty.
+int WideBits::first() {
+  for (int i = 0; i < WIDE_WORDS; ++i) {
+    if (words[i]) return i * 64 + __builtin_ctzll(words[i]);
+  }
+  return -1;
+}
+
+bool WideBits::test(int space) {
+  return (words[space / 64] >> (space % 64)) & 1;
+}
+
+void WideBits::set(int space) {
+  words[space / 64] |= (uint64_t) 1 << (space % 64);
+}
+
+// Helper functions for combining WideBits.
+static WideBits operator&(const WideBits& a, const WideBits& b) {
+  WideBits result;
+  for (int i = 0; i < WIDE_WORDS; ++i) {
+    result.words[i] = a.words[i] & b.words[i];
+  }
+  return result;
+}
+
+static WideBits operator|(const WideBits& a, const WideBits& b) {
+  WideBits result;
+  for (int i = 0; i < WIDE_WORDS; ++i) {
+    result.words[i] = a.words[i] | b.words[i];
+  }
+  return result;
+}
+
+static WideBits operator~(const WideBits& a) {
+  WideBits result;
+  for (int i = 0; i < WIDE_WORDS; ++i) result.words[i] = ~a.words[i];
+  return result;
+}
+
+// Helper function that returns an empty set of spaces.
+static WideBits no_spaces() {
+  WideBits result;
+  for (int i = 0; i < WIDE_WORDS; ++i) result.words[i] = 0;
+  return result;
+}
+
+// Helper function for WideBoard::shift.  Returns the set of all spaces not in a
+// given column.
+static WideBits make_column_mask(int column) {
+  WideBits mask;
+  for (int i = 0; i < WIDE_WORDS; ++i) mask.words[i] = ~(uint64_t) 0;
+  for (int x = 0; x < WIDE_MAX_SIZE; ++x) {
+    int space = x * WIDE_MAX_SIZE + column;
+    mask.words[space / 64] &= ~((uint64_t) 1 << (space % 64));
+  }
+  return mask;
+}
+
+/*
+ * Constructor for WideBoard.  Sets up the starting position: four pieces in the
+ * center of the board, placed as on a GameBoard.
+ *
+ * Inputs:
+ *  - n: The number of spaces along each side of the board.  Is assumed to be
+ *       even and between 4 and WIDE_MAX_SIZE.
+ */
+WideBoard::WideBoard(int n) {
+  size = n;
+  black = no_spaces();
+  white = no_spaces();
+  valid = no_spaces();
+  for (int x = 0; x < size; ++x) {
+    for (int y = 0; y < size; ++y) {
+      valid.set(x * WIDE_MAX_SIZE + y);
+    }
+  }
+  int c = size / 2;
+  black.set((c - 1) * WIDE_MAX_SIZE + (c - 1));
+  black.set(c * WIDE_MAX_SIZE + c);
+  white.set(c * WIDE_MAX_SIZE + (c - 1));
+  white.set((c - 1) * WIDE_MAX_SIZE + c);
+}
+
+/*
+ * Function: shift
+ *
+ * Description: This function moves every space in a set one step in a
+ *              direction, dropping spaces that would leave the board.
+ *
+ * Inputs:
+ *  - bits: The set to shift.
+ *  - direction: One of the entries of directions.
+ *
+ * Return value: The shifted set.
+ */
+WideBits WideBoard::shift(const WideBits& bits, int direction) {
+  WideBits result;
+  if (direction > 0) {
+    for (int i = WIDE_WORDS - 1; i > 0; --i) {
+      result.words[i] = (bits.words[i] << direction) |
+        (bits.words[i - 1] >> (64 - direction));
+    }
+    result.words[0] = bits.words[0] << direction;
+  }
+  else {
+    int d = -direction;
+    for (int i = 0; i < WIDE_WORDS - 1; ++i) {
+      result.words[i] = (bits.words[i] >> d) |
+        (bits.words[i + 1] << (64 - d));
+    }
+    result.words[WIDE_WORDS - 1] = bits.words[WIDE_WORDS - 1] >> d;
+  }
+
+  // A step along the y-axis off one edge of the board lands on the opposite
+  // edge of the neighboring row, which must be masked off.
+  static const WideBits not_first_column = make_column_mask(0);
+  static const WideBits not_last_column = make_column_mask(WIDE_MAX_SIZE - 1);
+  int dy = (direction + WIDE_MAX_SIZE + 1) % WIDE_MAX_SIZE - 1;
+  if (dy > 0) result = result & not_first_column;
+  if (dy < 0) result = result & not_last_column;
+  return result & valid;
+}
+
+/*
+ * Function: place_piece
+ *
+ * Description: This function places a given piece of a given color on the
+ *              board and flips all pieces that will now need to be flipped, as
+ *              GameBoard::place_piece does.  For each direction, the run of
+ *              opposing pieces next to the space is found by repeatedly
+ *              shifting, and it is flipped if a piece of the player's own color
+ *              lies beyond it.
+ *
+ * Inputs:
+ *  - color: The color of the piece to be placed.  1 represents white, and 2
+ *           represents black.
+ *  - x: The x-coordinate of the space onto which to place the piece.
+ *  - y: The y-coordinate of the space onto which to place the piece.
+ *  - do_flip: A piece will be placed, and existing pieces will be flipped, only
+ *    if this boolean is true.
+ *
+ * Return value:
+ *  - If true, that means the move made was a legal move.
+ *  - If false, the move that would have been made was an illegal move.
+ */
+bool WideBoard::place_piece(int color, int x, int y, bool do_flip) {
+  int space = x * WIDE_MAX_SIZE + y;
+  if (!valid.test(space) || black.test(space) || white.test(space)) {
+    return false;
+  }
+  WideBits& own = (color == 2) ? black : white;
+  WideBits& opponent = (color == 2) ? white : black;
+
+  WideBits piece = no_spaces();
+  piece.set(space);
+
+  WideBits flips = no_spaces();
+  for (int d = 0; d < 8; ++d) {
+    WideBits run = no_spaces();
+    WideBits step = shift(piece, directions[d]);
+    while (!(step & opponent).empty()) {
+      run = run | step;
+      step = shift(step, directions[d]);
+    }
+    if (!run.empty() && !(step & own).empty()) flips = flips | run;
+  }
+  if (flips.empty()) return false;
+
+  if (do_flip) {
+    own = own | flips | piece;
+    opponent = opponent & ~flips;
+  }
+  return true;
+}
+
+/*
+ * Function: legal_moves
+ *
+ * Description: This function finds every legal move for a player at once: for
+ *              each direction, runs of opposing pieces adjoining the player's
+ *              pieces are grown one step at a time, and the empty spaces just
+ *              past their ends are moves.
+ *
+ * Inputs:
+ *  - color: The color of the player.  1 represents white, and 2 represents
+ *           black.
+ *
+ * Return value: The set of spaces on which the player may place a piece.
+ */
+WideBits WideBoard::legal_moves(int color) {
+  WideBits& own = (color == 2) ? black : white;
+  WideBits& opponent = (color == 2) ? white : black;
+  WideBits empty_spaces = valid & ~(black | white);
+
+  WideBits moves = no_spaces();
+  for (int d = 0; d < 8; ++d) {
+    WideBits run = shift(own, directions[d]) & opponent;
+    for (int step = 0; step < size - 3; ++step) {
+      run = run | (shift(run, directions[d]) & opponent);
+    }
+    moves = moves | (shift(run, directions[d]) & empty_spaces);
+  }
+  return moves;
+}
+
+/*
+ * Function: raw_score_of_board
+ *
+ * Return value: The number of white pieces subtracted from the number of black
+ *               pieces, as in GameBoard::raw_score_of_board.
+ */
+int WideBoard::raw_score_of_board() {
+  return black.count() - white.count();
+}
+
+/*
+ * Function: square_class
+ *
+ * Description: This function sorts a space into the classes of
+ *              Othello::square_class, for a board of this board's size, so that
+ *              an 8 by 8 WideBoard is scored exactly as a GameBoard is.
+ *
+ * Inputs:
+ *  - x: The x-coordinate of the space in question.
+ *  - y: The y-coordinate of the space in question.
+ *
+ * Return value: As for Othello::square_class.
+ */
+int WideBoard::square_class(int x, int y) {
+  return Othello::square_class(x, y, size);
+}
+
+// Helper function for WideBoard::weighted_score_of_board.  Returns, for every
+// board size up to WIDE_MAX_SIZE, the set of spaces in each class; the set for
+// size n and class k is entry n * NUM_SQUARE_CLASSES + k.
+static vector<WideBits> make_class_masks() {
+  vector<WideBits> masks((WIDE_MAX_SIZE + 1) * NUM_SQUARE_CLASSES, no_spaces());
+  for (int n = 4; n <= WIDE_MAX_SIZE; n += 2) {
+    WideBoard board(n);
+    for (int x = 0; x < n; ++x) {
+      for (int y = 0; y < n; ++y) {
+        masks[n * NUM_SQUARE_CLASSES + board.square_class(x, y)].set(
+          x * WIDE_MAX_SIZE + y);
+      }
+    }
+  }
+  return masks;
+}
+
+/*
+ * Function: weighted_score_of_board
+ *
+ * Description: This function measures the score of the board for the purpose of
+ *              minimax move prediction, weighting each piece by the class of
+ *              its space as GameBoard::weighted_score_of_board does.  The
+ *              pieces in each class are counted with a mask of the class's
+ *              spaces.
+ *
+ * Return value: The weighted score.  A positive value indicates that black is
+ *               in a better position than white.
+ */
+int WideBoard::weighted_score_of_board() {
+  static const vector<WideBits> class_masks = make_class_masks();
+  int total = 0;
+  for (int k = 0; k < NUM_SQUARE_CLASSES; ++k) {
+    const WideBits& mask = class_masks[size * NUM_SQUARE_CLASSES + k];
+    total += Othello::get_square_weight(k) *
+      ((black & mask).count() - (white & mask).count());
+  }
+  return total;
+}
+
+/*
+ * Function: get_space
+ *
+ * Return value: The contents of space (x, y): 0 if empty, 1 if white, or 2 if
+ *               black.
+ */
+int WideBoard::get_space(int x, int y) {
+  int space = x * WIDE_MAX_SIZE + y;
+  if (black.test(space)) return 2;
+  if (white.test(space)) return 1;
+  return 0;
+}
+
+int WideBoard::get_size() {return size;}
+
+/*
+ * Function: alpha_beta
+ *
+ * Description: This function performs alpha-beta pruning from this board,
+ *              generating positions as it goes rather than building a decision
+ *              tree first.  Unlike Othello::alpha_beta, it lets a player with
+ *              no legal moves pass, and stops when neither player can move.
+ *
+ * Inputs:
+ *  - color: The player whose turn it is.
+ *  - depth: The number of further turns to look ahead.
+ *  - alpha: The best possible heuristic score for the black player found thus
+ *           far.
+ *  - beta: The best possible heuristic score for the white player found thus
+ *          far.
+ *  - passed: Whether the previous player passed.
+ *
+ * Outputs:
+ *  - nodes: Incremented once for every position visited.
+ *
+ * Return value: The heuristic score that would result from the best move by the
+ *               player.
+ */
+int WideBoard::alpha_beta(int color, int depth, int alpha, int beta,
+                          bool passed, long* nodes) {
+  ++*nodes;
+  if (depth <= 0) return weighted_score_of_board();
+  WideBits moves = legal_moves(color);
+  if (moves.empty()) {
+    if (passed) return weighted_score_of_board();
+    return alpha_beta(3 - color, depth - 1, alpha, beta, true, nodes);
+  }
+
+  int value = (color == 2) ? INT_MIN : INT_MAX;
+  for (int space = moves.first(); space >= 0; space = moves.first()) {
+    moves.words[space / 64] &= ~((uint64_t) 1 << (space % 64));
+    WideBoard child = *this;
+    child.place_piece(color, space / WIDE_MAX_SIZE, space % WIDE_MAX_SIZE,
+                      true);
+    int child_value = child.alpha_beta(3 - color, depth - 1, alpha, beta,
+                                       false, nodes);
+    if (color == 2) {
+      value = max(value, child_value);
+      alpha = max(alpha, value);
+    }
+    else {
+      value = min(value, child_value);
+      beta = min(beta, value);
+    }
+    if (beta <= alpha) break;
+  }
+  return value;
+}
+
+/*
+ * Function: choose_move
+ *
+ * Description: This function finds the best move for a player by searching
+ *              every legal move to a given depth with alpha_beta.
+ *
+ * Inputs:
+ *  - color: The player whose move is being chosen.
+ *  - depth: The number of turns to look ahead, including this one.
+ *
+ * Outputs:
+ *  - best_x: The x-coordinate of the best move is stored here.
+ *  - best_y: The y-coordinate of the best move is stored here.
+ *  - nodes: Incremented once for every position visited.
+ *
+ * Return value: True if a move was found; false if the player has no legal
+ *               moves.
+ */
+bool WideBoard::choose_move(int color, int depth, int* best_x, int* best_y,
+                            long* nodes) {
+  WideBits moves = legal_moves(color);
+  if (moves.empty()) return false;
+
+  int alpha = INT_MIN, beta = INT_MAX;
+  int best_value = (color == 2) ? INT_MIN : INT_MAX;
+  for (int space = moves.first(); space >= 0; space = moves.first()) {
+    moves.words[space / 64] &= ~((uint64_t) 1 << (space % 64));
+    WideBoard child = *this;
+    child.place_piece(color, space / WIDE_MAX_SIZE, space % WIDE_MAX_SIZE,
+                      true);
+    int value = child.alpha_beta(3 - color, depth - 1, alpha, beta, false,
+                                 nodes);
+    bool better = (color == 2) ? (value > best_value) : (value < best_value);
+    if (better || (best_value == ((color == 2) ? INT_MIN : INT_MAX))) {
+      best_value = value;
+      *best_x = space / WIDE_MAX_SIZE;
+      *best_y = space % WIDE_MAX_SIZE;
+    }
+    if (color == 2) alpha = max(alpha, best_value);
+    else beta = min(beta, best_value);
+  }
+  return true;
+}
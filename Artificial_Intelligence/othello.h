@@ -1,14 +1,109 @@
 #include <unordered_set>
 #include <climits>
+#include <cerrno>
 #include <string>
+#include <cstring>
 #include <iostream>
 #include <iterator>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <thread>
+#include <future>
+#include <functional>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <poll.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #define BOARD_SIZE 8
+#define NUM_SQUARE_CLASSES 4 // corner, next to corner, side, and other spaces
+
+// The bits of the spaces with y-coordinate 0 on a 64-bit board.
+#define COLUMN_ZERO 0x0101010101010101ULL
+
+// Ways of finding the pieces flipped by a move.  See GameBoard::place_piece.
+#define FLIP_SCAN 0 // step away from the move one space at a time
+#define FLIP_TABLE 1 // look up whole lines in precomputed tables
+
+// Game log format: each game is a GAME_LOG_HEADER_SIZE-byte header followed by
+// one byte per turn.  See GameLog.cpp for details.
+#define GAME_LOG_MAGIC 0xB7
+#define GAME_LOG_HEADER_SIZE 4
+#define GAME_LOG_PASS 0xFF
+#define GAME_LOG_FORFEIT 0x04 // flag in the second header byte
+
+#define NUM_SYMMETRIES 8 // rotations and reflections of the board
+
+// Neural evaluator dimensions.  There is one input per combination of space
+// and color, and NNUE_HIDDEN must be a multiple of 8 so that the accumulator
+// can be processed eight 16-bit lanes at a time.
+#define NNUE_INPUTS (2 * BOARD_SIZE * BOARD_SIZE)
+#define NNUE_HIDDEN 64
+#define NNUE_MAGIC "ONN1"
+
+// Board variants.  A WideBoard may be any even size from 4 to WIDE_MAX_SIZE.
+// Space (x, y) is bit x * WIDE_MAX_SIZE + y of a WIDE_WORDS-word bitset.
+#define WIDE_MAX_SIZE 16
+#define WIDE_WORDS (WIDE_MAX_SIZE * WIDE_MAX_SIZE / 64)
+
+// Bound types stored in the transposition table.
+#define BOUND_EXACT 0
+#define BOUND_LOWER 1 // the true value is at least the stored value
+#define BOUND_UPPER 2 // the true value is at most the stored value
+#define NO_MOVE 0x7f // stored in the transposition table when there is no move
+
+// Types of message passed between the coordinator and the workers of a
+// distributed search.  See DistributedSearch.cpp for details.
+#define MESSAGE_TASK 0
+#define MESSAGE_BOUNDS 1
+#define MESSAGE_RESULT 2
+#define MESSAGE_QUIT 3
+
+// Solved-position database.  See SolvedDB.cpp for the file formats.
+#define SOLVED_DB_MAGIC "OSDB"
+#define SOLVED_DB_HEADER_SIZE 16
+
+// Positions with at most this many empty spaces are solved exactly when
+// endgame solving is turned on without giving a number of empty spaces.
+#define ENDGAME_DEFAULT_EMPTIES 12
+
+// The number of events kept by each thread's trace buffer.  Must be a power of
+// two.
+#define TRACE_BUFFER_SIZE 8192
 
 using namespace std;
 
 void parse_initial_input(int*, int*);
+int tune_weights(int, char**);
+int replay_games(int, char**);
+int benchmark_nnue(int, char**);
+int analyze_position(int, char**);
+int play_variant(int, char**);
+int benchmark_variants(int, char**);
+int benchmark_distributed(int, char**);
+int compact_database(int, char**);
+int benchmark_search(int, char**);
+int check_flips(int, char**);
+int check_async(int, char**);
+int train_engine(int, char**);
 
 /*
  * This class represents a game board, containing its current state.
@@ -17,6 +112,15 @@ class GameBoard {
 
  private:
   int** game_board; // state
+  int16_t* accumulator; // if not NULL, the hidden layer of the neural
+                        // evaluator, kept up to date with the state
+  uint64_t black_bits, white_bits; // the state as 64-bit boards, kept up to
+                                   // date for the flip tables
+  static int flip_method; // FLIP_SCAN or FLIP_TABLE
+
+  void set_space(int, int, int);
+  void sync_bitboards();
+  uint64_t table_flips(int, int, int);
 
  public:
   // constructors and destructor
@@ -29,7 +133,93 @@ class GameBoard {
   bool flip_pieces(int, int, int, int, int, bool);
   int raw_score_of_board();
   int weighted_score_of_board();
+  int evaluate();
+  void attach_accumulator();
   bool is_legal(int, int, int);
+  bool load_position(const char*);
+  void save_position(char*);
+  void to_bitboards(uint64_t*, uint64_t*);
+  void load_bitboards(uint64_t, uint64_t);
+  static int weighted_score_of_bitboards(uint64_t, uint64_t);
+  static void weighted_scores_of_bitboards(const uint64_t*, const uint64_t*,
+                                           int, int*);
+  static int evaluate_bitboards(uint64_t, uint64_t);
+  static void set_flip_method(int);
+  static int get_flip_method();
+  int get_space(int, int);
+};
+
+/*
+ * The WideBits class is a set of spaces on a board of up to WIDE_MAX_SIZE by
+ * WIDE_MAX_SIZE spaces, stored as a multi-word bitset.
+ */
+class WideBits {
+ public:
+  uint64_t words[WIDE_WORDS];
+
+  // See WideBoard.cpp for descriptions.
+  bool empty();
+  int count();
+  int first();
+  bool test(int);
+  void set(int);
+};
+
+/*
+ * The WideBoard class represents the state of a game played on a board of any
+ * even size up to WIDE_MAX_SIZE.  It follows the same rules as GameBoard, but
+ * finds moves and flips for whole lines of spaces at once with bitwise
+ * operations on multi-word bitsets, rather than one space at a time.
+ */
+class WideBoard {
+ private:
+  int size; // the number of spaces along each side of the board
+  WideBits black, white; // the spaces holding pieces of each color
+  WideBits valid; // the spaces that are on the board
+
+  WideBits shift(const WideBits&, int);
+
+ public:
+  // constructor
+  WideBoard(int);
+
+  // See WideBoard.cpp for descriptions.
+  bool place_piece(int, int, int, bool);
+  WideBits legal_moves(int);
+  int raw_score_of_board();
+  int weighted_score_of_board();
+  int square_class(int, int);
+  int get_space(int, int);
+  int get_size();
+  int alpha_beta(int, int, int, int, bool, long*);
+  bool choose_move(int, int, int*, int*, long*);
+};
+
+/*
+ * The NNUE class holds the network used by the neural evaluator, which is
+ * loaded from a weight file, and contains the functions that run it.  The
+ * network has one hidden layer, whose pre-activation values (the accumulator)
+ * are updated incrementally as pieces are placed and flipped, followed by a
+ * clipped ReLU and a single quantized output neuron.
+ */
+class NNUE {
+ private:
+  static bool loaded; // whether a network has been loaded
+  static int16_t feature_weights[NNUE_INPUTS][NNUE_HIDDEN];
+  static int16_t hidden_biases[NNUE_HIDDEN];
+  static int16_t output_weights[NNUE_HIDDEN];
+  static int32_t output_bias;
+  static int32_t output_shift; // the output is divided by 2^output_shift
+
+ public:
+  // See NNUE.cpp for descriptions.
+  static bool load(const char*);
+  static bool is_loaded();
+  static int feature_index(int, int, int);
+  static void refresh(GameBoard*, int16_t*);
+  static void add_feature(int16_t*, int);
+  static void move_feature(int16_t*, int, int);
+  static int evaluate(const int16_t*);
 };
 
 /*
@@ -68,6 +258,445 @@ class TreeNode {
   void set_value(int);
 };
 
+/*
+ * The GameLog class appends a compact binary record of each game played to a
+ * log file.  Turns are buffered in memory and written out as one record when
+ * the game ends.
+ */
+class GameLog {
+ private:
+  int fd; // the log file, opened for appending
+  int our_color; // the color played by the program
+  vector<unsigned char> turns; // one byte per turn taken so far
+
+ public:
+  // constructor and destructor
+  GameLog(const char*, int);
+  ~GameLog();
+
+  // See GameLog.cpp for descriptions.
+  bool is_open();
+  void record_move(int, int);
+  void record_pass();
+  bool finish(int, bool);
+};
+
+/*
+ * The GameLogReader class reads a game log written by GameLog.  The log is
+ * memory-mapped and indexed once, after which any game can be replayed onto a
+ * GameBoard.
+ */
+class GameLogReader {
+ private:
+  unsigned char* data; // the mapped log file
+  size_t length; // the length of the log file in bytes
+  vector<size_t> offsets; // the offset of each game's header in data
+
+ public:
+  // constructor and destructor
+  GameLogReader();
+  ~GameLogReader();
+
+  // See GameLog.cpp for descriptions.
+  long open_log(const char*);
+  size_t num_games();
+  int num_turns(size_t);
+  int get_result(size_t);
+  bool is_forfeit(size_t);
+  bool apply_turn(size_t, int, GameBoard*);
+  int replay(size_t, GameBoard*);
+};
+
+/*
+ * The Symmetry class contains functions for working with positions up to the
+ * eight symmetries of the board (the identity, three rotations, and four
+ * reflections).  Positions are handled as a pair of 64-bit boards, one for the
+ * black pieces and one for the white pieces, in which space (x, y) is bit
+ * x * BOARD_SIZE + y.  Symmetry number s is the composition of transposing the
+ * board if (s & 4), then reversing the x-coordinate if (s & 1), then reversing
+ * the y-coordinate if (s & 2).
+ */
+class Symmetry {
+ public:
+  // See Symmetry.cpp for descriptions.
+  static uint64_t flip_x(uint64_t);
+  static uint64_t flip_y(uint64_t);
+  static uint64_t transpose(uint64_t);
+  static uint64_t transform(uint64_t, int);
+  static uint64_t untransform(uint64_t, int);
+  static int canonicalize(uint64_t, uint64_t, uint64_t*, uint64_t*);
+  static uint64_t hash(uint64_t, uint64_t);
+  static uint64_t canonical_hash(GameBoard*, int*);
+  static void transform_move(int, int, int, int*, int*);
+  static void untransform_move(int, int, int, int*, int*);
+};
+
+/*
+ * The TranspositionTable class is a hash table of search results, keyed by
+ * position and player to move, that lets searches of the same position share
+ * work.  It may be used by several threads at once without locking: each entry
+ * is stored as its data plus its key XORed with its data, so an entry torn by
+ * concurrent writes fails its key check and is ignored.
+ */
+class TranspositionTable {
+ private:
+  atomic<uint64_t>* checks; // key XOR data for each entry
+  atomic<uint64_t>* data; // packed value, depth, bound type, and move
+  size_t num_entries; // always a power of two
+
+ public:
+  // constructor and destructor
+  TranspositionTable(size_t);
+  ~TranspositionTable();
+
+  // See TranspositionTable.cpp for descriptions.
+  static uint64_t key(uint64_t, uint64_t, int);
+  void resize(size_t);
+  void clear();
+  bool probe(uint64_t, int, int*, int*, int*);
+  void store(uint64_t, int, int, int, int);
+  size_t size();
+};
+
+/*
+ * The ArenaNode class is a node of an ArenaTree.  It plays the same role as a
+ * TreeNode, but stores its board inline as a pair of 64-bit boards (see
+ * GameBoard::to_bitboards) and refers to its children as a contiguous range of
+ * indices in the tree's node array.
+ */
+class ArenaNode {
+ public:
+  uint64_t black, white; // the board after this node's move
+  int32_t first_child; // the index of the first child in the node array
+  int32_t value; // for alpha-beta pruning
+  uint8_t num_children; // the children are first_child, first_child + 1, ...
+  int8_t x, y; // the space occupied by this node's move; -1 for the root
+  int8_t color; // the player who would be taking their turn
+  int8_t depth; // the depth in the decision tree at which this node resides
+};
+
+/*
+ * The ArenaTree class is a decision tree whose nodes all live in one array,
+ * allocated bump-style as the tree is built.  The children of each node are
+ * allocated together, so walking them touches consecutive memory, and freeing
+ * the tree takes constant time because the array is simply reused.  It is used
+ * where the decision tree needs to outlive a single search.
+ */
+class ArenaTree {
+ private:
+  ArenaNode* nodes; // the node array; the root is nodes[0]
+  size_t num_nodes; // the number of nodes in use
+  size_t capacity; // the number of nodes allocated
+  GameBoard scratch; // used to generate moves from a node's board
+  int depth_limit; // the depth limit of the tree last built
+  TranspositionTable* table; // if not NULL, consulted by alpha_beta
+
+  int32_t allocate(size_t);
+  void expand(int32_t, int);
+
+ public:
+  // constructor and destructor
+  ArenaTree();
+  ~ArenaTree();
+
+  // See ArenaTree.cpp for descriptions.
+  void clear();
+  void build(GameBoard*, int, int);
+  int alpha_beta(int32_t, int, int);
+  int evaluate(int32_t);
+  int32_t find_child(int32_t, int, int);
+  int remaining_depth(int32_t);
+  void set_table(TranspositionTable*);
+  ArenaNode* get_node(int32_t);
+  size_t size();
+};
+
+/*
+ * The PVLine class holds the result of analyzing one root move: its exact
+ * score and its principal variation, the sequence of moves (each stored as
+ * x * BOARD_SIZE + y) expected to be played if both players play their best,
+ * starting with the root move itself.
+ */
+class PVLine {
+ public:
+  int value;
+  vector<int> moves;
+};
+
+/*
+ * The Analysis class contains functions for analyzing a position in more depth
+ * than is needed to choose a move, for the purpose of reviewing games.
+ */
+class Analysis {
+ public:
+  // See Analysis.cpp for descriptions.
+  static int multi_pv(GameBoard*, int, int, int, int, TranspositionTable*,
+                      vector<PVLine>*);
+  static void extract_pv(ArenaTree*, TranspositionTable*, int32_t, PVLine*);
+};
+
+/*
+ * The SearchMessage class is a message passed between the coordinator of a
+ * distributed search and one of its workers.  Every message has the same size;
+ * which fields are meaningful depends on its type.
+ */
+class SearchMessage {
+ public:
+  int32_t type; // one of the MESSAGE_ constants
+  int32_t task; // the number of the task the message concerns
+  uint64_t black, white; // the board to search (MESSAGE_TASK)
+  int32_t color; // the player whose turn it is (MESSAGE_TASK)
+  int32_t depth; // the number of levels to search (MESSAGE_TASK)
+  int32_t alpha, beta; // the search window (MESSAGE_TASK, MESSAGE_BOUNDS)
+  int32_t value; // the result of the search (MESSAGE_RESULT)
+  int64_t nodes; // the number of nodes searched (MESSAGE_RESULT)
+};
+
+/*
+ * The IterationResult class records one iteration of an iterative deepening
+ * search: the move it chose, and the work done by the end of the iteration.
+ */
+class IterationResult {
+ public:
+  int depth; // the depth of the decision tree searched
+  int move; // the best move, as x * BOARD_SIZE + y
+  int value; // the heuristic score of the best move
+  long nodes; // the number of nodes searched by all iterations so far
+  double seconds; // the time taken by all iterations so far
+};
+
+/*
+ * The SearchWorker class performs the same alpha-beta pruning as
+ * Othello::alpha_beta, depth-first on a board rather than on a prebuilt tree.
+ * In a worker process of a DistributedSearch, it reads tasks from a socket and
+ * writes back their results, and while searching it checks the socket for
+ * tighter windows sent by the coordinator.
+ */
+class SearchWorker {
+ private:
+  int fd; // the worker's end of its socket, or -1 if it has none
+  int32_t task; // the task being searched
+  int shared_alpha, shared_beta; // the latest window sent for the task
+  bool quit; // whether the coordinator has asked the worker to exit
+  long nodes; // the number of nodes searched for the task so far
+  long node_limit; // if positive, the search stops after this many nodes
+  atomic<bool>* stop_flag; // if not NULL, the search stops once this is set
+  bool aborted; // whether the search stopped early
+  GameBoard scratch; // used to generate moves from a board
+
+  void poll_bounds();
+
+ public:
+  // constructor
+  SearchWorker(int);
+
+  // See DistributedSearch.cpp for descriptions.
+  void run();
+  int search(uint64_t, uint64_t, int, int, int, int);
+  int search_root(uint64_t, uint64_t, int, int, int*);
+  void set_node_limit(long);
+  void set_stop_flag(atomic<bool>*);
+  bool is_aborted();
+  long get_nodes();
+};
+
+/*
+ * The RootTask class is a unit of work handed to a worker by a
+ * DistributedSearch: either a whole root move, or one reply to a root move that
+ * has been split.
+ */
+class RootTask {
+ public:
+  int move; // the index of the root move the task belongs to
+  bool is_reply; // whether the task is a reply to a split root move
+  uint64_t black, white; // the board to search
+  int alpha, beta; // the window most recently sent for the task
+};
+
+/*
+ * The DistributedSearch class chooses moves by dividing the root moves of a
+ * search among worker processes, each running a SearchWorker, which are
+ * connected to this process by local sockets.  The workers are forked when the
+ * search is created and run until it is destroyed.
+ */
+class DistributedSearch {
+ private:
+  vector<pid_t> pids; // the process ID of each worker
+  vector<int> fds; // this process's end of each worker's socket
+  long nodes; // the number of nodes searched by the last call to choose_move
+
+  void stop_workers();
+
+ public:
+  // constructor and destructor
+  DistributedSearch(int);
+  ~DistributedSearch();
+
+  // See DistributedSearch.cpp for descriptions.
+  bool choose_move(GameBoard*, int, int, int*, int*);
+  int num_workers();
+  long get_nodes();
+};
+
+/*
+ * The SolvedEntry class is an entry of a SolvedDB: a position in canonical
+ * form (see Symmetry::canonicalize), the player to move, and the result of
+ * solving it.  Its layout is that of the database files.
+ */
+class SolvedEntry {
+ public:
+  uint64_t black, white; // the pieces of the canonical position
+  uint8_t color; // the player whose turn it is
+  int8_t score; // the exact final score with best play; positive if black wins
+  uint8_t move; // the best move, as x * BOARD_SIZE + y in the canonical
+                // position, or NO_MOVE if the player must pass
+  uint8_t padding[5];
+};
+
+/*
+ * The SolvedDB class is a persistent database of solved positions, shared by
+ * every engine process that opens it.  It consists of a sorted file, which is
+ * memory-mapped read-only and searched by binary search, and a log to which
+ * newly solved positions are appended.  Compaction merges the log into a new
+ * sorted file, which replaces the old one by renaming, so readers never need
+ * to lock either file; they map the new file the next time they look up a
+ * position.
+ */
+class SolvedDB {
+ private:
+  unsigned char* data; // the mapped sorted file
+  size_t length; // the length of the sorted file in bytes
+  SolvedEntry* entries; // the sorted entries, within data
+  size_t num_entries;
+  dev_t mapped_dev; // the device and inode of the mapped sorted file
+  ino_t mapped_ino;
+  string path; // the path of the sorted file
+  int log_fd; // the log, opened for appending
+  vector<SolvedEntry> appended; // entries appended by this process
+
+  long map_sorted();
+  void refresh();
+  bool append_to_log(const SolvedEntry&);
+
+ public:
+  // constructor and destructor
+  SolvedDB();
+  ~SolvedDB();
+
+  // See SolvedDB.cpp for descriptions.
+  static bool is_before(const SolvedEntry&, const SolvedEntry&);
+  static string log_name(const char*);
+  long open_db(const char*);
+  bool lookup(uint64_t, uint64_t, int, int*, int*);
+  bool insert(uint64_t, uint64_t, int, int, int);
+  static long compact(const char*);
+  size_t size();
+};
+
+/*
+ * The Endgame class contains functions for solving positions near the end of
+ * the game exactly: rather than estimating the score with a heuristic, they
+ * search every line of play to the end of the game, including passes, and
+ * return the final difference in the number of pieces.  Positions are handled
+ * as pairs of 64-bit boards (see GameBoard::to_bitboards), and moves are
+ * generated and played with whole-board bitwise operations.
+ */
+class Endgame {
+ public:
+  // See Endgame.cpp for descriptions.
+  static uint64_t shift(uint64_t, int);
+  static uint64_t legal_moves(uint64_t, uint64_t);
+  static uint64_t flips(uint64_t, uint64_t, int);
+  static int solve(uint64_t, uint64_t, int, int, int, bool, int*, long*);
+  static bool choose_move(GameBoard*, int, SolvedDB*, int*, int*);
+};
+
+/*
+ * The TraceEvent class is an event recorded by SearchTrace.
+ */
+class TraceEvent {
+ public:
+  int64_t time; // nanoseconds since the trace was started
+  int64_t duration; // the length of an 'X' event, in nanoseconds
+  const char* name; // a string literal naming the event
+  char phase; // 'X' is a complete span, and 'i' marks an instant
+  int32_t tid; // the timeline on which the event is shown
+  int64_t arg; // a number describing the event
+};
+
+/*
+ * The TraceBuffer class is a ring buffer of the most recent TRACE_BUFFER_SIZE
+ * events recorded by one thread.  Only the thread that owns the buffer writes
+ * to it, so no locking is needed; events are published to readers by the
+ * release store of count.
+ */
+class TraceBuffer {
+ public:
+  TraceEvent events[TRACE_BUFFER_SIZE];
+  atomic<uint64_t> count; // the number of events ever written
+  uint64_t dumped; // the number of events already written to the trace file
+  atomic<bool> in_use; // whether a running thread owns the buffer
+  int32_t tid; // the timeline of the thread that owns the buffer
+  TraceBuffer* next; // the next buffer in SearchTrace's list
+};
+
+/*
+ * The TraceBufferOwner class holds a thread's trace buffer, and gives it back
+ * when the thread exits so that threads started later can reuse it.
+ */
+class TraceBufferOwner {
+ public:
+  TraceBuffer* buffer;
+
+  ~TraceBufferOwner();
+};
+
+/*
+ * The SearchTrace class records a timeline of what each thread of a search is
+ * doing, and writes it to a file in the Chrome trace event format, which can be
+ * viewed in chrome://tracing or Perfetto.  Recording an event costs a few
+ * stores into the calling thread's own buffer, and nothing beyond a check of a
+ * flag while tracing is off.
+ */
+class SearchTrace {
+ private:
+  static atomic<bool> enabled; // whether events are being recorded
+  static FILE* file; // the trace file
+  static bool first_event; // whether no event has been written to file yet
+  static atomic<TraceBuffer*> buffers; // every buffer created, newest first
+  static atomic<int32_t> next_tid; // the timeline for the next new buffer
+  static chrono::steady_clock::time_point epoch; // when tracing started
+
+  static TraceBuffer* claim_buffer();
+
+ public:
+  // See SearchTrace.cpp for descriptions.
+  static bool start(const char*);
+  static void stop();
+  static bool is_enabled();
+  static void record(const char*, char, int64_t);
+  static void record_for(int32_t, const char*, char, int64_t);
+  static int64_t now();
+  static void record_span(int32_t, const char*, int64_t, int64_t);
+  static void dump();
+};
+
+/*
+ * The TraceSpan class records a span of a SearchTrace covering its own
+ * lifetime, so that a span is ended however the enclosing block is left.
+ */
+class TraceSpan {
+ private:
+  const char* name;
+  int64_t arg;
+  int64_t start; // when the span began, from SearchTrace::now
+
+ public:
+  // constructor and destructor
+  TraceSpan(const char*, int64_t);
+  ~TraceSpan();
+};
+
 /*
  * This class contains functions that will be necessary for the playing of the
  * game that aren't relevant to the TreeNodes or GameBoards specifically.
@@ -75,15 +704,97 @@ class TreeNode {
 class Othello {
  private:
   static int our_color; // the color of the program; 1 is white, 2 is black
+  static int square_weights[NUM_SQUARE_CLASSES]; // heuristic value of a piece
+                                                 // in each class of space
+  static GameLog* game_log; // if not NULL, every turn is recorded here
+  static ArenaTree* arena; // if not NULL, take_turn builds its trees here
+  static DistributedSearch* distributed; // if not NULL, take_turn searches
+                                         // with these workers
+  static int endgame_empties; // positions with at most this many empty
+                              // spaces are solved exactly; 0 turns this off
+  static SolvedDB* solved_db; // if not NULL, consulted by the endgame solver
+  static long node_budget; // if positive, take_turn searches exactly this many
+                           // nodes per move, deepening iteratively
 
  public:
   // See Othello.cpp for descriptions.
   static bool take_turn(int, GameBoard*, int, bool*);
+  static bool choose_move(int, GameBoard*, int, int*, int*);
   static void set_color(int);
   static int get_color();
+  static void set_game_log(GameLog*);
+  static void set_arena(ArenaTree*);
+  static void set_distributed(DistributedSearch*);
+  static void set_endgame(int);
+  static void set_solved_db(SolvedDB*);
+  static void set_node_budget(long);
+  static bool search_with_budget(GameBoard*, int, int, long, int*, int*,
+                                 vector<IterationResult>*, long*);
+  static int iterative_deepening(uint64_t, uint64_t, int, int, SearchWorker*,
+                                 function<void(const IterationResult&)>);
+  static int play_random_turns(GameBoard*, int);
   static void create_decision_tree(TreeNode*, int);
   static int alpha_beta(TreeNode*, int, int);
-  static bool is_corner(int, int);
-  static bool is_next_to_corner(int, int);
-  static bool is_side(int, int);
+  static bool is_corner(int, int, int);
+  static bool is_next_to_corner(int, int, int);
+  static bool is_side(int, int, int);
+  static int square_class(int, int, int);
+  static int get_square_weight(int);
+  static bool load_weights(const char*);
+};
+
+/*
+ * The AsyncSearch class runs an iterative deepening search on a thread of its
+ * own, so that the engine can be embedded in a program that cannot block on a
+ * search, such as a game server.  It reports each finished iteration through a
+ * callback, delivers the final result through a future, and can be stopped at
+ * any time.  It does no console I/O.
+ */
+class AsyncSearch {
+ private:
+  thread searcher; // the thread running the search, if one has been started
+  atomic<bool> stop_requested; // checked by the search at every node
+  promise<IterationResult> result; // fulfilled when the search finishes
+  function<void(const IterationResult&)> progress; // called per iteration
+
+  void run(uint64_t, uint64_t, int, int, long);
+
+ public:
+  // constructor and destructor
+  AsyncSearch();
+  ~AsyncSearch();
+
+  // See AsyncSearch.cpp for descriptions.
+  future<IterationResult> start(GameBoard*, int, int, long,
+                                function<void(const IterationResult&)>);
+  void request_stop();
+  void stop();
+};
+
+/*
+ * The Tuner class fits the square weights used by weighted_score_of_board to a
+ * collection of labeled positions.  Positions are stored as a
+ * structure-of-arrays feature matrix: for each class of space there is one
+ * contiguous column holding, for every position, the number of black pieces in
+ * that class minus the number of white pieces in that class.
+ */
+class Tuner {
+ private:
+  size_t num_positions;
+  int num_features; // the number of classes that some space of the board is in
+  int feature_class[NUM_SQUARE_CLASSES]; // the class of each feature column
+  vector<float> features[NUM_SQUARE_CLASSES]; // one column per class of space
+  vector<float> labels; // 1 if black won, 0.5 for a tie, 0 if white won
+  double weights[NUM_SQUARE_CLASSES]; // the weight of each feature column
+
+ public:
+  Tuner();
+
+  // See Tuner.cpp for descriptions.
+  long load_positions(const char*);
+  static void evaluate_batch(const float* const*, const double*, int, size_t,
+                             float*);
+  double fit(int, double, int);
+  bool write_weights(const char*);
+  size_t get_num_positions();
 };
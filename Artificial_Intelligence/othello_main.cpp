@@ -5,36 +5,182 @@
  */
 int main(int argc, char **argv) {
 
+  // Handle command-line options.  Options that select a non-interactive mode
+  // run that mode and return; all others configure the game that follows.
+  char* log_filename = NULL;
+  ArenaTree* arena = NULL;
+  int num_workers = 0;
+  SolvedDB* solved_db = NULL;
+  int endgame_empties = -1;
+  for (int i = 1; i < argc; ++i) {
+    string option = argv[i];
+    if ((option == "--weights") && (i + 1 < argc)) {
+      if (!Othello::load_weights(argv[++i])) {
+        cerr << "Could not load weights from " << argv[i] << "\n";
+        return 1;
+      }
+    }
+    else if ((option == "--nnue") && (i + 1 < argc)) {
+      if (!NNUE::load(argv[++i])) {
+        cerr << "Could not load network from " << argv[i] << "\n";
+        return 1;
+      }
+    }
+    else if (option == "--arena") {
+      if (arena == NULL) arena = new ArenaTree;
+      Othello::set_arena(arena);
+    }
+    else if ((option == "--log") && (i + 1 < argc)) {
+      log_filename = argv[++i];
+    }
+    else if ((option == "--trace") && (i + 1 < argc)) {
+      if (!SearchTrace::start(argv[++i])) {
+        cerr << "Could not create trace file " << argv[i] << "\n";
+        return 1;
+      }
+    }
+    else if ((option == "--endgame") && (i + 1 < argc)) {
+      endgame_empties = atoi(argv[++i]);
+    }
+    else if ((option == "--db") && (i + 1 < argc)) {
+      if (solved_db == NULL) solved_db = new SolvedDB;
+      if (solved_db->open_db(argv[++i]) < 0) {
+        cerr << "Could not open database " << argv[i] << "\n";
+        delete solved_db;
+        return 1;
+      }
+      Othello::set_solved_db(solved_db);
+    }
+    else if (option == "--compact-db") {
+      return compact_database(argc - i - 1, argv + i + 1);
+    }
+    else if ((option == "--nodes") && (i + 1 < argc)) {
+      Othello::set_node_budget(atol(argv[++i]));
+    }
+    else if (option == "--bench") {
+      return benchmark_search(argc - i - 1, argv + i + 1);
+    }
+    else if ((option == "--flips") && (i + 1 < argc)) {
+      string method = argv[++i];
+      if ((method != "table") && (method != "scan")) {
+        cerr << "Unrecognized flip method: " << method << "\n";
+        return 1;
+      }
+      GameBoard::set_flip_method((method == "table") ? FLIP_TABLE :
+                                 FLIP_SCAN);
+    }
+    else if (option == "--train") {
+      return train_engine(argc - i - 1, argv + i + 1);
+    }
+    else if (option == "--check-flips") {
+      return check_flips(argc - i - 1, argv + i + 1);
+    }
+    else if (option == "--check-async") {
+      return check_async(argc - i - 1, argv + i + 1);
+    }
+    else if ((option == "--workers") && (i + 1 < argc)) {
+      num_workers = atoi(argv[++i]);
+    }
+    else if (option == "--tune") {
+      return tune_weights(argc - i - 1, argv + i + 1);
+    }
+    else if (option == "--replay") {
+      return replay_games(argc - i - 1, argv + i + 1);
+    }
+    else if (option == "--nnue-bench") {
+      return benchmark_nnue(argc - i - 1, argv + i + 1);
+    }
+    else if (option == "--analyze") {
+      return analyze_position(argc - i - 1, argv + i + 1);
+    }
+    else if (option == "--variant") {
+      return play_variant(argc - i - 1, argv + i + 1);
+    }
+    else if (option == "--variant-bench") {
+      return benchmark_variants(argc - i - 1, argv + i + 1);
+    }
+    else if (option == "--distributed-bench") {
+      return benchmark_distributed(argc - i - 1, argv + i + 1);
+    }
+    else {
+      cerr << "Unrecognized option: " << option << "\n";
+      return 1;
+    }
+  }
+
+  // The database is only consulted by the endgame solver, so giving one turns
+  // the solver on unless told otherwise.
+  if (endgame_empties < 0) {
+    endgame_empties = (solved_db != NULL) ? ENDGAME_DEFAULT_EMPTIES : 0;
+  }
+  Othello::set_endgame(endgame_empties);
+
   // Parse input line.
   int our_color, depth_limit;
   parse_initial_input(&our_color, &depth_limit);
   Othello::set_color(our_color);
   bool isDepthLimited = (depth_limit <= 0);
 
-  // Create and initialize the main game board.
+  // If requested, record the game in a game log.
+  GameLog* game_log = NULL;
+  if (log_filename != NULL) {
+    game_log = new GameLog(log_filename, our_color);
+    if (!game_log->is_open()) {
+      cerr << "Could not open game log " << log_filename << "\n";
+      delete game_log;
+      return 1;
+    }
+    Othello::set_game_log(game_log);
+  }
+
+  // If requested, divide searches among worker processes.  They are started
+  // only now, so that they share the weights and network loaded above.
+  DistributedSearch* distributed = NULL;
+  if (num_workers > 0) {
+    distributed = new DistributedSearch(num_workers);
+    Othello::set_distributed(distributed);
+  }
+
+  // Create and initialize the main game board.  If a network was loaded, the
+  // board (and every board copied from it) uses the neural evaluator.
   GameBoard* game_board = new GameBoard;
+  if (NNUE::is_loaded()) game_board->attach_accumulator();
 
   // Main turn-taking loop.  If there is ever a situation in which neither player
   // can make a move, the game is over.
   bool blackPassed = false, whitePassed = false;
   bool forfeit = false;
+  // If a trace is being recorded, each turn is written to it as soon as the
+  // turn is over.
   while (true) {
     blackPassed = Othello::take_turn(2, game_board, depth_limit, &forfeit);
+    SearchTrace::dump();
     if ((blackPassed && whitePassed) || forfeit) break;
     whitePassed = Othello::take_turn(1, game_board, depth_limit, &forfeit);
+    SearchTrace::dump();
     if ((blackPassed && whitePassed) || forfeit) break;
   }
 
+  // Record the finished game.
+  int score = game_board->raw_score_of_board();
+  if (game_log != NULL) {
+    game_log->finish(score, forfeit);
+    Othello::set_game_log(NULL);
+    delete game_log;
+  }
+
   // This occurs if the user input an illegal move.
   if (forfeit) {
     cout << "That's not a legal move!  I win by forfeit!\n";
     delete game_board;
+    if (arena != NULL) delete arena;
+    if (distributed != NULL) delete distributed;
+    if (solved_db != NULL) delete solved_db;
     return 0;
   }
   
   // Once the game is over, display the results.
   cout << "The game is over!\n";
-  int score = game_board->raw_score_of_board();
   if (score == 0) {
     cout << "It's a tie!\n";
   }
@@ -47,6 +193,9 @@ int main(int argc, char **argv) {
 
   // Delete main game board.
   delete game_board;
+  if (arena != NULL) delete arena;
+  if (distributed != NULL) delete distributed;
+  if (solved_db != NULL) delete solved_db;
 
   return 0;
 }
@@ -90,3 +239,904 @@ void parse_initial_input(int* our_color, int* depth_limit) {
   cin >> *depth_limit;
   return;
 }
+
+
+/*
+ * Function: tune_weights
+ *
+ * Description: This function implements the --tune mode, which fits the square
+ *              weights to a file of labeled positions (see
+ *              Tuner::load_positions) and writes them to a weight file that can
+ *              be passed back to the program with --weights.
+ *
+ * Inputs:
+ *  - argc: The number of arguments following --tune.
+ *  - argv: The arguments following --tune: the positions file, the output
+ *          weight file, and optionally the number of iterations and the number
+ *          of threads.
+ *
+ * Return value: The exit status for the program.
+ */
+int tune_weights(int argc, char** argv) {
+  if (argc < 2) {
+    cerr << "Usage: othello --tune <positions> <weights> [iterations] " <<
+      "[threads]\n";
+    return 1;
+  }
+  int iterations = (argc > 2) ? atoi(argv[2]) : 1000;
+  int num_threads = (argc > 3) ? atoi(argv[3]) : 0;
+
+  Tuner tuner;
+  if (tuner.load_positions(argv[0]) < 0) {
+    cerr << "Could not read positions from " << argv[0] << "\n";
+    return 1;
+  }
+  cout << "Loaded " << tuner.get_num_positions() << " positions.\n";
+
+  double loss = tuner.fit(iterations, 0.01, num_threads);
+  if (loss < 0) {
+    cerr << "No positions to tune on!\n";
+    return 1;
+  }
+  cout << "Final loss: " << loss << "\n";
+
+  if (!tuner.write_weights(argv[1])) {
+    cerr << "Could not write weights to " << argv[1] << "\n";
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Function: replay_games
+ *
+ * Description: This function implements the --replay mode, which replays every
+ *              game in a game log (see GameLog.cpp), checks that each is legal
+ *              and ends with the recorded score, and reports how quickly this
+ *              was done.  If a positions file is given, every position reached
+ *              in a game that was not forfeited is written to it in the format
+ *              read by the --tune mode, labeled with the result of the game.
+ *
+ * Inputs:
+ *  - argc: The number of arguments following --replay.
+ *  - argv: The arguments following --replay: the game log, and optionally the
+ *          positions file to write.
+ *
+ * Return value: The exit status for the program.
+ */
+int replay_games(int argc, char** argv) {
+  if (argc < 1) {
+    cerr << "Usage: othello --replay <game log> [positions]\n";
+    return 1;
+  }
+  FILE* positions = NULL;
+  if (argc > 1) {
+    positions = fopen(argv[1], "w");
+    if (positions == NULL) {
+      cerr << "Could not open " << argv[1] << "\n";
+      return 1;
+    }
+  }
+
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  GameLogReader reader;
+  if (reader.open_log(argv[0]) < 0) {
+    cerr << "Could not read game log " << argv[0] << "\n";
+    if (positions != NULL) fclose(positions);
+    return 1;
+  }
+
+  long turns = 0, illegal = 0, mismatched = 0;
+  char position[BOARD_SIZE * BOARD_SIZE + 1];
+  for (size_t game = 0; game < reader.num_games(); ++game) {
+    GameBoard board;
+    bool write_positions = (positions != NULL) && !reader.is_forfeit(game);
+    int result = reader.get_result(game);
+    int label = (result > 0) ? 1 : ((result < 0) ? -1 : 0);
+    bool legal = true;
+    for (int t = 0; legal && (t < reader.num_turns(game)); ++t) {
+      legal = reader.apply_turn(game, t, &board);
+      if (legal && write_positions) {
+        board.save_position(position);
+        fprintf(positions, "%s %d\n", position, label);
+      }
+    }
+    turns += reader.num_turns(game);
+    if (!legal) ++illegal;
+    else if (board.raw_score_of_board() != result) ++mismatched;
+  }
+  chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+  if (positions != NULL) fclose(positions);
+
+  cout << "Replayed " << reader.num_games() << " games (" << turns <<
+    " turns) in " << elapsed.count() << " seconds.\n";
+  if (elapsed.count() > 0) {
+    cout << (long) (reader.num_games() * 60 / elapsed.count()) <<
+      " games per minute.\n";
+  }
+  if (illegal || mismatched) {
+    cout << illegal << " games contained illegal moves, and " << mismatched <<
+      " games did not end with their recorded score.\n";
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Function: benchmark_nnue
+ *
+ * Description: This function implements the --nnue-bench mode, which loads a
+ *              network and measures how many evaluations per second can be
+ *              done by weighted_score_of_board and by the neural evaluator, on
+ *              positions generated by random play.  For the neural evaluator,
+ *              both the incremental case (accumulator already up to date, as in
+ *              search) and the from-scratch case are measured.
+ *
+ * Inputs:
+ *  - argc: The number of arguments following --nnue-bench.
+ *  - argv: The arguments following --nnue-bench: the weight file, and
+ *          optionally the number of positions and the random seed.
+ *
+ * Return value: The exit status for the program.
+ */
+int benchmark_nnue(int argc, char** argv) {
+  if (argc < 1) {
+    cerr << "Usage: othello --nnue-bench <network> [positions] [seed]\n";
+    return 1;
+  }
+  if (!NNUE::load(argv[0])) {
+    cerr << "Could not load network from " << argv[0] << "\n";
+    return 1;
+  }
+  int num_positions = (argc > 1) ? atoi(argv[1]) : 10000;
+  srand((argc > 2) ? atoi(argv[2]) : 1);
+  if (num_positions < 1) num_positions = 1;
+
+  vector<GameBoard*> boards;
+  for (int p = 0; p < num_positions; ++p) {
+    GameBoard* board = new GameBoard;
+    board->attach_accumulator();
+    Othello::play_random_turns(board, rand() % (BOARD_SIZE * BOARD_SIZE - 4));
+    boards.push_back(board);
+  }
+
+  // Each evaluator is run over every position enough times to take a
+  // measurable amount of time; the sum keeps the work from being optimized
+  // away.
+  const int rounds = 100;
+  long checksum = 0;
+  double rates[3];
+  for (int e = 0; e < 3; ++e) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int r = 0; r < rounds; ++r) {
+      for (int p = 0; p < num_positions; ++p) {
+        if (e == 0) checksum += boards[p]->weighted_score_of_board();
+        else if (e == 1) checksum += boards[p]->evaluate();
+        else {
+          boards[p]->attach_accumulator();
+          checksum += boards[p]->evaluate();
+        }
+      }
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    rates[e] = (double) rounds * num_positions / elapsed.count();
+  }
+
+  cout << "Heuristic: " << (long) rates[0] << " evaluations per second.\n";
+  cout << "Network (incremental): " << (long) rates[1] <<
+    " evaluations per second.\n";
+  cout << "Network (from scratch): " << (long) rates[2] <<
+    " evaluations per second.\n";
+  cout << "(checksum " << checksum << ")\n";
+
+  for (int p = 0; p < num_positions; ++p) {
+    delete boards[p];
+  }
+  return 0;
+}
+
+/*
+ * Function: analyze_position
+ *
+ * Description: This function implements the --analyze mode, which prints the
+ *              best moves of a position, ranked, with their exact scores and
+ *              principal variations (see Analysis::multi_pv).
+ *
+ * Inputs:
+ *  - argc: The number of arguments following --analyze.
+ *  - argv: The arguments following --analyze: the position (in the format
+ *          accepted by GameBoard::load_position), the player to move (B or W),
+ *          the maximum depth of the decision tree, the number of moves to
+ *          report, and optionally the number of threads.
+ *
+ * Return value: The exit status for the program.
+ */
+int analyze_position(int argc, char** argv) {
+  if (argc < 4) {
+    cerr << "Usage: othello --analyze <position> <B|W> <depth> <moves> " <<
+      "[threads]\n";
+    return 1;
+  }
+  GameBoard board;
+  if ((strlen(argv[0]) != BOARD_SIZE * BOARD_SIZE) ||
+      !board.load_position(argv[0])) {
+    cerr << "Not a valid position: " << argv[0] << "\n";
+    return 1;
+  }
+  int color = (argv[1][0] == 'B') ? 2 : 1;
+  int depth_limit = atoi(argv[2]);
+  int num_lines = atoi(argv[3]);
+  int num_threads = (argc > 4) ? atoi(argv[4]) : 0;
+
+  TranspositionTable table(1 << 20);
+  vector<PVLine> lines;
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  Analysis::multi_pv(&board, color, depth_limit, num_lines, num_threads,
+                     &table, &lines);
+  chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+  if (lines.empty()) {
+    cout << "No legal moves.\n";
+    return 0;
+  }
+  for (size_t l = 0; l < lines.size(); ++l) {
+    cout << l + 1 << ". (" << lines[l].moves[0] / BOARD_SIZE << ", " <<
+      lines[l].moves[0] % BOARD_SIZE << ") score " << lines[l].value << ":";
+    for (size_t m = 0; m < lines[l].moves.size(); ++m) {
+      cout << " (" << lines[l].moves[m] / BOARD_SIZE << ", " <<
+        lines[l].moves[m] % BOARD_SIZE << ")";
+    }
+    cout << "\n";
+  }
+  cout << "Analyzed in " << elapsed.count() << " seconds.\n";
+  return 0;
+}
+
+// Helper function for benchmark_variants.  Picks a legal move uniformly at
+// random with rand(), returning it as a bit index, or -1 if there is none.
+static int random_wide_move(WideBoard* board, int color) {
+  WideBits moves = board->legal_moves(color);
+  int num_moves = moves.count();
+  if (num_moves == 0) return -1;
+  for (int skip = rand() % num_moves; skip > 0; --skip) {
+    int space = moves.first();
+    moves.words[space / 64] &= ~((uint64_t) 1 << (space % 64));
+  }
+  return moves.first();
+}
+
+// Helper function for benchmark_variants.  Returns true if an 8 by 8 WideBoard
+// holds the same pieces as a GameBoard, gives a player the same legal moves,
+// and scores the same.
+static bool boards_agree(GameBoard* board, WideBoard* wide, int color) {
+  WideBits moves = wide->legal_moves(color);
+  for (int x = 0; x < BOARD_SIZE; ++x) {
+    for (int y = 0; y < BOARD_SIZE; ++y) {
+      if ((board->get_space(x, y) != wide->get_space(x, y)) ||
+          (board->is_legal(color, x, y) != moves.test(x * WIDE_MAX_SIZE + y))) {
+        return false;
+      }
+    }
+  }
+  return (board->raw_score_of_board() == wide->raw_score_of_board()) &&
+    (board->weighted_score_of_board() == wide->weighted_score_of_board());
+}
+
+/*
+ * Function: play_variant
+ *
+ * Description: This function implements the --variant mode, in which the
+ *              program plays a game against itself on a board of a given size
+ *              (see WideBoard), printing each move and the result.
+ *
+ * Inputs:
+ *  - argc: The number of arguments following --variant.
+ *  - argv: The arguments following --variant: the size of the board, and the
+ *          number of turns each player looks ahead.
+ *
+ * Return value: The exit status for the program.
+ */
+int play_variant(int argc, char** argv) {
+  if (argc < 2) {
+    cerr << "Usage: othello --variant <board size> <depth>\n";
+    return 1;
+  }
+  int size = atoi(argv[0]);
+  int depth = atoi(argv[1]);
+  if ((size < 4) || (size > WIDE_MAX_SIZE) || (size % 2) || (depth < 1)) {
+    cerr << "The board size must be even and between 4 and " <<
+      WIDE_MAX_SIZE << ", and the depth must be positive.\n";
+    return 1;
+  }
+
+  WideBoard board(size);
+  int color = 2;
+  bool passed = false;
+  long nodes = 0;
+  while (true) {
+    int x, y;
+    if (board.choose_move(color, depth, &x, &y, &nodes)) {
+      board.place_piece(color, x, y, true);
+      cout << (color == 2 ? "Black" : "White") << " placed a piece at (" <<
+        x << ", " << y << ").\n";
+      passed = false;
+    }
+    else {
+      cout << (color == 2 ? "Black" : "White") << " passes.\n";
+      if (passed) break;
+      passed = true;
+    }
+    color = 3 - color;
+  }
+
+  int score = board.raw_score_of_board();
+  if (score == 0) cout << "It's a tie!\n";
+  else if (score > 0) cout << "Black wins by " << score << " points!\n";
+  else cout << "White wins by " << -score << " points!\n";
+  return 0;
+}
+
+/*
+ * Function: benchmark_variants
+ *
+ * Description: This function implements the --variant-bench mode, which
+ *              measures, for each supported board size, how many turns per
+ *              second WideBoard can generate and play in random games, and how
+ *              many positions per second it can search.  For comparison, the
+ *              rate of random play on a GameBoard is measured as well.  First,
+ *              the same random games are played on an 8 by 8 WideBoard and a
+ *              GameBoard, which must agree on the pieces, the legal moves and
+ *              the scores after every turn.
+ *
+ * Inputs:
+ *  - argc: The number of arguments following --variant-bench.
+ *  - argv: The arguments following --variant-bench: optionally the search
+ *          depth, the number of random games per board size, and the random
+ *          seed.
+ *
+ * Return value: The exit status for the program: 0 if the two boards agreed
+ *               throughout, and 1 otherwise.
+ */
+int benchmark_variants(int argc, char** argv) {
+  int depth = (argc > 0) ? atoi(argv[0]) : 4;
+  int num_games = (argc > 1) ? atoi(argv[1]) : 200;
+  srand((argc > 2) ? atoi(argv[2]) : 1);
+  const int sizes[] = {8, 10, 12, 16};
+
+  int agreed = 0;
+  for (int g = 0; g < num_games; ++g) {
+    GameBoard board;
+    WideBoard wide(BOARD_SIZE);
+    int color = 2, passes = 0;
+    bool agree = boards_agree(&board, &wide, color);
+    while (agree && (passes < 2)) {
+      int space = random_wide_move(&wide, color);
+      if (space < 0) ++passes;
+      else {
+        passes = 0;
+        int x = space / WIDE_MAX_SIZE, y = space % WIDE_MAX_SIZE;
+        wide.place_piece(color, x, y, true);
+        board.place_piece(color, x, y, true);
+      }
+      color = 3 - color;
+      agree = boards_agree(&board, &wide, color);
+    }
+    if (agree) ++agreed;
+  }
+  cout << "WideBoard matched GameBoard move for move in " << agreed << " of " <<
+    num_games << " random games.\n";
+
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  long moves = 0;
+  for (int g = 0; g < num_games; ++g) {
+    GameBoard board;
+    int color = 2, passes = 0;
+    while (passes < 2) {
+      int spaces[BOARD_SIZE * BOARD_SIZE];
+      int num_spaces = 0;
+      for (int x = 0; x < BOARD_SIZE; ++x) {
+        for (int y = 0; y < BOARD_SIZE; ++y) {
+          if (board.is_legal(color, x, y)) {
+            spaces[num_spaces++] = x * BOARD_SIZE + y;
+          }
+        }
+      }
+      if (num_spaces == 0) ++passes;
+      else {
+        passes = 0;
+        int space = spaces[rand() % num_spaces];
+        board.place_piece(color, space / BOARD_SIZE, space % BOARD_SIZE, true);
+      }
+      color = 3 - color;
+      ++moves;
+    }
+  }
+  chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+  cout << "GameBoard, size " << BOARD_SIZE << ": " <<
+    (long) (moves / elapsed.count()) << " random turns per second.\n";
+
+  for (int s = 0; s < (int) (sizeof(sizes) / sizeof(sizes[0])); ++s) {
+    int size = sizes[s];
+
+    // Random games, to measure move generation and flipping.
+    start = chrono::steady_clock::now();
+    moves = 0;
+    for (int g = 0; g < num_games; ++g) {
+      WideBoard board(size);
+      int color = 2, passes = 0;
+      while (passes < 2) {
+        int space = random_wide_move(&board, color);
+        if (space < 0) ++passes;
+        else {
+          passes = 0;
+          board.place_piece(color, space / WIDE_MAX_SIZE,
+                            space % WIDE_MAX_SIZE, true);
+        }
+        color = 3 - color;
+        ++moves;
+      }
+    }
+    elapsed = chrono::steady_clock::now() - start;
+    double turn_rate = moves / elapsed.count();
+
+    // Searches from positions a few turns into random games.
+    start = chrono::steady_clock::now();
+    long nodes = 0;
+    for (int p = 0; p < 5; ++p) {
+      WideBoard board(size);
+      int color = 2;
+      for (int t = 0; t < size; ++t) {
+        int space = random_wide_move(&board, color);
+        if (space >= 0) {
+          board.place_piece(color, space / WIDE_MAX_SIZE,
+                            space % WIDE_MAX_SIZE, true);
+        }
+        color = 3 - color;
+      }
+      int x, y;
+      board.choose_move(color, depth, &x, &y, &nodes);
+    }
+    elapsed = chrono::steady_clock::now() - start;
+
+    cout << "WideBoard, size " << size << ": " << (long) turn_rate <<
+      " random turns per second, " << (long) (nodes / elapsed.count()) <<
+      " positions searched per second at depth " << depth << ".\n";
+  }
+  return (agreed == num_games) ? 0 : 1;
+}
+
+/*
+ * Function: benchmark_distributed
+ *
+ * Description: This function implements the --distributed-bench mode, which
+ *              chooses moves for positions taken from random games three ways:
+ *              with an ArenaTree, with a DistributedSearch that has no workers
+ *              (so searches in this process), and with a DistributedSearch
+ *              whose workers are processes on this machine.  It checks that
+ *              all three choose the same moves, and reports how long each took.
+ *
+ * Inputs:
+ *  - argc: The number of arguments following --distributed-bench.
+ *  - argv: The arguments following --distributed-bench: optionally the number
+ *          of worker processes, the depth of the decision tree, the number of
+ *          positions, and the random seed.
+ *
+ * Return value: The exit status for the program: 0 if every move matched, and
+ *               1 otherwise.
+ */
+int benchmark_distributed(int argc, char** argv) {
+  int num_workers = (argc > 0) ? atoi(argv[0]) : 4;
+  int depth_limit = (argc > 1) ? atoi(argv[1]) : 6;
+  int num_positions = (argc > 2) ? atoi(argv[2]) : 10;
+  srand((argc > 3) ? atoi(argv[3]) : 1);
+
+  DistributedSearch local(0);
+  DistributedSearch distributed(num_workers);
+  if (distributed.num_workers() < num_workers) {
+    cerr << "Could only start " << distributed.num_workers() <<
+      " workers.\n";
+  }
+  ArenaTree arena;
+  double arena_time = 0.0, local_time = 0.0, distributed_time = 0.0;
+  long local_nodes = 0, distributed_nodes = 0;
+  int mismatches = 0;
+
+  for (int p = 0; p < num_positions; ++p) {
+    GameBoard board;
+    int color = Othello::play_random_turns(&board, 10 + rand() % 30);
+    if (color == 0) {
+      --p;
+      continue;
+    }
+
+    int x[3] = {-1, -1, -1}, y[3] = {-1, -1, -1};
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    Othello::set_arena(&arena);
+    Othello::choose_move(color, &board, depth_limit, &x[0], &y[0]);
+    Othello::set_arena(NULL);
+    chrono::steady_clock::time_point end = chrono::steady_clock::now();
+    arena_time += chrono::duration<double>(end - start).count();
+
+    start = end;
+    local.choose_move(&board, color, depth_limit, &x[1], &y[1]);
+    end = chrono::steady_clock::now();
+    local_time += chrono::duration<double>(end - start).count();
+    local_nodes += local.get_nodes();
+
+    start = end;
+    distributed.choose_move(&board, color, depth_limit, &x[2], &y[2]);
+    end = chrono::steady_clock::now();
+    distributed_time += chrono::duration<double>(end - start).count();
+    distributed_nodes += distributed.get_nodes();
+
+    if ((x[1] != x[0]) || (y[1] != y[0]) || (x[2] != x[0]) ||
+        (y[2] != y[0])) {
+      ++mismatches;
+      cout << "Position " << p << ": arena chose (" << x[0] << ", " << y[0] <<
+        "), local search chose (" << x[1] << ", " << y[1] <<
+        "), distributed search chose (" << x[2] << ", " << y[2] << ").\n";
+    }
+  }
+
+  cout << "ArenaTree: " << arena_time << " seconds.\n";
+  cout << "Local search: " << local_time << " seconds, " << local_nodes <<
+    " nodes.\n";
+  cout << "Distributed search with " << distributed.num_workers() <<
+    " workers: " << distributed_time << " seconds, " << distributed_nodes <<
+    " nodes, " << local_time / distributed_time << " times as fast.\n";
+  cout << mismatches << " of " << num_positions << " moves differed.\n";
+  return (mismatches == 0) ? 0 : 1;
+}
+
+/*
+ * Function: compact_database
+ *
+ * Description: This function implements the --compact-db mode, which merges the
+ *              log of a database of solved positions into its sorted file (see
+ *              SolvedDB::compact).  Engines may keep reading the database while
+ *              it is compacted.
+ *
+ * Inputs:
+ *  - argc: The number of arguments following --compact-db.
+ *  - argv: The arguments following --compact-db: the path of the database.
+ *
+ * Return value: The exit status for the program.
+ */
+int compact_database(int argc, char** argv) {
+  if (argc < 1) {
+    cerr << "Usage: othello --compact-db <database>\n";
+    return 1;
+  }
+  long count = SolvedDB::compact(argv[0]);
+  if (count < 0) {
+    cerr << "Could not compact database " << argv[0] << "\n";
+    return 1;
+  }
+  cout << "The database now holds " << count << " positions.\n";
+  return 0;
+}
+
+// The positions searched by --bench and --train, taken from random games at
+// various stages, and the player to move in each.
+static const char* bench_positions[] = {
+  "0000000000010000000222000012212000022010000200000000000000000000",
+  "0000000000012000000111000002210000212100001002000000012000000000",
+  "0000000000002210002021000021220011222000202220000020020000000000",
+  "0101200001020000212101000112220001112000010200000111000000000000",
+  "0000000000001200000222202002100002011200021212110102001000111112",
+  "0100122000122200000222100022121000221111000211110002011100000000",
+  "0111020000112110012211002221210201211010122222112000001000000001",
+  "0000000210100020012102000112122101122121001122110202112101110122",
+  "0010000001211102102211210121120022111222011202221122022210120012",
+  "1110200101122001202221112221210021222111111121112022011000002111"
+};
+static const int bench_colors[] = {1, 2, 1, 2, 1, 2, 1, 2, 1, 2};
+
+/*
+ * Function: benchmark_search
+ *
+ * Description: This function implements the --bench mode, which searches a
+ *              fixed suite of positions under a node budget (see
+ *              Othello::search_with_budget) and reports the move chosen for
+ *              each, the total number of nodes searched, the number of nodes
+ *              searched per second, and the average time taken to finish each
+ *              depth.  Since the search is deterministic, the moves and node
+ *              counts are the same for every build of the same engine, and
+ *              differ only if the search itself has changed, so the speeds of
+ *              two builds can be compared directly.
+ *
+ * Inputs:
+ *  - argc: The number of arguments following --bench.
+ *  - argv: The arguments following --bench: optionally the node budget for
+ *          each position, and the deepest iteration allowed.
+ *
+ * Return value: The exit status for the program.
+ */
+int benchmark_search(int argc, char** argv) {
+  long budget = (argc > 0) ? atol(argv[0]) : 1000000;
+  int depth_limit = (argc > 1) ? atoi(argv[1]) : 0;
+  if (budget <= 0) {
+    cerr << "Usage: othello --bench [nodes] [depth]\n";
+    return 1;
+  }
+
+  int num_positions = sizeof(bench_positions) / sizeof(bench_positions[0]);
+  long total_nodes = 0;
+  double total_seconds = 0.0;
+  vector<double> depth_seconds; // summed over the positions reaching a depth
+  vector<int> depth_counts;
+  for (int p = 0; p < num_positions; ++p) {
+    GameBoard board;
+    board.load_position(bench_positions[p]);
+    if (NNUE::is_loaded()) board.attach_accumulator();
+    vector<IterationResult> iterations;
+    int x = -1, y = -1;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    long nodes = 0;
+    Othello::search_with_budget(&board, bench_colors[p], depth_limit, budget,
+                                &x, &y, &iterations, &nodes);
+    double seconds =
+      chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    // The nodes of an iteration cut short by the budget are counted, as its
+    // time is, although it does not appear among the iterations.
+    int depth = iterations.empty() ? 0 : iterations.back().depth;
+    for (size_t k = 0; k < iterations.size(); ++k) {
+      if ((int) depth_seconds.size() < iterations[k].depth) {
+        depth_seconds.resize(iterations[k].depth, 0.0);
+        depth_counts.resize(iterations[k].depth, 0);
+      }
+      depth_seconds[iterations[k].depth - 1] += iterations[k].seconds;
+      ++depth_counts[iterations[k].depth - 1];
+    }
+    total_nodes += nodes;
+    total_seconds += seconds;
+    cout << "Position " << p + 1 << ": (" << x << ", " << y << ") at depth " <<
+      depth << ", " << nodes << " nodes, " << seconds << " seconds.\n";
+  }
+
+  cout << "Nodes searched: " << total_nodes << "\n";
+  cout << "Nodes per second: " << (long) (total_nodes / total_seconds) << "\n";
+  for (size_t d = 0; d < depth_seconds.size(); ++d) {
+    cout << "Depth " << d + 1 << ": " << depth_seconds[d] / depth_counts[d] <<
+      " seconds on average, reached in " << depth_counts[d] << " of " <<
+      num_positions << " positions.\n";
+  }
+  return 0;
+}
+
+/*
+ * Function: check_flips
+ *
+ * Description: This function implements the --check-flips mode, which checks
+ *              that the two flip methods (see GameBoard::set_flip_method) agree
+ *              and measures how fast each is.  In positions generated by
+ *              random play, every empty space is tried as a move by each player
+ *              with each method.  The methods must agree on whether
+ *              the move is legal and on the board that results, and the table
+ *              method's copy of the board as 64-bit boards must match the board
+ *              itself.
+ *
+ * Inputs:
+ *  - argc: The number of arguments following --check-flips.
+ *  - argv: The arguments following --check-flips: optionally the number of
+ *          positions and the random seed.
+ *
+ * Return value: The exit status for the program.
+ */
+int check_flips(int argc, char** argv) {
+  int num_positions = (argc > 0) ? atoi(argv[0]) : 10000;
+  srand((argc > 1) ? atoi(argv[1]) : 1);
+  if (num_positions < 1) num_positions = 1;
+  int method = GameBoard::get_flip_method();
+
+  // The positions are generated with the scanner, so that a fault in the
+  // tables cannot affect which positions are checked.
+  GameBoard::set_flip_method(FLIP_SCAN);
+  vector<GameBoard*> boards;
+  for (int p = 0; p < num_positions; ++p) {
+    GameBoard* board = new GameBoard;
+    Othello::play_random_turns(board, rand() % (BOARD_SIZE * BOARD_SIZE - 4));
+    boards.push_back(board);
+  }
+
+  long moves = 0, mismatches = 0;
+  for (size_t p = 0; p < boards.size(); ++p) {
+    for (int square = 0; square < BOARD_SIZE * BOARD_SIZE; ++square) {
+      int x = square / BOARD_SIZE, y = square % BOARD_SIZE;
+      if (boards[p]->get_space(x, y) != 0) continue;
+      for (int color = 1; color <= 2; ++color) {
+        GameBoard scanned(*boards[p]), looked_up(*boards[p]);
+        GameBoard::set_flip_method(FLIP_SCAN);
+        bool scan_legal = scanned.place_piece(color, x, y, true);
+        GameBoard::set_flip_method(FLIP_TABLE);
+        bool table_legal = looked_up.place_piece(color, x, y, true);
+
+        char scanned_position[BOARD_SIZE * BOARD_SIZE + 1];
+        char table_position[BOARD_SIZE * BOARD_SIZE + 1];
+        scanned.save_position(scanned_position);
+        looked_up.save_position(table_position);
+        GameBoard reloaded;
+        reloaded.load_position(table_position);
+        uint64_t black, white, reloaded_black, reloaded_white;
+        looked_up.to_bitboards(&black, &white);
+        reloaded.to_bitboards(&reloaded_black, &reloaded_white);
+        ++moves;
+        if ((scan_legal != table_legal) ||
+            (strcmp(scanned_position, table_position) != 0) ||
+            (black != reloaded_black) || (white != reloaded_white)) {
+          if (mismatches == 0) {
+            cout << "Methods disagree on move (" << x << ", " << y <<
+              ") by " << ((color == 2) ? "black" : "white") << " in " <<
+              scanned_position << "\n";
+          }
+          ++mismatches;
+        }
+      }
+    }
+  }
+
+  // Each method is timed over the same moves, without copying boards; the
+  // count of legal moves keeps the work from being optimized away.
+  const int rounds = 10;
+  double seconds[2];
+  long legal[2] = {0, 0};
+  for (int m = 0; m < 2; ++m) {
+    GameBoard::set_flip_method((m == 0) ? FLIP_SCAN : FLIP_TABLE);
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int r = 0; r < rounds; ++r) {
+      for (size_t p = 0; p < boards.size(); ++p) {
+        for (int x = 0; x < BOARD_SIZE; ++x) {
+          for (int y = 0; y < BOARD_SIZE; ++y) {
+            legal[m] += boards[p]->is_legal(2, x, y);
+            legal[m] += boards[p]->is_legal(1, x, y);
+          }
+        }
+      }
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    seconds[m] = elapsed.count();
+  }
+  GameBoard::set_flip_method(method);
+
+  cout << "Checked " << moves << " moves in " << boards.size() <<
+    " positions: " << mismatches << " mismatches.\n";
+  double tests = (double) rounds * boards.size() * BOARD_SIZE * BOARD_SIZE * 2;
+  cout << "Scan: " << (long) (tests / seconds[0]) <<
+    " legality tests per second.\n";
+  cout << "Table: " << (long) (tests / seconds[1]) <<
+    " legality tests per second.\n";
+
+  for (size_t p = 0; p < boards.size(); ++p) {
+    delete boards[p];
+  }
+  return (mismatches == 0) ? 0 : 1;
+}
+
+/*
+ * Function: check_async
+ *
+ * Description: This function implements the --check-async mode, which checks
+ *              that a search run by an AsyncSearch can be followed and
+ *              stopped.  Each position of the --bench suite is searched with
+ *              no limit; the iterations reported through the callback are
+ *              polled until the given number have finished, and the search is
+ *              then stopped.  Its result must be a legal move, and must be the
+ *              move and depth of the last iteration reported.  The time from
+ *              the request to stop until the result is ready is reported for
+ *              each position.
+ *
+ * Inputs:
+ *  - argc: The number of arguments following --check-async.
+ *  - argv: The arguments following --check-async: optionally the number of
+ *          iterations to wait for before stopping each search.
+ *
+ * Return value: The exit status for the program: 0 if every search gave a
+ *               consistent result, and 1 otherwise.
+ */
+int check_async(int argc, char** argv) {
+  int wait_iterations = (argc > 0) ? atoi(argv[0]) : 6;
+  if (wait_iterations < 1) wait_iterations = 1;
+
+  int num_positions = sizeof(bench_positions) / sizeof(bench_positions[0]);
+  int consistent = 0;
+  double longest = 0.0;
+  AsyncSearch search;
+  for (int p = 0; p < num_positions; ++p) {
+    GameBoard board;
+    board.load_position(bench_positions[p]);
+    atomic<int> finished(0), last_depth(0), last_move(-1);
+    auto progress = [&](const IterationResult& iteration) {
+      last_depth.store(iteration.depth);
+      last_move.store(iteration.move);
+      finished.fetch_add(1);
+    };
+    future<IterationResult> result =
+      search.start(&board, bench_colors[p], 0, 0, progress);
+
+    // Poll without blocking on the search, as a game server would.
+    while ((finished.load() < wait_iterations) &&
+           (result.wait_for(chrono::milliseconds(1)) != future_status::ready)) {
+    }
+    chrono::steady_clock::time_point stop_time = chrono::steady_clock::now();
+    search.request_stop();
+    IterationResult final_result = result.get();
+    double latency =
+      chrono::duration<double>(chrono::steady_clock::now() - stop_time).count();
+    search.stop();
+
+    int x = final_result.move / BOARD_SIZE, y = final_result.move % BOARD_SIZE;
+    bool legal = (final_result.move >= 0) &&
+      board.is_legal(bench_colors[p], x, y);
+    if (legal && ((finished.load() == 0) ||
+                  ((final_result.move == last_move.load()) &&
+                   (final_result.depth == last_depth.load())))) {
+      ++consistent;
+    }
+    longest = max(longest, latency);
+    cout << "Position " << p + 1 << ": (" << x << ", " << y << ") at depth " <<
+      final_result.depth << " after " << finished.load() <<
+      " iterations, stopped in " << latency * 1000 << " ms.\n";
+  }
+
+  cout << consistent << " of " << num_positions <<
+    " searches stopped with the result of their last iteration.\n";
+  cout << "Longest time to stop: " << longest * 1000 << " ms.\n";
+  return (consistent == num_positions) ? 0 : 1;
+}
+
+/*
+ * Function: train_engine
+ *
+ * Description: This function implements the --train mode, which searches the
+ *              positions of the --bench suite to a fixed depth with each kind
+ *              of search the program can do: a tree of TreeNodes, an
+ *              ArenaTree, and a SearchWorker.  It is the workload from which
+ *              the profile for the optimized build is recorded (see the
+ *              Makefile), so it needs no input and takes a fixed amount of
+ *              work.  The moves chosen are printed, and should not depend on
+ *              how the program was built.
+ *
+ * Inputs:
+ *  - argc: The number of arguments following --train.
+ *  - argv: The arguments following --train: optionally the depth.
+ *
+ * Return value: The exit status for the program.
+ */
+int train_engine(int argc, char** argv) {
+  int depth = (argc > 0) ? atoi(argv[0]) : 5;
+  if (depth < 1) {
+    cerr << "Usage: othello --train [depth]\n";
+    return 1;
+  }
+
+  int num_positions = sizeof(bench_positions) / sizeof(bench_positions[0]);
+  ArenaTree arena;
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  for (int p = 0; p < num_positions; ++p) {
+    int moves[3][2];
+    for (int s = 0; s < 3; ++s) {
+      GameBoard board;
+      board.load_position(bench_positions[p]);
+      if (NNUE::is_loaded()) board.attach_accumulator();
+      moves[s][0] = moves[s][1] = -1;
+      if (s == 2) {
+        Othello::search_with_budget(&board, bench_colors[p], depth, LONG_MAX,
+                                    &moves[s][0], &moves[s][1], NULL, NULL);
+        continue;
+      }
+      Othello::set_arena((s == 1) ? &arena : NULL);
+      Othello::choose_move(bench_colors[p], &board, depth, &moves[s][0],
+                           &moves[s][1]);
+    }
+    Othello::set_arena(NULL);
+    cout << "Position " << p + 1 << ": (" << moves[0][0] << ", " <<
+      moves[0][1] << ") with TreeNodes, (" << moves[1][0] << ", " <<
+      moves[1][1] << ") with an ArenaTree, (" << moves[2][0] << ", " <<
+      moves[2][1] << ") with a SearchWorker.\n";
+  }
+  chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+  cout << "Trained at depth " << depth << " in " << elapsed.count() <<
+    " seconds.\n";
+  return 0;
+}
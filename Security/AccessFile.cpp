@@ -26,10 +26,11 @@ void AccessFile::determine_blocks(size_t count, long *first, long *last, off_t p
 /*
  * Function: pyramid_close
  *
- * Description: This function closes the file descriptor fd, encrypts the
- *              associated pyramid structure, writes the encrypted pyramid to
- *              the file "[filename]_pyramid", closes this file, and frees the
- *              pyramid.
+ * Description: This function closes the file descriptor fd, flushes the
+ *              changes made to the associated pyramid structure to its journal
+ *              (see flush_journal), and closes the pyramid file and journal.
+ *              A pyramid without a journal is instead written out in full (see
+ *              write_snapshot).
  *
  * Inputs:
  *  fd - The file descriptor of the file you wish to close.
@@ -42,16 +43,16 @@ void AccessFile::determine_blocks(size_t count, long *first, long *last, off_t p
  *  -2 if the attempt to close the pyramid file failed; check errno.
  *  -3 if pyra is NULL.
  *  -4 if pyra is not the top level of its pyramid.
- *  -5 if a call to sizeof_pyramid failed.
- *  -6 if a call to encrypt_pyramid failed.
+ *  -6 if the pyramid could not be encrypted.
  *  -7 if fd is invalid (it's negative, or it's reserved for stdin, stdout, or
  *   stderr).
- *  -8 if a call to snprintf failed.
- *  -9 if a call to open failed; check errno.
- *  -10 if a call to write didn't write as many bytes as was expected.
- *  -11 if a call to sign_pyramid failed.
- *  -12 if a call to ftruncate failed; check errno.
- *  -13 if a call to lseek failed; check errno.
+ *  -10 if the pyramid file could not be written or synced.
+ *  -11 if the pyramid could not be signed.
+ *  -12 if the new copy of the pyramid file could not be created, or could not
+ *   replace the old one; check errno.
+ *  -13 if a level of a lazily opened pyramid could not be loaded.
+ *  -14 if the data file is mapped and a call to msync failed; check errno.
+ *  -15 if the journal could not be written or synced; check errno.
  */
 int AccessFile::pyramid_close(int fd, Pyramid* pyra) {
 
@@ -60,102 +61,125 @@ int AccessFile::pyramid_close(int fd, Pyramid* pyra) {
   if (pyra == NULL) return -3;
   if (pyra->get_level() != 1) return -4;
 
-  // Erase the contents of the current pyramid file.
-  if (ftruncate(pyra->get_pyramid_fd(), 0)) {
-    return -12;
+  // Persist the changes to the pyramid.
+  PyramidJournal *journal = pyra->get_journal();
+  if (journal != NULL) {
+    int flush_return = flush_journal(pyra);
+    if (flush_return < 0) return flush_return;
+    if (fsync(journal->get_journal_fd())) return -15;
+    pyra->set_journal(NULL);
+    delete journal;
   }
-  if (lseek(pyra->get_pyramid_fd(), 0, SEEK_SET)) {
-    return -13;
+  else {
+    unsigned char digest[SIGLEN];
+    int snapshot_return = write_snapshot(pyra, digest);
+    if (snapshot_return < 0) return snapshot_return;
   }
 
-  // Determine how many identifiers are capable of being stored in the input
-  // pyramid, returning immediately in the event of an error in doing so.
-  size_t pyramid_size = pyra->sizeof_pyramid();
-  if (pyramid_size == 0) return -5;
-
-  // Allocate space for the block IDs to be copied from the pyramid and the
-  // encrypted version of the block IDs, based on the size of the pyramid.
-  // Also, allocate space for the randomly generated nonce to be used in the
-  // encryption of the pyramid.
-  long* identifiers = new long[pyramid_size];
-  long* encrypted_identifiers = new long[pyramid_size];
-  unsigned char* nonce = new unsigned char[KEY_LENGTH];
-
-  // Copy the pyramid's block IDs to 'identifiers'.
-  size_t offset = 0L;
-  size_t num_ids = 4L;
-  Pyramid* p = pyra;
-  while (p) {
-    bcopy(p->get_identifiers(), identifiers + offset, sizeof(long) * num_ids);
-    offset += num_ids;
-    num_ids = num_ids << 2;
-    p = p->get_next_level();
+  // Write back the changes made through the mapping, if any, and unmap it.
+  FileMapping *mapping = pyra->get_mapping();
+  if (mapping != NULL) {
+    int sync_return = mapping->sync_file(true);
+    delete mapping;
+    pyra->set_mapping(NULL);
+    if (sync_return < 0) return -14;
   }
-  
-  // Encrypt 'identifiers' and store it in 'encrypted_identifiers', and store
-  // the nonce in 'nonce', while checking for errors.
-  int enc_return = pyra->encrypt_pyramid(identifiers, encrypted_identifiers, (int) (pyramid_size * sizeof(long)), nonce, (long) rand());
-  if (enc_return < 0) {
-    delete[] identifiers;
-    delete[] encrypted_identifiers;
-    delete[] nonce;
-    return -6;
-  }
-
-  // Append nonce to beginning of encrypted pyramid in to_write.
-  unsigned long write_length = KEY_LENGTH + (pyramid_size * sizeof(long)) + SIGLEN;
-  char *to_write = new char[write_length];
-  bcopy(nonce, to_write + SIGLEN, KEY_LENGTH);
-  bcopy(encrypted_identifiers, to_write + SIGLEN + KEY_LENGTH,
-        pyramid_size * sizeof(long));
-
-  // Sign pyramid file.
-  char *sig = new char[SIGLEN];
-  unsigned siglen;
-  if (Pyramid::sign_pyramid(to_write + SIGLEN, write_length - SIGLEN, sig, &siglen)) {
-    delete[] identifiers;
-    delete[] encrypted_identifiers;
-    delete[] nonce;
-    delete[] to_write;
-    delete[] sig;
-    return -11;
-  }
-
-  // Append signature to beginning of nonce and write buffer to file.
-  bcopy(sig, to_write, SIGLEN);
-  if (write(pyra->get_pyramid_fd(), to_write, write_length) < write_length) {
-    delete[] identifiers;
-    delete[] encrypted_identifiers;
-    delete[] nonce;
-    delete[] to_write;
-    delete[] sig;
-    return -10;
-  }
-
-  int file_close_return = close(fd);
-  if (file_close_return) {
-    delete[] identifiers;
-    delete[] encrypted_identifiers;
-    delete[] nonce;
-    delete[] to_write;
-    delete[] sig;
-    return -1;
-  }
-  int pyramid_close_return = close(pyra->get_pyramid_fd());
-  if (pyramid_close_return) {
-    delete[] identifiers;
-    delete[] encrypted_identifiers;
-    delete[] nonce;
-    delete[] to_write;
-    delete[] sig;
-    return -2;
+
+  // No transfer is in flight between calls, so the ring can simply be closed.
+  if (pyra->get_ring() != NULL) {
+    delete pyra->get_ring();
+    pyra->set_ring(NULL);
+  }
+
+  if (close(fd)) return -1;
+  if (close(pyra->get_pyramid_fd())) return -2;
+  return 0;
+}
+
+
+/*
+ * Function: write_snapshot
+ *
+ * Description: This function writes the pyramid structure to the pyramid file
+ *              and syncs it (see PyramidSnapshot::write).  Once the file is in
+ *              the Merkle tree format, only the chunks of the levels that have
+ *              changed since it was last written are rewritten, and a level of
+ *              a lazily opened pyramid that has not been loaded is not loaded:
+ *              only the chunks touched by changes replayed from the journal
+ *              are read, verified and rewritten.  Otherwise the file is
+ *              rewritten whole, and the levels that have not been loaded are
+ *              loaded first.
+ *
+ * Inputs:
+ *  pyra - A pointer to the top level of the pyramid.
+ *
+ * Outputs:
+ *  digest - The HMAC of the header written to the pyramid file, SIGLEN bytes,
+ *   is stored here.
+ *
+ * Return value:
+ *  0 upon success.
+ *  -4 if pyra is not the top level of its pyramid.
+ *  -5 if pyra has no snapshot to write through (see pyramid_open).
+ *  -6 if the identifiers could not be encrypted.
+ *  -10 if a call to pwrite didn't write as many bytes as was expected, or a
+ *   call to fsync failed.
+ *  -11 if the identifiers could not be signed.
+ *  -12 if the new copy of the pyramid file could not be created, or could not
+ *   replace the old one; check errno.
+ *  -13 if a level, or a chunk of one, could not be loaded from the pyramid
+ *   file.
+ */
+int AccessFile::write_snapshot(Pyramid* pyra, unsigned char* digest) {
+  if (pyra->get_level() != 1) return -4;
+
+  PyramidSnapshot *snapshot = pyra->get_snapshot();
+  if (snapshot == NULL) return -5;
+  for (Pyramid *p = pyra; (p != NULL) && snapshot->needs_levels(); p = p->get_next_level()) {
+    if (p->ensure_loaded() < 0) return -13;
+  }
+
+  switch (snapshot->write(pyra)) {
+    case 0: break;
+    case -1: return -6;
+    case -2: return -10;
+    case -3: return -11;
+    case -5: return -13;
+    default: return -12;
   }
+  memcpy(digest, snapshot->get_header_mac(), SIGLEN);
+  return 0;
+}
+
+
+/*
+ * Function: flush_journal
+ *
+ * Description: This function appends the changes made to a pyramid since the
+ *              last flush to its journal.  Once the journal has grown larger
+ *              than the pyramid file, a checkpoint is taken: the pyramid is
+ *              written out in full (see write_snapshot) and the journal is
+ *              emptied.
+ *
+ * Inputs:
+ *  pyra - A pointer to the top level of the pyramid.
+ *
+ * Return value:
+ *  0 upon success, or if the pyramid has no journal.
+ *  -15 if the journal could not be written or emptied; check errno.
+ *  Otherwise, the error returned by write_snapshot.
+ */
+int AccessFile::flush_journal(Pyramid* pyra) {
+  PyramidJournal *journal = pyra->get_journal();
+  if (journal == NULL) return 0;
+  if (journal->flush() < 0) return -15;
+  off_t snapshot_size = PyramidSnapshot::file_size(pyra->how_many_levels());
+  if (journal->get_size() <= snapshot_size) return 0;
 
-  delete[] identifiers;
-  delete[] encrypted_identifiers;
-  delete[] nonce;
-  delete[] to_write;
-  delete[] sig;
+  unsigned char digest[SIGLEN];
+  int snapshot_return = write_snapshot(pyra, digest);
+  if (snapshot_return < 0) return snapshot_return;
+  if (journal->reset(digest) < 0) return -15;
   return 0;
 }
 
@@ -165,9 +189,12 @@ int AccessFile::pyramid_close(int fd, Pyramid* pyra) {
  *
  * Description: This function attempts to open the file referenced by filename
  *              and the associated pyramid file [filename]_pyramid, if it
- *              exists, creating it if it does not exist.  It returns a pointer
- *              to a newly allocated and initialized pyramid object upon
- *              success.
+ *              exists, creating it if it does not exist or is empty.  It
+ *              returns a pointer to a newly allocated and initialized pyramid
+ *              object upon success.  Every level of the pyramid is read from
+ *              the pyramid file and verified before it returns; see
+ *              pyramid_open_lazy to load each level only when it is first
+ *              needed.
  *
  * Inputs:
  *  pathname - The pathname of the file to be passed to open().
@@ -185,14 +212,18 @@ int AccessFile::pyramid_close(int fd, Pyramid* pyra) {
  *   -1 if the attempt to open the file failed; check errno.
  *   -2 if the attempt to open the pyramid file failed; check errno.
  *   -4 if fstat failed; check errno.
- *   -5 if any attempt to add a block ID into the pyramid struct failed.
+ *   -5 if the pyramid of a new file could not be built.
  *   -6 if read returned -1; check errno.
  *   -7 if read didn't return an error, but did read fewer bytes than expected.
- *   -8 if decrypt_pyramid failed.
+ *   -8 if decrypt_pyramid failed, or a level could not be decrypted.
  *   -9 if verify_pyramid indicates that the pyramid file's integrity has been
- *    compromised.
+ *    compromised, or the header or a level of the file does not match its
+ *    HMAC.
  *   -10 if verify_pyramid failed for some other reason.
  *   -11 if fchmod failed; check errno.
+ *   -12 if the journal "[filename]_pyramid_journal" could not be opened.
+ *   -13 if the journal could not be read or replayed.
+ *   -14 if the first snapshot of a new pyramid could not be written.
  *   
  * Return value:
  *  NULL upon failure; check err.
@@ -200,6 +231,153 @@ int AccessFile::pyramid_close(int fd, Pyramid* pyra) {
  *   referenced by pathname.
  */
 Pyramid* AccessFile::pyramid_open(char *pathname, int flags, int* file_fd, int* pyramid_fd, int *err, unsigned char *key) {
+  return open_pyramid(pathname, flags, file_fd, pyramid_fd, err, key, false);
+}
+
+
+/*
+ * Function: pyramid_open_lazy
+ *
+ * Description: This function opens a file and its pyramid as pyramid_open
+ *              does, except that only the header of a pyramid file in the
+ *              Merkle tree format (see PyramidSnapshot.cpp) is read and
+ *              verified before it returns.  An access finds the block it wants
+ *              in a level that has not been loaded from the pyramid file's
+ *              position map, reading and verifying only the chunk of the map
+ *              that holds the block's entry and the chunk of the level that
+ *              holds its slot, and moves it to the top level without loading
+ *              the level (see plan_block).  A level is read, verified against
+ *              its own root and decrypted whole the first time it must be (see
+ *              ensure_loaded): when a block is added to it, as when the level
+ *              above it overflows, or when the file must be rewritten whole.
+ *              An access reads a block chosen from the whole file at any level
+ *              that has not been loaded, so the time to open, and to access a
+ *              block that has not been moved since, grows only with the
+ *              logarithm of the size of the pyramid.  Changes replayed from the
+ *              journal to a level not yet loaded are kept until it is loaded
+ *              or the next snapshot is written.  A pyramid file in the
+ *              original format is loaded whole.
+ *
+ * Inputs and outputs: As for pyramid_open.
+ *
+ * Return value:
+ *  As for pyramid_open.  An error in a level found when it is loaded is
+ *   returned by the access that needed it.
+ */
+Pyramid* AccessFile::pyramid_open_lazy(char *pathname, int flags, int* file_fd, int* pyramid_fd, int *err, unsigned char *key) {
+  return open_pyramid(pathname, flags, file_fd, pyramid_fd, err, key, true);
+}
+
+
+/*
+ * Function: pyramid_check_lazy
+ *
+ * Description: This function checks that a file reads the same through a
+ *              lazily opened pyramid as through read.  It opens the file with
+ *              pyramid_open, reads num_reads blocks chosen at random and
+ *              closes it, which moves those blocks to the top of the pyramid;
+ *              then reopens it with pyramid_open_lazy and reads the same
+ *              blocks again in reverse order, so that the first is found in
+ *              the top level before it has been loaded, and the rest in levels
+ *              further down that may not have been.  Every block read is
+ *              compared with the file's contents, and once the second pass is
+ *              done every level is loaded and each block of the file must be
+ *              found in exactly one of them; during it, each block read must
+ *              be found exactly once in the levels loaded so far.
+ *
+ * Inputs:
+ *  pathname - The pathname of the file, which must not be empty.
+ *  key - An array of size KEY_LENGTH containing the key needed to unlock the
+ *   files.
+ *  num_reads - The number of blocks read in each pass.
+ *
+ * Return value:
+ *  0 if the file passed the check.
+ *  -1 if the file could not be opened or closed (see pyramid_open and
+ *   pyramid_close), or is empty.
+ *  -2 if a block could not be read, or did not match the file's contents.
+ *  -3 if a block was missing from the pyramid, or found in it more than once.
+ */
+int AccessFile::pyramid_check_lazy(char *pathname, unsigned char *key, long num_reads) {
+  int file_fd, pyramid_fd, err;
+  Pyramid *pyra = pyramid_open(pathname, O_RDWR, &file_fd, &pyramid_fd, &err, key);
+  if (pyra == NULL) return -1;
+  struct stat filestat;
+  long num_blocks = 0;
+  if (fstat(file_fd, &filestat) == 0) num_blocks = (filestat.st_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  vector<long> blocks;
+  for (long i = 0; (num_blocks > 0) && (i < num_reads); ++i) {
+    long block = Pyramid::random_below(num_blocks);
+    if (block < 0) break;
+    blocks.push_back(block);
+  }
+  unsigned char *expected = new unsigned char[2 * BLOCK_SIZE];
+  unsigned char *actual = expected + BLOCK_SIZE;
+  int check_return = (blocks.size() == (size_t) num_reads) ? 0 : -1;
+
+  for (int pass = 0; (pass < 2) && (check_return == 0); ++pass) {
+    if (pass == 1) {
+      pyra = pyramid_open_lazy(pathname, O_RDWR, &file_fd, &pyramid_fd, &err, key);
+      if (pyra == NULL) {
+        delete[] expected;
+        return -1;
+      }
+    }
+    for (size_t i = 0; (i < blocks.size()) && (check_return == 0); ++i) {
+      long block = (pass == 0) ? blocks[i] : blocks[blocks.size() - 1 - i];
+      off_t position = (off_t) block * BLOCK_SIZE;
+      size_t length = min((off_t) BLOCK_SIZE, filestat.st_size - position);
+      if ((pread(file_fd, expected, length, position) != (ssize_t) length) ||
+          (lseek(file_fd, position, SEEK_SET) < 0) ||
+          (pyramid_read(file_fd, actual, length, pyra) != (ssize_t) length) ||
+          memcmp(expected, actual, length)) check_return = -2;
+
+      // The block has just been moved to the top level, which is loaded, so
+      // it must be found once among the levels that are.
+      long copies = 0;
+      for (Pyramid *p = pyra; (pass == 1) && (p != NULL); p = p->get_next_level()) {
+        long *ids = p->get_identifiers();
+        if (!p->is_loaded() || (ids == NULL)) continue;
+        copies += count(ids, ids + p->how_many_ids(), block);
+      }
+      if ((pass == 1) && (check_return == 0) && (copies != 1)) check_return = -3;
+    }
+
+    // Every block must have survived being moved out of levels that were
+    // never loaded, once and only once.
+    if ((pass == 1) && (check_return == 0)) {
+      vector<unsigned char> found(num_blocks, 0);
+      for (Pyramid *p = pyra; (p != NULL) && (check_return == 0); p = p->get_next_level()) {
+        if (p->ensure_loaded() < 0) check_return = -2;
+        long *ids = p->get_identifiers();
+        for (size_t slot = 0; (check_return == 0) && (ids != NULL) && (slot < p->how_many_ids()); ++slot) {
+          if ((ids[slot] < 0) || (ids[slot] >= num_blocks)) continue;
+          if (found[ids[slot]]++) check_return = -3;
+        }
+      }
+      if ((check_return == 0) && (count(found.begin(), found.end(), 1) != num_blocks)) check_return = -3;
+    }
+
+    if ((pyramid_close(file_fd, pyra) < 0) && (check_return == 0)) check_return = -1;
+    delete pyra;
+  }
+
+  delete[] expected;
+  return check_return;
+}
+
+
+/*
+ * Function: open_pyramid
+ *
+ * Description: This function does the work of pyramid_open and
+ *              pyramid_open_lazy, which see.
+ *
+ * Inputs:
+ *  lazy - True to load the levels of a pyramid file in the Merkle tree format
+ *   on first touch; false to load them all now.
+ */
+Pyramid* AccessFile::open_pyramid(char *pathname, int flags, int* file_fd, int* pyramid_fd, int *err, unsigned char *key, bool lazy) {
   *err = 0;
 
   // Open the file itself.
@@ -226,19 +404,24 @@ Pyramid* AccessFile::pyramid_open(char *pathname, int flags, int* file_fd, int*
     return NULL;
   }
 
-  // Allocate and initialize pyramid.  If no pyramid file existed, fill in the
-  // pyramid with the block IDs in arbitrary order.
-  Pyramid *p = new Pyramid(NULL, *pyramid_fd, key);
+  // A pyramid file is only ever replaced whole, so an empty one is left from a
+  // pyramid_open that stopped before its first snapshot was renamed into place.
+  // No access was made through that pyramid, so it is built again.
+  struct stat pyramid_filestat;
+  if (!new_pyramid && !fstat(*pyramid_fd, &pyramid_filestat) && (pyramid_filestat.st_size == 0)) {
+    new_pyramid = true;
+  }
+
+  // If no pyramid file existed, build the pyramid from the block IDs in random
+  // order.
   if (new_pyramid) {
     if (fchmod(*pyramid_fd, S_IRUSR|S_IWUSR)) {
-      delete p;
       delete[] pyramid_filename;
       *err = -11;
       return NULL;
     }
     struct stat filestat;
     if (fstat(*file_fd, &filestat)) {
-      delete p;
       delete[] pyramid_filename;
       *err = -4;
       return NULL;
@@ -246,21 +429,83 @@ Pyramid* AccessFile::pyramid_open(char *pathname, int flags, int* file_fd, int*
     ssize_t filesize = filestat.st_size;
     long num_blocks = filesize / BLOCK_SIZE;
     if (num_blocks * BLOCK_SIZE != filesize) num_blocks++;
-    for (long i = 0L; i < num_blocks; ++i) {
-      if (p->add_id_pyramid(i) == 0) {
-        delete p;
-	delete[] pyramid_filename;
-        *err = -5;
-        return NULL;
+    Pyramid *p = Pyramid::bulk_load(*pyramid_fd, key, num_blocks);
+    if (p == NULL) {
+      delete[] pyramid_filename;
+      *err = -5;
+      return NULL;
+    }
+
+    // The journal starts from a snapshot of the new pyramid.
+    p->set_snapshot(new PyramidSnapshot(*pyramid_fd, pyramid_filename, p->get_key()));
+    unsigned char digest[SIGLEN];
+    if (write_snapshot(p, digest) < 0) {
+      delete p;
+      delete[] pyramid_filename;
+      *err = -14;
+      return NULL;
+    }
+    *err = attach_journal(pyramid_filename, p, digest, false);
+    delete[] pyramid_filename;
+    if (*err < 0) {
+      delete p;
+      return NULL;
+    }
+    return p;
+  }
+
+  // Allocate and initialize pyramid.
+  Pyramid *p = new Pyramid(NULL, *pyramid_fd, key);
+
+  // A pyramid file in the Merkle tree format is loaded level by level.  The
+  // errors of read_header and load_level map to those of the original format.
+  static const int load_errors[] = {-6, -7, -9, -8};
+  PyramidSnapshot *snapshot = new PyramidSnapshot(*pyramid_fd, pyramid_filename, p->get_key());
+  int header_return = snapshot->read_header();
+  if (header_return != 0) {
+    if (header_return > 0) {
+      p->set_snapshot(snapshot);
+      Pyramid *this_pyramid = p;
+      for (unsigned i = 1; i < snapshot->get_num_levels(); ++i) {
+        this_pyramid = new Pyramid(this_pyramid, *pyramid_fd, key);
+      }
+      for (this_pyramid = p; (this_pyramid != NULL) && !lazy; this_pyramid = this_pyramid->get_next_level()) {
+        int load_return = this_pyramid->ensure_loaded();
+        if (load_return < 0) {
+          header_return = load_return;
+          break;
+        }
       }
     }
+    else {
+      delete snapshot;
+    }
+    if (header_return < 0) {
+      delete p;
+      delete[] pyramid_filename;
+      *err = load_errors[-header_return - 1];
+      return NULL;
+    }
+
+    // Replay the changes made since the pyramid file was written.
+    unsigned char digest[SIGLEN];
+    memcpy(digest, snapshot->get_header_mac(), SIGLEN);
+    *err = attach_journal(pyramid_filename, p, digest, true);
+    delete[] pyramid_filename;
+    if (*err < 0) {
+      delete p;
+      return NULL;
+    }
     return p;
   }
 
+  // A file in the original format is read whole, and written out whole in the
+  // Merkle tree format by the first checkpoint.
+  p->set_snapshot(snapshot);
+
   // Define signature, verification payload, nonce, and decryption payload of
   // pyramid file.
   unsigned char* signature = new unsigned char[SIGLEN];
-  struct stat pyramid_filestat;
   if (fstat(*pyramid_fd, &pyramid_filestat)) {
     delete p;
     delete[] pyramid_filename;
@@ -269,6 +514,13 @@ Pyramid* AccessFile::pyramid_open(char *pathname, int flags, int* file_fd, int*
     return NULL;
   }
   ssize_t pyramid_filesize = pyramid_filestat.st_size - SIGLEN - KEY_LENGTH;
+  if (pyramid_filesize < 0) {
+    delete p;
+    delete[] pyramid_filename;
+    delete[] signature;
+    *err = -7;
+    return NULL;
+  }
   unsigned char *verification_payload = new unsigned char[pyramid_filesize + KEY_LENGTH];
   unsigned char *nonce = verification_payload;
   unsigned char *decryption_payload = verification_payload + KEY_LENGTH;
@@ -336,17 +588,108 @@ Pyramid* AccessFile::pyramid_open(char *pathname, int flags, int* file_fd, int*
     bcopy(decrypted_identifiers + offset, this_pyramid->get_identifiers(), this_pyramid->how_many_ids() * sizeof(long));
     offset += this_pyramid->how_many_ids();
   }
-  
+  p->index_pyramid();
+
+  // Replay the changes made since the pyramid file was written.
+  unsigned char digest[SIGLEN];
+  unsigned digest_length;
+  if (Pyramid::sign_pyramid(verification_payload, pyramid_filesize + KEY_LENGTH, (char*) digest, &digest_length)) {
+    *err = -13;
+  }
+  else {
+    *err = attach_journal(pyramid_filename, p, digest, true);
+  }
+  delete[] pyramid_filename;
+  delete[] signature;
+  delete[] verification_payload;
+  delete[] decrypted_identifiers;
+  if (*err < 0) {
+    delete p;
+    return NULL;
+  }
   return p;
 }
 
 
+/*
+ * Function: attach_journal
+ *
+ * Description: This function opens the journal of a pyramid file,
+ *              "[filename]_pyramid_journal", creating it if it does not exist,
+ *              and attaches it to the pyramid loaded from that file, so that
+ *              changes to the pyramid are recorded in it.
+ *
+ * Inputs:
+ *  pyramid_filename - The name of the pyramid file.
+ *  p - A pointer to the top level of the pyramid.
+ *  digest - The signature of the pyramid file.
+ *  replay - True to apply the changes already in the journal to the pyramid
+ *   first; false to empty the journal, as for a pyramid file just written.
+ *
+ * Return value:
+ *  0 upon success.
+ *  -12 if the journal could not be opened; check errno.
+ *  -13 if the journal could not be read, replayed, or emptied.
+ */
+int AccessFile::attach_journal(char *pyramid_filename, Pyramid *p, unsigned char *digest, bool replay) {
+  size_t journal_filename_len = strlen(pyramid_filename) + 9;
+  char *journal_filename = new char[journal_filename_len];
+  snprintf(journal_filename, journal_filename_len, "%s_journal", pyramid_filename);
+  int journal_fd = open(journal_filename, O_CREAT|O_RDWR, S_IRUSR|S_IWUSR);
+  delete[] journal_filename;
+  if (journal_fd < 0) return -12;
+
+  PyramidJournal *journal = new PyramidJournal(journal_fd, p->get_key());
+  int journal_return = replay ? journal->replay(p, digest) : journal->reset(digest);
+  if (journal_return < 0) {
+    delete journal;
+    return -13;
+  }
+  p->set_journal(journal);
+  return 0;
+}
+
+
+/*
+ * Function: pyramid_map
+ *
+ * Description: This function switches a file to mmap mode.  The data file is
+ *              mapped into memory, and from then on pyramid_read and
+ *              pyramid_write access blocks through the mapping (see
+ *              mapped_read and mapped_write) instead of copying them through a
+ *              buffer.  The file stays mapped until pyramid_close.
+ *
+ * Inputs:
+ *  fd - The file descriptor of the file.  It must have been opened for reading
+ *   and writing.
+ *  pyra - A pointer to the top level of the pyramid associated with the file.
+ *
+ * Return value:
+ *  0 upon success, or if the file is already mapped.
+ *  -1 if any of the function's inputs is invalid.
+ *  -2 if the file could not be mapped; check errno.
+ */
+int AccessFile::pyramid_map(int fd, Pyramid *pyra) {
+  if ((fd < 0) || (pyra == NULL) || (pyra->get_level() != 1)) return -1;
+  if (pyra->get_mapping() != NULL) return 0;
+  FileMapping *mapping = new FileMapping(fd);
+  if (mapping->map_file() < 0) {
+    delete mapping;
+    return -2;
+  }
+  pyra->set_mapping(mapping);
+  return 0;
+}
+
+
 /*
  * Function: pyramid_read
  * 
  * Description: This function attempts to read count bytes from the file with
  *  file descriptor fd.  Upon success, the file position is incremented by
  *  the number of bytes read.  Upon failure, the file position is unchanged.
+ *  The blocks of every level are chosen for all of the requested blocks first
+ *  (see plan_block), and then read together (see transfer_blocks).
  *
  * Inputs:
  *  fd - The file descriptor of the file to read from.
@@ -360,58 +703,70 @@ Pyramid* AccessFile::pyramid_open(char *pathname, int flags, int* file_fd, int*
  * Return value:
  *  The number of bytes read if the function succeeds.
  *  -1 if any of the function's inputs is invalid.
- *  -2 if a call to read_block failed.
+ *  -2 if a call to plan_block or transfer_blocks failed.
  *  -3 if a call to lseek failed; check errno.
+ *  -4 if fstat failed; check errno.
+ *  -5 if the file is mapped, and could not be remapped to its new size.
+ *  -6 if a call to flush_journal failed.
  */
 ssize_t AccessFile::pyramid_read(int fd, unsigned char *buf, size_t count, Pyramid *pyra) {
   if ((pyra == NULL) || (fd < 0) || (buf == NULL)) return -1L;
 
   long first_block_id, last_block_id, curr_block_id;
-  unsigned num_levels = pyra->how_many_levels();
-  long *block_ids = new long[num_levels];
-  ssize_t read_block_return;
   off_t original_position = lseek(fd, (off_t) 0, SEEK_CUR);
   size_t buf_offset = 0L;
-  if (original_position < 0) {
-    delete[] block_ids;
-    return -3L;
+  if (original_position < 0) return -3L;
+  struct stat filestat;
+  if (fstat(fd, &filestat)) return -4L;
+
+  if (pyra->get_mapping() != NULL) {
+    ssize_t mapped_return = mapped_read(buf, count, pyra, original_position, filestat.st_size);
+    if (mapped_return < 0) return mapped_return;
+    if (flush_journal(pyra) < 0) return -6L;
+    if (lseek(fd, original_position + mapped_return, SEEK_SET) < 0) return -3L;
+    return mapped_return;
   }
-  
-  unsigned char *big_buffer = new unsigned char[num_levels * BLOCK_SIZE];
-  
+
+  // Choose the block to be read at every level for each requested block.
   determine_blocks(count, &first_block_id, &last_block_id, original_position);
+  vector<long> block_ids;
+  vector<ssize_t> requested;
   for (curr_block_id = first_block_id; curr_block_id <= last_block_id; ++curr_block_id) {
-    read_block_return = read_block(fd, curr_block_id, pyra, block_ids, big_buffer);
-    
-    if (read_block_return < 0L) {
-      delete[] big_buffer;
-      delete[] block_ids;
-      lseek(fd, original_position, SEEK_SET);
-      return -2L;
-    }
-    
+    ssize_t index = plan_block(curr_block_id, pyra, filestat.st_size, &block_ids);
+    if (index < 0L) return -2L;
+    requested.push_back(index);
+  }
+
+  unsigned char *big_buffer = new unsigned char[block_ids.size() * BLOCK_SIZE];
+  if (transfer_blocks(pyra, fd, block_ids.data(), block_ids.size(), big_buffer, filestat.st_size, false) < 0) {
+    delete[] big_buffer;
+    return -2L;
+  }
+
+  for (curr_block_id = first_block_id; curr_block_id <= last_block_id; ++curr_block_id) {
+    unsigned char *block_data = big_buffer + requested[curr_block_id - first_block_id] * BLOCK_SIZE;
     if (first_block_id == last_block_id) {
-      bcopy(big_buffer + read_block_return + (original_position % BLOCK_SIZE), buf, count);
+      bcopy(block_data + (original_position % BLOCK_SIZE), buf, count);
       buf_offset += count;
     }
     else if (curr_block_id == first_block_id) {
       size_t this_size = BLOCK_SIZE - (original_position % BLOCK_SIZE);
-      bcopy(big_buffer + read_block_return + (original_position % BLOCK_SIZE), buf, this_size);
+      bcopy(block_data + (original_position % BLOCK_SIZE), buf, this_size);
       buf_offset += this_size;
     }
     else if (curr_block_id == last_block_id) {
       size_t this_size = count - buf_offset;
-      bcopy(big_buffer + read_block_return, buf + buf_offset, this_size);
+      bcopy(block_data, buf + buf_offset, this_size);
       buf_offset += this_size;
     }
     else {
-      bcopy(big_buffer + read_block_return, buf + buf_offset, BLOCK_SIZE);
+      bcopy(block_data, buf + buf_offset, BLOCK_SIZE);
       buf_offset += BLOCK_SIZE;
     }
   }
 
   delete[] big_buffer;
-  delete[] block_ids;
+  if (flush_journal(pyra) < 0) return -6L;
   if (lseek(fd, original_position + buf_offset, SEEK_SET) < 0) return -3L;
   return (ssize_t) buf_offset;
 }
@@ -428,6 +783,8 @@ ssize_t AccessFile::pyramid_read(int fd, unsigned char *buf, size_t count, Pyram
  *              make it large enough.  If pyramid_write succeeds, the position
  *              of the file is set to its current position + count.  If it
  *              fails, the position of the file is set to its current position.
+ *              As in pyramid_read, every block accessed is read at once, and
+ *              they are then all written back at once.
  *
  * Inputs:
  *  fd - The file descriptor of the file.
@@ -442,9 +799,11 @@ ssize_t AccessFile::pyramid_read(int fd, unsigned char *buf, size_t count, Pyram
  *  -2 if fstat failed; check errno.
  *  -3 if add_id_pyramid failed.
  *  -4 if ftruncate failed; check errno.
- *  -6 if read_block failed.
+ *  -6 if plan_block failed, or transfer_blocks failed to read.
  *  -7 if lseek failed; check errno.
- *  -8 if write failed; check errno.
+ *  -8 if transfer_blocks failed to write.
+ *  -9 if the file is mapped, and could not be remapped to its new size.
+ *  -10 if a call to flush_journal failed.
  */
 ssize_t AccessFile::pyramid_write(int fd, unsigned char *buf, size_t count, Pyramid *pyra) {
   if ((fd < 0) || (buf == NULL) || (pyra == NULL)) return -1L;
@@ -454,17 +813,18 @@ ssize_t AccessFile::pyramid_write(int fd, unsigned char *buf, size_t count, Pyra
   if (fstat(fd, &filestat)) {
     return -2L;
   }
+  off_t file_size = filestat.st_size;
 
   long final_block;
-  if (filestat.st_size == 0) {
+  if (file_size == 0) {
     final_block = -1;
   }
   else {
-    if ((filestat.st_size % (off_t) BLOCK_SIZE) == 0) {
-      final_block = (long) ((filestat.st_size / (off_t) BLOCK_SIZE) - (off_t) 1);
+    if ((file_size % (off_t) BLOCK_SIZE) == 0) {
+      final_block = (long) ((file_size / (off_t) BLOCK_SIZE) - (off_t) 1);
     }
     else {
-      final_block = (long) (filestat.st_size / (off_t) BLOCK_SIZE);
+      final_block = (long) (file_size / (off_t) BLOCK_SIZE);
     }
   }
 
@@ -472,6 +832,7 @@ ssize_t AccessFile::pyramid_write(int fd, unsigned char *buf, size_t count, Pyra
   long new_final_block;
   off_t original_position, new_size;
   original_position = lseek(fd, 0, SEEK_CUR);
+  if (original_position < 0) return -7L;
   new_size = original_position + (off_t) count;
   if ((new_size % (off_t) BLOCK_SIZE) == (off_t) 0) {
     new_final_block = (long) ((new_size / (off_t) BLOCK_SIZE) - (off_t) 1);
@@ -487,52 +848,56 @@ ssize_t AccessFile::pyramid_write(int fd, unsigned char *buf, size_t count, Pyra
         return -3L;
       }
     }
-    if (ftruncate(fd, (off_t) ((new_final_block + 1) * BLOCK_SIZE))) {
+    file_size = (off_t) ((new_final_block + 1) * BLOCK_SIZE);
+    if (ftruncate(fd, file_size)) {
       return -4L;
     }
   }
 
+  if (pyra->get_mapping() != NULL) {
+    // Bytes written through the mapping past the end of the file would be
+    // lost, so the file is first extended to the end of the last block
+    // written, as writing back whole blocks would.
+    if (new_size > file_size) {
+      file_size = (off_t) ((new_final_block + 1) * BLOCK_SIZE);
+      if (ftruncate(fd, file_size)) {
+        return -4L;
+      }
+    }
+    ssize_t mapped_return = mapped_write(buf, count, pyra, original_position, file_size);
+    if (mapped_return < 0) return mapped_return;
+    if (flush_journal(pyra) < 0) return -10L;
+    return 0L;
+  }
+
   long first_block_id, last_block_id;
   determine_blocks(count, &first_block_id, &last_block_id, original_position);
 
-  unsigned num_levels;
-  num_levels = pyra->how_many_levels();
-  long *block_ids = new long[num_levels];
-  unsigned char *big_buffer = new unsigned char[BLOCK_SIZE * num_levels];
-
   long curr_block_id;
-  ssize_t read_block_return;
+  vector<long> block_ids;
   for (curr_block_id = first_block_id; curr_block_id <= last_block_id; ++curr_block_id) {
-    read_block_return = read_block(fd, curr_block_id, pyra, block_ids, big_buffer);
-    if (read_block_return < 0) {
-      delete[] big_buffer;
-      delete[] block_ids;
-      lseek(fd, original_position, SEEK_SET);
-      return -6L;
-    }
+    if (plan_block(curr_block_id, pyra, file_size, &block_ids) < 0) return -6L;
+  }
 
-    write_block_to_big_buffer(buf, first_block_id, last_block_id, curr_block_id, big_buffer, count, read_block_return, original_position);
+  unsigned char *big_buffer = new unsigned char[block_ids.size() * BLOCK_SIZE];
+  if (transfer_blocks(pyra, fd, block_ids.data(), block_ids.size(), big_buffer, file_size, false) < 0) {
+    delete[] big_buffer;
+    return -6L;
+  }
 
-    size_t big_buffer_offset;
-    for (long i = 0, big_buffer_offset = 0; i < num_levels; ++i, big_buffer_offset += BLOCK_SIZE) {
-      if (lseek(fd, block_ids[i] * BLOCK_SIZE, SEEK_SET) < 0) {
-        delete[] big_buffer;
-	delete[] block_ids;
-        lseek(fd, original_position, SEEK_SET);
-        return -7L;
-      }
-      if (write(fd, big_buffer + big_buffer_offset, BLOCK_SIZE) < 0) {
-        delete[] big_buffer;
-	delete[] block_ids;
-        lseek(fd, original_position, SEEK_SET);
-        return -8L;
-      }
+  // A block being written may also have been read as a dummy block for
+  // another, so every copy of it is updated, and all copies written back are
+  // the same.
+  for (size_t i = 0; i < block_ids.size(); ++i) {
+    if ((block_ids[i] >= first_block_id) && (block_ids[i] <= last_block_id)) {
+      write_block_to_big_buffer(buf, first_block_id, last_block_id, block_ids[i], big_buffer, count, i * BLOCK_SIZE, original_position);
     }
   }
 
+  int transfer_return = transfer_blocks(pyra, fd, block_ids.data(), block_ids.size(), big_buffer, file_size, true);
   delete[] big_buffer;
-  delete[] block_ids;
-  lseek(fd, original_position, SEEK_SET);
+  if (transfer_return < 0) return -8L;
+  if (flush_journal(pyra) < 0) return -10L;
   return 0L;
 }
 
@@ -542,8 +907,9 @@ ssize_t AccessFile::pyramid_write(int fd, unsigned char *buf, size_t count, Pyra
  * Description: This function will attempt a "noisy" read of the desired block
  *              by going through each level of pyra and either finding the
  *              desired block and reading it, or failing to find it and reading
- *              a randomly selected block.  This function, when it finds the
- *              desired block ID in pyra, moves it to the top level of pyra.
+ *              a randomly selected block (see plan_block).  This function, when
+ *              it finds the desired block ID in pyra, moves it to the top level
+ *              of pyra.
  *
  * Inputs:
  *  file_fd - The file descriptor of the file being accessed.
@@ -571,67 +937,295 @@ ssize_t AccessFile::pyramid_write(int fd, unsigned char *buf, size_t count, Pyra
  *  -3 if any of the function inputs is invalid.
  *  -4 if a call to read caused an error; check errno.
  *  -5 if a call to read caused fewer bytes to be read than expected.
- *  -6 if a call to read caused more bytes to be read than expected.
  *  -7 if a call to fstat failed; check errno.
  *  -8 if the id "block" was not found in pyra.
- *  -9 if a call to lseek failed; check errno.
  */
 ssize_t AccessFile::read_block(int file_fd, long block, Pyramid *pyra, long *block_ids,
                     unsigned char *big_buffer) {
-  
   if ((block < 0L) || (pyra == NULL) || (block_ids == NULL) || (file_fd < 0) || (big_buffer == NULL))
     return (ssize_t) -3;
-  int movereturn, notfoundyet, i, j;
-  Pyramid *this_level;
-  ssize_t offset, readreturn, returnoffset;
   struct stat filestat;
-  long final_block, this_block;
+  if (fstat(file_fd, &filestat)) return (ssize_t) -7;
+
+  vector<long> planned;
+  ssize_t index = plan_block(block, pyra, filestat.st_size, &planned);
+  if (index < 0) return index;
+  int transfer_return = transfer_blocks(pyra, file_fd, planned.data(), planned.size(), big_buffer, filestat.st_size, false);
+  if (transfer_return < 0) return (ssize_t) transfer_return;
+  copy(planned.begin(), planned.end(), block_ids);
+  return index * BLOCK_SIZE;
+}
 
-  notfoundyet = 1;
-  returnoffset = -8;
-  for (this_level = pyra, offset = 0, i = 0; this_level != NULL;
-       this_level = this_level->get_next_level(), offset += BLOCK_SIZE, ++i) {
+/*
+ * Function: plan_block
+ *
+ * Description: This function chooses the block to be read at each level of
+ *              pyra for a "noisy" access of the desired block, without reading
+ *              anything: the desired block at the level where it is found,
+ *              which is then moved to the top level of pyra, and a randomly
+ *              selected block at every other level (from the whole file, if the
+ *              level is empty, or has not been loaded from a lazily opened
+ *              pyramid file).  The block is located through the pyramid's
+ *              position map, so each level costs constant time rather than a
+ *              scan of its identifiers.  In a level of a lazily opened pyramid
+ *              that has not been loaded, the block is looked up in the pyramid
+ *              file's position map instead, which reads two chunks of the file
+ *              for the whole access, and the level is not loaded unless the
+ *              map cannot tell (see move_id_in_pyramid).
+ *
+ * Inputs:
+ *  block - The identifier of the block to be accessed.
+ *  pyra - A pointer to the top level of the pyramid for the file being
+ *   accessed.
+ *  file_size - The size of the file, in bytes.
+ *
+ * Outputs:
+ *  block_ids - The identifier chosen at each level is appended to this vector.
+ *   Moving the block to the top level may add a level to the pyramid, but only
+ *   the levels that existed beforehand are included.
+ *
+ * Return value:
+ *  Upon success, the index in block_ids of the desired block.
+ *  -1 if move_id_in_pyramid fails.
+ *  -2 if randomly_select_id_pyramid fails.
+ *  -3 if any of the function inputs is invalid.
+ *  -8 if the id "block" was not found in pyra.
+ */
+ssize_t AccessFile::plan_block(long block, Pyramid *pyra, off_t file_size, vector<long> *block_ids) {
+  if ((block < 0L) || (pyra == NULL) || (block_ids == NULL)) return (ssize_t) -3;
+  int movereturn;
+  bool notfoundyet = true;
+  ssize_t returnindex = -8;
+  unsigned num_levels = pyra->how_many_levels();
+  Pyramid *this_level = pyra;
+  for (unsigned i = 0; (this_level != NULL) && (i < num_levels); this_level = this_level->get_next_level(), ++i) {
+    long this_block;
     if (notfoundyet && ((movereturn = this_level->move_id_in_pyramid(pyra, block)) == 1)) {
-      notfoundyet = 0;
+      notfoundyet = false;
       this_block = block;
+      returnindex = (ssize_t) block_ids->size();
     }
     else {
       if ((movereturn != -3) && notfoundyet) {
         return (ssize_t) -1;
       }
       this_block = this_level->randomly_select_id_pyramid();
+      if (((this_block == -2L) || (this_block == -5L)) && (file_size > 0)) {
+        // Earlier moves to the top level have emptied this level, or it has not
+        // been loaded yet, so the dummy read is of a block chosen from the
+        // whole file instead.
+        this_block = Pyramid::random_below((file_size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+      }
       if (this_block < 0L) {
         return (ssize_t) -2;
       }
     }
-    
-    if (lseek(file_fd, this_block * BLOCK_SIZE, SEEK_SET) < 0) {
-      return (ssize_t) -9;
+    block_ids->push_back(this_block);
+  }
+  return returnindex;
+}
+
+/*
+ * Function: transfer_blocks
+ *
+ * Description: This function reads or writes a batch of blocks with positioned
+ *              I/O, so the file position is neither used nor changed.  The
+ *              blocks are taken in order of identifier, and each run of
+ *              consecutive identifiers is transferred by a single vectored
+ *              read or write.  All of the runs are submitted together through
+ *              the pyramid's own io_uring instance (see BlockRing), which is
+ *              set up on first use, or, where that is unavailable, transferred
+ *              one after another with preadv or pwritev.  A block that appears
+ *              more than once is read or written only once; when reading, it
+ *              is then copied to each of its places in big_buffer.  The part of
+ *              a block that lies beyond the end of the file is read as zeroes.
+ *
+ * Inputs:
+ *  pyra - A pointer to the top level of the pyramid for the file being
+ *   accessed.
+ *  file_fd - The file descriptor of the file being accessed.
+ *  block_ids - The identifiers of the blocks.  The block with ID block_ids[i]
+ *   is stored at big_buffer + BLOCK_SIZE * i.
+ *  num_blocks - The number of entries in block_ids.
+ *  big_buffer - When writing, the blocks to be written.
+ *  file_size - The size of the file, in bytes.
+ *  writing - True to write the blocks; false to read them.
+ *
+ * Outputs:
+ *  big_buffer - When reading, the blocks are stored here.
+ *
+ * Return value:
+ *  0 upon success.
+ *  -4 if a read or write caused an error; check errno.
+ *  -5 if a read or write transferred fewer bytes than expected.
+ */
+int AccessFile::transfer_blocks(Pyramid *pyra, int file_fd, const long *block_ids, size_t num_blocks, unsigned char *big_buffer, off_t file_size, bool writing) {
+  vector<size_t> order(num_blocks);
+  for (size_t i = 0; i < num_blocks; ++i) {
+    order[i] = i;
+  }
+  sort(order.begin(), order.end(), [block_ids](size_t a, size_t b) {
+    return block_ids[a] < block_ids[b];
+  });
+
+  // Gather the blocks into runs.  Every block's buffer is listed in blocks
+  // before any run points into it, so that it is never reallocated.
+  vector<struct iovec> blocks;
+  blocks.reserve(num_blocks);
+  vector<BlockRun> runs;
+  vector<size_t> copies; // pairs of the indices of a copy and its original
+  for (size_t k = 0; k < num_blocks; ++k) {
+    long id = block_ids[order[k]];
+    BlockRun *last = runs.empty() ? NULL : &runs.back();
+    long next_id = (last == NULL) ? -1L : (long) (last->offset / BLOCK_SIZE) + last->num_blocks;
+    if ((last != NULL) && (id == next_id - 1)) {
+      copies.push_back(order[k]);
+      copies.push_back(order[k - 1]);
+      order[k] = order[k - 1];
+      continue;
+    }
+    struct iovec block;
+    block.iov_base = big_buffer + order[k] * BLOCK_SIZE;
+    block.iov_len = BLOCK_SIZE;
+    blocks.push_back(block);
+    if ((last != NULL) && (id == next_id) && (last->num_blocks < IOV_MAX)) {
+      ++last->num_blocks;
+      continue;
     }
-    readreturn = read(file_fd, big_buffer + offset, BLOCK_SIZE);
-    if (readreturn < 0) return (ssize_t) -4;
-    if (readreturn > BLOCK_SIZE) return (ssize_t) -6;
-    if (fstat(file_fd, &filestat)) return (ssize_t) -7;
-    if (!filestat.st_size) final_block = 0;
-    else final_block = (long) ((filestat.st_size - (off_t) 1) / (off_t) BLOCK_SIZE);
-    if ((this_block == final_block) && (filestat.st_size % BLOCK_SIZE)) {
-      for (j = offset + (filestat.st_size % BLOCK_SIZE); j < offset + BLOCK_SIZE; ++j) big_buffer[j] = (unsigned char) 0;
-      if (filestat.st_size % (off_t) BLOCK_SIZE != (off_t) (readreturn % BLOCK_SIZE)) {
-        return (ssize_t) -5;
-      }
+    BlockRun run;
+    run.offset = (off_t) id * BLOCK_SIZE;
+    run.blocks = &blocks.back();
+    run.num_blocks = 1;
+    run.transferred = 0;
+    runs.push_back(run);
+  }
+
+  // The runs the ring did not get to, if any, are transferred one at a time.
+  BlockRing *ring = pyra->get_ring();
+  if (ring == NULL) {
+    ring = new BlockRing(BLOCK_RING_ENTRIES);
+    pyra->set_ring(ring);
+  }
+  size_t done = ring->transfer(file_fd, runs.data(), runs.size(), writing);
+  if (done < runs.size()) {
+    for (size_t r = done; r < runs.size(); ++r) {
+      ssize_t transferred = writing ?
+        pwritev(file_fd, runs[r].blocks, runs[r].num_blocks, runs[r].offset) :
+        preadv(file_fd, runs[r].blocks, runs[r].num_blocks, runs[r].offset);
+      runs[r].transferred = (transferred < 0) ? -errno : transferred;
     }
-    else {
-      if (readreturn != BLOCK_SIZE) {
-        return (ssize_t) -5;
+  }
+
+  for (size_t r = 0; r < runs.size(); ++r) {
+    ssize_t expected = (ssize_t) runs[r].num_blocks * BLOCK_SIZE;
+    if (!writing) {
+      if (file_size - runs[r].offset < expected) expected = max((off_t) 0, file_size - runs[r].offset);
+      for (int i = 0; i < runs[r].num_blocks; ++i) {
+        off_t valid = file_size - runs[r].offset - (off_t) i * BLOCK_SIZE;
+        if (valid < BLOCK_SIZE) {
+          valid = max((off_t) 0, valid);
+          memset((unsigned char*) runs[r].blocks[i].iov_base + valid, 0, BLOCK_SIZE - valid);
+        }
       }
     }
-    if (this_block == block) {
-      returnoffset = offset;
+    if (runs[r].transferred < 0) {
+      errno = (int) -runs[r].transferred;
+      return -4;
     }
-    block_ids[i] = this_block;
+    if (runs[r].transferred != expected) return -5;
   }
-  
-  return returnoffset;
+
+  if (!writing) {
+    for (size_t i = 0; i < copies.size(); i += 2) {
+      memcpy(big_buffer + copies[i] * BLOCK_SIZE, big_buffer + copies[i + 1] * BLOCK_SIZE, BLOCK_SIZE);
+    }
+  }
+  return 0;
+}
+
+/*
+ * Function: mapped_read
+ *
+ * Description: This function does the work of pyramid_read in mmap mode.  The
+ *              blocks of every level are chosen as usual, but each is accessed
+ *              in place through the mapping instead of being copied, and only
+ *              the requested bytes are copied, straight into buf.
+ *
+ * Inputs:
+ *  count - The number of bytes to be read.
+ *  pyra - A pointer to the top level of the pyramid associated with the file.
+ *   Its mapping must not be NULL.
+ *  position - The position of the file.
+ *  file_size - The size of the file, in bytes.
+ *
+ * Outputs:
+ *  buf - The bytes read are stored here.  Bytes past the end of the file are
+ *   read as zeroes.
+ *
+ * Return value:
+ *  The number of bytes read if the function succeeds.
+ *  -2 if a call to plan_block failed.
+ *  -5 if the file could not be remapped to its new size.
+ */
+ssize_t AccessFile::mapped_read(unsigned char *buf, size_t count, Pyramid *pyra, off_t position, off_t file_size) {
+  FileMapping *mapping = pyra->get_mapping();
+  if (mapping->resize(file_size) < 0) return -5L;
+
+  long first_block_id, last_block_id;
+  determine_blocks(count, &first_block_id, &last_block_id, position);
+  vector<long> block_ids;
+  for (long curr_block_id = first_block_id; curr_block_id <= last_block_id; ++curr_block_id) {
+    if (plan_block(curr_block_id, pyra, file_size, &block_ids) < 0) return -2L;
+  }
+  for (size_t i = 0; i < block_ids.size(); ++i) {
+    mapping->touch_block(block_ids[i], false);
+  }
+
+  size_t available = (position < file_size) ? min(count, (size_t) (file_size - position)) : 0;
+  if (available > 0) bcopy(mapping->get_data() + position, buf, available);
+  if (available < count) memset(buf + available, 0, count - available);
+  return (ssize_t) count;
+}
+
+/*
+ * Function: mapped_write
+ *
+ * Description: This function does the work of pyramid_write in mmap mode,
+ *              after the file has been extended to hold the bytes written.
+ *              The blocks of every level are chosen as usual, and each is
+ *              marked dirty through the mapping as a write-back would, but
+ *              only the bytes written are copied, straight from buf.
+ *
+ * Inputs:
+ *  buf - A buffer containing the data to be written to the file.
+ *  count - The number of bytes to write to the file.
+ *  pyra - A pointer to the top level of the pyramid associated with the file.
+ *   Its mapping must not be NULL.
+ *  position - The position of the file.
+ *  file_size - The size of the file, in bytes.
+ *
+ * Return value:
+ *  0 upon success.
+ *  -6 if a call to plan_block failed.
+ *  -9 if the file could not be remapped to its new size.
+ */
+ssize_t AccessFile::mapped_write(unsigned char *buf, size_t count, Pyramid *pyra, off_t position, off_t file_size) {
+  FileMapping *mapping = pyra->get_mapping();
+  if (mapping->resize(file_size) < 0) return -9L;
+
+  long first_block_id, last_block_id;
+  determine_blocks(count, &first_block_id, &last_block_id, position);
+  vector<long> block_ids;
+  for (long curr_block_id = first_block_id; curr_block_id <= last_block_id; ++curr_block_id) {
+    if (plan_block(curr_block_id, pyra, file_size, &block_ids) < 0) return -6L;
+  }
+  for (size_t i = 0; i < block_ids.size(); ++i) {
+    mapping->touch_block(block_ids[i], true);
+  }
+
+  bcopy(buf, mapping->get_data() + position, count);
+  mapping->mark_dirty(position, position + count);
+  return 0L;
 }
 
 // Workhorse helper function for pyramid_write.  Writes a block from a file to a
@@ -0,0 +1,296 @@
+#include "pyramid_project.h"
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#define HAVE_IO_URING 1
+#else
+#define HAVE_IO_URING 0
+#endif
+
+// Set in the user data of a cancellation entry, to tell its completion apart
+// from those of the runs.
+#define BLOCK_RING_CANCEL_TAG (1ULL << 63)
+
+// BlockRing constructor.  Sets up an io_uring instance with room for entries
+// submissions at a time, leaving the ring unavailable if that fails.
+BlockRing::BlockRing(unsigned entries) {
+  ring_fd = -1;
+  sq_ring = MAP_FAILED;
+  cq_ring = MAP_FAILED;
+  sqes = MAP_FAILED;
+  sq_ring_size = 0;
+  cq_ring_size = 0;
+  sqes_size = 0;
+#if HAVE_IO_URING
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring_fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+  if (ring_fd < 0) {
+    ring_fd = -1;
+    return;
+  }
+  sq_entries = params.sq_entries;
+  sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single_mmap) {
+    sq_ring_size = max(sq_ring_size, cq_ring_size);
+    cq_ring_size = 0;
+  }
+  sq_ring = mmap(NULL, sq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  if (sq_ring == MAP_FAILED) {
+    shut_down();
+    return;
+  }
+  if (single_mmap) {
+    cq_ring = sq_ring;
+  }
+  else {
+    cq_ring = mmap(NULL, cq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    if (cq_ring == MAP_FAILED) {
+      shut_down();
+      return;
+    }
+  }
+  sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  sqes = mmap(NULL, sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    shut_down();
+    return;
+  }
+
+  unsigned char *sq = (unsigned char*) sq_ring;
+  unsigned char *cq = (unsigned char*) cq_ring;
+  sq_head = (unsigned*) (sq + params.sq_off.head);
+  sq_tail = (unsigned*) (sq + params.sq_off.tail);
+  sq_mask = (unsigned*) (sq + params.sq_off.ring_mask);
+  sq_array = (unsigned*) (sq + params.sq_off.array);
+  cq_head = (unsigned*) (cq + params.cq_off.head);
+  cq_tail = (unsigned*) (cq + params.cq_off.tail);
+  cq_mask = (unsigned*) (cq + params.cq_off.ring_mask);
+  cqes = cq + params.cq_off.cqes;
+#endif
+}
+
+// BlockRing destructor.
+BlockRing::~BlockRing() {
+  shut_down();
+}
+
+/*
+ * Function: shut_down
+ *
+ * Description: This function unmaps the rings and closes the io_uring
+ *              instance, leaving the ring unavailable.
+ */
+void BlockRing::shut_down() {
+  if (sqes != MAP_FAILED) munmap(sqes, sqes_size);
+  if ((cq_ring != MAP_FAILED) && (cq_ring != sq_ring)) munmap(cq_ring, cq_ring_size);
+  if (sq_ring != MAP_FAILED) munmap(sq_ring, sq_ring_size);
+  sqes = MAP_FAILED;
+  cq_ring = MAP_FAILED;
+  sq_ring = MAP_FAILED;
+  if (ring_fd >= 0) close(ring_fd);
+  ring_fd = -1;
+}
+
+/*
+ * Function: wait_for
+ *
+ * Description: This function waits for the completions of count submitted
+ *              entries, storing each run's result in the run.  Completions of
+ *              cancellation entries are counted but not stored.  Unless
+ *              persist is set, it gives up if the kernel fails the wait for a
+ *              reason other than an interruption or a temporary shortage, in
+ *              which case the ring is no longer usable.  If persist is set, it
+ *              keeps polling the completion queue instead, yielding the
+ *              processor between polls, since any system call lets the kernel
+ *              post the completions it has queued for this thread.
+ *
+ * Inputs:
+ *  count - The number of completions to wait for.
+ *  runs - The runs the entries were submitted for.
+ *  persist - True to keep polling rather than give up.
+ *
+ * Outputs:
+ *  runs - The result of each completion is stored in the transferred field of
+ *   its run.
+ *
+ * Return value:
+ *  The number of completions reaped.  This is count unless waiting failed, in
+ *   which case errno is set.
+ */
+unsigned BlockRing::wait_for(unsigned count, BlockRun *runs, bool persist) {
+#if HAVE_IO_URING
+  struct io_uring_cqe *cqe_array = (struct io_uring_cqe*) cqes;
+  unsigned reaped = 0;
+  unsigned head = *cq_head;
+  bool entering = true;
+  while (reaped < count) {
+    if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+      if (!entering) {
+        sched_yield();
+        continue;
+      }
+      int entered = (int) syscall(__NR_io_uring_enter, ring_fd, 0, count - reaped, IORING_ENTER_GETEVENTS, NULL, 0);
+      if ((entered < 0) && (errno != EINTR) && (errno != EAGAIN) && (errno != EBUSY)) {
+        if (!persist) return reaped;
+        entering = false;
+      }
+      continue;
+    }
+    struct io_uring_cqe *cqe = &cqe_array[head & *cq_mask];
+    if (!(cqe->user_data & BLOCK_RING_CANCEL_TAG)) runs[cqe->user_data].transferred = cqe->res;
+    ++head;
+    ++reaped;
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+  }
+  return reaped;
+#else
+  return 0;
+#endif
+}
+
+/*
+ * Function: cancel
+ *
+ * Description: This function is used when waiting for a batch of runs has
+ *              failed.  Closing the ring would not stop the kernel from
+ *              reading or writing their buffers afterwards, so a cancellation
+ *              is submitted for each run of the batch, and the completions of
+ *              the runs still outstanding and of the cancellations are reaped,
+ *              polling if need be, before it returns.  A run that completed
+ *              before it could be cancelled keeps its result; one that was
+ *              cancelled gets -ECANCELED.
+ *
+ * Inputs:
+ *  first - The index in runs of the first run of the batch.
+ *  submitted - The number of runs of the batch that were submitted.
+ *  outstanding - The number of their completions not yet reaped.
+ *  runs - The runs of the batch, from index 0.
+ *
+ * Outputs:
+ *  runs - The results of the runs reaped here are stored as by wait_for.
+ */
+void BlockRing::cancel(size_t first, unsigned submitted, unsigned outstanding, BlockRun *runs) {
+#if HAVE_IO_URING
+  struct io_uring_sqe *sqe_array = (struct io_uring_sqe*) sqes;
+  unsigned tail = *sq_tail;
+  for (unsigned i = 0; i < submitted; ++i, ++tail) {
+    unsigned index = tail & *sq_mask;
+    struct io_uring_sqe *sqe = &sqe_array[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = first + i;
+    sqe->user_data = BLOCK_RING_CANCEL_TAG | i;
+    sq_array[index] = index;
+  }
+  __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+  unsigned to_submit = submitted;
+  while (to_submit > 0) {
+    int entered = (int) syscall(__NR_io_uring_enter, ring_fd, to_submit, 0, 0, NULL, 0);
+    if ((entered < 0) && (errno == EINTR)) continue;
+    if (entered <= 0) break;
+    to_submit -= entered;
+  }
+  __atomic_store_n(sq_tail, __atomic_load_n(sq_head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+  wait_for(outstanding + submitted - to_submit, runs, true);
+#endif
+}
+
+/*
+ * Function: transfer
+ *
+ * Description: This function reads or writes runs of blocks, submitting as
+ *              many at once as the submission queue holds and waiting for all
+ *              of them to complete together.  Runs are submitted in order, and
+ *              the function never returns while any of them is still in
+ *              flight, so the caller may transfer the runs that were not
+ *              submitted itself, or free their buffers.  If the kernel rejects
+ *              a submission, the entries it did not consume are taken back off
+ *              the queue, the ones it did are waited for, and the ring is shut
+ *              down, since the next submission would most likely be rejected
+ *              too.  If waiting fails, the runs still in flight are cancelled
+ *              and reaped (see cancel) before the ring is shut down.  A ring
+ *              must only be used by one thread at a time.
+ *
+ * Inputs:
+ *  file_fd - The file descriptor of the file being accessed.
+ *  runs - The runs of blocks to transfer.
+ *  num_runs - The number of entries in runs.
+ *  writing - True to write the blocks; false to read them.
+ *
+ * Outputs:
+ *  runs - The number of bytes transferred for each run that was submitted, or
+ *   the negated error number if its transfer failed or was cancelled, is
+ *   stored in its transferred field.
+ *
+ * Return value:
+ *  The number of runs, from the first, that were submitted and completed
+ *   (successfully or not).  This is 0 if the ring is unavailable, and num_runs
+ *   unless the ring failed part way through.
+ */
+size_t BlockRing::transfer(int file_fd, BlockRun *runs, size_t num_runs, bool writing) {
+  if (ring_fd < 0) return 0;
+#if HAVE_IO_URING
+  struct io_uring_sqe *sqe_array = (struct io_uring_sqe*) sqes;
+  size_t next = 0;
+  while (next < num_runs) {
+    unsigned batch = (unsigned) min((size_t) sq_entries, num_runs - next);
+    unsigned tail = *sq_tail;
+    for (unsigned i = 0; i < batch; ++i, ++tail) {
+      unsigned index = tail & *sq_mask;
+      struct io_uring_sqe *sqe = &sqe_array[index];
+      BlockRun *run = &runs[next + i];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = writing ? IORING_OP_WRITEV : IORING_OP_READV;
+      sqe->fd = file_fd;
+      sqe->addr = (unsigned long) run->blocks;
+      sqe->len = (unsigned) run->num_blocks;
+      sqe->off = (unsigned long long) run->offset;
+      sqe->user_data = next + i;
+      sq_array[index] = index;
+    }
+    __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+    // Submit the batch, then wait for every completion.  The kernel only
+    // consumes entries while it is entered, so the ones it leaves behind can
+    // safely be taken back by moving the tail back to its head.
+    unsigned to_submit = batch;
+    while (to_submit > 0) {
+      int entered = (int) syscall(__NR_io_uring_enter, ring_fd, to_submit, 0, 0, NULL, 0);
+      if ((entered < 0) && (errno == EINTR)) continue;
+      if (entered <= 0) break;
+      to_submit -= entered;
+    }
+    unsigned submitted = batch - to_submit;
+    int saved_errno = errno;
+    if (to_submit > 0) {
+      __atomic_store_n(sq_tail, __atomic_load_n(sq_head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+    }
+    unsigned reaped = wait_for(submitted, runs, false);
+    if (reaped < submitted) {
+      if (to_submit == 0) saved_errno = errno;
+      cancel(next, submitted, submitted - reaped, runs);
+    }
+    if ((to_submit > 0) || (reaped < submitted)) {
+      shut_down();
+      errno = saved_errno;
+      return next + submitted;
+    }
+    next += batch;
+  }
+  return num_runs;
+#else
+  return 0;
+#endif
+}
+
+bool BlockRing::is_available() {return ring_fd >= 0;}
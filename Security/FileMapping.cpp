@@ -0,0 +1,180 @@
+#include "pyramid_project.h"
+
+// FileMapping constructor.  The file is not mapped until map_file is called.
+FileMapping::FileMapping(int file_fd) {
+  this->file_fd = file_fd;
+  data = NULL;
+  size = 0;
+  page_size = (size_t) sysconf(_SC_PAGESIZE);
+  dirty_writes = 0;
+}
+
+// FileMapping destructor.  Writes back any changes and unmaps the file.
+FileMapping::~FileMapping() {
+  if (data != NULL) {
+    sync_file(true);
+    munmap(data, size);
+  }
+}
+
+/*
+ * Function: map_file
+ *
+ * Description: This function maps the whole file into memory, shared with the
+ *              file so that changes made through the mapping are written back
+ *              to it.  An empty file is left unmapped until it grows.
+ *
+ * Return value:
+ *  0 upon success.
+ *  -1 if fstat failed; check errno.
+ *  -2 if mmap failed; check errno.
+ */
+int FileMapping::map_file() {
+  struct stat filestat;
+  if (fstat(file_fd, &filestat)) return -1;
+  if (data != NULL) {
+    sync_file(true);
+    munmap(data, size);
+    data = NULL;
+    size = 0;
+  }
+  if (filestat.st_size == 0) return 0;
+  void *mapped = mmap(NULL, filestat.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, file_fd, 0);
+  if (mapped == MAP_FAILED) return -2;
+  data = (unsigned char*) mapped;
+  size = filestat.st_size;
+  return 0;
+}
+
+/*
+ * Function: resize
+ *
+ * Description: This function changes the size of the mapping after the file
+ *              has been resized, moving it with mremap where that is supported
+ *              rather than mapping the file again.
+ *
+ * Inputs:
+ *  new_size - The new size of the file, in bytes.
+ *
+ * Return value:
+ *  0 upon success.
+ *  -1 if fstat failed; check errno.
+ *  -2 if mmap or mremap failed; check errno.
+ */
+int FileMapping::resize(off_t new_size) {
+  if ((size_t) new_size == size) return 0;
+  if ((data == NULL) || (new_size == 0)) return map_file();
+#ifdef MREMAP_MAYMOVE
+  void *mapped = mremap(data, size, new_size, MREMAP_MAYMOVE);
+  if (mapped == MAP_FAILED) return -2;
+  data = (unsigned char*) mapped;
+  size = new_size;
+  size_t pages = (size + page_size - 1) / page_size;
+  size_t kept = 0;
+  for (size_t i = 0; i < dirty.size(); ++i) {
+    if (dirty[i].first >= pages) continue;
+    dirty[kept].first = dirty[i].first;
+    dirty[kept].second = min(dirty[i].second, pages);
+    ++kept;
+  }
+  dirty.resize(kept);
+  return 0;
+#else
+  return map_file();
+#endif
+}
+
+/*
+ * Function: touch_block
+ *
+ * Description: This function accesses a block through the mapping, the way a
+ *              block is read or written back at each level of the pyramid, so
+ *              that its page is faulted in and, if writing, marked dirty.  The
+ *              contents of the block are not changed.
+ *
+ * Inputs:
+ *  block - The identifier of the block.
+ *  writing - True to mark the block's page dirty, as a write-back would.
+ */
+void FileMapping::touch_block(long block, bool writing) {
+  size_t offset = (size_t) block * BLOCK_SIZE;
+  if (offset >= size) return;
+  volatile unsigned char *page = data + offset;
+  unsigned char value = *page;
+  if (writing) {
+    *page = value;
+    mark_dirty(offset, min(size, offset + BLOCK_SIZE));
+  }
+}
+
+/*
+ * Function: mark_dirty
+ *
+ * Description: This function records a range of the mapping that has been
+ *              written to, as the run of pages it covers.  A run that touches
+ *              the one recorded just before it is merged into it.  The runs are
+ *              written back asynchronously once MAPPING_SYNC_WRITES ranges have
+ *              been recorded, so that each write does not pay for an msync of
+ *              its own.
+ *
+ * Inputs:
+ *  begin - The offset of the first byte written.
+ *  end - The offset just past the last byte written.
+ */
+void FileMapping::mark_dirty(size_t begin, size_t end) {
+  if (end <= begin) return;
+  size_t first = begin / page_size;
+  size_t last = (end + page_size - 1) / page_size;
+  if (!dirty.empty() && (first <= dirty.back().second) && (last >= dirty.back().first)) {
+    dirty.back().first = min(dirty.back().first, first);
+    dirty.back().second = max(dirty.back().second, last);
+  }
+  else {
+    dirty.push_back(make_pair(first, last));
+  }
+  if (++dirty_writes >= MAPPING_SYNC_WRITES) sync_file(false);
+}
+
+/*
+ * Function: sync_file
+ *
+ * Description: This function writes back the pages of the mapping written to
+ *              since the last sync.  The runs recorded by mark_dirty are sorted
+ *              and those that overlap or touch are joined, so that each msync
+ *              covers only pages that were written, in order of offset.
+ *
+ * Inputs:
+ *  wait - True to wait for the write-back to finish (MS_SYNC); false to only
+ *   start it (MS_ASYNC).
+ *
+ * Return value:
+ *  0 upon success.
+ *  -1 if an msync failed; check errno.  The other runs are still written back.
+ */
+int FileMapping::sync_file(bool wait) {
+  dirty_writes = 0;
+  if ((data == NULL) || dirty.empty()) return 0;
+  sort(dirty.begin(), dirty.end());
+  int result = 0;
+  int saved_errno = 0;
+  size_t i = 0;
+  while (i < dirty.size()) {
+    size_t first = dirty[i].first;
+    size_t last = dirty[i].second;
+    for (++i; (i < dirty.size()) && (dirty[i].first <= last); ++i) {
+      last = max(last, dirty[i].second);
+    }
+    size_t begin = first * page_size;
+    size_t end = min(last * page_size, size);
+    if (msync(data + begin, end - begin, wait ? MS_SYNC : MS_ASYNC) && (result == 0)) {
+      result = -1;
+      saved_errno = errno;
+    }
+  }
+  dirty.clear();
+  if (result < 0) errno = saved_errno;
+  return result;
+}
+
+unsigned char* FileMapping::get_data() {return data;}
+size_t FileMapping::get_size() {return size;}
@@ -1,6 +1,12 @@
 #include "pyramid_project.h"
 
-// Pyramid constructor.
+// Random bytes drawn from RAND_bytes, consumed from random_pool_used onwards.
+static unsigned char random_pool[RANDOM_POOL_SIZE];
+static size_t random_pool_used = RANDOM_POOL_SIZE;
+
+// Pyramid constructor.  A level that is in the pyramid file the pyramid is
+// lazily loaded from is left empty, without its identifiers allocated, until
+// it is loaded (see ensure_loaded).
 Pyramid::Pyramid(Pyramid* parent, int pyramid_fd, unsigned char *key) {
   if (key == NULL) return;
   if (parent == NULL) {
@@ -10,24 +16,37 @@ Pyramid::Pyramid(Pyramid* parent, int pyramid_fd, unsigned char *key) {
     for (int i = 0; i < KEY_LENGTH; ++i) {
       this->key[i] = key[i];
     }
+    locations = new vector<BlockLocation>;
+    journal = NULL;
+    snapshot = NULL;
   }
   else {
     level = parent->level + 1;
     this->pyramid_fd = parent->get_pyramid_fd();
     this->key = parent->get_key();
+    locations = parent->locations;
+    journal = parent->journal;
+    snapshot = parent->snapshot;
   }
+  loaded = (snapshot == NULL) || (level > snapshot->get_num_levels());
+  mapping = NULL;
+  ring = NULL;
   identifiers = NULL;
+  occupied = NULL;
+  free_slots = NULL;
+  num_occupied = 0;
+  num_free = 0;
   next_level = NULL;
-  size_t howmanyentries = how_many_ids();
-  if (howmanyentries == 0) {
+  if (!loaded) {
+    parent->set_next_level(this);
     return;
   }
-  identifiers = new long[howmanyentries];
-  if (identifiers == NULL) {
+  if (!allocate_level()) {
     return;
   }
-  for (int i = 0; i < howmanyentries; ++i) {
+  for (size_t i = 0; i < how_many_ids(); ++i) {
     identifiers[i] = -1L;
+    free_slots[num_free++] = i;
   }
   if (parent != NULL) {
     parent->set_next_level(this);
@@ -38,7 +57,35 @@ Pyramid::Pyramid(Pyramid* parent, int pyramid_fd, unsigned char *key) {
 Pyramid::~Pyramid() {
   if (next_level != NULL) delete next_level;
   if (identifiers != NULL) delete[] identifiers;
+  if (occupied != NULL) delete[] occupied;
+  if (free_slots != NULL) delete[] free_slots;
   if ((key != NULL) && (next_level == NULL)) delete[] key;
+  if (level == 1) delete locations;
+  if ((level == 1) && (mapping != NULL)) delete mapping;
+  if ((level == 1) && (ring != NULL)) delete ring;
+  if ((level == 1) && (journal != NULL)) delete journal;
+  if ((level == 1) && (snapshot != NULL)) delete snapshot;
+}
+
+/*
+ * Function: allocate_level
+ *
+ * Description: This function allocates the identifiers, occupied identifiers
+ *              and free slot stack of this level, leaving them uninitialized.
+ *
+ * Return value:
+ *  true upon success.
+ *  false if the level holds no identifiers.
+ */
+bool Pyramid::allocate_level() {
+  size_t howmanyentries = how_many_ids();
+  if (howmanyentries == 0) {
+    return false;
+  }
+  identifiers = new long[howmanyentries];
+  occupied = new long[howmanyentries];
+  free_slots = new size_t[howmanyentries];
+  return true;
 }
 
 /*
@@ -93,11 +140,16 @@ int Pyramid::pyramid_overflow() {
     next_level = new Pyramid(this, pyramid_fd, key);
   }
   
-  for (int idx = 0; idx < how_many_ids(); ++idx) {
-    if (next_level->add_id_pyramid(identifiers[idx]) == 0) {
+  while (num_occupied > 0) {
+    long id = occupied[num_occupied - 1];
+    size_t slot = (*locations)[id].slot;
+    if (next_level->add_id_pyramid(id) == 0) {
       return -3;
     }
-    identifiers[idx] = -1L;
+    identifiers[slot] = -1L;
+    record_change(slot);
+    free_slots[num_free++] = slot;
+    --num_occupied;
   }
   return 1;
 }
@@ -107,7 +159,13 @@ int Pyramid::pyramid_overflow() {
  *
  * Description: This function removes a block identifier from this level in the
  *              pyramid, if present, and stores it in the top level of the
- *              pyramid.
+ *              pyramid.  Whether it is present, and where, is looked up in the
+ *              position map (see locate_id).  If this level has not been
+ *              loaded from the pyramid file, and the block is in no level that
+ *              has, it is looked up in the pyramid file's position map instead
+ *              (see PyramidSnapshot::find_id), and removed by deferring the
+ *              change to its slot, without loading the level; the level is
+ *              only loaded when that cannot tell.
  *
  * Inputs:
  *  top_level - A pointer to level 1 of the pyramid.
@@ -120,32 +178,38 @@ int Pyramid::pyramid_overflow() {
  *  -3 if the given block identifier was not found at the specified level of the
  *   pyramid.
  *  -4 if the call to pyramid_overflow failed.
+ *  -5 if this level or the top level could not be loaded from the pyramid file
+ *   (see ensure_loaded).
  */
 int Pyramid::move_id_in_pyramid(Pyramid* top_level, long id) {
   if ((top_level == NULL) || (id < 0)) return -1;
-  long* current_ids = identifiers;
-  if (current_ids == NULL) return -2;
-  size_t howmanyids = how_many_ids();
-  int i;
-  bool foundit = false;
-  for (i = 0; i < howmanyids; ++i) {
-    bool thisisit = (current_ids[i] == id);
-    foundit = foundit || thisisit;
-    if (thisisit) current_ids[i] = -1L;
-  }
-  if (!foundit) return -3;
-  for (int i = 0; i < top_level->how_many_ids(); ++i) {
-    if (top_level->identifiers[i] < 0L) {
-      top_level->identifiers[i] = id;
-      break;
-    }
+
+  // The top level is loaded first, since loading it applies the changes
+  // deferred to it; a slot found for it beforehand would already be stale.
+  if (top_level->ensure_loaded() < 0) return -5;
+  size_t slot;
+  int find_return = -1;
+  if (!loaded) find_return = (locate_id(id, &slot) != 0) ? 0 : snapshot->find_id(id, level, &slot);
+  if (find_return == 0) return -3;
+  if (find_return < -1) return -5;
+  if (find_return == 1) {
+    if (journal != NULL) journal->record(level, slot, -1L);
+    snapshot->defer_record(level, slot, -1L);
   }
-  if (i >= top_level->how_many_ids()) {
-    if (top_level->pyramid_overflow() < 0) {
-      return -4;
-    }
-    top_level->add_id_pyramid(id);
+  else {
+    if (ensure_loaded() < 0) return -5;
+    if (identifiers == NULL) return -2;
+    if (locate_id(id, &slot) != level) return -3;
+    remove_id(id);
+  }
+  if (top_level->num_free > 0) {
+    top_level->store_id(id);
+    return 1;
   }
+  if (top_level->pyramid_overflow() < 0) {
+    return -4;
+  }
+  top_level->add_id_pyramid(id);
   return 1;
 }
 
@@ -154,26 +218,27 @@ int Pyramid::move_id_in_pyramid(Pyramid* top_level, long id) {
  *
  * Description: This function, when passed a pointer to a level of the pyramid,
  *              randomly selects one of the block identifiers stored there.
+ *              Each is equally likely, and the selection takes constant time
+ *              however full the level is, since the identifiers are also kept
+ *              without gaps in occupied.
  *
  * Return value:
  *  -1 if a call to how_many_ids failed.
  *  -2 if the block identifier list at this level of the pyramid was empty.
  *  -3 if the list of block identifiers is NULL.
+ *  -4 if no random bytes could be generated.
+ *  -5 if this level has not been loaded from the pyramid file yet.  It is not
+ *   loaded just to choose a block to read.
  *  Otherwise, the randomly selected block identifier is returned.
  */
 long Pyramid::randomly_select_id_pyramid() {
+  if (!loaded) return -5L;
   if (identifiers == NULL) return -3L;
-  size_t howmanyids = how_many_ids();
-  if (howmanyids == 0) return -1L;
-  int r = rand() % howmanyids;
-  int i = r;
-  do {
-    if (identifiers[i] >= 0) {
-      return identifiers[i];
-    }
-    i = (i + 1) % howmanyids;
-  } while (i != r);
-  return -2L;
+  if (how_many_ids() == 0) return -1L;
+  if (num_occupied == 0) return -2L;
+  long r = random_below(num_occupied);
+  if (r < 0) return -4L;
+  return occupied[r];
 }
 
 /*
@@ -187,30 +252,325 @@ long Pyramid::randomly_select_id_pyramid() {
  *  id - The number of the block to be added.
  *
  * Return value:
- *  0 if id is invalid, or a block with identifier id was already
- *   found at that level in the pyramid.
+ *  0 if id is invalid, a block with identifier id was already found at that
+ *   level in the pyramid, or the level could not be loaded from the pyramid
+ *   file (see ensure_loaded).
  *  1 if the block was successfully added.
  */
 int Pyramid::add_id_pyramid(long id) {
   if (id < 0) return 0;
-  int empty = -1;
-  
-  for (int i = 0; i < how_many_ids(); ++i) {
-    if (identifiers[i] < 0) {
-      empty = i;
-    }
-    else if (identifiers[i] == id) {
-      return 0;
-    }
-  }
-  if (empty != -1) {
-    identifiers[empty] = id;
+  if (ensure_loaded() < 0) return 0;
+  size_t slot;
+  if (locate_id(id, &slot) == level) return 0;
+  if (num_free > 0) {
+    store_id(id);
     return 1;
   }
   pyramid_overflow();
   return add_id_pyramid(id);
 }
 
+/*
+ * Function: store_id
+ *
+ * Description: This function stores a block identifier in the empty slot on
+ *              top of the free slot stack of this level, which must not be
+ *              empty.
+ *
+ * Inputs:
+ *  id - The identifier to store.
+ */
+void Pyramid::store_id(long id) {
+  size_t slot = free_slots[--num_free];
+  identifiers[slot] = id;
+  record_change(slot);
+  occupied[num_occupied] = id;
+  set_location(id, level, slot, num_occupied);
+  ++num_occupied;
+}
+
+/*
+ * Function: remove_id
+ *
+ * Description: This function removes a block identifier stored at this level,
+ *              in constant time: its slot is pushed onto the free slot stack,
+ *              and the last of the occupied identifiers is moved into its place
+ *              in occupied.
+ *
+ * Inputs:
+ *  id - The identifier to remove.
+ */
+void Pyramid::remove_id(long id) {
+  BlockLocation here = (*locations)[id];
+  identifiers[here.slot] = -1L;
+  record_change(here.slot);
+  free_slots[num_free++] = here.slot;
+  long last = occupied[--num_occupied];
+  occupied[here.dense] = last;
+  (*locations)[last].dense = here.dense;
+  set_location(id, 0, 0, 0);
+}
+
+/*
+ * Function: record_change
+ *
+ * Description: This function records a change to one of the identifiers of
+ *              this level in the pyramid's journal, if it has one, and marks
+ *              its chunk of the pyramid file to be rewritten by the next
+ *              snapshot (see PyramidSnapshot::mark_dirty), along with the
+ *              entry of an identifier stored in it in the file's position map
+ *              (see PyramidSnapshot::place_id).
+ *
+ * Inputs:
+ *  slot - The index of the identifier that changed.
+ */
+void Pyramid::record_change(size_t slot) {
+  if (journal != NULL) journal->record(level, slot, identifiers[slot]);
+  if (snapshot != NULL) {
+    snapshot->mark_dirty(level, slot);
+    if (identifiers[slot] >= 0) snapshot->place_id(identifiers[slot], level, slot);
+  }
+}
+
+/*
+ * Function: random_below
+ *
+ * Description: This function draws a uniformly distributed random number from
+ *              a cryptographically secure generator.  Bytes are taken from
+ *              RAND_bytes RANDOM_POOL_SIZE at a time, and values that would
+ *              bias the result towards small numbers are rejected and drawn
+ *              again.
+ *
+ * Inputs:
+ *  bound - The number of possible results.  Must be positive.
+ *
+ * Return value:
+ *  -1 if RAND_bytes failed.
+ *  Otherwise, a random number from 0 to bound - 1.
+ */
+long Pyramid::random_below(size_t bound) {
+  uint64_t limit = UINT64_MAX - UINT64_MAX % bound;
+  uint64_t r;
+  do {
+    if (random_pool_used + sizeof(r) > RANDOM_POOL_SIZE) {
+      if (RAND_bytes(random_pool, RANDOM_POOL_SIZE) != 1) return -1L;
+      random_pool_used = 0;
+    }
+    memcpy(&r, random_pool + random_pool_used, sizeof(r));
+    random_pool_used += sizeof(r);
+  } while (r >= limit);
+  return (long) (r % bound);
+}
+
+/*
+ * Function: locate_id
+ *
+ * Description: This function looks up where a block identifier is stored in
+ *              the pyramid, in constant time, using the position map shared by
+ *              all levels.
+ *
+ * Inputs:
+ *  id - The identifier to look up.
+ *
+ * Outputs:
+ *  slot - If the identifier is stored in the pyramid, its index in the
+ *   identifiers of its level is stored here.
+ *
+ * Return value:
+ *  0 if the identifier is not stored in the pyramid.
+ *  Otherwise, the level at which it is stored.
+ */
+unsigned Pyramid::locate_id(long id, size_t* slot) {
+  if ((id < 0) || ((size_t) id >= locations->size())) return 0;
+  *slot = (*locations)[id].slot;
+  return (*locations)[id].level;
+}
+
+/*
+ * Function: set_location
+ *
+ * Description: This function records in the position map where a block
+ *              identifier is now stored, growing the map if needed.
+ *
+ * Inputs:
+ *  id - The identifier that was stored or removed.
+ *  new_level - The level at which it is now stored, or 0 if it was removed.
+ *  slot - Its index in the identifiers of that level.
+ *  dense - Its index in the occupied identifiers of that level.
+ */
+void Pyramid::set_location(long id, unsigned new_level, size_t slot, size_t dense) {
+  if ((size_t) id >= locations->size()) {
+    BlockLocation absent;
+    absent.level = 0;
+    absent.slot = 0;
+    absent.dense = 0;
+    locations->resize(id + 1, absent);
+  }
+  (*locations)[id].level = new_level;
+  (*locations)[id].slot = slot;
+  (*locations)[id].dense = dense;
+}
+
+/*
+ * Function: index_pyramid
+ *
+ * Description: This function rebuilds the position map, and the occupied
+ *              identifiers and free slot stack of every level, from the
+ *              identifiers of every level, after they have been filled in
+ *              directly rather than through add_id_pyramid (as when a pyramid
+ *              file is loaded).  Levels not yet loaded from the pyramid file
+ *              are left out, and indexed when they are loaded.
+ */
+void Pyramid::index_pyramid() {
+  locations->clear();
+  for (Pyramid* p = this; p != NULL; p = p->get_next_level()) {
+    if (p->loaded) p->index_level();
+  }
+}
+
+/*
+ * Function: index_level
+ *
+ * Description: This function rebuilds the occupied identifiers and free slot
+ *              stack of this level from its identifiers, and records where
+ *              each of them is in the position map.
+ */
+void Pyramid::index_level() {
+  num_occupied = 0;
+  num_free = 0;
+  for (size_t i = 0; i < how_many_ids(); ++i) {
+    if (identifiers[i] >= 0) {
+      set_location(identifiers[i], level, i, num_occupied);
+      occupied[num_occupied++] = identifiers[i];
+    }
+    else {
+      free_slots[num_free++] = i;
+    }
+  }
+}
+
+/*
+ * Function: ensure_loaded
+ *
+ * Description: This function loads this level from the pyramid file it was
+ *              lazily opened from, if that has not been done yet: its
+ *              identifiers are read, checked against the level's root and
+ *              decrypted (see PyramidSnapshot::load_level), and indexed.  No
+ *              other level is read.
+ *
+ * Return value:
+ *  0 upon success, or if the level is already loaded.
+ *  Otherwise, the error returned by load_level; the level stays unloaded.
+ */
+int Pyramid::ensure_loaded() {
+  if (loaded) return 0;
+  if ((identifiers == NULL) && !allocate_level()) return -1;
+  int load_return = snapshot->load_level(level, identifiers);
+  if (load_return < 0) return load_return;
+  loaded = true;
+  index_level();
+  return 0;
+}
+
+/*
+ * Function: count_bulk_ids
+ *
+ * Description: This function works out how many block identifiers each level
+ *              of a pyramid holds after a number of them have been added to a
+ *              level one at a time with add_id_pyramid, without adding them.
+ *              A level with room takes as many as fit, and a full level passes
+ *              everything it holds on to the next level, as pyramid_overflow
+ *              does, so the counts are found in time proportional to the
+ *              number of overflows rather than the number of identifiers.
+ *
+ * Inputs:
+ *  counts - The number of identifiers held by each level, indexed from level 1
+ *   at counts[0].  Grown if a new level is needed.
+ *  level - The level to which the identifiers are added.
+ *  how_many - The number of identifiers to add.
+ */
+void Pyramid::count_bulk_ids(vector<size_t>* counts, unsigned level, size_t how_many) {
+  if (counts->size() < level) counts->resize(level, 0);
+  size_t capacity = (size_t) pow(4.0, (double) level);
+  while (how_many > 0) {
+    size_t room = capacity - (*counts)[level - 1];
+    if (room == 0) {
+      count_bulk_ids(counts, level + 1, (*counts)[level - 1]);
+      (*counts)[level - 1] = 0;
+      continue;
+    }
+    if (room > how_many) room = how_many;
+    (*counts)[level - 1] += room;
+    how_many -= room;
+  }
+}
+
+/*
+ * Function: bulk_load
+ *
+ * Description: This function builds the pyramid of a new file in one pass.
+ *              Each level holds as many block identifiers as if they had been
+ *              added to the top level one at a time (see count_bulk_ids), but
+ *              which identifiers go to which level is decided by a random
+ *              shuffle of all of them.
+ *
+ * Inputs:
+ *  pyramid_fd - The FD of the pyramid file.
+ *  key - An array of size KEY_LENGTH containing the key used for encryption
+ *   and decryption of the file.
+ *  num_blocks - The number of blocks in the file; identifiers 0 through
+ *   num_blocks - 1 are stored.
+ *
+ * Return value:
+ *  NULL if num_blocks is negative or no random bytes could be generated.
+ *  Otherwise, a pointer to level 1 of the new pyramid.
+ */
+Pyramid* Pyramid::bulk_load(int pyramid_fd, unsigned char* key, long num_blocks) {
+  if (num_blocks < 0) return NULL;
+  vector<size_t> counts;
+  count_bulk_ids(&counts, 1, (size_t) num_blocks);
+
+  // Shuffle the identifiers with Fisher-Yates.
+  vector<long> shuffled(num_blocks);
+  for (long i = 0; i < num_blocks; ++i) {
+    shuffled[i] = i;
+  }
+  for (long i = num_blocks - 1; i > 0; --i) {
+    long j = random_below(i + 1);
+    if (j < 0) return NULL;
+    swap(shuffled[i], shuffled[j]);
+  }
+
+  // Each level is filled from its first slot, and the rest of its slots are
+  // stacked so that the last is used first, as in a new level.
+  Pyramid* top_level = new Pyramid(NULL, pyramid_fd, key);
+  BlockLocation absent;
+  absent.level = 0;
+  absent.slot = 0;
+  absent.dense = 0;
+  top_level->locations->assign(num_blocks, absent);
+  Pyramid* this_level = top_level;
+  size_t next = 0;
+  for (size_t k = 0; k < counts.size(); ++k) {
+    if (k > 0) this_level = new Pyramid(this_level, pyramid_fd, key);
+    for (size_t i = 0; i < counts[k]; ++i) {
+      long id = shuffled[next++];
+      this_level->identifiers[i] = id;
+      this_level->occupied[i] = id;
+      BlockLocation* location = &(*top_level->locations)[id];
+      location->level = this_level->level;
+      location->slot = i;
+      location->dense = i;
+    }
+    this_level->num_occupied = counts[k];
+    this_level->num_free = 0;
+    for (size_t i = counts[k]; i < this_level->how_many_ids(); ++i) {
+      this_level->free_slots[this_level->num_free++] = i;
+    }
+  }
+  return top_level;
+}
+
 /*
  * Function: encrypt_pyramid
  *
@@ -439,3 +799,26 @@ unsigned char* Pyramid::get_key() {return key;}
 void Pyramid::set_next_level(Pyramid* next) {next_level = next;}
 Pyramid* Pyramid::get_next_level() {return next_level;}
 long* Pyramid::get_identifiers() {return identifiers;}
+FileMapping* Pyramid::get_mapping() {return mapping;}
+void Pyramid::set_mapping(FileMapping* new_mapping) {mapping = new_mapping;}
+BlockRing* Pyramid::get_ring() {return ring;}
+void Pyramid::set_ring(BlockRing* new_ring) {ring = new_ring;}
+PyramidJournal* Pyramid::get_journal() {return journal;}
+bool Pyramid::is_loaded() {return loaded;}
+PyramidSnapshot* Pyramid::get_snapshot() {return snapshot;}
+
+// Sets the journal of every level of the pyramid, from this one down.
+void Pyramid::set_journal(PyramidJournal* new_journal) {
+  for (Pyramid* p = this; p != NULL; p = p->next_level) {
+    p->journal = new_journal;
+  }
+}
+
+// Sets the pyramid file every level of the pyramid, from this one down, is
+// lazily loaded from, marking the levels it holds as not yet loaded.
+void Pyramid::set_snapshot(PyramidSnapshot* new_snapshot) {
+  for (Pyramid* p = this; p != NULL; p = p->next_level) {
+    p->snapshot = new_snapshot;
+    p->loaded = (new_snapshot == NULL) || (p->level > new_snapshot->get_num_levels());
+  }
+}
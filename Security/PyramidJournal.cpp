@@ -0,0 +1,244 @@
+#include "pyramid_project.h"
+
+/*
+ * A journal is a sequence of frames, each holding the changes made to the
+ * identifiers of a pyramid between two flushes.  A frame consists of a
+ * KEY_LENGTH-byte nonce, the length of the encrypted records as a 32-bit
+ * integer, the records encrypted with AES-128-OFB under the pyramid's key and
+ * the nonce, and a SIGLEN-byte HMAC-SHA384.  Each record is three longs: a
+ * level, a slot in that level's identifiers, and the identifier now stored
+ * there (-1 if the slot was emptied).
+ *
+ * The HMAC of a frame covers the HMAC of the frame before it, or for the first
+ * frame the signature of the pyramid file the journal was started from, so
+ * frames cannot be reordered or replayed onto a different pyramid file, and a
+ * journal left over from before a checkpoint is ignored.
+ */
+
+// PyramidJournal constructor.  The journal is not usable until it has been
+// reset or replayed.
+PyramidJournal::PyramidJournal(int journal_fd, unsigned char *key) {
+  this->journal_fd = journal_fd;
+  this->key = key;
+  size = 0;
+  memset(chain, 0, SIGLEN);
+  unsigned mac_key_length = SIGLEN;
+  HMAC(EVP_sha384(), key, KEY_LENGTH, (const unsigned char*) JOURNAL_MAC_LABEL, strlen(JOURNAL_MAC_LABEL), mac_key, &mac_key_length);
+}
+
+// PyramidJournal destructor.  Closes the journal without flushing it.
+PyramidJournal::~PyramidJournal() {
+  if (journal_fd >= 0) close(journal_fd);
+}
+
+/*
+ * Function: record
+ *
+ * Description: This function records that a slot of a pyramid level has
+ *              changed, to be written to the journal by the next flush.
+ *
+ * Inputs:
+ *  level - The level of the slot.
+ *  slot - The index of the slot in the identifiers of the level.
+ *  id - The identifier now stored in the slot, or -1 if it is empty.
+ */
+void PyramidJournal::record(unsigned level, size_t slot, long id) {
+  pending.push_back((long) level);
+  pending.push_back((long) slot);
+  pending.push_back(id);
+}
+
+/*
+ * Function: frame_mac
+ *
+ * Description: This function computes the HMAC of a frame.  The frame must be
+ *              preceded in memory by SIGLEN bytes holding the HMAC it chains
+ *              from.
+ *
+ * Inputs:
+ *  frame - The frame, excluding its HMAC.
+ *  frame_length - The length of the frame, in bytes, excluding its HMAC.
+ *
+ * Outputs:
+ *  mac - The HMAC, SIGLEN bytes, is stored here.
+ */
+void PyramidJournal::frame_mac(unsigned char *frame, size_t frame_length, unsigned char *mac) {
+  unsigned mac_length = SIGLEN;
+  HMAC(EVP_sha384(), mac_key, SIGLEN, frame - SIGLEN, SIGLEN + frame_length, mac, &mac_length);
+}
+
+/*
+ * Function: flush
+ *
+ * Description: This function appends the changes recorded since the last flush
+ *              to the journal as one frame, with a single write.  Nothing is
+ *              written if there are none.
+ *
+ * Return value:
+ *  0 upon success.
+ *  -1 if no random nonce could be generated, or encryption failed.
+ *  -2 if a call to write failed or wrote fewer bytes than expected; the
+ *   changes are kept for the next flush.
+ */
+int PyramidJournal::flush() {
+  if (pending.empty()) return 0;
+  uint32_t records_length = (uint32_t) (pending.size() * sizeof(long));
+  size_t frame_length = KEY_LENGTH + sizeof(records_length) + records_length;
+  vector<unsigned char> buffer(SIGLEN + frame_length + SIGLEN);
+  unsigned char *frame = buffer.data() + SIGLEN;
+  memcpy(buffer.data(), chain, SIGLEN);
+  if (RAND_bytes(frame, KEY_LENGTH) != 1) return -1;
+  memcpy(frame + KEY_LENGTH, &records_length, sizeof(records_length));
+
+  EVP_CIPHER_CTX *context = EVP_CIPHER_CTX_new();
+  int encrypted_bytes = 0;
+  int final_bytes = 0;
+  unsigned char *encrypted = frame + KEY_LENGTH + sizeof(records_length);
+  bool encrypt_ok = EVP_EncryptInit(context, EVP_aes_128_ofb(), key, frame) &&
+    EVP_EncryptUpdate(context, encrypted, &encrypted_bytes, (unsigned char*) pending.data(), records_length) &&
+    EVP_EncryptFinal(context, encrypted + encrypted_bytes, &final_bytes);
+  EVP_CIPHER_CTX_free(context);
+  if (!encrypt_ok) return -1;
+
+  unsigned char *mac = frame + frame_length;
+  frame_mac(frame, frame_length, mac);
+  ssize_t written = pwrite(journal_fd, frame, frame_length + SIGLEN, size);
+  if (written != (ssize_t) (frame_length + SIGLEN)) {
+    if (written > 0) ftruncate(journal_fd, size);
+    return -2;
+  }
+  size += frame_length + SIGLEN;
+  memcpy(chain, mac, SIGLEN);
+  pending.clear();
+  return 0;
+}
+
+/*
+ * Function: reset
+ *
+ * Description: This function empties the journal, after the pyramid it
+ *              describes has been written out in full, so that it starts again
+ *              from that pyramid file.
+ *
+ * Inputs:
+ *  digest - The signature of the pyramid file written.
+ *
+ * Return value:
+ *  0 upon success.
+ *  -1 if a call to ftruncate or fsync failed; check errno.
+ */
+int PyramidJournal::reset(unsigned char *digest) {
+  pending.clear();
+  if (ftruncate(journal_fd, 0) || fsync(journal_fd)) return -1;
+  size = 0;
+  memcpy(chain, digest, SIGLEN);
+  return 0;
+}
+
+/*
+ * Function: replay
+ *
+ * Description: This function applies the changes in the journal to a pyramid
+ *              that has just been loaded from its pyramid file, adding levels
+ *              as needed.  Frames are checked and applied in order, stopping at
+ *              the first that is incomplete or whose HMAC does not match, as
+ *              left by a crash during a flush; the journal is truncated there,
+ *              so that later frames are appended after the last good one.  The
+ *              pyramid's position map is rebuilt afterwards.
+ *
+ * Inputs:
+ *  pyra - A pointer to the top level of the pyramid.
+ *  digest - The signature of the pyramid file it was loaded from.
+ *
+ * Return value:
+ *  The number of frames applied upon success.
+ *  -1 if a call to fstat or read failed; check errno.
+ *  -2 if a frame with a matching HMAC could not be decrypted or holds an
+ *   invalid record.
+ *  -3 if a call to ftruncate failed; check errno.
+ */
+int PyramidJournal::replay(Pyramid *pyra, unsigned char *digest) {
+  pending.clear();
+  memcpy(chain, digest, SIGLEN);
+  struct stat filestat;
+  if (fstat(journal_fd, &filestat)) return -1;
+  vector<unsigned char> buffer(SIGLEN + filestat.st_size);
+  if ((filestat.st_size > 0) && (pread(journal_fd, buffer.data() + SIGLEN, filestat.st_size, 0) != filestat.st_size)) return -1;
+
+  int frames = 0;
+  size_t offset = 0;
+  size_t header_length = KEY_LENGTH + sizeof(uint32_t);
+  while (offset + header_length + SIGLEN <= (size_t) filestat.st_size) {
+    unsigned char *frame = buffer.data() + SIGLEN + offset;
+    uint32_t records_length;
+    memcpy(&records_length, frame + KEY_LENGTH, sizeof(records_length));
+    size_t frame_length = header_length + records_length;
+    if ((records_length % (3 * sizeof(long)) != 0) || (offset + frame_length + SIGLEN > (size_t) filestat.st_size)) break;
+
+    // The HMAC is computed over the chained HMAC placed just before the frame,
+    // overwriting the end of the previous frame, which has been applied.
+    unsigned char mac[SIGLEN];
+    memcpy(frame - SIGLEN, chain, SIGLEN);
+    frame_mac(frame, frame_length, mac);
+    if (CRYPTO_memcmp(mac, frame + frame_length, SIGLEN) != 0) break;
+
+    vector<long> records(records_length / sizeof(long));
+    if ((records_length > 0) && (Pyramid::decrypt_pyramid(key, frame, frame + header_length, records.data(), records_length) < 0)) return -2;
+    for (size_t i = 0; i < records.size(); i += 3) {
+      if (apply_record(pyra, records[i], records[i + 1], records[i + 2]) < 0) return -2;
+    }
+    memcpy(chain, mac, SIGLEN);
+    offset += frame_length + SIGLEN;
+    ++frames;
+  }
+
+  if (offset < (size_t) filestat.st_size) {
+    if (ftruncate(journal_fd, offset)) return -3;
+  }
+  size = offset;
+  pyra->index_pyramid();
+  return frames;
+}
+
+/*
+ * Function: apply_record
+ *
+ * Description: This function applies one record of the journal to a pyramid.
+ *              A record for a level not yet loaded from a lazily opened
+ *              pyramid file is kept until it is (see defer_record); otherwise
+ *              the slot's chunk of the pyramid file is marked to be rewritten.
+ *              Either way, an identifier stored is placed in the pyramid
+ *              file's position map (see place_id).
+ *
+ * Inputs:
+ *  pyra - A pointer to the top level of the pyramid.
+ *  level - The level of the slot that changed.
+ *  slot - The index of the slot in the identifiers of the level.
+ *  id - The identifier now stored in the slot, or -1 if it is empty.
+ *
+ * Return value:
+ *  0 upon success.
+ *  -1 if the record is invalid.
+ */
+int PyramidJournal::apply_record(Pyramid *pyra, long level, long slot, long id) {
+  if ((level < 1) || (level > JOURNAL_MAX_LEVEL) || (slot < 0) || (id < -1L)) return -1;
+  Pyramid *this_level = pyra;
+  for (long i = 1; i < level; ++i) {
+    if (this_level->get_next_level() == NULL) {
+      new Pyramid(this_level, this_level->get_pyramid_fd(), this_level->get_key());
+    }
+    this_level = this_level->get_next_level();
+  }
+  if ((size_t) slot >= this_level->how_many_ids()) return -1;
+  if ((id >= 0) && (this_level->get_snapshot() != NULL)) this_level->get_snapshot()->place_id(id, (unsigned) level, (size_t) slot);
+  if (!this_level->is_loaded()) {
+    this_level->get_snapshot()->defer_record((unsigned) level, (size_t) slot, id);
+    return 0;
+  }
+  this_level->get_identifiers()[slot] = id;
+  if (this_level->get_snapshot() != NULL) this_level->get_snapshot()->mark_dirty((unsigned) level, (size_t) slot);
+  return 0;
+}
+
+int PyramidJournal::get_journal_fd() {return journal_fd;}
+off_t PyramidJournal::get_size() {return size;}
@@ -0,0 +1,1582 @@
+#include "pyramid_project.h"
+
+/*
+ * A pyramid file is written in the Merkle tree format.  It starts with a
+ * header of fixed length: the SNAPSHOT_MAGIC_LENGTH bytes of
+ * SNAPSHOT_TREE_MAGIC, a SIGLEN-byte HMAC-SHA384 of the rest of the header
+ * (excluding itself), the number of levels as a 32-bit integer, and room for
+ * the SIGLEN-byte root of each of 2 * JOURNAL_MAX_LEVEL Merkle trees: those of
+ * up to JOURNAL_MAX_LEVEL levels, then those of their slices of the position
+ * map.  The region of each level follows, level 1 first, holding the level's
+ * encrypted identifiers, then the nonce of each of its chunks, then the nodes
+ * of its tree, and then the region of the level's slice of the position map,
+ * laid out in the same way.  Since the header's length does not depend on the
+ * number of levels, neither does where a region starts.
+ *
+ * The position map records where each block identifier is stored: the slice
+ * of level k holds an entry for each of the 4^k identifiers that follow those
+ * of the slices above it, which is the level holding it, shifted left by
+ * SNAPSHOT_SLOT_BITS, plus its slot there, or 0 if no level holds it.  A slice
+ * is split into chunks and authenticated exactly as a level is, so that the
+ * entry of one identifier can be read and verified on its own (see find_id).
+ *
+ * The identifiers of a level are split into chunks of MERKLE_CHUNK_SIZE bytes
+ * (a smaller level is a single chunk), and each chunk is encrypted with
+ * AES-128-CTR under the pyramid's key and a nonce of its own, drawn afresh
+ * whenever the chunk is rewritten.  The leaves of the level's tree are SHA-384
+ * hashes of each chunk's level, index, nonce and encrypted identifiers, and
+ * each node above is the SHA-384 hash of its two children.  The nodes are
+ * stored in heap order from the root, the children of node i (counting the
+ * root as 1) being nodes 2i and 2i+1.  Since the header authenticates every
+ * root, any chunk can be checked on its own from the hashes on its path (see
+ * load_chunk), and a write rewrites only the chunks that have changed and
+ * the nodes above them.  The header's HMAC is the signature the journal chains
+ * from.
+ *
+ * Those rewrites are not made in place directly, as a crash part way through
+ * would leave new chunks under old roots.  They are first written to the patch
+ * log "[pyramid file]_patch", which is synced before any of them is applied and
+ * emptied once all of them have been.  The log holds SNAPSHOT_PATCH_MAGIC, the
+ * HMAC of the header it applies to, then each patch as a 64-bit offset in the
+ * pyramid file, a 32-bit length and the bytes to write there, then an end
+ * marker (an offset of all ones) carrying the HMAC of the new header, and
+ * finally an HMAC-SHA384 of all of the above.  A complete log found when the
+ * file is next opened is applied again, unless the file's header is intact and
+ * is neither the one it applies to nor the one it produces.
+ *
+ * Files in the original format (a SHA-384 signature, a nonce, and every level
+ * encrypted with AES-128-OFB as one stream) do not start with
+ * SNAPSHOT_TREE_MAGIC, and are read by pyramid_open itself.  A pyramid read
+ * from one is written out whole in the Merkle tree format.
+ */
+
+// Runs work over the indices 0 to count - 1, split into contiguous ranges
+// across the available cores when there are at least MERKLE_THREAD_CHUNKS of
+// them for each thread.
+static void run_parallel(size_t count, const function<void(size_t, size_t)> &work) {
+  size_t threads = min((size_t) thread::hardware_concurrency(), count / MERKLE_THREAD_CHUNKS);
+  if (threads <= 1) {
+    work(0, count);
+    return;
+  }
+  vector<thread> workers;
+  for (size_t t = 0; t < threads; ++t) {
+    workers.push_back(thread(work, count * t / threads, count * (t + 1) / threads));
+  }
+  for (size_t t = 0; t < threads; ++t) {
+    workers[t].join();
+  }
+}
+
+// Reads length bytes at offset, however many calls to pread that takes.
+// Returns 0 upon success, -1 if pread failed, or -2 if the file ended first.
+static int read_fully(int fd, void *buffer, size_t length, off_t offset) {
+  for (size_t done = 0; done < length; ) {
+    ssize_t readreturn = pread(fd, (unsigned char*) buffer + done, length - done, offset + done);
+    if (readreturn < 0) return -1;
+    if (readreturn == 0) return -2;
+    done += readreturn;
+  }
+  return 0;
+}
+
+// Writes length bytes at offset.  Returns true upon success.
+static bool write_fully(int fd, const void *buffer, size_t length, off_t offset) {
+  return pwrite(fd, buffer, length, offset) == (ssize_t) length;
+}
+
+// Syncs the directory holding the file named path, so that a file renamed into
+// it stays renamed.  Returns true upon success.
+static bool sync_directory(const char *path) {
+  const char *slash = strrchr(path, '/');
+  size_t directory_len = (slash == NULL) ? 1 : max((size_t) 1, (size_t) (slash - path));
+  char *directory = new char[directory_len + 1];
+  if (slash == NULL) strcpy(directory, ".");
+  else snprintf(directory, directory_len + 1, "%s", path);
+  int directory_fd = open(directory, O_RDONLY|O_DIRECTORY);
+  delete[] directory;
+  if (directory_fd < 0) return false;
+  bool synced = (fsync(directory_fd) == 0);
+  close(directory_fd);
+  return synced;
+}
+
+// PyramidSnapshot constructor.  The snapshot describes nothing until a header
+// has been read or a pyramid written.  pyramid_filename is the name of the
+// file open as pyramid_fd, which a whole write replaces.
+PyramidSnapshot::PyramidSnapshot(int pyramid_fd, const char *pyramid_filename, unsigned char *key) {
+  this->pyramid_fd = pyramid_fd;
+  this->pyramid_filename = new char[strlen(pyramid_filename) + 1];
+  strcpy(this->pyramid_filename, pyramid_filename);
+  this->key = key;
+  updatable = false;
+  num_levels = 0;
+  tags = NULL;
+  patch_fd = -1;
+  patch_size = 0;
+  patch_mac = NULL;
+  found_id = -1;
+  found_return = 0;
+  found_level = 0;
+  found_slot = 0;
+  memset(header_mac, 0, SIGLEN);
+  unsigned mac_key_length = SIGLEN;
+  HMAC(EVP_sha384(), key, KEY_LENGTH, (const unsigned char*) SNAPSHOT_MAC_LABEL, strlen(SNAPSHOT_MAC_LABEL), mac_key, &mac_key_length);
+}
+
+// PyramidSnapshot destructor.  Does not close the pyramid file.
+PyramidSnapshot::~PyramidSnapshot() {
+  delete[] pyramid_filename;
+  if (tags != NULL) delete[] tags;
+  if (patch_mac != NULL) EVP_MAC_CTX_free(patch_mac);
+  if (patch_fd >= 0) close(patch_fd);
+}
+
+/*
+ * Function: tree_level
+ *
+ * Description: This function returns the level a Merkle tree belongs to.  The
+ *              tree of a level is numbered as the level, and the tree of its
+ *              slice of the position map as map_tree gives; the functions that
+ *              take a level also take the number of either tree.
+ *
+ * Inputs:
+ *  tree - The number of the tree.
+ *
+ * Return value:
+ *  The level.
+ */
+unsigned PyramidSnapshot::tree_level(unsigned tree) {
+  return (tree > JOURNAL_MAX_LEVEL) ? tree - JOURNAL_MAX_LEVEL : tree;
+}
+
+/*
+ * Function: map_tree
+ *
+ * Description: This function returns the number of the Merkle tree of a
+ *              level's slice of the position map, which is also the index of
+ *              its root in the header.
+ *
+ * Inputs:
+ *  level - The level.
+ *
+ * Return value:
+ *  The number of the tree.
+ */
+unsigned PyramidSnapshot::map_tree(unsigned level) {
+  return JOURNAL_MAX_LEVEL + level;
+}
+
+/*
+ * Function: map_slot
+ *
+ * Description: This function finds the entry of a block identifier in the
+ *              position map.
+ *
+ * Inputs:
+ *  id - The identifier.
+ *
+ * Outputs:
+ *  level - The level whose slice holds the entry is stored here.
+ *  index - The index of the entry in the slice is stored here.
+ *
+ * Return value:
+ *  true upon success; false if the identifier is beyond the slices of
+ *   JOURNAL_MAX_LEVEL levels.
+ */
+bool PyramidSnapshot::map_slot(long id, unsigned *level, size_t *index) {
+  size_t first = 0;
+  for (unsigned k = 1; (k <= JOURNAL_MAX_LEVEL) && (id >= 0); ++k) {
+    size_t count = (size_t) 1 << (2 * k);
+    if ((size_t) id < first + count) {
+      *level = k;
+      *index = (size_t) id - first;
+      return true;
+    }
+    first += count;
+  }
+  return false;
+}
+
+/*
+ * Function: level_bytes
+ *
+ * Description: This function calculates the length of the identifiers of a
+ *              level, which is also that of its slice of the position map.
+ *
+ * Inputs:
+ *  level - The level, or a tree (see tree_level).
+ *
+ * Return value:
+ *  The length, in bytes.
+ */
+size_t PyramidSnapshot::level_bytes(unsigned level) {
+  return sizeof(long) << (2 * tree_level(level));
+}
+
+/*
+ * Function: chunk_bytes
+ *
+ * Description: This function calculates the length of each chunk of the
+ *              identifiers of a level: MERKLE_CHUNK_SIZE, or the whole level
+ *              if it is smaller.
+ *
+ * Inputs:
+ *  level - The level, or a tree (see tree_level).
+ *
+ * Return value:
+ *  The length, in bytes.
+ */
+size_t PyramidSnapshot::chunk_bytes(unsigned level) {
+  return min((size_t) MERKLE_CHUNK_SIZE, level_bytes(level));
+}
+
+/*
+ * Function: num_chunks
+ *
+ * Description: This function calculates how many chunks, and thus leaves of
+ *              its Merkle tree, a level has.  It is always a power of two.
+ *
+ * Inputs:
+ *  level - The level, or a tree (see tree_level).
+ *
+ * Return value:
+ *  The number of chunks.
+ */
+size_t PyramidSnapshot::num_chunks(unsigned level) {
+  return level_bytes(level) / chunk_bytes(level);
+}
+
+/*
+ * Function: region_bytes
+ *
+ * Description: This function calculates the length of the region of a level,
+ *              or of its slice of the position map, in a pyramid file in the
+ *              Merkle tree format.
+ *
+ * Inputs:
+ *  level - The level, or a tree (see tree_level).
+ *
+ * Return value:
+ *  The length, in bytes.
+ */
+size_t PyramidSnapshot::region_bytes(unsigned level) {
+  size_t chunks = num_chunks(level);
+  return level_bytes(level) + chunks * KEY_LENGTH + (2 * chunks - 1) * SIGLEN;
+}
+
+/*
+ * Function: region_offset
+ *
+ * Description: This function calculates where the region of a level, or of
+ *              its slice of the position map, starts in a pyramid file in the
+ *              Merkle tree format.
+ *
+ * Inputs:
+ *  tree - The level, or a tree (see tree_level).
+ *
+ * Return value:
+ *  The offset, in bytes.
+ */
+off_t PyramidSnapshot::region_offset(unsigned tree) {
+  unsigned level = tree_level(tree);
+  off_t offset = SNAPSHOT_MAGIC_LENGTH + SIGLEN + sizeof(uint32_t) + 2 * JOURNAL_MAX_LEVEL * SIGLEN;
+  for (unsigned i = 1; i < level; ++i) {
+    offset += 2 * region_bytes(i);
+  }
+  if (tree != level) offset += region_bytes(level);
+  return offset;
+}
+
+/*
+ * Function: file_size
+ *
+ * Description: This function calculates the size of a pyramid file holding a
+ *              number of levels, in the format write produces.
+ *
+ * Inputs:
+ *  levels - The number of levels.
+ *
+ * Return value:
+ *  The size of the file, in bytes.
+ */
+off_t PyramidSnapshot::file_size(unsigned levels) {
+  return region_offset(map_tree(levels)) + region_bytes(levels);
+}
+
+/*
+ * Function: level_state
+ *
+ * Description: This function returns the Merkle tree and changes kept for a
+ *              level, adding room for them if needed.
+ *
+ * Inputs:
+ *  level - The level, or a tree (see tree_level).
+ *
+ * Return value:
+ *  A pointer to the level's state.
+ */
+SnapshotLevel* PyramidSnapshot::level_state(unsigned level) {
+  if (levels.size() < level) levels.resize(level);
+  return &levels[level - 1];
+}
+
+/*
+ * Function: new_mac
+ *
+ * Description: This function creates an HMAC-SHA384 context keyed with the
+ *              snapshot's HMAC key.  The caller frees it with
+ *              EVP_MAC_CTX_free.
+ *
+ * Return value:
+ *  The context upon success; NULL if it could not be created.
+ */
+EVP_MAC_CTX* PyramidSnapshot::new_mac() {
+  EVP_MAC *hmac = EVP_MAC_fetch(NULL, "HMAC", NULL);
+  if (hmac == NULL) return NULL;
+  EVP_MAC_CTX *context = EVP_MAC_CTX_new(hmac);
+  EVP_MAC_free(hmac);
+  if (context == NULL) return NULL;
+  OSSL_PARAM params[2];
+  params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char*) "SHA384", 0);
+  params[1] = OSSL_PARAM_construct_end();
+  if (!EVP_MAC_init(context, mac_key, SIGLEN, params)) {
+    EVP_MAC_CTX_free(context);
+    return NULL;
+  }
+  return context;
+}
+
+/*
+ * Function: compute_header_mac
+ *
+ * Description: This function computes the HMAC of a header, which covers all
+ *              of it but the HMAC itself.
+ *
+ * Inputs:
+ *  header - The header.
+ *  length - The length of the header, in bytes.
+ *
+ * Outputs:
+ *  mac - The HMAC, SIGLEN bytes, is stored here.
+ *
+ * Return value:
+ *  true upon success; false if the HMAC could not be computed.
+ */
+bool PyramidSnapshot::compute_header_mac(unsigned char *header, size_t length, unsigned char *mac) {
+  EVP_MAC_CTX *context = new_mac();
+  size_t mac_length = 0;
+  size_t rest = SNAPSHOT_MAGIC_LENGTH + SIGLEN;
+  bool mac_ok = (context != NULL) &&
+    EVP_MAC_update(context, header, SNAPSHOT_MAGIC_LENGTH) &&
+    EVP_MAC_update(context, header + rest, length - rest) &&
+    EVP_MAC_final(context, mac, &mac_length, SIGLEN) && (mac_length == SIGLEN);
+  EVP_MAC_CTX_free(context);
+  return mac_ok;
+}
+
+/*
+ * Function: leaf_hash
+ *
+ * Description: This function computes the leaf of a level's Merkle tree for
+ *              one of its chunks.
+ *
+ * Inputs:
+ *  level - The level, or a tree (see tree_level).
+ *  chunk - The index of the chunk in the level.
+ *  chunk_nonce - The nonce the chunk was encrypted with.
+ *  encrypted - The encrypted identifiers of the chunk.
+ *
+ * Outputs:
+ *  leaf - The hash, SIGLEN bytes, is stored here.
+ *
+ * Return value:
+ *  true upon success; false if the hash could not be computed.
+ */
+bool PyramidSnapshot::leaf_hash(unsigned level, size_t chunk, const unsigned char *chunk_nonce, const unsigned char *encrypted, unsigned char *leaf) {
+  unsigned char kind = 0;
+  uint32_t level_number = (uint32_t) level;
+  uint64_t chunk_number = (uint64_t) chunk;
+  unsigned hash_length = SIGLEN;
+  EVP_MD_CTX *context = EVP_MD_CTX_create();
+  bool hash_ok = (context != NULL) &&
+    EVP_DigestInit_ex(context, EVP_sha384(), NULL) &&
+    EVP_DigestUpdate(context, &kind, sizeof(kind)) &&
+    EVP_DigestUpdate(context, &level_number, sizeof(level_number)) &&
+    EVP_DigestUpdate(context, &chunk_number, sizeof(chunk_number)) &&
+    EVP_DigestUpdate(context, chunk_nonce, KEY_LENGTH) &&
+    EVP_DigestUpdate(context, encrypted, chunk_bytes(level)) &&
+    EVP_DigestFinal_ex(context, leaf, &hash_length) && (hash_length == SIGLEN);
+  EVP_MD_CTX_destroy(context);
+  return hash_ok;
+}
+
+/*
+ * Function: node_hash
+ *
+ * Description: This function computes a node of a Merkle tree above its two
+ *              children.
+ *
+ * Inputs:
+ *  children - The hashes of the left and the right child, one after the
+ *   other.
+ *
+ * Outputs:
+ *  node - The hash, SIGLEN bytes, is stored here.
+ *
+ * Return value:
+ *  true upon success; false if the hash could not be computed.
+ */
+bool PyramidSnapshot::node_hash(const unsigned char *children, unsigned char *node) {
+  unsigned char kind = 1;
+  unsigned hash_length = SIGLEN;
+  EVP_MD_CTX *context = EVP_MD_CTX_create();
+  bool hash_ok = (context != NULL) &&
+    EVP_DigestInit_ex(context, EVP_sha384(), NULL) &&
+    EVP_DigestUpdate(context, &kind, sizeof(kind)) &&
+    EVP_DigestUpdate(context, children, 2 * SIGLEN) &&
+    EVP_DigestFinal_ex(context, node, &hash_length) && (hash_length == SIGLEN);
+  EVP_MD_CTX_destroy(context);
+  return hash_ok;
+}
+
+/*
+ * Function: crypt_chunk
+ *
+ * Description: This function encrypts or decrypts one chunk with AES-128-CTR.
+ *
+ * Inputs:
+ *  chunk_nonce - The chunk's nonce, used as the initial counter.
+ *  from - The chunk to encrypt or decrypt.
+ *  length - The length of the chunk, in bytes.
+ *
+ * Outputs:
+ *  to - The result is stored here.  May be the same as from.
+ *
+ * Return value:
+ *  true upon success; false if the chunk could not be encrypted.
+ */
+bool PyramidSnapshot::crypt_chunk(const unsigned char *chunk_nonce, const unsigned char *from, unsigned char *to, size_t length) {
+  int crypted_bytes = 0;
+  EVP_CIPHER_CTX *cipher = EVP_CIPHER_CTX_new();
+  bool crypt_ok = (cipher != NULL) &&
+    EVP_EncryptInit(cipher, EVP_aes_128_ctr(), key, chunk_nonce) &&
+    EVP_EncryptUpdate(cipher, to, &crypted_bytes, from, (int) length) &&
+    (crypted_bytes == (int) length);
+  EVP_CIPHER_CTX_free(cipher);
+  return crypt_ok;
+}
+
+/*
+ * Function: seal_chunk
+ *
+ * Description: This function encrypts one chunk of a level under a new nonce
+ *              and computes its leaf.  Different chunks of a level may be
+ *              sealed at the same time.
+ *
+ * Inputs:
+ *  level - The level, or a tree (see tree_level).
+ *  chunk - The index of the chunk in the level.
+ *  plain - The identifiers of the chunk.
+ *
+ * Outputs:
+ *  encrypted - The encrypted identifiers are stored here.
+ *  chunk_nonce - The new nonce, KEY_LENGTH bytes, is stored here.
+ *  leaf - The leaf, SIGLEN bytes, is stored here.
+ *
+ * Return value:
+ *  true upon success; false if no nonce could be generated, or the chunk
+ *   could not be encrypted or hashed.
+ */
+bool PyramidSnapshot::seal_chunk(unsigned level, size_t chunk, const unsigned char *plain, unsigned char *encrypted, unsigned char *chunk_nonce, unsigned char *leaf) {
+  return (RAND_bytes(chunk_nonce, KEY_LENGTH) == 1) &&
+    crypt_chunk(chunk_nonce, plain, encrypted, chunk_bytes(level)) &&
+    leaf_hash(level, chunk, chunk_nonce, encrypted, leaf);
+}
+
+/*
+ * Function: build_tree
+ *
+ * Description: This function computes the nodes of a level's Merkle tree
+ *              above its leaves.  Only the nodes marked in changed are
+ *              computed, if it is given; a node must be marked if any leaf
+ *              below it is.
+ *
+ * Inputs:
+ *  level - The level, or a tree (see tree_level).
+ *  changed - NULL, or which nodes to compute, indexed from the root as 1.
+ *
+ * Return value:
+ *  true upon success; false if a hash could not be computed.
+ */
+bool PyramidSnapshot::build_tree(unsigned level, const vector<bool> *changed) {
+  unsigned char *nodes = levels[level - 1].nodes.data();
+  for (size_t i = num_chunks(level) - 1; i >= 1; --i) {
+    if ((changed != NULL) && !(*changed)[i]) continue;
+    if (!node_hash(nodes + (2 * i - 1) * SIGLEN, nodes + (i - 1) * SIGLEN)) return false;
+  }
+  return true;
+}
+
+/*
+ * Function: read_header
+ *
+ * Description: This function reads and verifies the header of the pyramid
+ *              file, leaving the identifiers of every level to be loaded with
+ *              load_level.  A write that a crash left part way through
+ *              applying its patch log is finished first (see
+ *              apply_patch_log).
+ *
+ * Return value:
+ *  1 upon success.
+ *  0 if the file does not start with SNAPSHOT_TREE_MAGIC; it is in the
+ *   original format.
+ *  -1 if a call to pread failed, or the patch log could not be applied; check
+ *   errno.
+ *  -2 if the file is too short to hold its header.
+ *  -3 if the header's HMAC does not match, or it could not be computed.
+ */
+int PyramidSnapshot::read_header() {
+  size_t patch_filename_len = strlen(pyramid_filename) + 7;
+  char *patch_filename = new char[patch_filename_len];
+  snprintf(patch_filename, patch_filename_len, "%s_patch", pyramid_filename);
+  if (patch_fd < 0) patch_fd = open(patch_filename, O_RDWR);
+  delete[] patch_filename;
+  if ((patch_fd < 0) && (errno != ENOENT)) return -1;
+  if ((patch_fd >= 0) && (apply_patch_log(true) < 0)) return -1;
+
+  unsigned char magic[SNAPSHOT_MAGIC_LENGTH];
+  ssize_t readreturn = pread(pyramid_fd, magic, SNAPSHOT_MAGIC_LENGTH, 0);
+  if (readreturn < 0) return -1;
+  if ((readreturn < SNAPSHOT_MAGIC_LENGTH) || memcmp(magic, SNAPSHOT_TREE_MAGIC, SNAPSHOT_MAGIC_LENGTH)) return 0;
+
+  // The number of levels comes just before the roots.
+  off_t count_offset = SNAPSHOT_MAGIC_LENGTH + SIGLEN;
+  uint32_t level_count;
+  int read_return = read_fully(pyramid_fd, &level_count, sizeof(level_count), count_offset);
+  if (read_return < 0) return read_return;
+  if ((level_count == 0) || (level_count > JOURNAL_MAX_LEVEL)) return -3;
+
+  off_t tags_offset = count_offset + sizeof(level_count);
+  vector<unsigned char> header(region_offset(1));
+  read_return = read_fully(pyramid_fd, header.data(), header.size(), 0);
+  if (read_return < 0) return read_return;
+  unsigned char mac[SIGLEN];
+  if (!compute_header_mac(header.data(), header.size(), mac) ||
+      CRYPTO_memcmp(mac, header.data() + SNAPSHOT_MAGIC_LENGTH, SIGLEN)) {
+    return -3;
+  }
+  updatable = true;
+  num_levels = level_count;
+  memcpy(header_mac, header.data() + SNAPSHOT_MAGIC_LENGTH, SIGLEN);
+  if (tags != NULL) delete[] tags;
+  tags = new unsigned char[2 * JOURNAL_MAX_LEVEL * SIGLEN];
+  memcpy(tags, header.data() + tags_offset, 2 * JOURNAL_MAX_LEVEL * SIGLEN);
+  levels.clear();
+  levels.resize(num_levels);
+  found_id = -1;
+  return 1;
+}
+
+/*
+ * Function: load_level
+ *
+ * Description: This function reads the identifiers of one level from the
+ *              pyramid file, verifies and decrypts them, without touching any
+ *              other level.  Every chunk is hashed and decrypted, across the
+ *              available cores, and the level's tree is built from the leaves
+ *              and checked against its root.  The tree is kept, so that the
+ *              chunks that change can be rewritten on their own.
+ *
+ * Inputs:
+ *  level - The level to load.
+ *
+ * Outputs:
+ *  identifiers - The 4^level identifiers of the level are stored here, with
+ *   the changes deferred for it by defer_record applied.
+ *
+ * Return value:
+ *  0 upon success.
+ *  -1 if level is not in the file, or a call to pread failed; check errno.
+ *  -2 if the file ends before the level does.
+ *  -3 if the level does not match its root.
+ *  -4 if the level could not be decrypted, or its hashes computed.
+ */
+int PyramidSnapshot::load_level(unsigned level, long *identifiers) {
+  if ((level < 1) || (level > num_levels)) return -1;
+  unsigned char *buffer = (unsigned char*) identifiers;
+  size_t chunks = num_chunks(level);
+  size_t length = chunk_bytes(level);
+  SnapshotLevel *state = level_state(level);
+  off_t offset = region_offset(level);
+  state->nonces.resize(chunks * KEY_LENGTH);
+  state->nodes.assign((2 * chunks - 1) * SIGLEN, 0);
+  int read_return = read_fully(pyramid_fd, buffer, level_bytes(level), offset);
+  if (read_return == 0) read_return = read_fully(pyramid_fd, state->nonces.data(), state->nonces.size(), offset + level_bytes(level));
+  if (read_return < 0) {
+    state->nodes.clear();
+    return read_return;
+  }
+
+  atomic<bool> opened(true);
+  run_parallel(chunks, [&](size_t begin, size_t end) {
+    for (size_t chunk = begin; chunk < end; ++chunk) {
+      unsigned char *chunk_nonce = state->nonces.data() + chunk * KEY_LENGTH;
+      unsigned char *data = buffer + chunk * length;
+      unsigned char *leaf = state->nodes.data() + (chunks + chunk - 1) * SIGLEN;
+      if (!leaf_hash(level, chunk, chunk_nonce, data, leaf) || !crypt_chunk(chunk_nonce, data, data, length)) {
+        opened = false;
+      }
+    }
+  });
+  if (!opened || !build_tree(level, NULL)) {
+    state->nodes.clear();
+    return -4;
+  }
+  if (CRYPTO_memcmp(state->nodes.data(), tags + (level - 1) * SIGLEN, SIGLEN)) {
+    state->nodes.clear();
+    return -3;
+  }
+  state->dirty.assign(chunks, false);
+  state->known.clear();
+
+  // Apply the changes deferred while the level was not loaded.
+  for (map<size_t, vector<long> >::iterator changes = state->deferred.begin(); changes != state->deferred.end(); ++changes) {
+    for (size_t i = 0; i < changes->second.size(); i += 2) {
+      identifiers[changes->second[i]] = changes->second[i + 1];
+      mark_dirty(level, (size_t) changes->second[i]);
+    }
+  }
+  state->deferred.clear();
+  found_id = -1;
+  return 0;
+}
+
+/*
+ * Function: tree_node
+ *
+ * Description: This function returns a node of a level's Merkle tree, if it
+ *              is held here: the level's whole tree once it has been loaded or
+ *              written, or otherwise the nodes load_chunk has verified.
+ *
+ * Inputs:
+ *  level - The level, or a tree (see tree_level).
+ *  node - The index of the node, counting the root as 1.
+ *
+ * Return value:
+ *  A pointer to the node, SIGLEN bytes; NULL if it is not held.
+ */
+const unsigned char* PyramidSnapshot::tree_node(unsigned level, size_t node) {
+  SnapshotLevel *state = level_state(level);
+  if (!state->nodes.empty()) return state->nodes.data() + (node - 1) * SIGLEN;
+  map<size_t, vector<unsigned char> >::iterator found = state->known.find(node);
+  return (found == state->known.end()) ? NULL : found->second.data();
+}
+
+/*
+ * Function: load_chunk
+ *
+ * Description: This function reads one chunk of a level from the pyramid
+ *              file, verifies it against the level's root, and decrypts it,
+ *              reading only the chunk, its nonce, and the sibling of each node
+ *              on its path up to the first node already verified, so that it
+ *              takes time logarithmic in the size of the level at most.  The
+ *              nodes it verifies are kept for later calls (see tree_node).
+ *
+ * Inputs:
+ *  level - The level, or a tree (see tree_level).
+ *  chunk - The index of the chunk in the level.
+ *
+ * Outputs:
+ *  plain - The chunk_bytes(level) bytes of identifiers of the chunk, as they
+ *   are in the file, are stored here.
+ *
+ * Return value:
+ *  0 upon success.
+ *  -1 if the file is not in the Merkle tree format, the chunk is not in it, or
+ *   a call to pread failed; check errno.
+ *  -2 if the file ends before the chunk or its path does.
+ *  -3 if the chunk does not match the level's root.
+ *  -4 if the chunk could not be decrypted, or a hash computed.
+ */
+int PyramidSnapshot::load_chunk(unsigned level, size_t chunk, unsigned char *plain) {
+  if ((level < 1) || (tree_level(level) > num_levels) || (chunk >= num_chunks(level))) return -1;
+  size_t chunks = num_chunks(level);
+  size_t length = chunk_bytes(level);
+  off_t offset = region_offset(level);
+  off_t nodes_offset = offset + level_bytes(level) + chunks * KEY_LENGTH;
+  unsigned char chunk_nonce[KEY_LENGTH];
+  int read_return = read_fully(pyramid_fd, plain, length, offset + chunk * length);
+  if (read_return == 0) read_return = read_fully(pyramid_fd, chunk_nonce, KEY_LENGTH, offset + level_bytes(level) + chunk * KEY_LENGTH);
+  if (read_return < 0) return read_return;
+
+  // Hash up from the leaf, with the node so far on the left of its sibling if
+  // it is a left child (an even index), and on the right otherwise, until a
+  // node that is already trusted is reached.  The nodes passed and siblings
+  // read on the way are verified along with the chunk.
+  map<size_t, vector<unsigned char> > path;
+  unsigned char children[2 * SIGLEN];
+  size_t node = chunks + chunk;
+  unsigned char *current = children + (node % 2) * SIGLEN;
+  if (!leaf_hash(level, chunk, chunk_nonce, plain, current)) return -4;
+  const unsigned char *trusted;
+  while ((trusted = (node == 1) ? tags + (level - 1) * SIGLEN : tree_node(level, node)) == NULL) {
+    path[node].assign(current, current + SIGLEN);
+    size_t sibling = node ^ 1;
+    unsigned char *other = children + (sibling % 2) * SIGLEN;
+    const unsigned char *held = tree_node(level, sibling);
+    if (held != NULL) memcpy(other, held, SIGLEN);
+    else {
+      read_return = read_fully(pyramid_fd, other, SIGLEN, nodes_offset + (sibling - 1) * SIGLEN);
+      if (read_return < 0) return read_return;
+      path[sibling].assign(other, other + SIGLEN);
+    }
+    node /= 2;
+    current = children + (node % 2) * SIGLEN;
+    if (!node_hash(children, current)) return -4;
+  }
+  if (CRYPTO_memcmp(current, trusted, SIGLEN)) return -3;
+  level_state(level)->known.insert(path.begin(), path.end());
+  return crypt_chunk(chunk_nonce, plain, plain, length) ? 0 : -4;
+}
+
+/*
+ * Function: apply_deferred
+ *
+ * Description: This function applies the records deferred for one chunk of a
+ *              level, or of a slice of the position map, to the chunk, in the
+ *              order they were deferred.
+ *
+ * Inputs:
+ *  level - The level, or a tree (see tree_level).
+ *  chunk - The index of the chunk in the level.
+ *  ids - The identifiers or entries of the chunk.
+ *
+ * Outputs:
+ *  ids - The changed identifiers or entries are stored here.
+ */
+void PyramidSnapshot::apply_deferred(unsigned level, size_t chunk, long *ids) {
+  if (levels.size() < level) return;
+  map<size_t, vector<long> >::iterator changes = levels[level - 1].deferred.find(chunk);
+  if (changes == levels[level - 1].deferred.end()) return;
+  size_t first_slot = chunk * (chunk_bytes(level) / sizeof(long));
+  for (size_t i = 0; i < changes->second.size(); i += 2) {
+    ids[changes->second[i] - first_slot] = changes->second[i + 1];
+  }
+}
+
+/*
+ * Function: locate_unloaded
+ *
+ * Description: This function finds where a block identifier that is not in any
+ *              level that has been loaded is stored, without loading a level.
+ *              Its entry is read from the chunk of the position map that holds
+ *              it, and the slot the entry names from the chunk of the level
+ *              that holds it, both verified (see load_chunk) and with the
+ *              records deferred for them applied.  The slot must hold the
+ *              identifier for it to count as found.
+ *
+ * Inputs:
+ *  id - The identifier.
+ *
+ * Outputs:
+ *  level - If the identifier is found, the level holding it is stored here.
+ *  slot - If the identifier is found, its slot in the level is stored here.
+ *
+ * Return value:
+ *  1 if the identifier was found in a level that has not been loaded.
+ *  0 if no level that has not been loaded holds it.
+ *  -1 if this cannot be told without loading the levels: the file is not in
+ *   the Merkle tree format, the identifier is beyond the position map, or the
+ *   map does not agree with the level it names.
+ *  -2 if a chunk could not be read from the pyramid file, or does not match
+ *   its root.
+ */
+int PyramidSnapshot::locate_unloaded(long id, unsigned *level, size_t *slot) {
+  unsigned map_level;
+  size_t index;
+  if ((num_levels == 0) || !map_slot(id, &map_level, &index)) return -1;
+  unsigned tree = map_tree(map_level);
+  size_t per_chunk = chunk_bytes(tree) / sizeof(long);
+  size_t chunk = index / per_chunk;
+  vector<long> entries(per_chunk, 0);
+  if ((map_level <= num_levels) && (load_chunk(tree, chunk, (unsigned char*) entries.data()) < 0)) return -2;
+  apply_deferred(tree, chunk, entries.data());
+  long entry = entries[index - chunk * per_chunk];
+  if (entry == 0) return 0;
+
+  // A level that has been loaded would have been searched already.
+  *level = (unsigned) (entry >> SNAPSHOT_SLOT_BITS);
+  *slot = (size_t) (entry & ((1L << SNAPSHOT_SLOT_BITS) - 1));
+  if ((*level < 1) || (*level > num_levels) || (*slot >= level_bytes(*level) / sizeof(long))) return -1;
+  if (!level_state(*level)->nodes.empty()) return -1;
+  per_chunk = chunk_bytes(*level) / sizeof(long);
+  chunk = *slot / per_chunk;
+  vector<long> ids(per_chunk);
+  if (load_chunk(*level, chunk, (unsigned char*) ids.data()) < 0) return -2;
+  apply_deferred(*level, chunk, ids.data());
+  return (ids[*slot - chunk * per_chunk] == id) ? 1 : -1;
+}
+
+/*
+ * Function: write
+ *
+ * Description: This function writes the pyramid structure to the pyramid file
+ *              in the Merkle tree format, then syncs the file.  If the file is
+ *              already in that format and the last write succeeded, only the
+ *              chunks that have changed since (see mark_dirty) are encrypted
+ *              and hashed again and rewritten, with the nodes above them, along
+ *              with any level added since; of a level that has not been loaded,
+ *              only the chunks changed by deferred records (see defer_record)
+ *              are read, verified and rewritten, and the rewrites go through
+ *              the patch log, so that a crash leaves the file as it was or lets
+ *              the next read_header finish them.  Otherwise the file is
+ *              rewritten whole, and every level must have been loaded: it is
+ *              written and synced as "[pyramid file].tmp", which is then
+ *              renamed over the pyramid file, and the rename synced, so that a
+ *              crash at any point leaves either the old file or the new one.
+ *              pyramid_fd then refers to the new file.  The header, which comes
+ *              first in the file, is written last.
+ *
+ * Inputs:
+ *  pyra - A pointer to the top level of the pyramid.
+ *
+ * Return value:
+ *  0 upon success; the snapshot then describes the file written.
+ *  -1 if the identifiers could not be encrypted or hashed, or the pyramid has
+ *   too many levels.
+ *  -2 if a call to pwrite didn't write as many bytes as was expected, a call to
+ *   fsync failed, or the patch log could not be written or applied.
+ *  -3 if a hash or the header's HMAC could not be computed.
+ *  -4 if the new file could not be created, or could not replace the pyramid
+ *   file; check errno.
+ *  -5 if a chunk of a level that has not been loaded could not be read from
+ *   the pyramid file, or does not match the level's root.
+ */
+int PyramidSnapshot::write(Pyramid *pyra) {
+  unsigned new_levels = pyra->how_many_levels();
+  if (new_levels > JOURNAL_MAX_LEVEL) return -1;
+  bool whole = !updatable;
+
+  // Until this write succeeds, the file no longer matches what is kept here,
+  // so the next one must rewrite it whole.  A whole write goes to a new file,
+  // which only replaces the pyramid file once it is complete and synced.
+  updatable = false;
+  int target_fd = pyramid_fd;
+  size_t temporary_len = strlen(pyramid_filename) + 5;
+  char *temporary_filename = new char[temporary_len];
+  snprintf(temporary_filename, temporary_len, "%s.tmp", pyramid_filename);
+  if (whole) {
+    target_fd = open(temporary_filename, O_CREAT|O_TRUNC|O_RDWR, S_IRUSR|S_IWUSR);
+    if (target_fd < 0) {
+      delete[] temporary_filename;
+      return -4;
+    }
+  }
+  vector<unsigned char> roots;
+  unsigned char new_header_mac[SIGLEN];
+  int return_value = 0;
+  if (!whole && !begin_patch_log()) return_value = -2;
+  if (return_value == 0) return_value = write_tree(pyra, target_fd, whole, &roots, new_header_mac);
+  if ((return_value == 0) && whole) {
+    // A log left over from an update that failed to apply no longer applies.
+    if (rename(temporary_filename, pyramid_filename)) return_value = -4;
+    else if ((dup2(target_fd, pyramid_fd) < 0) || !sync_directory(pyramid_filename)) return_value = -4;
+    else if ((patch_fd >= 0) && (ftruncate(patch_fd, 0) || fsync(patch_fd))) return_value = -2;
+  }
+  else if (return_value == 0) {
+    if (!commit_patch_log(new_header_mac) || (apply_patch_log(false) < 0)) return_value = -2;
+  }
+  if (whole) {
+    if (return_value < 0) unlink(temporary_filename);
+    close(target_fd);
+  }
+  delete[] temporary_filename;
+
+  // Every deferred record is now in the file, and the new nodes of the trees
+  // updated without being loaded hold.  After a failure, the nodes verified
+  // earlier may no longer match it.  The whole trees of the position map are
+  // not kept, as it is only ever read a chunk at a time.
+  for (size_t i = 0; i < levels.size(); ++i) {
+    SnapshotLevel *state = &levels[i];
+    if (return_value < 0) state->known.clear();
+    else {
+      for (map<size_t, vector<unsigned char> >::iterator node = state->staged.begin(); node != state->staged.end(); ++node) {
+        state->known[node->first].swap(node->second);
+      }
+      state->deferred.clear();
+    }
+    state->staged.clear();
+    if (i >= JOURNAL_MAX_LEVEL) {
+      vector<unsigned char>().swap(state->nonces);
+      vector<unsigned char>().swap(state->nodes);
+      vector<bool>().swap(state->dirty);
+    }
+  }
+  found_id = -1;
+  if (return_value < 0) return return_value;
+
+  updatable = true;
+  num_levels = new_levels;
+  if (tags != NULL) delete[] tags;
+  tags = new unsigned char[roots.size()];
+  memcpy(tags, roots.data(), roots.size());
+  memcpy(header_mac, new_header_mac, SIGLEN);
+  return 0;
+}
+
+/*
+ * Function: write_tree
+ *
+ * Description: This function does the work of write: it writes the regions of
+ *              the levels to a file, the whole of every level or only what has
+ *              changed, along with each level's slice of the position map,
+ *              then the header, and syncs the file.  When only what has
+ *              changed is written, the rewrites and the header go to the patch
+ *              log started by begin_patch_log instead.
+ *
+ * Inputs:
+ *  pyra - A pointer to the top level of the pyramid.
+ *  fd - The file descriptor of the file to write.
+ *  whole - True to write every level whole, to an empty file; false to update
+ *   the pyramid file (fd) through the patch log.
+ *
+ * Outputs:
+ *  roots - The root of every tree, SIGLEN bytes each, is stored here, indexed
+ *   by tree - 1 (see tree_level).
+ *  new_header_mac - The HMAC of the header written, SIGLEN bytes, is stored
+ *   here.
+ *
+ * Return value: As for write.
+ */
+int PyramidSnapshot::write_tree(Pyramid *pyra, int fd, bool whole, vector<unsigned char> *roots, unsigned char *new_header_mac) {
+  unsigned new_levels = pyra->how_many_levels();
+  roots->assign(2 * JOURNAL_MAX_LEVEL * SIGLEN, 0);
+  if (!whole) memcpy(roots->data(), tags, roots->size());
+  bool added = false;
+  for (Pyramid *p = pyra; p != NULL; p = p->get_next_level()) {
+    unsigned level = p->get_level();
+    for (unsigned tree = level; tree <= map_tree(level); tree += JOURNAL_MAX_LEVEL) {
+      SnapshotLevel *state = level_state(tree);
+      int tree_return = 0;
+      if (whole || (level > num_levels)) {
+        if (tree == level) {
+          const unsigned char *plain = (unsigned char*) p->get_identifiers();
+          size_t length = chunk_bytes(tree);
+          tree_return = write_level(tree, [plain, length](size_t first, size_t) {return plain + first * length;}, fd);
+        }
+        else tree_return = write_map(pyra, level, whole, fd);
+        added = true;
+      }
+      else if ((tree == level) && p->is_loaded()) tree_return = update_level(p);
+      else if (!state->deferred.empty()) tree_return = update_chunks(tree);
+      else continue;
+      if (tree_return < 0) return tree_return;
+      memcpy(roots->data() + (tree - 1) * SIGLEN, state->staged.empty() ? state->nodes.data() : state->staged[1].data(), SIGLEN);
+    }
+  }
+
+  // A level added to the file lies beyond the end of the old one, so it is
+  // written in place, but must be on disk before any header that includes it.
+  if (!whole && added && fsync(fd)) return -2;
+
+  vector<unsigned char> header(region_offset(1), 0);
+  uint32_t level_count = (uint32_t) new_levels;
+  memcpy(header.data(), SNAPSHOT_TREE_MAGIC, SNAPSHOT_MAGIC_LENGTH);
+  memcpy(header.data() + SNAPSHOT_MAGIC_LENGTH + SIGLEN, &level_count, sizeof(level_count));
+  memcpy(header.data() + SNAPSHOT_MAGIC_LENGTH + SIGLEN + sizeof(level_count), roots->data(), roots->size());
+  if (!compute_header_mac(header.data(), header.size(), new_header_mac)) return -3;
+  memcpy(header.data() + SNAPSHOT_MAGIC_LENGTH, new_header_mac, SIGLEN);
+  if (!whole) return log_patch(0, header.data(), header.size()) ? 0 : -2;
+  if (!write_fully(fd, header.data(), header.size(), 0) || fsync(fd)) return -2;
+  return 0;
+}
+
+/*
+ * Function: write_level
+ *
+ * Description: This function writes the whole region of a level, or of its
+ *              slice of the position map: every chunk is encrypted under a new
+ *              nonce and hashed, across the available cores,
+ *              MERKLE_BATCH_SIZE bytes at a time into a single buffer that is
+ *              written out before the next are, and then the tree is built
+ *              and written with the nonces.
+ *
+ * Inputs:
+ *  level - The level, or a tree (see tree_level).
+ *  plain - Called with the index of the first chunk of a batch and the number
+ *   of chunks in it, and returns the identifiers of those chunks, or their
+ *   entries of the slice, which must stay valid until the next call.
+ *  fd - The file descriptor of the file to write.
+ *
+ * Return value: As for write.
+ */
+int PyramidSnapshot::write_level(unsigned level, function<const unsigned char*(size_t, size_t)> plain, int fd) {
+  size_t chunks = num_chunks(level);
+  size_t length = chunk_bytes(level);
+  SnapshotLevel *state = level_state(level);
+  state->nonces.assign(chunks * KEY_LENGTH, 0);
+  state->nodes.assign((2 * chunks - 1) * SIGLEN, 0);
+  state->dirty.assign(chunks, false);
+
+  off_t offset = region_offset(level);
+  size_t batch_chunks = max((size_t) 1, (size_t) MERKLE_BATCH_SIZE / length);
+  unsigned char *batch = new unsigned char[min(chunks, batch_chunks) * length];
+  int return_value = 0;
+  for (size_t first = 0; (first < chunks) && (return_value == 0); first += batch_chunks) {
+    size_t count = min(batch_chunks, chunks - first);
+    const unsigned char *batch_plain = plain(first, count);
+    atomic<bool> sealed(true);
+    run_parallel(count, [&](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; ++i) {
+        size_t chunk = first + i;
+        if (!seal_chunk(level, chunk, batch_plain + i * length, batch + i * length,
+                        state->nonces.data() + chunk * KEY_LENGTH, state->nodes.data() + (chunks + chunk - 1) * SIGLEN)) {
+          sealed = false;
+        }
+      }
+    });
+    if (!sealed) return_value = -1;
+    else if (!write_fully(fd, batch, count * length, offset + first * length)) return_value = -2;
+  }
+  delete[] batch;
+  if (return_value < 0) return return_value;
+
+  if (!build_tree(level, NULL)) return -3;
+  off_t nonces_offset = offset + level_bytes(level);
+  if (!write_fully(fd, state->nonces.data(), state->nonces.size(), nonces_offset) ||
+      !write_fully(fd, state->nodes.data(), state->nodes.size(), nonces_offset + state->nonces.size())) {
+    return -2;
+  }
+  return 0;
+}
+
+/*
+ * Function: write_map
+ *
+ * Description: This function writes the whole region of a level's slice of
+ *              the position map.  When the file is written whole, every level
+ *              has been loaded, and the entries are taken from the pyramid's
+ *              own position map; otherwise the level is new to the file, so
+ *              every identifier in the slice has been stored since it was last
+ *              written, and the entries are those placed since (see place_id).
+ *              The entries are filled in one batch of chunks at a time, as
+ *              write_level seals them.
+ *
+ * Inputs:
+ *  pyra - A pointer to the top level of the pyramid.
+ *  level - The level.
+ *  whole - True if the file is being written whole.
+ *  fd - The file descriptor of the file to write.
+ *
+ * Return value: As for write.
+ */
+int PyramidSnapshot::write_map(Pyramid *pyra, unsigned level, bool whole, int fd) {
+  unsigned tree = map_tree(level);
+  size_t per_chunk = chunk_bytes(tree) / sizeof(long);
+  size_t first_id = 0;
+  for (unsigned k = 1; k < level; ++k) {
+    first_id += (size_t) 1 << (2 * k);
+  }
+  vector<long> entries;
+  return write_level(tree, [&](size_t first, size_t count) {
+    entries.assign(count * per_chunk, 0);
+    for (size_t i = 0; i < entries.size(); ++i) {
+      size_t slot;
+      unsigned found = whole ? pyra->locate_id((long) (first_id + first * per_chunk + i), &slot) : 0;
+      if (found != 0) entries[i] = ((long) found << SNAPSHOT_SLOT_BITS) | (long) slot;
+      if (!whole && (i % per_chunk == 0)) apply_deferred(tree, first + i / per_chunk, entries.data() + i);
+    }
+    return (const unsigned char*) entries.data();
+  }, fd);
+}
+
+/*
+ * Function: update_level
+ *
+ * Description: This function rewrites the chunks of a level that have changed
+ *              since it was last written or loaded, each under a new nonce, and
+ *              the nodes of its tree above them, by adding them to the patch
+ *              log.  Runs of nodes that are next to each other in the file are
+ *              written together.
+ *
+ * Inputs:
+ *  p - A pointer to the level.
+ *
+ * Return value: As for write.
+ */
+int PyramidSnapshot::update_level(Pyramid *p) {
+  unsigned level = p->get_level();
+  size_t chunks = num_chunks(level);
+  size_t length = chunk_bytes(level);
+  SnapshotLevel *state = level_state(level);
+  vector<size_t> changed_chunks;
+  for (size_t chunk = 0; chunk < chunks; ++chunk) {
+    if (state->dirty[chunk]) changed_chunks.push_back(chunk);
+  }
+  if (changed_chunks.empty()) return 0;
+
+  unsigned char *plain = (unsigned char*) p->get_identifiers();
+  off_t offset = region_offset(level);
+  off_t nonces_offset = offset + level_bytes(level);
+  size_t batch_chunks = max((size_t) 1, (size_t) MERKLE_BATCH_SIZE / length);
+  unsigned char *batch = new unsigned char[min(changed_chunks.size(), batch_chunks) * length];
+  int return_value = 0;
+  for (size_t first = 0; (first < changed_chunks.size()) && (return_value == 0); first += batch_chunks) {
+    size_t count = min(batch_chunks, changed_chunks.size() - first);
+    atomic<bool> sealed(true);
+    run_parallel(count, [&](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; ++i) {
+        size_t chunk = changed_chunks[first + i];
+        if (!seal_chunk(level, chunk, plain + chunk * length, batch + i * length,
+                        state->nonces.data() + chunk * KEY_LENGTH, state->nodes.data() + (chunks + chunk - 1) * SIGLEN)) {
+          sealed = false;
+        }
+      }
+    });
+    if (!sealed) return_value = -1;
+    for (size_t i = 0; (i < count) && (return_value == 0); ++i) {
+      size_t chunk = changed_chunks[first + i];
+      if (!log_patch(offset + chunk * length, batch + i * length, length) ||
+          !log_patch(nonces_offset + chunk * KEY_LENGTH, state->nonces.data() + chunk * KEY_LENGTH, KEY_LENGTH)) {
+        return_value = -2;
+      }
+    }
+  }
+  delete[] batch;
+  if (return_value < 0) return return_value;
+
+  // Mark the leaves of the changed chunks and every node above them, then
+  // recompute the marked nodes from the bottom up.
+  vector<bool> changed(2 * chunks, false);
+  for (size_t i = 0; i < changed_chunks.size(); ++i) {
+    for (size_t node = chunks + changed_chunks[i]; (node >= 1) && !changed[node]; node /= 2) {
+      changed[node] = true;
+    }
+  }
+  if (!build_tree(level, &changed)) return -3;
+  off_t nodes_offset = nonces_offset + chunks * KEY_LENGTH;
+  for (size_t node = 1; node < 2 * chunks; ) {
+    if (!changed[node]) {
+      ++node;
+      continue;
+    }
+    size_t run = node;
+    while ((run < 2 * chunks) && changed[run]) ++run;
+    if (!log_patch(nodes_offset + (node - 1) * SIGLEN, state->nodes.data() + (node - 1) * SIGLEN, (run - node) * SIGLEN)) {
+      return -2;
+    }
+    node = run;
+  }
+  state->dirty.assign(chunks, false);
+  return 0;
+}
+
+/*
+ * Function: update_chunks
+ *
+ * Description: This function applies the records deferred for a level that
+ *              has not been loaded, or for a slice of the position map, to the
+ *              pyramid file without loading the rest of it: each chunk they
+ *              touch is read and verified (see load_chunk), changed, and added
+ *              to the patch log under a new nonce, and the nodes above those
+ *              chunks are recomputed from the verified siblings on their paths
+ *              and added to the log too.  The new nodes are staged until the
+ *              write succeeds.
+ *
+ * Inputs:
+ *  level - The level, or a tree (see tree_level).
+ *
+ * Return value: As for write.
+ */
+int PyramidSnapshot::update_chunks(unsigned level) {
+  SnapshotLevel *state = level_state(level);
+  size_t chunks = num_chunks(level);
+  size_t length = chunk_bytes(level);
+  off_t offset = region_offset(level);
+  off_t nonces_offset = offset + level_bytes(level);
+  off_t nodes_offset = nonces_offset + chunks * KEY_LENGTH;
+  state->staged.clear();
+  vector<unsigned char> plain(length), encrypted(length);
+  vector<size_t> row;
+  for (map<size_t, vector<long> >::iterator changes = state->deferred.begin(); changes != state->deferred.end(); ++changes) {
+    size_t chunk = changes->first;
+    if (load_chunk(level, chunk, plain.data()) < 0) return -5;
+    apply_deferred(level, chunk, (long*) plain.data());
+    unsigned char chunk_nonce[KEY_LENGTH];
+    vector<unsigned char> *leaf = &state->staged[chunks + chunk];
+    leaf->resize(SIGLEN);
+    if (!seal_chunk(level, chunk, plain.data(), encrypted.data(), chunk_nonce, leaf->data())) return -1;
+    if (!log_patch(offset + chunk * length, encrypted.data(), length) ||
+        !log_patch(nonces_offset + chunk * KEY_LENGTH, chunk_nonce, KEY_LENGTH) ||
+        !log_patch(nodes_offset + (chunks + chunk - 1) * SIGLEN, leaf->data(), SIGLEN)) {
+      return -2;
+    }
+    row.push_back(chunks + chunk);
+  }
+
+  // Work up the tree a row at a time, each parent of a changed node taking
+  // its other child from the nodes verified when its chunks were loaded.
+  while (!row.empty() && (row[0] > 1)) {
+    vector<size_t> parents;
+    for (size_t i = 0; i < row.size(); ++i) {
+      if (parents.empty() || (parents.back() != row[i] / 2)) parents.push_back(row[i] / 2);
+    }
+    for (size_t i = 0; i < parents.size(); ++i) {
+      size_t node = parents[i];
+      unsigned char children[2 * SIGLEN];
+      for (size_t child = 2 * node; child <= 2 * node + 1; ++child) {
+        map<size_t, vector<unsigned char> >::iterator fresh = state->staged.find(child);
+        const unsigned char *hash = (fresh != state->staged.end()) ? fresh->second.data() : tree_node(level, child);
+        if (hash == NULL) return -5;
+        memcpy(children + (child - 2 * node) * SIGLEN, hash, SIGLEN);
+      }
+      vector<unsigned char> *parent = &state->staged[node];
+      parent->resize(SIGLEN);
+      if (!node_hash(children, parent->data())) return -3;
+      if (!log_patch(nodes_offset + (node - 1) * SIGLEN, parent->data(), SIGLEN)) return -2;
+    }
+    row.swap(parents);
+  }
+  return 0;
+}
+
+/*
+ * Function: begin_patch_log
+ *
+ * Description: This function starts a new patch log for a write that updates
+ *              the pyramid file, creating the log if it does not exist.
+ *              Nothing reaches the log file until it fills a buffer of
+ *              MERKLE_BATCH_SIZE bytes or is committed.
+ *
+ * Return value:
+ *  true upon success; false if the log could not be created or its HMAC
+ *   started.
+ */
+bool PyramidSnapshot::begin_patch_log() {
+  if (patch_fd < 0) {
+    size_t patch_filename_len = strlen(pyramid_filename) + 7;
+    char *patch_filename = new char[patch_filename_len];
+    snprintf(patch_filename, patch_filename_len, "%s_patch", pyramid_filename);
+    patch_fd = open(patch_filename, O_CREAT|O_RDWR, S_IRUSR|S_IWUSR);
+    delete[] patch_filename;
+    if ((patch_fd < 0) || !sync_directory(pyramid_filename)) return false;
+  }
+  if (patch_mac != NULL) EVP_MAC_CTX_free(patch_mac);
+  patch_mac = new_mac();
+  if (patch_mac == NULL) return false;
+  patch_size = 0;
+  patch_buffer.clear();
+  patch_buffer.insert(patch_buffer.end(), SNAPSHOT_PATCH_MAGIC, SNAPSHOT_PATCH_MAGIC + SNAPSHOT_MAGIC_LENGTH);
+  patch_buffer.insert(patch_buffer.end(), header_mac, header_mac + SIGLEN);
+  return EVP_MAC_update(patch_mac, patch_buffer.data(), patch_buffer.size());
+}
+
+/*
+ * Function: log_patch
+ *
+ * Description: This function adds bytes to be written to the pyramid file to
+ *              the patch log, as pieces of at most MERKLE_BATCH_SIZE bytes.
+ *
+ * Inputs:
+ *  offset - The offset in the pyramid file to write the bytes at.
+ *  data - The bytes.
+ *  length - The number of bytes.
+ *
+ * Return value:
+ *  true upon success; false if the log could not be written.
+ */
+bool PyramidSnapshot::log_patch(uint64_t offset, const unsigned char *data, size_t length) {
+  do {
+    uint32_t piece = (uint32_t) min(length, (size_t) MERKLE_BATCH_SIZE);
+    size_t start = patch_buffer.size();
+    patch_buffer.insert(patch_buffer.end(), (unsigned char*) &offset, (unsigned char*) &offset + sizeof(offset));
+    patch_buffer.insert(patch_buffer.end(), (unsigned char*) &piece, (unsigned char*) &piece + sizeof(piece));
+    patch_buffer.insert(patch_buffer.end(), data, data + piece);
+    if (!EVP_MAC_update(patch_mac, patch_buffer.data() + start, patch_buffer.size() - start)) return false;
+    if (patch_buffer.size() >= MERKLE_BATCH_SIZE) {
+      if (!write_fully(patch_fd, patch_buffer.data(), patch_buffer.size(), patch_size)) return false;
+      patch_size += patch_buffer.size();
+      patch_buffer.clear();
+    }
+    offset += piece;
+    data += piece;
+    length -= piece;
+  } while (length > 0);
+  return true;
+}
+
+/*
+ * Function: commit_patch_log
+ *
+ * Description: This function ends the patch log with the HMAC of the header it
+ *              produces and the HMAC of the log itself, writes out what is
+ *              left of it, and syncs it.  Once this returns, the log will be
+ *              applied even if a crash interrupts the write.
+ *
+ * Inputs:
+ *  new_header_mac - The HMAC of the new header.
+ *
+ * Return value:
+ *  true upon success; false if the log could not be written or synced.
+ */
+bool PyramidSnapshot::commit_patch_log(const unsigned char *new_header_mac) {
+  if (!log_patch(UINT64_MAX, new_header_mac, SIGLEN)) return false;
+  size_t start = patch_buffer.size();
+  size_t mac_length = 0;
+  patch_buffer.resize(start + SIGLEN);
+  bool mac_ok = EVP_MAC_final(patch_mac, patch_buffer.data() + start, &mac_length, SIGLEN) && (mac_length == SIGLEN);
+  EVP_MAC_CTX_free(patch_mac);
+  patch_mac = NULL;
+  if (!mac_ok || !write_fully(patch_fd, patch_buffer.data(), patch_buffer.size(), patch_size)) return false;
+  patch_size += patch_buffer.size();
+  patch_buffer.clear();
+  return !ftruncate(patch_fd, patch_size) && !fsync(patch_fd);
+}
+
+/*
+ * Function: scan_patch_log
+ *
+ * Description: This function reads the patch log from start to end, reading
+ *              it a window of twice MERKLE_BATCH_SIZE bytes at a time, and
+ *              either checks that it is complete and matches its HMAC, or
+ *              writes each of its patches to the pyramid file.
+ *
+ * Inputs:
+ *  applying - True to write the patches; false to check the log.
+ *
+ * Outputs:
+ *  base - The HMAC of the header the log applies to is stored here.
+ *  target - The HMAC of the header the log produces is stored here.
+ *
+ * Return value:
+ *  1 if the log is complete and matches its HMAC, or its patches were written.
+ *  0 if the log is empty, incomplete, or does not match its HMAC.
+ *  -1 if a call to pread or pwrite failed; check errno.
+ */
+int PyramidSnapshot::scan_patch_log(bool applying, unsigned char *base, unsigned char *target) {
+  struct stat patch_stat;
+  if (fstat(patch_fd, &patch_stat)) return -1;
+  off_t size = patch_stat.st_size;
+  vector<unsigned char> window(2 * MERKLE_BATCH_SIZE);
+  off_t window_start = 0;
+  size_t window_length = 0;
+  bool read_failed = false;
+  auto fetch = [&](off_t position, size_t length) -> unsigned char* {
+    if ((position + (off_t) length > size) || (length > window.size())) return NULL;
+    if ((position < window_start) || (position + (off_t) length > window_start + (off_t) window_length)) {
+      window_start = position;
+      window_length = (size_t) min((off_t) window.size(), size - position);
+      if (read_fully(patch_fd, window.data(), window_length, position) < 0) {
+        read_failed = true;
+        return NULL;
+      }
+    }
+    return window.data() + (position - window_start);
+  };
+
+  EVP_MAC_CTX *mac = applying ? NULL : new_mac();
+  if (!applying && (mac == NULL)) return -1;
+  int return_value = 0;
+  off_t position = SNAPSHOT_MAGIC_LENGTH + SIGLEN;
+  unsigned char *start = fetch(0, position);
+  if ((start != NULL) && !memcmp(start, SNAPSHOT_PATCH_MAGIC, SNAPSHOT_MAGIC_LENGTH) &&
+      (applying || EVP_MAC_update(mac, start, position))) {
+    memcpy(base, start + SNAPSHOT_MAGIC_LENGTH, SIGLEN);
+    for (;;) {
+      uint64_t offset;
+      uint32_t length;
+      unsigned char *entry = fetch(position, sizeof(offset) + sizeof(length));
+      if (entry == NULL) break;
+      memcpy(&offset, entry, sizeof(offset));
+      memcpy(&length, entry + sizeof(offset), sizeof(length));
+      if (length > MERKLE_BATCH_SIZE) break;
+      size_t entry_length = sizeof(offset) + sizeof(length) + length;
+      entry = fetch(position, entry_length);
+      if ((entry == NULL) || (!applying && !EVP_MAC_update(mac, entry, entry_length))) break;
+      position += entry_length;
+      unsigned char *data = entry + sizeof(offset) + sizeof(length);
+      if (offset == UINT64_MAX) {
+        if (length != SIGLEN) break;
+        memcpy(target, data, SIGLEN);
+        if (applying) {
+          return_value = 1;
+          break;
+        }
+        unsigned char computed[SIGLEN];
+        size_t mac_length = 0;
+        unsigned char *stored = fetch(position, SIGLEN);
+        if ((stored != NULL) && (position + SIGLEN == size) &&
+            EVP_MAC_final(mac, computed, &mac_length, SIGLEN) && (mac_length == SIGLEN) &&
+            !CRYPTO_memcmp(computed, stored, SIGLEN)) {
+          return_value = 1;
+        }
+        break;
+      }
+      if (applying && !write_fully(pyramid_fd, data, length, (off_t) offset)) {
+        read_failed = true;
+        break;
+      }
+    }
+  }
+  if (mac != NULL) EVP_MAC_CTX_free(mac);
+  return read_failed ? -1 : return_value;
+}
+
+/*
+ * Function: apply_patch_log
+ *
+ * Description: This function writes the patches in the patch log to the
+ *              pyramid file, syncs it, and then empties the log.  A log that
+ *              is incomplete or does not match its HMAC was never committed,
+ *              so the pyramid file was never patched from it, and it is only
+ *              emptied.  When recovering, a complete log is also only emptied
+ *              if the file's header is intact but is neither the one the log
+ *              applies to nor the one it produces.
+ *
+ * Inputs:
+ *  recovering - True when the file is being opened; false when the log has
+ *   just been committed by write.
+ *
+ * Return value:
+ *  0 upon success.
+ *  -1 if the log could not be read or applied, the pyramid file could not be
+ *   synced, or, when not recovering, the log does not match its HMAC.
+ */
+int PyramidSnapshot::apply_patch_log(bool recovering) {
+  unsigned char base[SIGLEN], target[SIGLEN];
+  int scan_return = scan_patch_log(false, base, target);
+  if (scan_return < 0) return -1;
+  bool applying = (scan_return > 0);
+  if (!applying && !recovering) return -1;
+
+  if (applying && recovering) {
+    // A header torn by the crash is rewritten by the log's last patch.
+    vector<unsigned char> header(region_offset(1));
+    int read_return = read_fully(pyramid_fd, header.data(), header.size(), 0);
+    if (read_return == -1) return -1;
+    unsigned char mac[SIGLEN];
+    unsigned char *stored = header.data() + SNAPSHOT_MAGIC_LENGTH;
+    if ((read_return < 0) || memcmp(header.data(), SNAPSHOT_TREE_MAGIC, SNAPSHOT_MAGIC_LENGTH)) {
+      applying = false;
+    }
+    else if (compute_header_mac(header.data(), header.size(), mac) && !CRYPTO_memcmp(mac, stored, SIGLEN)) {
+      applying = !memcmp(stored, base, SIGLEN) || !memcmp(stored, target, SIGLEN);
+    }
+  }
+  if (applying && ((scan_patch_log(true, base, target) <= 0) || fsync(pyramid_fd))) return -1;
+  if (ftruncate(patch_fd, 0) || fsync(patch_fd)) return -1;
+  return 0;
+}
+
+/*
+ * Function: mark_dirty
+ *
+ * Description: This function records that a slot of a level has changed, so
+ *              that its chunk is rewritten by the next write.  Changes to a
+ *              level whose tree is not held here are not recorded, as they
+ *              are deferred instead (see defer_record), or the whole level is
+ *              written then anyway.
+ *
+ * Inputs:
+ *  level - The level of the slot.
+ *  slot - The index of the slot in the identifiers of the level.
+ */
+void PyramidSnapshot::mark_dirty(unsigned level, size_t slot) {
+  if ((level < 1) || (level > levels.size())) return;
+  SnapshotLevel *state = &levels[level - 1];
+  if (state->dirty.empty()) return;
+  state->dirty[slot * sizeof(long) / chunk_bytes(level)] = true;
+}
+
+/*
+ * Function: defer_record
+ *
+ * Description: This function keeps a change to a level that has not been
+ *              loaded, as replayed from the journal, to be applied when the
+ *              level is loaded, or written by the next write to the chunks
+ *              they touch alone (see update_chunks), so that replaying does
+ *              not load it.  Changes are applied in the order they were
+ *              deferred.
+ *
+ * Inputs:
+ *  level - The level of the slot that changed.
+ *  slot - The index of the slot in the identifiers of the level.
+ *  id - The identifier now stored in the slot, or -1 if it is empty.
+ */
+void PyramidSnapshot::defer_record(unsigned level, size_t slot, long id) {
+  vector<long> *changes = &level_state(level)->deferred[slot * sizeof(long) / chunk_bytes(level)];
+  changes->push_back((long) slot);
+  changes->push_back(id);
+  found_id = -1;
+}
+
+/*
+ * Function: place_id
+ *
+ * Description: This function records that a block identifier has been stored
+ *              in a slot, so that its entry in the position map is rewritten
+ *              by the next write.  An identifier is only ever removed from a
+ *              slot to be stored in another, so removals are not recorded.
+ *
+ * Inputs:
+ *  id - The identifier.
+ *  level - The level it is now stored at.
+ *  slot - The index of its slot in the identifiers of the level.
+ */
+void PyramidSnapshot::place_id(long id, unsigned level, size_t slot) {
+  unsigned map_level;
+  size_t index;
+  if (!map_slot(id, &map_level, &index)) return;
+  defer_record(map_tree(map_level), index, ((long) level << SNAPSHOT_SLOT_BITS) | (long) slot);
+}
+
+/*
+ * Function: find_id
+ *
+ * Description: This function tells whether a block identifier that is not in
+ *              any level that has been loaded is stored in a given level that
+ *              has not, without loading it (see locate_unloaded).  The last
+ *              identifier looked up is remembered until anything changes, so
+ *              that asking about each level in turn reads the file only once.
+ *
+ * Inputs:
+ *  id - The identifier.
+ *  level - The level, which has not been loaded.
+ *
+ * Outputs:
+ *  slot - If the identifier is stored in the level, its slot is stored here.
+ *
+ * Return value:
+ *  1 if the identifier is stored in the level.
+ *  0 if it is not.
+ *  Otherwise, the error returned by locate_unloaded.
+ */
+int PyramidSnapshot::find_id(long id, unsigned level, size_t *slot) {
+  if (id != found_id) {
+    found_return = locate_unloaded(id, &found_level, &found_slot);
+    found_id = id;
+  }
+  if (found_return <= 0) return found_return;
+  if (found_level != level) return 0;
+  *slot = found_slot;
+  return 1;
+}
+
+/*
+ * Function: needs_levels
+ *
+ * Description: This function tells whether every level must be loaded before
+ *              the next write, because the file is to be rewritten whole.
+ *              Otherwise, a level that has not been loaded may be left as it
+ *              is, even if changes have been deferred for it.
+ *
+ * Return value:
+ *  true if every level must be loaded; false if none need be.
+ */
+bool PyramidSnapshot::needs_levels() {
+  return !updatable;
+}
+
+unsigned PyramidSnapshot::get_num_levels() {return num_levels;}
+unsigned char* PyramidSnapshot::get_header_mac() {return header_mac;}
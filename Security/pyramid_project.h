@@ -9,18 +9,212 @@
 #include <cstring>
 #include <cmath>
 #include <iostream>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <climits>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <thread>
+#include <atomic>
+#include <functional>
 
 #include <openssl/evp.h>
 #include <openssl/bn.h>
 #include <openssl/err.h>
 #include <openssl/rand.h>
+#include <openssl/hmac.h>
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#include <openssl/crypto.h>
 
 #define KEY_LENGTH 16
 #define SIGLEN (384 / 8)
 #define BLOCK_SIZE (1 << 12)
+#define RANDOM_POOL_SIZE 4096 // bytes drawn from RAND_bytes at a time
+#define BLOCK_RING_ENTRIES 64 // the submission queue size of a BlockRing
+#define MAPPING_SYNC_WRITES 64 // writes to a FileMapping between msyncs
+#define JOURNAL_MAC_LABEL "pyramid journal" // derives the journal's HMAC key
+#define JOURNAL_MAX_LEVEL 24 // the deepest level a journal record may name
+#define SNAPSHOT_TREE_MAGIC "PYRAMID3" // starts a pyramid file in the Merkle tree format
+#define SNAPSHOT_PATCH_MAGIC "PYRPATCH" // starts the patch log of a pyramid file
+#define SNAPSHOT_MAGIC_LENGTH 8
+#define MERKLE_CHUNK_SIZE 4096 // bytes of identifiers under each Merkle leaf
+#define SNAPSHOT_SLOT_BITS 48 // the low bits of a position map entry, holding the slot
+#define MERKLE_THREAD_CHUNKS 64 // the fewest chunks worth hashing on a thread
+#define MERKLE_BATCH_SIZE (1 << 20) // bytes sealed at a time by write (1 MiB)
+#define SNAPSHOT_MAC_LABEL "pyramid snapshot" // derives the snapshot's HMAC key
 
 using namespace std;
 
+/*
+ * The BlockLocation class records where a block identifier is stored in a
+ * pyramid.
+ */
+class BlockLocation {
+ public:
+  unsigned level; // the level holding the identifier, or 0 if it is absent
+  size_t slot; // the index of the identifier in that level's identifiers
+  size_t dense; // the index of the identifier in that level's occupied
+};
+
+/*
+ * The FileMapping class maps a data file into memory, so that blocks are read
+ * and written through the mapping rather than copied with read and write.
+ */
+class FileMapping {
+ private:
+  int file_fd;
+  unsigned char* data; // the mapping, or NULL if the file is not mapped
+  size_t size; // the size of the mapping, in bytes
+  size_t page_size;
+  vector<pair<size_t, size_t> > dirty; // the runs of pages written to since
+                                       // the last sync, as [first, end) page
+                                       // indices, in the order written
+  unsigned dirty_writes; // the number of writes since the last sync
+
+ public:
+  // Descriptions can be found in FileMapping.cpp.
+  FileMapping(int);
+  ~FileMapping();
+  int map_file();
+  int resize(off_t);
+  void touch_block(long, bool);
+  void mark_dirty(size_t, size_t);
+  int sync_file(bool);
+  unsigned char* get_data();
+  size_t get_size();
+};
+
+class Pyramid;
+class BlockRing;
+
+/*
+ * The PyramidJournal class records the changes made to a pyramid in an
+ * append-only, encrypted and authenticated journal file, so that they are
+ * persisted without writing out the whole pyramid.
+ */
+class PyramidJournal {
+ private:
+  int journal_fd;
+  unsigned char* key; // the pyramid's key, used for encryption
+  unsigned char mac_key[SIGLEN]; // derived from key, used for the HMACs
+  unsigned char chain[SIGLEN]; // the HMAC of the last frame written
+  vector<long> pending; // the records not yet written
+  off_t size; // the size of the journal file, in bytes
+
+  void frame_mac(unsigned char*, size_t, unsigned char*);
+  static int apply_record(Pyramid*, long, long, long);
+
+ public:
+  // Descriptions can be found in PyramidJournal.cpp.
+  PyramidJournal(int, unsigned char*);
+  ~PyramidJournal();
+  void record(unsigned, size_t, long);
+  int flush();
+  int reset(unsigned char*);
+  int replay(Pyramid*, unsigned char*);
+  int get_journal_fd();
+  off_t get_size();
+};
+
+/*
+ * The SnapshotLevel class holds what a PyramidSnapshot keeps about one level of
+ * a pyramid file, or one level's slice of its position map: its Merkle tree and
+ * the chunks changed since it was written.
+ */
+class SnapshotLevel {
+ public:
+  vector<unsigned char> nonces; // the nonce of each chunk, KEY_LENGTH bytes each
+  vector<unsigned char> nodes; // the nodes of the tree in heap order, SIGLEN
+                               // bytes each, or empty if it is not held
+  map<size_t, vector<unsigned char> > known; // the nodes verified by
+                                             // load_chunk while nodes is not
+                                             // held, by index from the root as 1
+  map<size_t, vector<unsigned char> > staged; // the nodes the write in progress
+                                              // gives them, until it succeeds
+  vector<bool> dirty; // whether each chunk has changed since it was written
+  map<size_t, vector<long> > deferred; // the slots and identifiers changed in
+                                       // each chunk before the level was loaded
+};
+
+/*
+ * The PyramidSnapshot class reads and writes a pyramid file in which each
+ * level is split into chunks authenticated by a Merkle tree of its own, so
+ * that any level can be loaded without reading the others, any chunk can be
+ * verified on its own, and only the chunks that have changed are rewritten.
+ * The file also holds a position map, so that a block can be found in a level
+ * that has not been loaded from two chunks of the file.
+ */
+class PyramidSnapshot {
+ private:
+  int pyramid_fd;
+  char* pyramid_filename; // a copy of the name of the pyramid file
+  unsigned char* key; // the pyramid's key, used for encryption
+  unsigned char mac_key[SIGLEN]; // derived from key, used for the HMACs
+  bool updatable; // true if the file can be updated in place by write
+  unsigned num_levels; // 0 if nothing has been read or written
+  unsigned char* tags; // the root of each tree, SIGLEN bytes each
+  unsigned char header_mac[SIGLEN]; // the HMAC of the header
+  vector<SnapshotLevel> levels; // indexed by level - 1, or by tree - 1 for the
+                                // trees of the position map (see map_tree)
+  long found_id; // the identifier find_id last looked up, or -1
+  int found_return; // what locate_unloaded returned for found_id
+  unsigned found_level; // where locate_unloaded found found_id
+  size_t found_slot;
+  int patch_fd; // the FD of the patch log, or -1 if it is not open
+  off_t patch_size; // the bytes of the log being written already in the file
+  vector<unsigned char> patch_buffer; // the rest of the log being written
+  EVP_MAC_CTX* patch_mac; // the HMAC of the log being written, or NULL
+
+  static unsigned tree_level(unsigned);
+  static unsigned map_tree(unsigned);
+  static bool map_slot(long, unsigned*, size_t*);
+  static size_t level_bytes(unsigned);
+  static size_t chunk_bytes(unsigned);
+  static size_t num_chunks(unsigned);
+  static size_t region_bytes(unsigned);
+  static off_t region_offset(unsigned);
+  SnapshotLevel* level_state(unsigned);
+  EVP_MAC_CTX* new_mac();
+  bool compute_header_mac(unsigned char*, size_t, unsigned char*);
+  bool leaf_hash(unsigned, size_t, const unsigned char*, const unsigned char*, unsigned char*);
+  static bool node_hash(const unsigned char*, unsigned char*);
+  bool crypt_chunk(const unsigned char*, const unsigned char*, unsigned char*, size_t);
+  bool seal_chunk(unsigned, size_t, const unsigned char*, unsigned char*, unsigned char*, unsigned char*);
+  bool build_tree(unsigned, const vector<bool>*);
+  const unsigned char* tree_node(unsigned, size_t);
+  int load_chunk(unsigned, size_t, unsigned char*);
+  void apply_deferred(unsigned, size_t, long*);
+  int locate_unloaded(long, unsigned*, size_t*);
+  int write_tree(Pyramid*, int, bool, vector<unsigned char>*, unsigned char*);
+  int write_level(unsigned, function<const unsigned char*(size_t, size_t)>, int);
+  int write_map(Pyramid*, unsigned, bool, int);
+  int update_level(Pyramid*);
+  int update_chunks(unsigned);
+  bool begin_patch_log();
+  bool log_patch(uint64_t, const unsigned char*, size_t);
+  bool commit_patch_log(const unsigned char*);
+  int scan_patch_log(bool, unsigned char*, unsigned char*);
+  int apply_patch_log(bool);
+
+ public:
+  // Descriptions can be found in PyramidSnapshot.cpp.
+  PyramidSnapshot(int, const char*, unsigned char*);
+  ~PyramidSnapshot();
+  static off_t file_size(unsigned);
+  int read_header();
+  int load_level(unsigned, long*);
+  void mark_dirty(unsigned, size_t);
+  void defer_record(unsigned, size_t, long);
+  void place_id(long, unsigned, size_t);
+  int find_id(long, unsigned, size_t*);
+  bool needs_levels();
+  int write(Pyramid*);
+  unsigned get_num_levels();
+  unsigned char* get_header_mac();
+};
+
 /*
  * The Pyramid class represents one level of a pyramid structure and contains
  * functions necessary for managing the pyramid.
@@ -30,8 +224,31 @@ class Pyramid {
   unsigned level; // the level in a file's pyramid that this object represents
   int pyramid_fd; // the FD of the pyramid file (not the read/write file itself)
   long* identifiers; // an array of block identifiers
+  long* occupied; // the identifiers stored at this level, with no gaps
+  size_t num_occupied;
+  size_t* free_slots; // a stack of the indices of empty identifiers
+  size_t num_free;
   Pyramid* next_level;
   unsigned char* key; // key used for encryption and decryption of the file
+  vector<BlockLocation>* locations; // indexed by block identifier; shared by
+                                    // all levels of the pyramid
+  FileMapping* mapping; // the mapping of the data file in mmap mode, or NULL;
+                        // only set on level 1
+  BlockRing* ring; // the ring block transfers of the data file are submitted
+                   // through, or NULL until the first; only set on level 1
+  PyramidJournal* journal; // the journal changes are recorded in, or NULL;
+                           // shared by all levels of the pyramid
+  PyramidSnapshot* snapshot; // the pyramid file levels are loaded from on
+                             // first touch, or NULL; shared by all levels
+  bool loaded; // false until this level has been loaded from snapshot
+
+  void set_location(long, unsigned, size_t, size_t);
+  void store_id(long);
+  void remove_id(long);
+  void record_change(size_t);
+  bool allocate_level();
+  void index_level();
+  static void count_bulk_ids(vector<size_t>*, unsigned, size_t);
 
  public:
   // Descriptions can be found in Pyramid.cpp.
@@ -43,6 +260,11 @@ class Pyramid {
   int move_id_in_pyramid(Pyramid*, long);
   long randomly_select_id_pyramid();
   int add_id_pyramid(long);
+  unsigned locate_id(long, size_t*);
+  void index_pyramid();
+  int ensure_loaded();
+  static Pyramid* bulk_load(int, unsigned char*, long);
+  static long random_below(size_t);
   int encrypt_pyramid(long*, long*, int, unsigned char*, long);
   static int decrypt_pyramid(unsigned char*, unsigned char*, unsigned char*, long*, ssize_t);
   static int verify_pyramid(unsigned char*, unsigned char*, ssize_t);
@@ -54,6 +276,64 @@ class Pyramid {
   void set_next_level(Pyramid*);
   Pyramid* get_next_level();
   long* get_identifiers();
+  FileMapping* get_mapping();
+  void set_mapping(FileMapping*);
+  BlockRing* get_ring();
+  void set_ring(BlockRing*);
+  PyramidJournal* get_journal();
+  void set_journal(PyramidJournal*);
+  void set_snapshot(PyramidSnapshot*);
+  PyramidSnapshot* get_snapshot();
+  bool is_loaded();
+};
+
+/*
+ * The BlockRun class describes a run of blocks at consecutive offsets of a
+ * file, transferred by a single vectored read or write.
+ */
+class BlockRun {
+ public:
+  off_t offset; // the offset of the first block in the file, in bytes
+  struct iovec* blocks; // the buffers of the blocks
+  int num_blocks;
+  ssize_t transferred; // the number of bytes transferred, or -errno
+};
+
+/*
+ * The BlockRing class submits batches of block reads and writes to the kernel
+ * through an io_uring instance, so that all of them are in flight at once.  It
+ * is set up with the raw system calls, and is unavailable where they are not
+ * supported or not permitted.
+ */
+class BlockRing {
+ private:
+  int ring_fd; // the FD of the io_uring instance, or -1 if it is unavailable
+  void* sq_ring;
+  size_t sq_ring_size;
+  void* cq_ring;
+  size_t cq_ring_size;
+  void* sqes;
+  size_t sqes_size;
+  unsigned sq_entries;
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned* sq_mask;
+  unsigned* sq_array;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned* cq_mask;
+  void* cqes;
+
+  void shut_down();
+  unsigned wait_for(unsigned, BlockRun*, bool);
+  void cancel(size_t, unsigned, unsigned, BlockRun*);
+
+ public:
+  // Descriptions can be found in BlockRing.cpp.
+  BlockRing(unsigned);
+  ~BlockRing();
+  bool is_available();
+  size_t transfer(int, BlockRun*, size_t, bool);
 };
 
 /*
@@ -67,9 +347,20 @@ class AccessFile {
   // Descriptions can be found in AccessFile.cpp.
   static void determine_blocks(size_t, long*, long*, off_t);
   static int pyramid_close(int, Pyramid*);
+  static int write_snapshot(Pyramid*, unsigned char*);
+  static int flush_journal(Pyramid*);
+  static int attach_journal(char*, Pyramid*, unsigned char*, bool);
+  static int pyramid_map(int, Pyramid*);
   static Pyramid* pyramid_open(char*, int, int*, int*, int*, unsigned char*);
+  static Pyramid* pyramid_open_lazy(char*, int, int*, int*, int*, unsigned char*);
+  static int pyramid_check_lazy(char*, unsigned char*, long);
+  static Pyramid* open_pyramid(char*, int, int*, int*, int*, unsigned char*, bool);
   static ssize_t pyramid_read(int, unsigned char*, size_t, Pyramid*);
   static ssize_t pyramid_write(int, unsigned char*, size_t, Pyramid*);
   static ssize_t read_block (int, long, Pyramid*, long*, unsigned char*);
+  static ssize_t plan_block(long, Pyramid*, off_t, vector<long>*);
+  static int transfer_blocks(Pyramid*, int, const long*, size_t, unsigned char*, off_t, bool);
+  static ssize_t mapped_read(unsigned char*, size_t, Pyramid*, off_t, off_t);
+  static ssize_t mapped_write(unsigned char*, size_t, Pyramid*, off_t, off_t);
   static void write_block_to_big_buffer(unsigned char*, long, long, long, unsigned char*, size_t, size_t, off_t);
 };